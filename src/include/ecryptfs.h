@@ -103,6 +103,14 @@
 #define ECRYPTFS_TAG_65_PACKET_TYPE 0x41
 #define ECRYPTFS_TAG_66_PACKET_TYPE 0x42
 #define ECRYPTFS_TAG_67_PACKET_TYPE 0x43
+#define RFC2440_CIPHER_DES3_EDE 0x02
+#define RFC2440_CIPHER_CAST_5 0x03
+#define RFC2440_CIPHER_BLOWFISH 0x04
+#define RFC2440_CIPHER_AES_128 0x07
+#define RFC2440_CIPHER_AES_192 0x08
+#define RFC2440_CIPHER_AES_256 0x09
+#define RFC2440_CIPHER_TWOFISH 0x0a
+#define RFC2440_CIPHER_CAST_6 0x0b
 #define ECRYPTFS_MSG_HELO 100
 #define ECRYPTFS_MSG_QUIT 101
 #define ECRYPTFS_MSG_REQUEST 102
@@ -437,6 +445,7 @@ struct ecryptfs_crypt_stat_user {
 #define ECRYPTFS_METADATA_IN_XATTR  0x00000100
 #define ECRYPTFS_VIEW_AS_ENCRYPTED  0x00000200
 #define ECRYPTFS_KEY_SET            0x00000400
+#define ECRYPTFS_ENCRYPT_FILENAMES  0x00000800
 	uint32_t flags;
 	unsigned int file_version;
 	uint64_t file_size;
@@ -524,9 +533,18 @@ int ecryptfs_unwrap_passphrase(char *decrypted_passphrase, char *filename,
 int ecryptfs_insert_wrapped_passphrase_into_keyring(
 	char *auth_tok_sig, char *filename, char *wrapping_passphrase,
 	char *salt);
+struct ecryptfs_timing;
+int ecryptfs_insert_wrapped_passphrase_into_keyring_timed(
+	char *auth_tok_sig, char *filename, char *wrapping_passphrase,
+	char *salt, struct ecryptfs_timing *timing);
 char *ecryptfs_get_wrapped_passphrase_filename();
 struct ecryptfs_key_mod_ops *passphrase_get_key_mod_ops(void);
 int ecryptfs_validate_keyring(void);
+/*
+ * Deprecated: the zombie session placeholders no longer live in a SysV
+ * shared memory segment, and nothing in libecryptfs uses these any more.
+ * They are kept so that existing code that refers to them still builds.
+ */
 #define ECRYPTFS_SHM_KEY 0x3c81b7f5
 #define ECRYPTFS_SEM_KEY 0x3c81b7f6
 #define ECRYPTFS_SHM_SIZE 4096
@@ -534,6 +552,7 @@ int ecryptfs_validate_keyring(void);
 int ecryptfs_set_zombie_session_placeholder(void);
 int ecryptfs_kill_and_clear_zombie_session_placeholder(void);
 int ecryptfs_list_zombie_session_placeholders(void);
+int ecryptfs_clean_zombie_session_placeholders(void);
 int ecryptfs_build_linear_subgraph_from_nvp(struct transition_node **trans_node,
 					    struct ecryptfs_key_mod *key_mod);
 int ecryptfs_build_linear_subgraph(struct transition_node **trans_node,
@@ -559,8 +578,183 @@ int ecryptfs_send_miscdev(struct ecryptfs_miscdev_ctx *miscdev_ctx,
 void ecryptfs_release_miscdev(struct ecryptfs_miscdev_ctx *miscdev_ctx);
 int ecryptfs_run_miscdev_daemon(struct ecryptfs_miscdev_ctx *miscdev_ctx);
 struct ecryptfs_ctx_ops *cryptfs_get_ctx_opts(void);
+/* File size, marker, flags, header extent size and header extent count */
+#define ECRYPTFS_HEADER_METADATA_BYTES (ECRYPTFS_FILE_SIZE_BYTES \
+					+ MAGIC_ECRYPTFS_MARKER_SIZE_BYTES \
+					+ 4 + 4 + 2)
+#define ECRYPTFS_XATTR_NAME "user.ecryptfs"
+#define ECRYPTFS_MAX_PACKET_SET_KEYS 16
+
+/**
+ * One key packet (tag 3 or tag 1) of a header packet set. All pointers
+ * reference the buffer that was parsed; nothing is copied.
+ *
+ * @tag: ECRYPTFS_TAG_3_PACKET_TYPE or ECRYPTFS_TAG_1_PACKET_TYPE
+ * @cipher_code: RFC2440 cipher code of the file key (tag 3 only)
+ * @key_size: Size of the file key in bytes; 0 if only the key module
+ *            can tell (tag 1)
+ * @sig: ECRYPTFS_SIG_SIZE bytes identifying the wrapping key; the tag
+ *       11 contents for tag 3, the key identifier for tag 1
+ * @salt: ECRYPTFS_SALT_SIZE bytes of S2K salt (tag 3 only)
+ * @hash_iterations: S2K iteration count (tag 3 only)
+ * @encrypted_key: The wrapped file key
+ * @literal_data: Contents of the tag 11 packet following a tag 3 packet
+ * @packet: The raw packet, including the tag 11 packet after a tag 3
+ */
+struct ecryptfs_key_packet_user {
+	uint8_t tag;
+	uint8_t cipher_code;
+	size_t key_size;
+	const unsigned char *sig;
+	const unsigned char *salt;
+	uint32_t hash_iterations;
+	const unsigned char *encrypted_key;
+	size_t encrypted_key_size;
+	const unsigned char *literal_data;
+	size_t literal_data_size;
+	const unsigned char *packet;
+	size_t packet_size;
+};
+
+/**
+ * @cipher_code: Cipher code of the first tag 3 packet, 0 if none
+ * @key_size: File key size of the first packet that knows it
+ * @num_keys: Number of entries filled in @keys
+ * @total_keys: Number of key packets in the set, which may be larger
+ *              than ECRYPTFS_MAX_PACKET_SET_KEYS
+ * @size: Bytes taken by the packet set, including the terminator
+ */
+struct ecryptfs_packet_set_user {
+	uint8_t cipher_code;
+	size_t key_size;
+	uint32_t num_keys;
+	uint32_t total_keys;
+	struct ecryptfs_key_packet_user keys[ECRYPTFS_MAX_PACKET_SET_KEYS];
+	size_t size;
+};
+
+int ecryptfs_contains_ecryptfs_marker(char *data);
 int ecryptfs_parse_stat(struct ecryptfs_crypt_stat_user *crypt_stat, char *buf,
 			size_t buf_size);
+int ecryptfs_parse_stat_packet_set(struct ecryptfs_crypt_stat_user *crypt_stat,
+				   struct ecryptfs_packet_set_user *packet_set,
+				   char *buf, size_t buf_size);
+int ecryptfs_parse_packet_set(struct ecryptfs_packet_set_user *packet_set,
+			      const unsigned char *buf, size_t buf_size);
+int ecryptfs_write_header_metadata(char *dest,
+				   struct ecryptfs_crypt_stat_user *crypt_stat);
+const char *ecryptfs_cipher_code_to_string(uint8_t cipher_code);
+uint8_t ecryptfs_code_for_cipher_string(const char *cipher_name,
+					size_t key_bytes);
+struct ecryptfs_extent_ctx;
+int ecryptfs_cipher_code_is_aes(uint8_t cipher_code);
+int ecryptfs_decrypt_fek(unsigned char *fek,
+			 struct ecryptfs_key_packet_user *key,
+			 const char *fekek);
+int ecryptfs_decrypt_fek_with_passphrase(unsigned char *fek,
+					 struct ecryptfs_key_packet_user *key,
+					 char *passphrase);
+int ecryptfs_write_passphrase_key_packets(unsigned char *dest, size_t max,
+					  size_t *written, uint8_t cipher_code,
+					  const unsigned char *fek,
+					  size_t key_size, const char *fekek,
+					  const char *sig, const char *salt);
+int ecryptfs_find_fek_with_passphrase(unsigned char *fek, size_t *key_size,
+				      struct ecryptfs_packet_set_user *packet_set,
+				      char *passphrase);
+int ecryptfs_extent_ctx_create(struct ecryptfs_extent_ctx **ctx,
+			       uint8_t cipher_code, const unsigned char *fek,
+			       size_t key_size, size_t extent_size);
+void ecryptfs_extent_ctx_destroy(struct ecryptfs_extent_ctx *ctx);
+int ecryptfs_derive_extent_iv(char *iv, struct ecryptfs_extent_ctx *ctx,
+			      uint64_t extent);
+int ecryptfs_decrypt_extent(struct ecryptfs_extent_ctx *ctx, char *dst,
+			    const char *src, uint64_t extent);
+int ecryptfs_encrypt_extents(struct ecryptfs_extent_ctx *ctx, char *dst,
+			     const char *src, uint64_t first_extent,
+			     size_t num_extents);
+int ecryptfs_generate_fek(unsigned char *fek, size_t key_size);
+uint64_t ecryptfs_upper_size_to_lower_size(size_t header_size,
+					   size_t extent_size,
+					   uint64_t upper_size);
+int ecryptfs_read_lower_metadata(int fd, char *buf, size_t buf_size,
+				 struct ecryptfs_crypt_stat_user *crypt_stat,
+				 struct ecryptfs_packet_set_user *packet_set,
+				 uint64_t *header_size);
+#define ECRYPTFS_HMAC_TREE_NODE_SIZE 32
+struct ecryptfs_hmac_tree;
+int ecryptfs_derive_hmac_tree_key(unsigned char *key, char *passphrase);
+int ecryptfs_hmac_tree_create(struct ecryptfs_hmac_tree **tree,
+			      const unsigned char *key, uint64_t num_leaves,
+			      uint64_t lower_size);
+void ecryptfs_hmac_tree_destroy(struct ecryptfs_hmac_tree *tree);
+uint64_t ecryptfs_hmac_tree_num_leaves(struct ecryptfs_hmac_tree *tree);
+int ecryptfs_hmac_tree_hash_leaf(struct ecryptfs_hmac_tree *tree,
+				 unsigned char *leaf, uint64_t index,
+				 const char *data, size_t size);
+int ecryptfs_hmac_tree_set_leaf(struct ecryptfs_hmac_tree *tree,
+				uint64_t index, const char *data, size_t size);
+int ecryptfs_hmac_tree_set_binding(struct ecryptfs_hmac_tree *tree,
+				   const char *metadata, size_t size);
+int ecryptfs_hmac_tree_build(struct ecryptfs_hmac_tree *tree);
+int ecryptfs_hmac_tree_verify_leaf(struct ecryptfs_hmac_tree *tree,
+				   uint64_t index, const unsigned char *leaf);
+int ecryptfs_hmac_tree_replace_leaf(struct ecryptfs_hmac_tree *tree,
+				    uint64_t index, const char *data,
+				    size_t size);
+int ecryptfs_hmac_tree_rebind(struct ecryptfs_hmac_tree *tree,
+			      const char *metadata, size_t size);
+int ecryptfs_hmac_tree_check_binding(struct ecryptfs_hmac_tree *tree,
+				     const char *metadata, size_t size);
+int ecryptfs_hmac_tree_compare(struct ecryptfs_hmac_tree *a,
+			       struct ecryptfs_hmac_tree *b,
+			       uint64_t *first_bad);
+int ecryptfs_hmac_tree_write(struct ecryptfs_hmac_tree *tree, int fd);
+int ecryptfs_hmac_tree_write_path(struct ecryptfs_hmac_tree *tree, int fd,
+				  uint64_t index);
+int ecryptfs_hmac_tree_read(struct ecryptfs_hmac_tree **tree,
+			    const unsigned char *key, int fd);
+#define ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX "ECRYPTFS_FNEK_ENCRYPTED."
+struct ecryptfs_fn_ctx;
+int ecryptfs_derive_fnek(char *fnek, char *sig, char *passphrase);
+int ecryptfs_fn_ctx_create(struct ecryptfs_fn_ctx **ctx, uint8_t cipher_code,
+			   const char *fnek, size_t key_size, const char *sig);
+void ecryptfs_fn_ctx_destroy(struct ecryptfs_fn_ctx *ctx);
+size_t ecryptfs_encode_for_filename(char *dst, const unsigned char *src,
+				    size_t src_size);
+size_t ecryptfs_encrypted_filename_size(size_t name_size);
+int ecryptfs_encrypt_filename(struct ecryptfs_fn_ctx *ctx, char *dst,
+			      size_t dst_size, const char *name,
+			      size_t name_size);
+int ecryptfs_is_encrypted_filename(const char *name, size_t name_size);
+ssize_t ecryptfs_decode_from_filename(unsigned char *dst, const char *src,
+				      size_t src_size);
+
+/**
+ * One name in a ecryptfs_decrypt_filenames() batch
+ * @lower, @lower_size: Name as found in the lower directory
+ * @upper, @upper_size: Set to the decrypted name, NUL terminated
+ * @rc: Set to zero, or to why this name could not be decrypted
+ */
+struct ecryptfs_filename {
+	const char *lower;
+	size_t lower_size;
+	char upper[NAME_MAX + 1];
+	size_t upper_size;
+	int rc;
+};
+
+int ecryptfs_decrypt_filenames(struct ecryptfs_fn_ctx *ctx,
+			       struct ecryptfs_filename *names, size_t count);
+int ecryptfs_decrypt_filename(struct ecryptfs_fn_ctx *ctx, char *dst,
+			      const char *name, size_t name_size);
+struct ecryptfs_file;
+int ecryptfs_file_open(struct ecryptfs_file **file, const char *path,
+		       char *passphrase, size_t cache_extents);
+uint64_t ecryptfs_file_size(struct ecryptfs_file *file);
+ssize_t ecryptfs_file_pread(struct ecryptfs_file *file, void *buf,
+			    size_t count, uint64_t offset);
+void ecryptfs_file_close(struct ecryptfs_file *file);
 binary_data ecryptfs_passphrase_blob(char *salt, char *passphrase);
 binary_data ecryptfs_passphrase_sig_from_blob(char *blob);
 int ecryptfs_add_passphrase_blob_to_keyring(char *blob, char *sig);
@@ -578,4 +772,78 @@ int ecryptfs_run_daemon(struct ecryptfs_messaging_ctx *mctx);
 char *ecryptfs_fetch_private_mnt(char *pw_dir);
 int ecryptfs_private_is_mounted(char *dev, char *mnt, char *sig, int mounting);
 
+/**
+ * struct ecryptfs_mount - One line of /proc/self/mountinfo
+ * @mnt_id: Mount ID, as statx() reports it in stx_mnt_id
+ * @target: Mount point
+ * @fstype: File system type
+ * @source: Mount source; the lower directory for eCryptfs
+ * @options: Per-mount options, then file system options, as in
+ *           /proc/mounts
+ */
+struct ecryptfs_mount {
+	int mnt_id;
+	char *target;
+	char *fstype;
+	char *source;
+	char *options;
+};
+struct ecryptfs_mount_table;
+int ecryptfs_mount_find(const char *target, const char *fstype,
+			struct ecryptfs_mount **mnt);
+void ecryptfs_mount_free(struct ecryptfs_mount *mnt);
+int ecryptfs_mount_has_opt(struct ecryptfs_mount *mnt, const char *opt);
+int ecryptfs_mount_table_load(struct ecryptfs_mount_table **table,
+			      const char *fstype);
+void ecryptfs_mount_table_destroy(struct ecryptfs_mount_table *table);
+struct ecryptfs_mount *
+ecryptfs_mount_table_find_target(struct ecryptfs_mount_table *table,
+				 const char *target);
+struct ecryptfs_mount *
+ecryptfs_mount_table_find_source(struct ecryptfs_mount_table *table,
+				 const char *source);
+
+#define ECRYPTFS_KEY_AGENT_FILE "key-agent"
+#define ECRYPTFS_KEY_AGENT_DEFAULT_GRACE 300
+#define ECRYPTFS_KEY_AGENT_MAX_GRACE 86400
+#define ECRYPTFS_KEY_AGENT_STATUS "status"
+#define ECRYPTFS_KEY_AGENT_RESTORE "restore"
+#define ECRYPTFS_KEY_AGENT_FLUSH "flush"
+int ecryptfs_key_agent_grace(char *pw_dir, unsigned int *grace);
+int ecryptfs_key_agent_request(const char *cmd, char *reply,
+			       size_t reply_size);
+int ecryptfs_key_agent_hold(char *sigs[], int num_sigs, unsigned int grace);
+
+#define ECRYPTFS_TIMING_MAX_PHASES 16
+/* Enough for every phase of one program with a 32 byte name */
+#define ECRYPTFS_TIMING_MAX_RECORD 1024
+/* Set by pam_ecryptfs to a pipe that mount.ecryptfs_private writes its
+ * own record to */
+#define ECRYPTFS_TIMING_FD_ENV "ECRYPTFS_TIMING_FD"
+
+/**
+ * struct ecryptfs_timing - Monotonic time spent in each phase
+ * @phases: Name and accumulated microseconds of each phase that ran
+ * @num_phases: Entries of @phases in use
+ * @current: Phase running since @begin, or NULL
+ * @begin: Start of @current
+ * @created: Start of the whole timing
+ */
+struct ecryptfs_timing {
+	struct ecryptfs_timing_phase {
+		const char *name;
+		uint64_t usec;
+	} phases[ECRYPTFS_TIMING_MAX_PHASES];
+	int num_phases;
+	const char *current;
+	uint64_t begin;
+	uint64_t created;
+};
+
+void ecryptfs_timing_init(struct ecryptfs_timing *timing);
+void ecryptfs_timing_begin(struct ecryptfs_timing *timing, const char *phase);
+void ecryptfs_timing_end(struct ecryptfs_timing *timing);
+int ecryptfs_timing_format(struct ecryptfs_timing *timing, const char *prefix,
+			   char *buf, size_t size);
+
 #endif
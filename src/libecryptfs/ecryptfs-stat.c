@@ -3,6 +3,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <arpa/inet.h>
+#include <nss.h>
+#include <pk11func.h>
 #include "../include/ecryptfs.h"
 
 static uint64_t swab64(uint64_t x)
@@ -39,7 +42,7 @@ static int host_is_big_endian(void)
  *
  * Returns one if marker found; zero if not found
  */
-static int ecryptfs_contains_ecryptfs_marker(char *data)
+int ecryptfs_contains_ecryptfs_marker(char *data)
 {
 	uint32_t m_1, m_2;
 	int big_endian;
@@ -65,7 +68,8 @@ struct ecryptfs_flag_map_elem {
 static struct ecryptfs_flag_map_elem ecryptfs_flag_map[] = {
 	{0x00000001, ECRYPTFS_ENABLE_HMAC},
 	{0x00000002, ECRYPTFS_ENCRYPTED},
-	{0x00000004, ECRYPTFS_METADATA_IN_XATTR}
+	{0x00000004, ECRYPTFS_METADATA_IN_XATTR},
+	{0x00000008, ECRYPTFS_ENCRYPT_FILENAMES}
 };
 
 /**
@@ -129,28 +133,379 @@ ecryptfs_parse_header_metadata(struct ecryptfs_crypt_stat_user *crypt_stat,
 	    && (crypt_stat->num_header_bytes_at_front
 		< ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE)) {
 		rc = -EINVAL;
-		printf("%s Invalid header size: [%zu]\n", __FUNCTION__,
-		       crypt_stat->num_header_bytes_at_front);
+		if (ecryptfs_verbosity)
+			printf("%s Invalid header size: [%zu]\n",
+			       __FUNCTION__,
+			       crypt_stat->num_header_bytes_at_front);
 	}
 	return rc;
 }
 
+/**
+ * ecryptfs_write_header_metadata
+ * @dest: Receives ECRYPTFS_HEADER_METADATA_BYTES bytes
+ * @crypt_stat: file_size, flags and num_header_bytes_at_front to record
+ *
+ * The inverse of the parsing above: file size, a fresh marker, the flag
+ * vector with the current file version and the header extent layout,
+ * as the kernel's ecryptfs_write_headers_virt() lays them out.
+ *
+ * Returns zero on success; non-zero otherwise
+ */
+int ecryptfs_write_header_metadata(char *dest,
+				   struct ecryptfs_crypt_stat_user *crypt_stat)
+{
+	uint64_t file_size = crypt_stat->file_size;
+	uint32_t m_1, m_2, flags = 0, header_extent_size;
+	uint16_t num_header_extents_at_front;
+	int i;
+
+	NSS_NoDB_Init(NULL);
+	if (PK11_GenerateRandom((unsigned char *)&m_1, 4) != SECSuccess)
+		return -EIO;
+	m_2 = (m_1 ^ MAGIC_ECRYPTFS_MARKER);
+	for (i = 0; i < ((sizeof(ecryptfs_flag_map)
+			  / sizeof(struct ecryptfs_flag_map_elem))); i++)
+		if (crypt_stat->flags & ecryptfs_flag_map[i].local_flag)
+			flags |= ecryptfs_flag_map[i].file_flag;
+	flags |= ((uint32_t)ECRYPTFS_SUPPORTED_FILE_VERSION << 24);
+	header_extent_size = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	num_header_extents_at_front = (crypt_stat->num_header_bytes_at_front
+				       / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	if (!host_is_big_endian())
+		file_size = swab64(file_size);
+	memcpy(dest, &file_size, ECRYPTFS_FILE_SIZE_BYTES);
+	dest += ECRYPTFS_FILE_SIZE_BYTES;
+	m_1 = htonl(m_1);
+	m_2 = htonl(m_2);
+	memcpy(dest, &m_1, 4);
+	memcpy((dest + 4), &m_2, 4);
+	dest += MAGIC_ECRYPTFS_MARKER_SIZE_BYTES;
+	flags = htonl(flags);
+	memcpy(dest, &flags, 4);
+	dest += 4;
+	header_extent_size = htonl(header_extent_size);
+	memcpy(dest, &header_extent_size, 4);
+	dest += 4;
+	num_header_extents_at_front = htons(num_header_extents_at_front);
+	memcpy(dest, &num_header_extents_at_front, 2);
+	return 0;
+}
+
+struct ecryptfs_cipher_code_str_map_elem {
+	const char *cipher_str;
+	uint8_t cipher_code;
+};
+
+/* Add support for additional ciphers by adding elements here. The
+ * cipher_code is whatever OpenPGP applications use to identify the
+ * ciphers. List in order of probability. */
+static struct ecryptfs_cipher_code_str_map_elem
+ecryptfs_cipher_code_str_map[] = {
+	{"aes", RFC2440_CIPHER_AES_128},
+	{"blowfish", RFC2440_CIPHER_BLOWFISH},
+	{"des3_ede", RFC2440_CIPHER_DES3_EDE},
+	{"cast5", RFC2440_CIPHER_CAST_5},
+	{"twofish", RFC2440_CIPHER_TWOFISH},
+	{"cast6", RFC2440_CIPHER_CAST_6},
+	{"aes", RFC2440_CIPHER_AES_192},
+	{"aes", RFC2440_CIPHER_AES_256}
+};
+
+/**
+ * ecryptfs_code_for_cipher_string
+ * @cipher_name: The kernel crypto API name of the cipher
+ * @key_bytes: Length of the key in bytes; AES has one code per key size
+ *
+ * Returns the RFC2440 cipher code, or zero if there is none
+ */
+uint8_t ecryptfs_code_for_cipher_string(const char *cipher_name,
+					size_t key_bytes)
+{
+	int i;
+
+	if (strcmp(cipher_name, "aes") == 0) {
+		switch (key_bytes) {
+		case 16:
+			return RFC2440_CIPHER_AES_128;
+		case 24:
+			return RFC2440_CIPHER_AES_192;
+		case 32:
+			return RFC2440_CIPHER_AES_256;
+		}
+		return 0;
+	}
+	for (i = 0; i < (sizeof(ecryptfs_cipher_code_str_map)
+			 / sizeof(ecryptfs_cipher_code_str_map[0])); i++)
+		if (strcmp(cipher_name,
+			   ecryptfs_cipher_code_str_map[i].cipher_str) == 0)
+			return ecryptfs_cipher_code_str_map[i].cipher_code;
+	return 0;
+}
+
+/**
+ * ecryptfs_cipher_code_to_string
+ * @cipher_code: RFC2440 cipher code
+ *
+ * Returns the kernel crypto API name of the cipher, or NULL
+ */
+const char *ecryptfs_cipher_code_to_string(uint8_t cipher_code)
+{
+	int i;
+
+	for (i = 0; i < (sizeof(ecryptfs_cipher_code_str_map)
+			 / sizeof(ecryptfs_cipher_code_str_map[0])); i++)
+		if (cipher_code == ecryptfs_cipher_code_str_map[i].cipher_code)
+			return ecryptfs_cipher_code_str_map[i].cipher_str;
+	return NULL;
+}
+
+/**
+ * ecryptfs_parse_packet_header
+ * @data: Start of the packet
+ * @max_size: Bytes available at @data
+ * @body: Set to the offset of the packet body
+ * @body_size: Set to the length of the packet body
+ *
+ * Checks that the packet length fits in the buffer before anything
+ * else looks at it.
+ */
+static int ecryptfs_parse_packet_header(const unsigned char *data,
+					size_t max_size, size_t *body,
+					size_t *body_size)
+{
+	size_t length_size;
+	int rc;
+
+	if (max_size < 2 || (data[1] >= 192 && max_size < 3))
+		return -EINVAL;
+	rc = ecryptfs_parse_packet_length((unsigned char *)&data[1],
+					  body_size, &length_size);
+	if (rc)
+		return rc;
+	(*body) = (1 + length_size);
+	if ((*body_size) > (max_size - (*body)))
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * ecryptfs_parse_tag_3_packet
+ *
+ * Tag 3 body: version (0x04), cipher code, S2K specifier (0x03), hash
+ * identifier, salt, encoded iteration count, encrypted key.
+ */
+static int ecryptfs_parse_tag_3_packet(struct ecryptfs_key_packet_user *key,
+				       const unsigned char *data,
+				       size_t max_size, size_t *packet_size)
+{
+	size_t body, body_size;
+	const unsigned char *p;
+	int rc;
+
+	rc = ecryptfs_parse_packet_header(data, max_size, &body, &body_size);
+	if (rc)
+		return rc;
+	if (body_size < (ECRYPTFS_SALT_SIZE + 5 + 1))
+		return -EINVAL;
+	p = &data[body];
+	if (p[0] != 0x04 || p[2] != 0x03)
+		return -EINVAL;
+	key->tag = ECRYPTFS_TAG_3_PACKET_TYPE;
+	key->cipher_code = p[1];
+	key->salt = &p[4];
+	key->hash_iterations = (((uint32_t)16 + (p[12] & 15))
+				<< ((p[12] >> 4) + 6));
+	key->encrypted_key = &p[13];
+	key->encrypted_key_size = (body_size - (ECRYPTFS_SALT_SIZE + 5));
+	if (key->encrypted_key_size > ECRYPTFS_MAX_ENCRYPTED_KEY_BYTES)
+		return -EINVAL;
+	/* The encrypted key is padded to the cipher block size, so the
+	 * cipher code is the only way to tell AES-192 apart */
+	if (key->cipher_code == RFC2440_CIPHER_AES_192)
+		key->key_size = 24;
+	else
+		key->key_size = key->encrypted_key_size;
+	(*packet_size) = (body + body_size);
+	return 0;
+}
+
+/**
+ * ecryptfs_parse_tag_11_packet
+ *
+ * Tag 11 body: format (0x62), filename length (8), "_CONSOLE", four
+ * bytes of date, literal contents.
+ */
+static int ecryptfs_parse_tag_11_packet(struct ecryptfs_key_packet_user *key,
+					const unsigned char *data,
+					size_t max_size, size_t *packet_size)
+{
+	size_t body, body_size;
+	const unsigned char *p;
+	int rc;
+
+	if (max_size < 1 || data[0] != ECRYPTFS_TAG_11_PACKET_TYPE)
+		return -EINVAL;
+	rc = ecryptfs_parse_packet_header(data, max_size, &body, &body_size);
+	if (rc)
+		return rc;
+	if (body_size < 14)
+		return -EINVAL;
+	p = &data[body];
+	if (p[0] != 0x62 || p[1] != 0x08)
+		return -EINVAL;
+	key->literal_data = &p[14];
+	key->literal_data_size = (body_size - 14);
+	if (key->literal_data_size == ECRYPTFS_SIG_SIZE)
+		key->sig = key->literal_data;
+	(*packet_size) = (body + body_size);
+	return 0;
+}
+
+/**
+ * ecryptfs_parse_tag_1_packet
+ *
+ * Tag 1 body: version (0x03), key identifier, public key algorithm,
+ * encrypted key.
+ */
+static int ecryptfs_parse_tag_1_packet(struct ecryptfs_key_packet_user *key,
+				       const unsigned char *data,
+				       size_t max_size, size_t *packet_size)
+{
+	size_t body, body_size;
+	const unsigned char *p;
+	int rc;
+
+	rc = ecryptfs_parse_packet_header(data, max_size, &body, &body_size);
+	if (rc)
+		return rc;
+	if (body_size < (ECRYPTFS_SIG_SIZE + 2 + 1))
+		return -EINVAL;
+	p = &data[body];
+	if (p[0] != 0x03)
+		return -EINVAL;
+	key->tag = ECRYPTFS_TAG_1_PACKET_TYPE;
+	key->sig = &p[1];
+	key->encrypted_key = &p[ECRYPTFS_SIG_SIZE + 2];
+	key->encrypted_key_size = (body_size - (ECRYPTFS_SIG_SIZE + 2));
+	if (key->encrypted_key_size > ECRYPTFS_MAX_ENCRYPTED_KEY_BYTES)
+		return -EINVAL;
+	(*packet_size) = (body + body_size);
+	return 0;
+}
+
+/**
+ * ecryptfs_parse_packet_set
+ * @packet_set: Filled in with the key packets found
+ * @buf: First byte of the packet set; typically the header extent (or
+ *       the user.ecryptfs xattr) plus ECRYPTFS_HEADER_METADATA_BYTES
+ * @buf_size: Bytes available at @buf
+ *
+ * Walks the packet set the same way the kernel does: each tag 3 packet
+ * must be followed by a tag 11 packet carrying the key signature, tag 1
+ * packets stand alone, and the set ends at the first byte that is not a
+ * packet tag. Nothing is copied; @packet_set points into @buf, which may
+ * be an mmap of the lower file.
+ *
+ * Returns zero on success; -EINVAL if the packet set is malformed
+ */
+int ecryptfs_parse_packet_set(struct ecryptfs_packet_set_user *packet_set,
+			      const unsigned char *buf, size_t buf_size)
+{
+	size_t i = 0;
+	int rc = 0;
+
+	memset(packet_set, 0, sizeof(*packet_set));
+	while (i < buf_size) {
+		struct ecryptfs_key_packet_user scratch;
+		struct ecryptfs_key_packet_user *key;
+		size_t packet_size;
+
+		if (buf[i] != ECRYPTFS_TAG_3_PACKET_TYPE
+		    && buf[i] != ECRYPTFS_TAG_1_PACKET_TYPE) {
+			if (buf[i] == ECRYPTFS_TAG_11_PACKET_TYPE) {
+				/* Tag 11 not allowed by itself */
+				rc = -EINVAL;
+				goto out;
+			}
+			break;
+		}
+		if (packet_set->num_keys < ECRYPTFS_MAX_PACKET_SET_KEYS)
+			key = &packet_set->keys[packet_set->num_keys];
+		else
+			key = &scratch;
+		memset(key, 0, sizeof(*key));
+		key->packet = &buf[i];
+		if (buf[i] == ECRYPTFS_TAG_3_PACKET_TYPE) {
+			rc = ecryptfs_parse_tag_3_packet(key, &buf[i],
+							 (buf_size - i),
+							 &packet_size);
+			if (rc)
+				goto out;
+			i += packet_size;
+			rc = ecryptfs_parse_tag_11_packet(key, &buf[i],
+							  (buf_size - i),
+							  &packet_size);
+			if (rc)
+				goto out;
+			if (!packet_set->cipher_code)
+				packet_set->cipher_code = key->cipher_code;
+		} else {
+			rc = ecryptfs_parse_tag_1_packet(key, &buf[i],
+							 (buf_size - i),
+							 &packet_size);
+			if (rc)
+				goto out;
+		}
+		i += packet_size;
+		key->packet_size = (&buf[i] - key->packet);
+		if (!packet_set->key_size)
+			packet_set->key_size = key->key_size;
+		if (key != &scratch)
+			packet_set->num_keys++;
+		packet_set->total_keys++;
+	}
+	if (!packet_set->total_keys) {
+		rc = -EINVAL;
+		goto out;
+	}
+	/* Count the terminating byte when it is there */
+	packet_set->size = (i < buf_size) ? (i + 1) : i;
+out:
+	return rc;
+}
+
 int ecryptfs_parse_stat(struct ecryptfs_crypt_stat_user *crypt_stat, char *buf,
 			size_t buf_size)
+{
+	return ecryptfs_parse_stat_packet_set(crypt_stat, NULL, buf, buf_size);
+}
+
+/**
+ * ecryptfs_parse_stat_packet_set
+ * @crypt_stat: Filled in with the header metadata
+ * @packet_set: If not NULL, filled in with the key packets; @buf must
+ *              then hold the whole packet set
+ * @buf: Start of the lower file, or the user.ecryptfs xattr contents
+ * @buf_size: Bytes available at @buf
+ *
+ * Returns zero on success; non-zero if the header is invalid
+ */
+int ecryptfs_parse_stat_packet_set(struct ecryptfs_crypt_stat_user *crypt_stat,
+				   struct ecryptfs_packet_set_user *packet_set,
+				   char *buf, size_t buf_size)
 {
 	uint64_t file_size;
 	int bytes_read;
 	int big_endian;
 	int rc = 0;
 
-	if (buf_size < (ECRYPTFS_FILE_SIZE_BYTES
-			+ MAGIC_ECRYPTFS_MARKER_SIZE_BYTES
-			+ 4)) {
-		printf("%s: Invalid metadata size; must have at least [%zu] "
-		       "bytes; there are only [%zu] bytes\n", __FUNCTION__,
-		       (ECRYPTFS_FILE_SIZE_BYTES
-			+ MAGIC_ECRYPTFS_MARKER_SIZE_BYTES
-			+ 4), buf_size);
+	if (buf_size < ECRYPTFS_HEADER_METADATA_BYTES) {
+		if (ecryptfs_verbosity)
+			printf("%s: Invalid metadata size; must have at least "
+			       "[%zu] bytes; there are only [%zu] bytes\n",
+			       __FUNCTION__, ECRYPTFS_HEADER_METADATA_BYTES,
+			       buf_size);
 		rc = -EINVAL;
 		goto out;
 	}
@@ -163,26 +518,39 @@ int ecryptfs_parse_stat(struct ecryptfs_crypt_stat_user *crypt_stat, char *buf,
 	crypt_stat->file_size = file_size;
 	rc = ecryptfs_contains_ecryptfs_marker(buf);
 	if (rc != 1) {
-		printf("%s: Magic eCryptfs marker not found in header.\n",
-		       __FUNCTION__);
+		if (ecryptfs_verbosity)
+			printf("%s: Magic eCryptfs marker not found in "
+			       "header.\n", __FUNCTION__);
 		rc = -EINVAL;
 		goto out;
 	}
 	buf += MAGIC_ECRYPTFS_MARKER_SIZE_BYTES;
 	rc = ecryptfs_process_flags(crypt_stat, buf, &bytes_read);
 	if (rc) {
-		printf("%s: Invalid header content.\n", __FUNCTION__);
+		if (ecryptfs_verbosity)
+			printf("%s: Invalid header content.\n", __FUNCTION__);
 		goto out;
 	}
 	buf += bytes_read;
 	rc = ecryptfs_parse_header_metadata(crypt_stat, buf, &bytes_read,
 					    ECRYPTFS_VALIDATE_HEADER_SIZE);
 	if (rc) {
-		printf("%s: Invalid header content.\n", __FUNCTION__);
+		if (ecryptfs_verbosity)
+			printf("%s: Invalid header content.\n", __FUNCTION__);
 		goto out;
 	}
 	buf += bytes_read;
-/*	rc = ecryptfs_parse_packet_set(crypt_stat, buf); */
+	if (!packet_set)
+		goto out;
+	rc = ecryptfs_parse_packet_set(packet_set, (unsigned char *)buf,
+				       (buf_size
+					- ECRYPTFS_HEADER_METADATA_BYTES));
+	if (rc) {
+		if (ecryptfs_verbosity)
+			printf("%s: Invalid packet set.\n", __FUNCTION__);
+		goto out;
+	}
+	crypt_stat->key_size = packet_set->key_size;
 out:
 	return rc;
 }
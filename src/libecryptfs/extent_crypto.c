@@ -0,0 +1,609 @@
+/**
+ * Offline access to the contents of lower files: file encryption key
+ * recovery from the header packet set and extent decryption, following
+ * what the kernel does in fs/ecryptfs/crypto.c and keystore.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <nss.h>
+#include <pk11func.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "../include/ecryptfs.h"
+
+/**
+ * @sym_key: The file encryption key
+ * @dec_ctx, @enc_ctx: AES-ECB contexts on @sym_key. CBC is layered on
+ *                     top by hand so that one context serves every
+ *                     extent, instead of setting up a new CBC context
+ *                     per IV.
+ * @root_iv: MD5 of the file encryption key
+ * @scratch: One extent of cipher output
+ * @ivs: One IV per extent being encrypted together
+ */
+struct ecryptfs_extent_ctx {
+	PK11SlotInfo *slot;
+	PK11SymKey *sym_key;
+	PK11Context *dec_ctx;
+	PK11Context *enc_ctx;
+	size_t extent_size;
+	char root_iv[ECRYPTFS_DEFAULT_IV_BYTES];
+	char *scratch;
+	char *ivs;
+};
+
+static int ecryptfs_aes_ecb(char *dst, const char *src, size_t size,
+			    const unsigned char *key, size_t key_size,
+			    CK_ATTRIBUTE_TYPE operation)
+{
+	SECItem key_item;
+	PK11SlotInfo *slot = NULL;
+	PK11SymKey *sym_key = NULL;
+	PK11Context *ctx = NULL;
+	SECItem *sec_param = NULL;
+	int outlen = 0;
+	unsigned int finlen = 0;
+	SECStatus err;
+	int rc = 0;
+
+	NSS_NoDB_Init(NULL);
+	slot = PK11_GetBestSlot(CKM_AES_ECB, NULL);
+	if (!slot) {
+		rc = -EIO;
+		goto out;
+	}
+	key_item.data = (unsigned char *)key;
+	key_item.len = key_size;
+	sym_key = PK11_ImportSymKey(slot, CKM_AES_ECB, PK11_OriginUnwrap,
+				    operation, &key_item, NULL);
+	if (!sym_key) {
+		syslog(LOG_ERR, "%s: PK11_ImportSymKey() returned NULL\n",
+		       __FUNCTION__);
+		rc = -EIO;
+		goto out;
+	}
+	sec_param = PK11_ParamFromIV(CKM_AES_ECB, NULL);
+	ctx = PK11_CreateContextBySymKey(CKM_AES_ECB, operation, sym_key,
+					 sec_param);
+	if (!ctx) {
+		rc = -EIO;
+		goto out;
+	}
+	err = PK11_CipherOp(ctx, (unsigned char *)dst, &outlen, size,
+			    (unsigned char *)src, size);
+	if (err == SECSuccess)
+		err = PK11_DigestFinal(ctx, (unsigned char *)dst + outlen,
+				       &finlen, (size - outlen));
+	if (err == SECFailure || (outlen + finlen) != size) {
+		syslog(LOG_ERR, "%s: PK11_CipherOp() error; "
+		       "SECFailure = [%d]; PORT_GetError() = [%d]\n",
+		       __FUNCTION__, SECFailure, PORT_GetError());
+		rc = -EIO;
+	}
+out:
+	if (ctx)
+		PK11_DestroyContext(ctx, PR_TRUE);
+	if (sym_key)
+		PK11_FreeSymKey(sym_key);
+	if (sec_param)
+		SECITEM_FreeItem(sec_param, PR_TRUE);
+	if (slot)
+		PK11_FreeSlot(slot);
+	return rc;
+}
+
+int ecryptfs_cipher_code_is_aes(uint8_t cipher_code)
+{
+	return (cipher_code == RFC2440_CIPHER_AES_128
+		|| cipher_code == RFC2440_CIPHER_AES_192
+		|| cipher_code == RFC2440_CIPHER_AES_256);
+}
+
+static int ecryptfs_check_fek_cipher(uint8_t cipher_code, size_t key_size)
+{
+	if (!ecryptfs_cipher_code_is_aes(cipher_code)
+	    || key_size > ECRYPTFS_MAX_KEY_BYTES) {
+		syslog(LOG_ERR, "%s: Unsupported cipher code [0x%.2x] or key "
+		       "size [%zu]\n", __FUNCTION__, cipher_code, key_size);
+		return -EOPNOTSUPP;
+	}
+	return 0;
+}
+
+/**
+ * ecryptfs_decrypt_fek
+ * @fek: Set to the file encryption key; ECRYPTFS_MAX_KEY_BYTES
+ * @key: A tag 3 packet from ecryptfs_parse_packet_set()
+ * @fekek: Session key encryption key, as generated by
+ *         generate_passphrase_sig() from the salt in @key
+ *
+ * Does not check that @fekek is the key @key was wrapped under; compare
+ * the signatures first.
+ */
+int ecryptfs_decrypt_fek(unsigned char *fek,
+			 struct ecryptfs_key_packet_user *key,
+			 const char *fekek)
+{
+	char decrypted[ECRYPTFS_MAX_ENCRYPTED_KEY_BYTES];
+	int rc;
+
+	if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE)
+		return -EINVAL;
+	rc = ecryptfs_check_fek_cipher(key->cipher_code, key->key_size);
+	if (rc)
+		return rc;
+	if (key->encrypted_key_size < key->key_size
+	    || (key->encrypted_key_size % ECRYPTFS_AES_BLOCK_SIZE))
+		return -EINVAL;
+	rc = ecryptfs_aes_ecb(decrypted, (char *)key->encrypted_key,
+			      key->encrypted_key_size,
+			      (unsigned char *)fekek, key->key_size,
+			      CKA_DECRYPT);
+	if (!rc)
+		memcpy(fek, decrypted, key->key_size);
+	memset(decrypted, 0, sizeof(decrypted));
+	return rc;
+}
+
+/**
+ * ecryptfs_decrypt_fek_with_passphrase
+ * @fek: Set to the file encryption key; ECRYPTFS_MAX_KEY_BYTES
+ * @key: A tag 3 packet from ecryptfs_parse_packet_set()
+ * @passphrase: The mount passphrase
+ *
+ * The session key encryption key is derived from the passphrase and
+ * the salt recorded in the packet, so this works whatever salt the
+ * mount used. Only AES file keys are supported.
+ *
+ * Returns zero on success; -ENOKEY if the passphrase does not match the
+ * signature in the packet
+ */
+int ecryptfs_decrypt_fek_with_passphrase(unsigned char *fek,
+					 struct ecryptfs_key_packet_user *key,
+					 char *passphrase)
+{
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char packet_sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+	int rc;
+
+	if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE || !key->sig)
+		return -EINVAL;
+	rc = ecryptfs_check_fek_cipher(key->cipher_code, key->key_size);
+	if (rc)
+		return rc;
+	rc = generate_passphrase_sig(sig_hex, fekek, (char *)key->salt,
+				     passphrase);
+	if (rc)
+		goto out;
+	to_hex(packet_sig_hex, (char *)key->sig, ECRYPTFS_SIG_SIZE);
+	if (memcmp(sig_hex, packet_sig_hex, ECRYPTFS_SIG_SIZE_HEX)) {
+		rc = -ENOKEY;
+		goto out;
+	}
+	rc = ecryptfs_decrypt_fek(fek, key, fekek);
+out:
+	memset(fekek, 0, sizeof(fekek));
+	return rc;
+}
+
+/**
+ * ecryptfs_write_passphrase_key_packets
+ * @dest: Receives a tag 3 packet followed by its tag 11 packet
+ * @max: Space available at @dest
+ * @written: Set to the number of bytes written
+ * @cipher_code: RFC2440 cipher code of the file encryption key
+ * @fek: File encryption key
+ * @key_size: Size of @fek
+ * @fekek: Session key encryption key from generate_passphrase_sig()
+ * @sig: ECRYPTFS_SIG_SIZE bytes of binary signature of @fekek
+ * @salt: ECRYPTFS_SALT_SIZE bytes of salt that @fekek was derived with
+ *
+ * Lays the packets out the way write_tag_3_packet() and
+ * write_tag_11_packet() do in the kernel, so that a mount holding the
+ * matching passphrase key can open the file.
+ */
+int ecryptfs_write_passphrase_key_packets(unsigned char *dest, size_t max,
+					  size_t *written, uint8_t cipher_code,
+					  const unsigned char *fek,
+					  size_t key_size, const char *fekek,
+					  const char *sig, const char *salt)
+{
+	char padded[ECRYPTFS_MAX_KEY_BYTES];
+	size_t encrypted_key_size;
+	size_t body_size;
+	size_t length_size;
+	size_t i = 0;
+	int rc;
+
+	rc = ecryptfs_check_fek_cipher(cipher_code, key_size);
+	if (rc)
+		return rc;
+	/* Only AES-192 needs padding to the block size; the kernel pads
+	 * it with zeros to 32 bytes */
+	encrypted_key_size = ((key_size + ECRYPTFS_AES_BLOCK_SIZE - 1)
+			      & ~(ECRYPTFS_AES_BLOCK_SIZE - 1));
+	body_size = (ECRYPTFS_SALT_SIZE + 5 + encrypted_key_size);
+	if (max < (1 + 2 + body_size + 1 + 2 + 14 + ECRYPTFS_SIG_SIZE))
+		return -ENOSPC;
+	memset(padded, 0, sizeof(padded));
+	memcpy(padded, fek, key_size);
+	dest[i++] = ECRYPTFS_TAG_3_PACKET_TYPE;
+	rc = ecryptfs_write_packet_length((char *)&dest[i], body_size,
+					  &length_size);
+	if (rc)
+		goto out;
+	i += length_size;
+	dest[i++] = 0x04; /* version 4 */
+	dest[i++] = cipher_code;
+	dest[i++] = 0x03; /* S2K */
+	dest[i++] = 0x01; /* MD5; ignored, as in the kernel */
+	memcpy(&dest[i], salt, ECRYPTFS_SALT_SIZE);
+	i += ECRYPTFS_SALT_SIZE;
+	dest[i++] = 0x60; /* 65536 hash iterations */
+	rc = ecryptfs_aes_ecb((char *)&dest[i], padded, encrypted_key_size,
+			      (unsigned char *)fekek, key_size, CKA_ENCRYPT);
+	if (rc)
+		goto out;
+	i += encrypted_key_size;
+	dest[i++] = ECRYPTFS_TAG_11_PACKET_TYPE;
+	rc = ecryptfs_write_packet_length((char *)&dest[i],
+					  (14 + ECRYPTFS_SIG_SIZE),
+					  &length_size);
+	if (rc)
+		goto out;
+	i += length_size;
+	dest[i++] = 0x62; /* binary data format specifier */
+	dest[i++] = 8;
+	memcpy(&dest[i], "_CONSOLE", 8);
+	i += 8;
+	memset(&dest[i], 0, 4);
+	i += 4;
+	memcpy(&dest[i], sig, ECRYPTFS_SIG_SIZE);
+	i += ECRYPTFS_SIG_SIZE;
+	(*written) = i;
+out:
+	memset(padded, 0, sizeof(padded));
+	return rc;
+}
+
+/**
+ * ecryptfs_find_fek_with_passphrase
+ * @fek: Set to the file encryption key; ECRYPTFS_MAX_KEY_BYTES
+ * @key_size: Set to the size of the file encryption key
+ * @packet_set: Parsed header packet set
+ * @passphrase: The mount passphrase
+ *
+ * Tries every tag 3 packet in the set until one is wrapped under
+ * @passphrase.
+ */
+int ecryptfs_find_fek_with_passphrase(unsigned char *fek, size_t *key_size,
+				      struct ecryptfs_packet_set_user *packet_set,
+				      char *passphrase)
+{
+	uint32_t i;
+	int rc = -ENOKEY;
+
+	for (i = 0; i < packet_set->num_keys; i++) {
+		struct ecryptfs_key_packet_user *key = &packet_set->keys[i];
+
+		if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE)
+			continue;
+		rc = ecryptfs_decrypt_fek_with_passphrase(fek, key,
+							  passphrase);
+		if (rc == -ENOKEY)
+			continue;
+		if (!rc)
+			(*key_size) = key->key_size;
+		break;
+	}
+	return rc;
+}
+
+/**
+ * ecryptfs_extent_ctx_create
+ * @ctx: Set to a new context; release with ecryptfs_extent_ctx_destroy()
+ * @cipher_code: RFC2440 cipher code from the packet set
+ * @fek: File encryption key
+ * @key_size: Size of @fek
+ * @extent_size: Size of an extent, ECRYPTFS_DEFAULT_EXTENT_SIZE for
+ *               every file the kernel writes
+ *
+ * A context must only be used by one thread at a time; give each
+ * worker its own.
+ */
+int ecryptfs_extent_ctx_create(struct ecryptfs_extent_ctx **ctx,
+			       uint8_t cipher_code, const unsigned char *fek,
+			       size_t key_size, size_t extent_size)
+{
+	struct ecryptfs_extent_ctx *new_ctx;
+	unsigned char digest[16];
+	SECItem key_item;
+	SECItem *sec_param = NULL;
+	int rc = 0;
+
+	if (!ecryptfs_cipher_code_is_aes(cipher_code)
+	    || !extent_size || (extent_size % ECRYPTFS_AES_BLOCK_SIZE))
+		return -EOPNOTSUPP;
+	new_ctx = calloc(1, sizeof(*new_ctx));
+	if (!new_ctx)
+		return -ENOMEM;
+	new_ctx->extent_size = extent_size;
+	new_ctx->scratch = malloc(extent_size);
+	new_ctx->ivs = malloc(extent_size);
+	if (!new_ctx->scratch || !new_ctx->ivs) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	NSS_NoDB_Init(NULL);
+	/* The root IV is the MD5 of the file encryption key */
+	if (PK11_HashBuf(SEC_OID_MD5, digest, (unsigned char *)fek,
+			 key_size) != SECSuccess) {
+		rc = -EIO;
+		goto out;
+	}
+	memcpy(new_ctx->root_iv, digest, ECRYPTFS_DEFAULT_IV_BYTES);
+	new_ctx->slot = PK11_GetBestSlot(CKM_AES_ECB, NULL);
+	if (!new_ctx->slot) {
+		rc = -EIO;
+		goto out;
+	}
+	key_item.data = (unsigned char *)fek;
+	key_item.len = key_size;
+	new_ctx->sym_key = PK11_ImportSymKeyWithFlags(
+		new_ctx->slot, CKM_AES_ECB, PK11_OriginUnwrap, CKA_FLAGS_ONLY,
+		&key_item, (CKF_ENCRYPT | CKF_DECRYPT), PR_FALSE, NULL);
+	if (!new_ctx->sym_key) {
+		syslog(LOG_ERR, "%s: PK11_ImportSymKey() returned NULL\n",
+		       __FUNCTION__);
+		rc = -EIO;
+		goto out;
+	}
+	sec_param = PK11_ParamFromIV(CKM_AES_ECB, NULL);
+	new_ctx->dec_ctx = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_DECRYPT,
+						      new_ctx->sym_key,
+						      sec_param);
+	new_ctx->enc_ctx = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_ENCRYPT,
+						      new_ctx->sym_key,
+						      sec_param);
+	if (!new_ctx->dec_ctx || !new_ctx->enc_ctx) {
+		rc = -EIO;
+		goto out;
+	}
+out:
+	if (sec_param)
+		SECITEM_FreeItem(sec_param, PR_TRUE);
+	if (rc)
+		ecryptfs_extent_ctx_destroy(new_ctx);
+	else
+		(*ctx) = new_ctx;
+	return rc;
+}
+
+void ecryptfs_extent_ctx_destroy(struct ecryptfs_extent_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->dec_ctx)
+		PK11_DestroyContext(ctx->dec_ctx, PR_TRUE);
+	if (ctx->enc_ctx)
+		PK11_DestroyContext(ctx->enc_ctx, PR_TRUE);
+	if (ctx->sym_key)
+		PK11_FreeSymKey(ctx->sym_key);
+	if (ctx->slot)
+		PK11_FreeSlot(ctx->slot);
+	if (ctx->scratch) {
+		memset(ctx->scratch, 0, ctx->extent_size);
+		free(ctx->scratch);
+	}
+	free(ctx->ivs);
+	memset(ctx, 0, sizeof(*ctx));
+	free(ctx);
+}
+
+/**
+ * ecryptfs_derive_extent_iv
+ * @iv: Set to ECRYPTFS_DEFAULT_IV_BYTES of IV
+ * @ctx: Extent context
+ * @extent: Extent number in the upper file
+ *
+ * MD5 of the root IV followed by the decimal extent number, zero
+ * padded to 16 bytes; see ecryptfs_derive_iv() in the kernel.
+ */
+int ecryptfs_derive_extent_iv(char *iv, struct ecryptfs_extent_ctx *ctx,
+			      uint64_t extent)
+{
+	char src[ECRYPTFS_DEFAULT_IV_BYTES + 16];
+	unsigned char digest[16];
+
+	memcpy(src, ctx->root_iv, ECRYPTFS_DEFAULT_IV_BYTES);
+	memset(&src[ECRYPTFS_DEFAULT_IV_BYTES], 0, 16);
+	snprintf(&src[ECRYPTFS_DEFAULT_IV_BYTES], 16, "%lld",
+		 (long long)extent);
+	if (PK11_HashBuf(SEC_OID_MD5, digest, (unsigned char *)src,
+			 sizeof(src)) != SECSuccess)
+		return -EIO;
+	memcpy(iv, digest, ECRYPTFS_DEFAULT_IV_BYTES);
+	return 0;
+}
+
+/**
+ * ecryptfs_decrypt_extent
+ * @ctx: Extent context
+ * @dst: Plaintext; ctx->extent_size bytes
+ * @src: Ciphertext; ctx->extent_size bytes. May equal @dst.
+ * @extent: Extent number in the upper file
+ *
+ * Extents are AES-CBC without padding. The whole extent goes through
+ * one ECB call, which lets the AES implementation (AES-NI in NSS's
+ * freebl) pipeline the blocks, and the CBC chaining is XORed in after.
+ */
+int ecryptfs_decrypt_extent(struct ecryptfs_extent_ctx *ctx, char *dst,
+			    const char *src, uint64_t extent)
+{
+	char iv[ECRYPTFS_DEFAULT_IV_BYTES];
+	const char *prev;
+	int outlen = 0;
+	size_t i;
+	int rc;
+
+	rc = ecryptfs_derive_extent_iv(iv, ctx, extent);
+	if (rc)
+		return rc;
+	if (PK11_CipherOp(ctx->dec_ctx, (unsigned char *)ctx->scratch,
+			  &outlen, ctx->extent_size, (unsigned char *)src,
+			  ctx->extent_size) != SECSuccess
+	    || (size_t)outlen != ctx->extent_size) {
+		syslog(LOG_ERR, "%s: PK11_CipherOp() error; "
+		       "PORT_GetError() = [%d]\n", __FUNCTION__,
+		       PORT_GetError());
+		return -EIO;
+	}
+	prev = iv;
+	for (i = 0; i < ctx->extent_size; i += ECRYPTFS_AES_BLOCK_SIZE) {
+		uint64_t a[2], b[2];
+
+		memcpy(a, &ctx->scratch[i], ECRYPTFS_AES_BLOCK_SIZE);
+		memcpy(b, prev, ECRYPTFS_AES_BLOCK_SIZE);
+		a[0] ^= b[0];
+		a[1] ^= b[1];
+		/* Keep the ciphertext block before @dst overwrites it
+		 * when decrypting in place */
+		if (dst == src)
+			memcpy(iv, &src[i], ECRYPTFS_AES_BLOCK_SIZE);
+		memcpy(&dst[i], a, ECRYPTFS_AES_BLOCK_SIZE);
+		prev = (dst == src) ? iv : &src[i];
+	}
+	return 0;
+}
+
+/**
+ * ecryptfs_encrypt_extents
+ * @ctx: Extent context
+ * @dst: Ciphertext; @num_extents extents. May equal @src.
+ * @src: Plaintext; @num_extents extents, the last one zero padded
+ * @first_extent: Extent number of the first extent in the upper file
+ * @num_extents: Number of consecutive extents
+ *
+ * CBC encryption is serial within an extent, but extents are
+ * independent. Block N of every extent in the batch is gathered into
+ * one buffer and encrypted with a single ECB call, so that the AES
+ * implementation (AES-NI in NSS's freebl) still has a long run of
+ * independent blocks to pipeline.
+ */
+int ecryptfs_encrypt_extents(struct ecryptfs_extent_ctx *ctx, char *dst,
+			     const char *src, uint64_t first_extent,
+			     size_t num_extents)
+{
+	size_t max_group = (ctx->extent_size / ECRYPTFS_AES_BLOCK_SIZE);
+	size_t done = 0;
+	int rc;
+
+	while (done < num_extents) {
+		size_t group = (num_extents - done);
+		size_t size, i, k;
+
+		if (group > max_group)
+			group = max_group;
+		size = (group * ECRYPTFS_AES_BLOCK_SIZE);
+		for (k = 0; k < group; k++) {
+			rc = ecryptfs_derive_extent_iv(
+				&ctx->ivs[k * ECRYPTFS_AES_BLOCK_SIZE], ctx,
+				(first_extent + done + k));
+			if (rc)
+				return rc;
+		}
+		for (i = 0; i < ctx->extent_size; i += ECRYPTFS_AES_BLOCK_SIZE) {
+			int outlen = 0;
+
+			for (k = 0; k < group; k++) {
+				size_t off = ((done + k) * ctx->extent_size + i);
+				const char *prev;
+				uint64_t a[2], b[2];
+
+				if (i)
+					prev = &dst[off - ECRYPTFS_AES_BLOCK_SIZE];
+				else
+					prev = &ctx->ivs[k * ECRYPTFS_AES_BLOCK_SIZE];
+
+				memcpy(a, &src[off], ECRYPTFS_AES_BLOCK_SIZE);
+				memcpy(b, prev, ECRYPTFS_AES_BLOCK_SIZE);
+				a[0] ^= b[0];
+				a[1] ^= b[1];
+				memcpy(&ctx->scratch[k * ECRYPTFS_AES_BLOCK_SIZE], a,
+				       ECRYPTFS_AES_BLOCK_SIZE);
+			}
+			if (PK11_CipherOp(ctx->enc_ctx,
+					  (unsigned char *)ctx->scratch, &outlen,
+					  size, (unsigned char *)ctx->scratch,
+					  size) != SECSuccess
+			    || (size_t)outlen != size) {
+				syslog(LOG_ERR, "%s: PK11_CipherOp() error; "
+				       "PORT_GetError() = [%d]\n",
+				       __FUNCTION__, PORT_GetError());
+				return -EIO;
+			}
+			for (k = 0; k < group; k++)
+				memcpy(&dst[(done + k) * ctx->extent_size + i],
+				       &ctx->scratch[k * ECRYPTFS_AES_BLOCK_SIZE],
+				       ECRYPTFS_AES_BLOCK_SIZE);
+		}
+		done += group;
+	}
+	return 0;
+}
+
+/**
+ * ecryptfs_generate_fek
+ * @fek: Set to @key_size random bytes
+ */
+int ecryptfs_generate_fek(unsigned char *fek, size_t key_size)
+{
+	NSS_NoDB_Init(NULL);
+	if (PK11_GenerateRandom(fek, key_size) != SECSuccess)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * ecryptfs_upper_size_to_lower_size
+ * @header_size: Bytes of metadata at the front of the lower file; zero
+ *               when the metadata is in the xattr
+ * @extent_size: Size of an extent
+ * @upper_size: Size of the decrypted file
+ */
+uint64_t ecryptfs_upper_size_to_lower_size(size_t header_size,
+					   size_t extent_size,
+					   uint64_t upper_size)
+{
+	uint64_t lower_size = header_size;
+
+	if (upper_size != 0) {
+		uint64_t num_extents;
+
+		num_extents = upper_size / extent_size;
+		if (upper_size % extent_size)
+			num_extents++;
+		lower_size += (num_extents * extent_size);
+	}
+	return lower_size;
+}
@@ -0,0 +1,379 @@
+/**
+ * Random-access reads of lower files, decrypting only the extents that
+ * are touched and keeping the most recently used ones decrypted
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+
+#define ECRYPTFS_FILE_DEFAULT_CACHE_EXTENTS 16
+
+/**
+ * @index: Extent number in the upper file
+ * @lru_prev, @lru_next: Position in the recency list; the head is the
+ *                       most recently used extent
+ * @hash_next: Next extent in the same hash bucket
+ */
+struct ecryptfs_cached_extent {
+	uint64_t index;
+	int valid;
+	struct ecryptfs_cached_extent *lru_prev;
+	struct ecryptfs_cached_extent *lru_next;
+	struct ecryptfs_cached_extent *hash_next;
+	char *data;
+};
+
+/**
+ * @header_size: Bytes of metadata in front of the first extent; zero
+ *               when the metadata is in the xattr
+ * @extents: All cache entries; invalid entries sit at the LRU tail
+ * @hash: Buckets of valid entries, keyed on the extent index
+ */
+struct ecryptfs_file {
+	int fd;
+	uint64_t file_size;
+	uint64_t header_size;
+	size_t extent_size;
+	struct ecryptfs_extent_ctx *ctx;
+	size_t num_extents;
+	struct ecryptfs_cached_extent *extents;
+	struct ecryptfs_cached_extent *lru_head;
+	struct ecryptfs_cached_extent *lru_tail;
+	struct ecryptfs_cached_extent **hash;
+	size_t hash_mask;
+	char *data;
+};
+
+/**
+ * ecryptfs_read_lower_metadata
+ * @fd: Lower file
+ * @buf: Receives the metadata; @packet_set points into it
+ * @buf_size: Size of @buf; ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE holds
+ *            any header the kernel writes
+ * @crypt_stat: Parsed metadata
+ * @packet_set: Parsed key packets
+ * @header_size: Set to the number of bytes in front of the first
+ *               extent of the lower file
+ *
+ * Reads the header at the front of the lower file, falling back to the
+ * user.ecryptfs xattr when the file was written with
+ * ecryptfs_xattr_metadata.
+ */
+int ecryptfs_read_lower_metadata(int fd, char *buf, size_t buf_size,
+				 struct ecryptfs_crypt_stat_user *crypt_stat,
+				 struct ecryptfs_packet_set_user *packet_set,
+				 uint64_t *header_size)
+{
+	ssize_t size;
+
+	size = pread(fd, buf, buf_size, 0);
+	if (size == -1)
+		return -errno;
+	if (!ecryptfs_parse_stat_packet_set(crypt_stat, packet_set, buf,
+					    size)) {
+		(*header_size) = crypt_stat->num_header_bytes_at_front;
+		return 0;
+	}
+	size = fgetxattr(fd, ECRYPTFS_XATTR_NAME, buf, buf_size);
+	if (size == -1)
+		return -EINVAL;
+	(*header_size) = 0;
+	return ecryptfs_parse_stat_packet_set(crypt_stat, packet_set, buf,
+					      size);
+}
+
+static void ecryptfs_file_lru_unlink(struct ecryptfs_file *file,
+				     struct ecryptfs_cached_extent *extent)
+{
+	if (extent->lru_prev)
+		extent->lru_prev->lru_next = extent->lru_next;
+	else
+		file->lru_head = extent->lru_next;
+	if (extent->lru_next)
+		extent->lru_next->lru_prev = extent->lru_prev;
+	else
+		file->lru_tail = extent->lru_prev;
+	extent->lru_prev = extent->lru_next = NULL;
+}
+
+static void ecryptfs_file_lru_push_head(struct ecryptfs_file *file,
+					struct ecryptfs_cached_extent *extent)
+{
+	extent->lru_prev = NULL;
+	extent->lru_next = file->lru_head;
+	if (file->lru_head)
+		file->lru_head->lru_prev = extent;
+	else
+		file->lru_tail = extent;
+	file->lru_head = extent;
+}
+
+static void ecryptfs_file_lru_push_tail(struct ecryptfs_file *file,
+					struct ecryptfs_cached_extent *extent)
+{
+	extent->lru_next = NULL;
+	extent->lru_prev = file->lru_tail;
+	if (file->lru_tail)
+		file->lru_tail->lru_next = extent;
+	else
+		file->lru_head = extent;
+	file->lru_tail = extent;
+}
+
+static struct ecryptfs_cached_extent **
+ecryptfs_file_bucket(struct ecryptfs_file *file, uint64_t index)
+{
+	/* Fibonacci hashing spreads runs of consecutive extents */
+	return &file->hash[((index * 0x9e3779b97f4a7c15ULL) >> 32)
+			   & file->hash_mask];
+}
+
+static void ecryptfs_file_hash_remove(struct ecryptfs_file *file,
+				      struct ecryptfs_cached_extent *extent)
+{
+	struct ecryptfs_cached_extent **pp;
+
+	for (pp = ecryptfs_file_bucket(file, extent->index); (*pp);
+	     pp = &(*pp)->hash_next)
+		if ((*pp) == extent) {
+			(*pp) = extent->hash_next;
+			break;
+		}
+	extent->hash_next = NULL;
+	extent->valid = 0;
+}
+
+/**
+ * ecryptfs_file_get_extent
+ * @file: Open file
+ * @index: Extent number in the upper file
+ * @extent: Set to the decrypted extent, now the most recently used one
+ *
+ * On a miss, the least recently used entry is recycled: the ciphertext
+ * is read straight into its buffer and decrypted in place.
+ */
+static int ecryptfs_file_get_extent(struct ecryptfs_file *file,
+				    uint64_t index,
+				    struct ecryptfs_cached_extent **extent)
+{
+	struct ecryptfs_cached_extent *e;
+	off_t offset;
+	size_t done = 0;
+	int rc = 0;
+
+	for (e = (*ecryptfs_file_bucket(file, index)); e; e = e->hash_next)
+		if (e->index == index)
+			goto out_hit;
+	e = file->lru_tail;
+	if (e->valid)
+		ecryptfs_file_hash_remove(file, e);
+	offset = (file->header_size + index * file->extent_size);
+	while (done < file->extent_size) {
+		ssize_t n = pread(file->fd, &e->data[done],
+				  (file->extent_size - done), (offset + done));
+
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			rc = (n == -1) ? -errno : -EIO;
+			syslog(LOG_ERR, "%s: Error reading extent [%llu] of the "
+			       "lower file; rc = [%d]\n", __FUNCTION__,
+			       (unsigned long long)index, rc);
+			goto out;
+		}
+		done += n;
+	}
+	rc = ecryptfs_decrypt_extent(file->ctx, e->data, e->data, index);
+	if (rc)
+		goto out;
+	e->index = index;
+	e->valid = 1;
+	e->hash_next = (*ecryptfs_file_bucket(file, index));
+	(*ecryptfs_file_bucket(file, index)) = e;
+out_hit:
+	ecryptfs_file_lru_unlink(file, e);
+	ecryptfs_file_lru_push_head(file, e);
+	(*extent) = e;
+out:
+	return rc;
+}
+
+/**
+ * ecryptfs_file_open
+ * @file: Set to a new handle; release with ecryptfs_file_close()
+ * @path: Lower file
+ * @passphrase: Mount passphrase the file is encrypted under
+ * @cache_extents: Maximum number of decrypted extents kept in memory
+ *                 for this handle; 0 picks a small default
+ *
+ * Recovers the file encryption key once, up front. A handle is not
+ * safe for concurrent use; open one per thread.
+ *
+ * Returns zero on success; -ENOKEY if the passphrase does not match
+ */
+int ecryptfs_file_open(struct ecryptfs_file **file, const char *path,
+		       char *passphrase, size_t cache_extents)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	struct ecryptfs_file *new_file;
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	size_t key_size;
+	char *header = NULL;
+	size_t num_buckets;
+	size_t i;
+	int rc;
+
+	if (!cache_extents)
+		cache_extents = ECRYPTFS_FILE_DEFAULT_CACHE_EXTENTS;
+	new_file = calloc(1, sizeof(*new_file));
+	if (!new_file)
+		return -ENOMEM;
+	new_file->extent_size = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	new_file->fd = open(path, O_RDONLY);
+	if (new_file->fd == -1) {
+		rc = -errno;
+		goto out;
+	}
+	header = malloc(ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE);
+	if (!header) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memset(&crypt_stat, 0, sizeof(crypt_stat));
+	rc = ecryptfs_read_lower_metadata(new_file->fd, header,
+					  ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE,
+					  &crypt_stat, &packet_set,
+					  &new_file->header_size);
+	if (rc)
+		goto out;
+	if (!(crypt_stat.flags & ECRYPTFS_ENCRYPTED)) {
+		rc = -EINVAL;
+		goto out;
+	}
+	new_file->file_size = crypt_stat.file_size;
+	rc = ecryptfs_find_fek_with_passphrase(fek, &key_size, &packet_set,
+					       passphrase);
+	if (rc)
+		goto out;
+	rc = ecryptfs_extent_ctx_create(&new_file->ctx,
+					packet_set.cipher_code, fek, key_size,
+					new_file->extent_size);
+	memset(fek, 0, sizeof(fek));
+	if (rc)
+		goto out;
+	for (num_buckets = 1; num_buckets < (cache_extents * 2);
+	     num_buckets <<= 1)
+		;
+	new_file->hash_mask = (num_buckets - 1);
+	new_file->hash = calloc(num_buckets, sizeof(*new_file->hash));
+	new_file->extents = calloc(cache_extents, sizeof(*new_file->extents));
+	new_file->data = malloc(cache_extents * new_file->extent_size);
+	if (!new_file->hash || !new_file->extents || !new_file->data) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	new_file->num_extents = cache_extents;
+	for (i = 0; i < cache_extents; i++) {
+		new_file->extents[i].data =
+			&new_file->data[i * new_file->extent_size];
+		ecryptfs_file_lru_push_tail(new_file, &new_file->extents[i]);
+	}
+out:
+	free(header);
+	if (rc)
+		ecryptfs_file_close(new_file);
+	else
+		(*file) = new_file;
+	return rc;
+}
+
+/**
+ * ecryptfs_file_size
+ *
+ * Returns the size of the decrypted file
+ */
+uint64_t ecryptfs_file_size(struct ecryptfs_file *file)
+{
+	return file->file_size;
+}
+
+/**
+ * ecryptfs_file_pread
+ * @file: Open file
+ * @buf: Receives the plaintext
+ * @count: Number of bytes to read
+ * @offset: Offset in the decrypted file
+ *
+ * Like pread(2), reads are short only at the end of the file.
+ *
+ * Returns the number of bytes read, or a negative errno
+ */
+ssize_t ecryptfs_file_pread(struct ecryptfs_file *file, void *buf,
+			    size_t count, uint64_t offset)
+{
+	char *dst = buf;
+	size_t done = 0;
+	int rc;
+
+	if (offset >= file->file_size)
+		return 0;
+	if (count > (file->file_size - offset))
+		count = (file->file_size - offset);
+	while (done < count) {
+		struct ecryptfs_cached_extent *extent = NULL;
+		uint64_t pos = (offset + done);
+		size_t extent_offset = (pos % file->extent_size);
+		size_t n = (file->extent_size - extent_offset);
+
+		rc = ecryptfs_file_get_extent(file, (pos / file->extent_size),
+					      &extent);
+		if (rc)
+			return rc;
+		if (n > (count - done))
+			n = (count - done);
+		memcpy(&dst[done], &extent->data[extent_offset], n);
+		done += n;
+	}
+	return done;
+}
+
+void ecryptfs_file_close(struct ecryptfs_file *file)
+{
+	if (!file)
+		return;
+	if (file->data) {
+		memset(file->data, 0, file->num_extents * file->extent_size);
+		free(file->data);
+	}
+	free(file->extents);
+	free(file->hash);
+	ecryptfs_extent_ctx_destroy(file->ctx);
+	if (file->fd != -1)
+		close(file->fd);
+	free(file);
+}
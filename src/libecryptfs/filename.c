@@ -0,0 +1,588 @@
+/**
+ * Offline filename encryption: the tag 70 packets and the filename-safe
+ * encoding that the kernel uses for names in a mount with
+ * ecryptfs_fnek_sig, following fs/ecryptfs/keystore.c and crypto.c
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <limits.h>
+#include <nss.h>
+#include <pk11func.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "../include/ecryptfs.h"
+
+#define ECRYPTFS_TAG_70_PACKET_TYPE 0x46
+#define ECRYPTFS_TAG_70_DIGEST_SIZE 16
+#define ECRYPTFS_FILENAME_MIN_RANDOM_PREPEND_BYTES 16
+#define ECRYPTFS_NON_NULL 0x42
+/* Enough prefix for the largest name that still fits in NAME_MAX */
+#define ECRYPTFS_FILENAME_MAX_PREFIX_BYTES 32
+/* Largest packet whose encoding still fits in NAME_MAX */
+#define ECRYPTFS_FILENAME_MAX_PACKET_BYTES \
+	(((NAME_MAX - (sizeof(ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX) - 1)) \
+	  / 4) * 3)
+
+static const char portable_filename_chars[] =
+	"-_0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+/* Inverse of portable_filename_chars; characters outside the alphabet
+ * map to ECRYPTFS_FILENAME_BAD_CHAR, which no valid sextet has set */
+#define ECRYPTFS_FILENAME_BAD_CHAR 0x40
+static const unsigned char filename_rev_map[256] = {
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x00, 0x40, 0x40,
+	0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+	0x0a, 0x0b, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+	0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a,
+	0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22,
+	0x23, 0x24, 0x25, 0x40, 0x40, 0x40, 0x40, 0x01,
+	0x40, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c,
+	0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34,
+	0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c,
+	0x3d, 0x3e, 0x3f, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40,
+	0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40, 0x40
+};
+
+/**
+ * @enc_ctx, @dec_ctx: AES-ECB contexts on the first @key_size bytes of
+ *                     the FNEK
+ * @sig: Binary signature of the FNEK, written into every packet
+ * @prefix: The bytes put in front of every name. The kernel calls them
+ *          random, but they are a fixed MD5 chain over the FNEK, so
+ *          they are computed once here.
+ * @batch: Ciphertext of every name in a ecryptfs_decrypt_filenames()
+ *         call, so that they all go through one ECB call
+ */
+struct ecryptfs_fn_ctx {
+	PK11SlotInfo *slot;
+	PK11SymKey *sym_key;
+	PK11Context *enc_ctx;
+	PK11Context *dec_ctx;
+	uint8_t cipher_code;
+	char sig[ECRYPTFS_SIG_SIZE];
+	unsigned char prefix[ECRYPTFS_FILENAME_MAX_PREFIX_BYTES];
+	unsigned char *batch;
+	size_t batch_size;
+};
+
+/**
+ * ecryptfs_derive_fnek
+ * @fnek: Set to ECRYPTFS_MAX_KEY_BYTES of filename encryption key
+ * @sig: Set to the ECRYPTFS_SIG_SIZE byte binary signature of @fnek
+ * @passphrase: The mount passphrase
+ *
+ * The mount helpers hand ECRYPTFS_DEFAULT_SALT_FNEK_HEX to the KDF
+ * without converting it from hex, so the salt actually used is its
+ * first ECRYPTFS_SALT_SIZE ASCII characters. That is repeated here so
+ * that the key matches the one in the keyring.
+ */
+int ecryptfs_derive_fnek(char *fnek, char *sig, char *passphrase)
+{
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	int rc;
+
+	rc = generate_passphrase_sig(sig_hex, fnek,
+				     ECRYPTFS_DEFAULT_SALT_FNEK_HEX,
+				     passphrase);
+	if (rc)
+		return (rc < 0) ? rc : -rc;
+	from_hex(sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	return 0;
+}
+
+static int ecryptfs_md5(unsigned char *digest, const unsigned char *src,
+			size_t size)
+{
+	if (PK11_HashBuf(SEC_OID_MD5, digest, src, size) != SECSuccess) {
+		syslog(LOG_ERR, "%s: PK11_HashBuf() error; PORT_GetError() = "
+		       "[%d]\n", __FUNCTION__, PORT_GetError());
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * ecryptfs_fn_ctx_create
+ * @ctx: Set to the new context
+ * @cipher_code: Filename cipher; only AES is supported
+ * @fnek: ECRYPTFS_MAX_KEY_BYTES from ecryptfs_derive_fnek()
+ * @key_size: Filename key size in bytes (ecryptfs_fn_key_bytes)
+ * @sig: Binary signature of @fnek
+ */
+int ecryptfs_fn_ctx_create(struct ecryptfs_fn_ctx **ctx, uint8_t cipher_code,
+			   const char *fnek, size_t key_size, const char *sig)
+{
+	struct ecryptfs_fn_ctx *new_ctx;
+	unsigned char hash[ECRYPTFS_TAG_70_DIGEST_SIZE];
+	SECItem key_item;
+	SECItem *sec_param = NULL;
+	int i;
+	int rc;
+
+	*ctx = NULL;
+	if (!ecryptfs_cipher_code_is_aes(cipher_code)
+	    || key_size > ECRYPTFS_MAX_KEY_BYTES)
+		return -EOPNOTSUPP;
+	NSS_NoDB_Init(NULL);
+	new_ctx = calloc(1, sizeof(*new_ctx));
+	if (!new_ctx)
+		return -ENOMEM;
+	new_ctx->cipher_code = cipher_code;
+	memcpy(new_ctx->sig, sig, ECRYPTFS_SIG_SIZE);
+	rc = ecryptfs_md5(hash, (const unsigned char *)fnek,
+			  ECRYPTFS_MAX_KEY_BYTES);
+	if (rc)
+		goto out;
+	for (i = 0; i < ECRYPTFS_FILENAME_MAX_PREFIX_BYTES; i++) {
+		new_ctx->prefix[i] = hash[i % ECRYPTFS_TAG_70_DIGEST_SIZE];
+		if ((i % ECRYPTFS_TAG_70_DIGEST_SIZE)
+		    == (ECRYPTFS_TAG_70_DIGEST_SIZE - 1)) {
+			rc = ecryptfs_md5(hash, hash,
+					  ECRYPTFS_TAG_70_DIGEST_SIZE);
+			if (rc)
+				goto out;
+		}
+		if (new_ctx->prefix[i] == '\0')
+			new_ctx->prefix[i] = ECRYPTFS_NON_NULL;
+	}
+	new_ctx->slot = PK11_GetBestSlot(CKM_AES_ECB, NULL);
+	if (!new_ctx->slot) {
+		rc = -EIO;
+		goto out;
+	}
+	key_item.data = (unsigned char *)fnek;
+	key_item.len = key_size;
+	new_ctx->sym_key = PK11_ImportSymKeyWithFlags(
+		new_ctx->slot, CKM_AES_ECB, PK11_OriginUnwrap, CKA_FLAGS_ONLY,
+		&key_item, (CKF_ENCRYPT | CKF_DECRYPT), PR_FALSE, NULL);
+	if (!new_ctx->sym_key) {
+		syslog(LOG_ERR, "%s: PK11_ImportSymKey() returned NULL\n",
+		       __FUNCTION__);
+		rc = -EIO;
+		goto out;
+	}
+	sec_param = PK11_ParamFromIV(CKM_AES_ECB, NULL);
+	new_ctx->enc_ctx = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_ENCRYPT,
+						      new_ctx->sym_key,
+						      sec_param);
+	new_ctx->dec_ctx = PK11_CreateContextBySymKey(CKM_AES_ECB, CKA_DECRYPT,
+						      new_ctx->sym_key,
+						      sec_param);
+	if (!new_ctx->enc_ctx || !new_ctx->dec_ctx) {
+		rc = -EIO;
+		goto out;
+	}
+	*ctx = new_ctx;
+	new_ctx = NULL;
+out:
+	if (sec_param)
+		SECITEM_FreeItem(sec_param, PR_TRUE);
+	memset(hash, 0, sizeof(hash));
+	ecryptfs_fn_ctx_destroy(new_ctx);
+	return rc;
+}
+
+void ecryptfs_fn_ctx_destroy(struct ecryptfs_fn_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	if (ctx->enc_ctx)
+		PK11_DestroyContext(ctx->enc_ctx, PR_TRUE);
+	if (ctx->dec_ctx)
+		PK11_DestroyContext(ctx->dec_ctx, PR_TRUE);
+	free(ctx->batch);
+	if (ctx->sym_key)
+		PK11_FreeSymKey(ctx->sym_key);
+	if (ctx->slot)
+		PK11_FreeSlot(ctx->slot);
+	memset(ctx, 0, sizeof(*ctx));
+	free(ctx);
+}
+
+/**
+ * ecryptfs_encode_for_filename
+ * @dst: Receives ((@src_size + 2) / 3) * 4 characters, not terminated
+ * @src: Bytes to encode
+ * @src_size: Number of bytes at @src
+ *
+ * Base64 over the filename-safe alphabet, without padding characters;
+ * a short final group is encoded as if zero filled.
+ *
+ * Returns the number of characters written
+ */
+size_t ecryptfs_encode_for_filename(char *dst, const unsigned char *src,
+				    size_t src_size)
+{
+	size_t i, j = 0;
+
+	for (i = 0; i < src_size; i += 3) {
+		unsigned char block[3] = { 0, 0, 0 };
+
+		memcpy(block, &src[i], (src_size - i) < 3 ? (src_size - i) : 3);
+		dst[j++] = portable_filename_chars[(block[0] >> 2) & 0x3F];
+		dst[j++] = portable_filename_chars[((block[0] << 4) & 0x30)
+						   | ((block[1] >> 4) & 0x0F)];
+		dst[j++] = portable_filename_chars[((block[1] << 2) & 0x3C)
+						   | ((block[2] >> 6) & 0x03)];
+		dst[j++] = portable_filename_chars[block[2] & 0x3F];
+	}
+	return j;
+}
+
+/**
+ * ecryptfs_encrypted_filename_size
+ * @name_size: Length of an upper name
+ *
+ * Returns the length, without the NUL, of the lower name that
+ * ecryptfs_encrypt_filename() produces for an upper name of
+ * @name_size bytes. Names for which this exceeds NAME_MAX cannot be
+ * created in a mount with ecryptfs_fnek_sig.
+ */
+size_t ecryptfs_encrypted_filename_size(size_t name_size)
+{
+	size_t num_rand_bytes = (ECRYPTFS_FILENAME_MIN_RANDOM_PREPEND_BYTES
+				 + 1);
+	size_t packet_size;
+
+	if ((num_rand_bytes + name_size) % ECRYPTFS_AES_BLOCK_SIZE)
+		num_rand_bytes += (ECRYPTFS_AES_BLOCK_SIZE
+				   - ((num_rand_bytes + name_size)
+				      % ECRYPTFS_AES_BLOCK_SIZE));
+	/* Type, one length byte, signature, cipher code, name */
+	packet_size = (num_rand_bytes + name_size + ECRYPTFS_SIG_SIZE + 3);
+	return ((sizeof(ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX) - 1)
+		+ (((packet_size + 2) / 3) * 4));
+}
+
+/**
+ * ecryptfs_encrypt_filename
+ * @ctx: Filename context
+ * @dst: Receives the NUL terminated lower name
+ * @dst_size: Size of @dst; NAME_MAX + 1 is always enough
+ * @name: Upper name, not NUL terminated
+ * @name_size: Length of @name
+ *
+ * Produces ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX followed by the
+ * encoded tag 70 packet, as ecryptfs_encrypt_and_encode_filename()
+ * does in the kernel.
+ *
+ * Returns zero on success; -ENAMETOOLONG if the lower name would not
+ * fit in NAME_MAX or in @dst
+ */
+int ecryptfs_encrypt_filename(struct ecryptfs_fn_ctx *ctx, char *dst,
+			      size_t dst_size, const char *name,
+			      size_t name_size)
+{
+	unsigned char packet[ECRYPTFS_FILENAME_MAX_PACKET_BYTES];
+	size_t prefix_len = strlen(ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX);
+	size_t num_rand_bytes, aligned_size, length_size, encoded_size;
+	size_t i = 0;
+	int outlen = 0;
+	int rc;
+
+	num_rand_bytes = (ECRYPTFS_FILENAME_MIN_RANDOM_PREPEND_BYTES + 1);
+	if ((num_rand_bytes + name_size) % ECRYPTFS_AES_BLOCK_SIZE)
+		num_rand_bytes += (ECRYPTFS_AES_BLOCK_SIZE
+				   - ((num_rand_bytes + name_size)
+				      % ECRYPTFS_AES_BLOCK_SIZE));
+	aligned_size = (num_rand_bytes + name_size);
+	/* Type, one length byte, signature, cipher code, name */
+	if (!name_size || (aligned_size + ECRYPTFS_SIG_SIZE + 3)
+			   > ECRYPTFS_FILENAME_MAX_PACKET_BYTES)
+		return -ENAMETOOLONG;
+	packet[i++] = ECRYPTFS_TAG_70_PACKET_TYPE;
+	rc = ecryptfs_write_packet_length((char *)&packet[i],
+					  (ECRYPTFS_SIG_SIZE + 1
+					   + aligned_size), &length_size);
+	if (rc)
+		return rc;
+	i += length_size;
+	memcpy(&packet[i], ctx->sig, ECRYPTFS_SIG_SIZE);
+	i += ECRYPTFS_SIG_SIZE;
+	packet[i++] = ctx->cipher_code;
+	memcpy(&packet[i], ctx->prefix, (num_rand_bytes - 1));
+	packet[i + num_rand_bytes - 1] = '\0';
+	memcpy(&packet[i + num_rand_bytes], name, name_size);
+	if (PK11_CipherOp(ctx->enc_ctx, &packet[i], &outlen, aligned_size,
+			  &packet[i], aligned_size) != SECSuccess
+	    || (size_t)outlen != aligned_size) {
+		syslog(LOG_ERR, "%s: PK11_CipherOp() error; PORT_GetError() = "
+		       "[%d]\n", __FUNCTION__, PORT_GetError());
+		return -EIO;
+	}
+	i += aligned_size;
+	encoded_size = (((i + 2) / 3) * 4);
+	if ((prefix_len + encoded_size) > NAME_MAX
+	    || (prefix_len + encoded_size) >= dst_size)
+		return -ENAMETOOLONG;
+	memcpy(dst, ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX, prefix_len);
+	ecryptfs_encode_for_filename(&dst[prefix_len], packet, i);
+	dst[prefix_len + encoded_size] = '\0';
+	return 0;
+}
+
+/**
+ * ecryptfs_is_encrypted_filename
+ *
+ * Returns one if @name carries ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX
+ */
+int ecryptfs_is_encrypted_filename(const char *name, size_t name_size)
+{
+	size_t prefix_len = strlen(ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX);
+
+	return (name_size > prefix_len
+		&& !memcmp(name, ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX,
+			   prefix_len));
+}
+
+/**
+ * ecryptfs_decode_from_filename
+ * @dst: Receives (@src_size / 4) * 3 bytes
+ * @src: Encoded characters
+ * @src_size: Number of characters at @src; a multiple of four, as
+ *            ecryptfs_encode_for_filename() produces
+ *
+ * Four characters are looked up and combined into three bytes at a
+ * time, with a single validity test per group rather than a branch per
+ * character.
+ *
+ * Returns the number of bytes written; -EINVAL if @src is not a valid
+ * encoding
+ */
+ssize_t ecryptfs_decode_from_filename(unsigned char *dst, const char *src,
+				      size_t src_size)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	size_t i, j = 0;
+
+	if (src_size % 4)
+		return -EINVAL;
+	for (i = 0; i < src_size; i += 4) {
+		uint32_t a = filename_rev_map[in[i]];
+		uint32_t b = filename_rev_map[in[i + 1]];
+		uint32_t c = filename_rev_map[in[i + 2]];
+		uint32_t d = filename_rev_map[in[i + 3]];
+		uint32_t group;
+
+		if ((a | b | c | d) & ECRYPTFS_FILENAME_BAD_CHAR)
+			return -EINVAL;
+		group = ((a << 18) | (b << 12) | (c << 6) | d);
+		dst[j++] = (group >> 16);
+		dst[j++] = (group >> 8);
+		dst[j++] = group;
+	}
+	return j;
+}
+
+/**
+ * ecryptfs_parse_tag_70_packet
+ * @name: Points at the name on entry; set to the encrypted name in the
+ *        decoded packet
+ * @name_size: Set to the size of the encrypted name
+ *
+ * Packet: type, length, FNEK signature, cipher code, encrypted name.
+ */
+static int ecryptfs_parse_tag_70_packet(struct ecryptfs_fn_ctx *ctx,
+					unsigned char *packet,
+					size_t packet_size,
+					unsigned char **name,
+					size_t *name_size)
+{
+	size_t body_size, length_size;
+	int rc;
+
+	if (packet_size < 2 || packet[0] != ECRYPTFS_TAG_70_PACKET_TYPE)
+		return -EINVAL;
+	rc = ecryptfs_parse_packet_length(&packet[1], &body_size,
+					  &length_size);
+	if (rc)
+		return -EINVAL;
+	if (body_size > (packet_size - 1 - length_size)
+	    || body_size < (ECRYPTFS_SIG_SIZE + 1 + ECRYPTFS_AES_BLOCK_SIZE)
+	    || ((body_size - ECRYPTFS_SIG_SIZE - 1)
+		% ECRYPTFS_AES_BLOCK_SIZE))
+		return -EINVAL;
+	packet += (1 + length_size);
+	if (memcmp(packet, ctx->sig, ECRYPTFS_SIG_SIZE))
+		return -ENOKEY;
+	if (packet[ECRYPTFS_SIG_SIZE] != ctx->cipher_code)
+		return -EOPNOTSUPP;
+	(*name) = &packet[ECRYPTFS_SIG_SIZE + 1];
+	(*name_size) = (body_size - ECRYPTFS_SIG_SIZE - 1);
+	return 0;
+}
+
+/**
+ * ecryptfs_decrypt_filenames
+ * @ctx: Filename context
+ * @names: Lower names to decrypt; upper, upper_size and rc are filled
+ *         in for each
+ * @count: Number of entries in @names
+ *
+ * Lower names without ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX are
+ * passed through unchanged, as the kernel does. Filename encryption is
+ * ECB with no chaining between names, so the encrypted names of the
+ * whole batch are decrypted together in one call.
+ *
+ * Returns zero unless the batch as a whole failed; per name errors are
+ * in @names[i].rc (-EINVAL for a malformed name, -ENOKEY for a name
+ * encrypted under another filename key)
+ */
+int ecryptfs_decrypt_filenames(struct ecryptfs_fn_ctx *ctx,
+			       struct ecryptfs_filename *names, size_t count)
+{
+	size_t prefix_len = strlen(ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX);
+	unsigned char packet[NAME_MAX];
+	size_t total = 0;
+	size_t i, j;
+	int outlen = 0;
+	int rc = 0;
+
+	/* Decode, check and collect */
+	for (i = 0; i < count; i++) {
+		struct ecryptfs_filename *fn = &names[i];
+		unsigned char *enc_name;
+		size_t enc_size;
+		ssize_t packet_size;
+
+		fn->upper_size = 0;
+		fn->rc = 0;
+		if (!ecryptfs_is_encrypted_filename(fn->lower,
+						    fn->lower_size)) {
+			if (fn->lower_size > NAME_MAX) {
+				fn->rc = -ENAMETOOLONG;
+				continue;
+			}
+			memcpy(fn->upper, fn->lower, fn->lower_size);
+			fn->upper[fn->lower_size] = '\0';
+			fn->upper_size = fn->lower_size;
+			continue;
+		}
+		if ((fn->lower_size - prefix_len) > (NAME_MAX / 3 * 4)) {
+			fn->rc = -EINVAL;
+			continue;
+		}
+		packet_size = ecryptfs_decode_from_filename(
+			packet, &fn->lower[prefix_len],
+			(fn->lower_size - prefix_len));
+		if (packet_size < 0) {
+			fn->rc = packet_size;
+			continue;
+		}
+		fn->rc = ecryptfs_parse_tag_70_packet(ctx, packet, packet_size,
+						      &enc_name, &enc_size);
+		if (fn->rc)
+			continue;
+		if ((total + enc_size) > ctx->batch_size) {
+			size_t new_size = ((total + enc_size) * 2);
+			unsigned char *batch = realloc(ctx->batch, new_size);
+
+			if (!batch)
+				return -ENOMEM;
+			ctx->batch = batch;
+			ctx->batch_size = new_size;
+		}
+		memcpy(&ctx->batch[total], enc_name, enc_size);
+		/* Park the size here until the batch is decrypted */
+		fn->upper_size = enc_size;
+		total += enc_size;
+	}
+	if (!total)
+		goto out;
+	if (PK11_CipherOp(ctx->dec_ctx, ctx->batch, &outlen, total,
+			  ctx->batch, total) != SECSuccess
+	    || (size_t)outlen != total) {
+		syslog(LOG_ERR, "%s: PK11_CipherOp() error; PORT_GetError() = "
+		       "[%d]\n", __FUNCTION__, PORT_GetError());
+		rc = -EIO;
+		goto out;
+	}
+	/* Split; each name follows the first NUL in its block run */
+	total = 0;
+	for (i = 0; i < count; i++) {
+		struct ecryptfs_filename *fn = &names[i];
+		size_t enc_size = fn->upper_size;
+		unsigned char *dec = &ctx->batch[total];
+
+		if (fn->rc || !ecryptfs_is_encrypted_filename(fn->lower,
+							      fn->lower_size))
+			continue;
+		total += enc_size;
+		for (j = 0; j < enc_size && dec[j] != '\0'; j++)
+			;
+		j++;
+		if (j >= enc_size) {
+			fn->rc = -EINVAL;
+			fn->upper_size = 0;
+			continue;
+		}
+		memcpy(fn->upper, &dec[j], (enc_size - j));
+		fn->upper[enc_size - j] = '\0';
+		fn->upper_size = (enc_size - j);
+	}
+	memset(ctx->batch, 0, total);
+out:
+	return rc;
+}
+
+/**
+ * ecryptfs_decrypt_filename
+ * @dst: Receives the NUL terminated upper name; NAME_MAX + 1 bytes
+ *
+ * Single name convenience wrapper around ecryptfs_decrypt_filenames()
+ */
+int ecryptfs_decrypt_filename(struct ecryptfs_fn_ctx *ctx, char *dst,
+			      const char *name, size_t name_size)
+{
+	struct ecryptfs_filename fn;
+	int rc;
+
+	fn.lower = name;
+	fn.lower_size = name_size;
+	rc = ecryptfs_decrypt_filenames(ctx, &fn, 1);
+	if (rc)
+		return rc;
+	if (fn.rc)
+		return fn.rc;
+	memcpy(dst, fn.upper, (fn.upper_size + 1));
+	return 0;
+}
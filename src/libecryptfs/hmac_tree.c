@@ -0,0 +1,674 @@
+/**
+ * HMAC trees over the ciphertext extents of lower files: a Merkle tree
+ * whose leaves are keyed hashes of each extent, so that a change to a
+ * few extents can be checked, or recorded, by rehashing only the paths
+ * from those leaves to the root
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <nss.h>
+#include <pk11pub.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "../include/ecryptfs.h"
+
+#define ECRYPTFS_HMAC_TREE_MAGIC "eCryptfsHTree1"
+#define ECRYPTFS_HMAC_TREE_MAGIC_SIZE 16
+/* Magic, number of leaves, lower size, key check, binding and root */
+#define ECRYPTFS_HMAC_TREE_HEADER_SIZE (ECRYPTFS_HMAC_TREE_MAGIC_SIZE + 8 \
+					+ 8 + (3 * ECRYPTFS_HMAC_TREE_NODE_SIZE))
+#define ECRYPTFS_HMAC_TREE_MAX_LEVELS 64
+
+/* Domain separation between leaves, inner nodes and the root */
+#define ECRYPTFS_HMAC_TREE_LEAF 'L'
+#define ECRYPTFS_HMAC_TREE_INNER 'N'
+#define ECRYPTFS_HMAC_TREE_ROOT 'R'
+#define ECRYPTFS_HMAC_TREE_KEY_CHECK 'K'
+
+/**
+ * @nodes: Every level, leaves first, each level right after the one
+ *         below it; this is also the layout of the sidecar file
+ * @level_start: Index in @nodes of the first node of each level
+ * @level_count: Number of nodes in each level; a node without a right
+ *               sibling is carried up to the next level unchanged
+ * @binding: Digest of the file's metadata, mixed into the root
+ * @root: HMAC over the top node, the number of leaves, the lower size
+ *        and @binding
+ */
+struct ecryptfs_hmac_tree {
+	PK11SlotInfo *slot;
+	PK11SymKey *sym_key;
+	PK11Context *hmac;
+	uint64_t num_leaves;
+	uint64_t lower_size;
+	uint32_t num_levels;
+	uint64_t level_start[ECRYPTFS_HMAC_TREE_MAX_LEVELS];
+	uint64_t level_count[ECRYPTFS_HMAC_TREE_MAX_LEVELS];
+	uint64_t num_nodes;
+	unsigned char *nodes;
+	unsigned char binding[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	unsigned char root[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+};
+
+static void ecryptfs_hmac_tree_put_be64(unsigned char *p, uint64_t value)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = (value & 0xFF);
+		value >>= 8;
+	}
+}
+
+static uint64_t ecryptfs_hmac_tree_get_be64(const unsigned char *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		value = ((value << 8) | p[i]);
+	return value;
+}
+
+static unsigned char *node(struct ecryptfs_hmac_tree *tree, uint32_t level,
+			   uint64_t index)
+{
+	return &tree->nodes[(tree->level_start[level] + index)
+			    * ECRYPTFS_HMAC_TREE_NODE_SIZE];
+}
+
+/**
+ * ecryptfs_hmac_tree_mac
+ *
+ * HMAC-SHA256 over @type followed by the two buffers
+ */
+static int ecryptfs_hmac_tree_mac(struct ecryptfs_hmac_tree *tree,
+				  unsigned char *out, unsigned char type,
+				  const unsigned char *a, size_t a_size,
+				  const unsigned char *b, size_t b_size)
+{
+	unsigned int len = 0;
+
+	if (PK11_DigestBegin(tree->hmac) != SECSuccess
+	    || PK11_DigestOp(tree->hmac, &type, 1) != SECSuccess
+	    || (a_size && PK11_DigestOp(tree->hmac, a, a_size) != SECSuccess)
+	    || (b_size && PK11_DigestOp(tree->hmac, b, b_size) != SECSuccess)
+	    || PK11_DigestFinal(tree->hmac, out, &len,
+				ECRYPTFS_HMAC_TREE_NODE_SIZE) != SECSuccess
+	    || len != ECRYPTFS_HMAC_TREE_NODE_SIZE) {
+		syslog(LOG_ERR, "%s: HMAC error; PORT_GetError() = [%d]\n",
+		       __FUNCTION__, PORT_GetError());
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * ecryptfs_derive_hmac_tree_key
+ * @key: Set to ECRYPTFS_HMAC_TREE_NODE_SIZE bytes of HMAC key
+ * @passphrase: The mount passphrase
+ *
+ * The key is a hash of the session key encryption key the mount
+ * derives from @passphrase and the salt in ~/.ecryptfsrc, or the
+ * default salt. It never encrypts anything, so it is independent of
+ * every file encryption key.
+ */
+int ecryptfs_derive_hmac_tree_key(unsigned char *key, char *passphrase)
+{
+	static const char label[] = "eCryptfs HMAC tree key";
+	char salt_hex[ECRYPTFS_SALT_SIZE_HEX];
+	char salt[ECRYPTFS_SALT_SIZE];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+	unsigned char src[sizeof(label) + ECRYPTFS_MAX_KEY_BYTES];
+	int rc;
+
+	if (ecryptfs_read_salt_hex_from_rc(salt_hex))
+		from_hex(salt, ECRYPTFS_DEFAULT_SALT_HEX, ECRYPTFS_SALT_SIZE);
+	else
+		from_hex(salt, salt_hex, ECRYPTFS_SALT_SIZE);
+	rc = generate_passphrase_sig(sig_hex, fekek, salt, passphrase);
+	if (rc)
+		goto out;
+	memcpy(src, label, sizeof(label));
+	memcpy(&src[sizeof(label)], fekek, ECRYPTFS_MAX_KEY_BYTES);
+	NSS_NoDB_Init(NULL);
+	if (PK11_HashBuf(SEC_OID_SHA256, key, src, sizeof(src))
+	    != SECSuccess)
+		rc = -EIO;
+out:
+	memset(fekek, 0, sizeof(fekek));
+	memset(src, 0, sizeof(src));
+	return rc;
+}
+
+/**
+ * ecryptfs_hmac_tree_create
+ * @tree: Set to a new tree; release with ecryptfs_hmac_tree_destroy()
+ * @key: ECRYPTFS_HMAC_TREE_NODE_SIZE bytes from
+ *       ecryptfs_derive_hmac_tree_key()
+ * @num_leaves: Number of extents in the lower file
+ * @lower_size: Size of the lower file
+ *
+ * The nodes start out zeroed. A tree must only be used by one thread
+ * at a time.
+ */
+int ecryptfs_hmac_tree_create(struct ecryptfs_hmac_tree **tree,
+			      const unsigned char *key, uint64_t num_leaves,
+			      uint64_t lower_size)
+{
+	struct ecryptfs_hmac_tree *new_tree;
+	SECItem key_item;
+	SECItem no_params = {siBuffer, NULL, 0};
+	uint64_t count = num_leaves;
+	int rc = 0;
+
+	new_tree = calloc(1, sizeof(*new_tree));
+	if (!new_tree)
+		return -ENOMEM;
+	new_tree->num_leaves = num_leaves;
+	new_tree->lower_size = lower_size;
+	while (count) {
+		if (new_tree->num_levels == ECRYPTFS_HMAC_TREE_MAX_LEVELS) {
+			rc = -EFBIG;
+			goto out;
+		}
+		new_tree->level_start[new_tree->num_levels] =
+			new_tree->num_nodes;
+		new_tree->level_count[new_tree->num_levels++] = count;
+		new_tree->num_nodes += count;
+		if (count == 1)
+			break;
+		count = ((count + 1) / 2);
+	}
+	if (new_tree->num_nodes > (SIZE_MAX / ECRYPTFS_HMAC_TREE_NODE_SIZE)) {
+		rc = -EFBIG;
+		goto out;
+	}
+	if (new_tree->num_nodes) {
+		new_tree->nodes = calloc(new_tree->num_nodes,
+					 ECRYPTFS_HMAC_TREE_NODE_SIZE);
+		if (!new_tree->nodes) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	NSS_NoDB_Init(NULL);
+	new_tree->slot = PK11_GetBestSlot(CKM_SHA256_HMAC, NULL);
+	if (!new_tree->slot) {
+		rc = -EIO;
+		goto out;
+	}
+	key_item.type = siBuffer;
+	key_item.data = (unsigned char *)key;
+	key_item.len = ECRYPTFS_HMAC_TREE_NODE_SIZE;
+	new_tree->sym_key = PK11_ImportSymKey(new_tree->slot, CKM_SHA256_HMAC,
+					      PK11_OriginUnwrap, CKA_SIGN,
+					      &key_item, NULL);
+	if (!new_tree->sym_key) {
+		syslog(LOG_ERR, "%s: PK11_ImportSymKey() returned NULL\n",
+		       __FUNCTION__);
+		rc = -EIO;
+		goto out;
+	}
+	new_tree->hmac = PK11_CreateContextBySymKey(CKM_SHA256_HMAC, CKA_SIGN,
+						    new_tree->sym_key,
+						    &no_params);
+	if (!new_tree->hmac)
+		rc = -EIO;
+out:
+	if (rc)
+		ecryptfs_hmac_tree_destroy(new_tree);
+	else
+		(*tree) = new_tree;
+	return rc;
+}
+
+void ecryptfs_hmac_tree_destroy(struct ecryptfs_hmac_tree *tree)
+{
+	if (!tree)
+		return;
+	if (tree->hmac)
+		PK11_DestroyContext(tree->hmac, PR_TRUE);
+	if (tree->sym_key)
+		PK11_FreeSymKey(tree->sym_key);
+	if (tree->slot)
+		PK11_FreeSlot(tree->slot);
+	free(tree->nodes);
+	memset(tree, 0, sizeof(*tree));
+	free(tree);
+}
+
+uint64_t ecryptfs_hmac_tree_num_leaves(struct ecryptfs_hmac_tree *tree)
+{
+	return tree->num_leaves;
+}
+
+/**
+ * ecryptfs_hmac_tree_hash_leaf
+ * @leaf: Set to the HMAC of extent @index holding @data
+ *
+ * The index is part of the HMAC, so extents cannot be swapped
+ */
+int ecryptfs_hmac_tree_hash_leaf(struct ecryptfs_hmac_tree *tree,
+				 unsigned char *leaf, uint64_t index,
+				 const char *data, size_t size)
+{
+	unsigned char be_index[8];
+
+	ecryptfs_hmac_tree_put_be64(be_index, index);
+	return ecryptfs_hmac_tree_mac(tree, leaf, ECRYPTFS_HMAC_TREE_LEAF,
+				      be_index, sizeof(be_index),
+				      (const unsigned char *)data, size);
+}
+
+/**
+ * ecryptfs_hmac_tree_set_leaf
+ *
+ * Stores the HMAC of extent @index. The inner nodes and the root are
+ * not updated; call ecryptfs_hmac_tree_build() once every leaf is set.
+ */
+int ecryptfs_hmac_tree_set_leaf(struct ecryptfs_hmac_tree *tree,
+				uint64_t index, const char *data, size_t size)
+{
+	if (index >= tree->num_leaves)
+		return -EINVAL;
+	return ecryptfs_hmac_tree_hash_leaf(tree, node(tree, 0, index), index,
+					    data, size);
+}
+
+static int ecryptfs_hmac_tree_parent(struct ecryptfs_hmac_tree *tree,
+				     uint32_t level, uint64_t index)
+{
+	uint64_t left = (index & ~1ULL);
+	unsigned char *parent = node(tree, level + 1, index / 2);
+
+	if (left + 1 >= tree->level_count[level]) {
+		memcpy(parent, node(tree, level, left),
+		       ECRYPTFS_HMAC_TREE_NODE_SIZE);
+		return 0;
+	}
+	return ecryptfs_hmac_tree_mac(tree, parent, ECRYPTFS_HMAC_TREE_INNER,
+				      node(tree, level, left),
+				      ECRYPTFS_HMAC_TREE_NODE_SIZE,
+				      node(tree, level, left + 1),
+				      ECRYPTFS_HMAC_TREE_NODE_SIZE);
+}
+
+static int ecryptfs_hmac_tree_compute_root(struct ecryptfs_hmac_tree *tree,
+					   unsigned char *root)
+{
+	unsigned char src[8 + 8 + ECRYPTFS_HMAC_TREE_NODE_SIZE
+			  + ECRYPTFS_HMAC_TREE_NODE_SIZE];
+
+	ecryptfs_hmac_tree_put_be64(src, tree->num_leaves);
+	ecryptfs_hmac_tree_put_be64(&src[8], tree->lower_size);
+	memcpy(&src[16], tree->binding, ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	if (tree->num_levels)
+		memcpy(&src[16 + ECRYPTFS_HMAC_TREE_NODE_SIZE],
+		       node(tree, tree->num_levels - 1, 0),
+		       ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	else
+		memset(&src[16 + ECRYPTFS_HMAC_TREE_NODE_SIZE], 0,
+		       ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	return ecryptfs_hmac_tree_mac(tree, root, ECRYPTFS_HMAC_TREE_ROOT,
+				      src, sizeof(src), NULL, 0);
+}
+
+/**
+ * ecryptfs_hmac_tree_set_binding
+ * @metadata: The header region of the lower file, or the value of its
+ *            metadata xattr
+ *
+ * Ties the tree to one file: the metadata holds its wrapped, random,
+ * file encryption key. Takes effect at the next build or update.
+ */
+int ecryptfs_hmac_tree_set_binding(struct ecryptfs_hmac_tree *tree,
+				   const char *metadata, size_t size)
+{
+	if (PK11_HashBuf(SEC_OID_SHA256, tree->binding,
+			 (unsigned char *)metadata, size) != SECSuccess)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_build
+ *
+ * Computes every inner node and the root from the leaves
+ */
+int ecryptfs_hmac_tree_build(struct ecryptfs_hmac_tree *tree)
+{
+	uint32_t level;
+	uint64_t i;
+	int rc;
+
+	for (level = 0; (level + 1) < tree->num_levels; level++)
+		for (i = 0; i < tree->level_count[level]; i += 2) {
+			rc = ecryptfs_hmac_tree_parent(tree, level, i);
+			if (rc)
+				return rc;
+		}
+	return ecryptfs_hmac_tree_compute_root(tree, tree->root);
+}
+
+/**
+ * ecryptfs_hmac_tree_verify_leaf
+ * @leaf: HMAC of extent @index as read now, from
+ *        ecryptfs_hmac_tree_hash_leaf()
+ *
+ * Checks @leaf against the tree along the path to the root, using the
+ * stored siblings of each node on the way. Only the nodes on that path
+ * are trusted, because the root they lead to is checked as well.
+ *
+ * Returns zero if the extent matches; -EBADMSG if it does not
+ */
+int ecryptfs_hmac_tree_verify_leaf(struct ecryptfs_hmac_tree *tree,
+				   uint64_t index, const unsigned char *leaf)
+{
+	unsigned char cur[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	unsigned char root[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	uint32_t level;
+	int rc;
+
+	if (index >= tree->num_leaves)
+		return -EINVAL;
+	memcpy(cur, leaf, ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	for (level = 0; (level + 1) < tree->num_levels; level++) {
+		uint64_t sibling = (index ^ 1);
+
+		if (sibling < tree->level_count[level]) {
+			if (index & 1)
+				rc = ecryptfs_hmac_tree_mac(
+					tree, cur, ECRYPTFS_HMAC_TREE_INNER,
+					node(tree, level, sibling),
+					ECRYPTFS_HMAC_TREE_NODE_SIZE, cur,
+					ECRYPTFS_HMAC_TREE_NODE_SIZE);
+			else
+				rc = ecryptfs_hmac_tree_mac(
+					tree, cur, ECRYPTFS_HMAC_TREE_INNER,
+					cur, ECRYPTFS_HMAC_TREE_NODE_SIZE,
+					node(tree, level, sibling),
+					ECRYPTFS_HMAC_TREE_NODE_SIZE);
+			if (rc)
+				return rc;
+		}
+		index /= 2;
+	}
+	if (tree->num_levels
+	    && memcmp(cur, node(tree, tree->num_levels - 1, 0),
+		      ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		return -EBADMSG;
+	rc = ecryptfs_hmac_tree_compute_root(tree, root);
+	if (rc)
+		return rc;
+	if (memcmp(root, tree->root, ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		return -EBADMSG;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_update
+ * @index: Leaf that was just set
+ *
+ * Recomputes the nodes from @index up to the root: one HMAC per level
+ */
+static int ecryptfs_hmac_tree_update(struct ecryptfs_hmac_tree *tree,
+				     uint64_t index)
+{
+	uint32_t level;
+	int rc;
+
+	for (level = 0; (level + 1) < tree->num_levels; level++) {
+		rc = ecryptfs_hmac_tree_parent(tree, level, index);
+		if (rc)
+			return rc;
+		index /= 2;
+	}
+	return ecryptfs_hmac_tree_compute_root(tree, tree->root);
+}
+
+/**
+ * ecryptfs_hmac_tree_replace_leaf
+ * @index: Extent that changed
+ * @data: Its new contents
+ *
+ * Checks the stored path from @index to the root first, so that a
+ * tampered sidecar is not blessed with a new root, then sets the leaf
+ * and recomputes that path only.
+ *
+ * Returns zero on success; -EBADMSG if the stored path does not match
+ * the root
+ */
+int ecryptfs_hmac_tree_replace_leaf(struct ecryptfs_hmac_tree *tree,
+				    uint64_t index, const char *data,
+				    size_t size)
+{
+	unsigned char stored[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	int rc;
+
+	if (index >= tree->num_leaves)
+		return -EINVAL;
+	memcpy(stored, node(tree, 0, index), ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	rc = ecryptfs_hmac_tree_verify_leaf(tree, index, stored);
+	if (rc)
+		return rc;
+	rc = ecryptfs_hmac_tree_set_leaf(tree, index, data, size);
+	if (rc)
+		return rc;
+	return ecryptfs_hmac_tree_update(tree, index);
+}
+
+/**
+ * ecryptfs_hmac_tree_rebind
+ *
+ * Like ecryptfs_hmac_tree_set_binding(), for a tree that was read back:
+ * checks the stored root first, then recomputes it over the new
+ * binding.
+ */
+int ecryptfs_hmac_tree_rebind(struct ecryptfs_hmac_tree *tree,
+			      const char *metadata, size_t size)
+{
+	unsigned char root[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	int rc;
+
+	rc = ecryptfs_hmac_tree_compute_root(tree, root);
+	if (rc)
+		return rc;
+	if (memcmp(root, tree->root, ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		return -EBADMSG;
+	rc = ecryptfs_hmac_tree_set_binding(tree, metadata, size);
+	if (rc)
+		return rc;
+	return ecryptfs_hmac_tree_compute_root(tree, tree->root);
+}
+
+/**
+ * ecryptfs_hmac_tree_check_binding
+ *
+ * Returns zero if @metadata is what the tree was bound to; -EBADMSG
+ * otherwise
+ */
+int ecryptfs_hmac_tree_check_binding(struct ecryptfs_hmac_tree *tree,
+				     const char *metadata, size_t size)
+{
+	unsigned char binding[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+
+	if (PK11_HashBuf(SEC_OID_SHA256, binding, (unsigned char *)metadata,
+			 size) != SECSuccess)
+		return -EIO;
+	if (memcmp(binding, tree->binding, ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		return -EBADMSG;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_compare
+ * @first_bad: Set to the first leaf that differs, or to the number of
+ *             leaves if only the metadata, or nothing, differs
+ *
+ * Returns zero if both trees have the same root; -EBADMSG otherwise
+ */
+int ecryptfs_hmac_tree_compare(struct ecryptfs_hmac_tree *a,
+			       struct ecryptfs_hmac_tree *b,
+			       uint64_t *first_bad)
+{
+	uint64_t i;
+
+	(*first_bad) = a->num_leaves;
+	if (a->num_leaves == b->num_leaves)
+		for (i = 0; i < a->num_leaves; i++)
+			if (memcmp(node(a, 0, i), node(b, 0, i),
+				   ECRYPTFS_HMAC_TREE_NODE_SIZE)) {
+				(*first_bad) = i;
+				break;
+			}
+	if (a->num_leaves != b->num_leaves || a->lower_size != b->lower_size
+	    || memcmp(a->root, b->root, ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		return -EBADMSG;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_write
+ * @fd: Sidecar file, written from offset zero
+ */
+int ecryptfs_hmac_tree_write(struct ecryptfs_hmac_tree *tree, int fd)
+{
+	unsigned char header[ECRYPTFS_HMAC_TREE_HEADER_SIZE];
+	size_t nodes_size = (tree->num_nodes * ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	size_t i = 0;
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, ECRYPTFS_HMAC_TREE_MAGIC,
+	       strlen(ECRYPTFS_HMAC_TREE_MAGIC));
+	i += ECRYPTFS_HMAC_TREE_MAGIC_SIZE;
+	ecryptfs_hmac_tree_put_be64(&header[i], tree->num_leaves);
+	i += 8;
+	ecryptfs_hmac_tree_put_be64(&header[i], tree->lower_size);
+	i += 8;
+	if (ecryptfs_hmac_tree_mac(tree, &header[i],
+				   ECRYPTFS_HMAC_TREE_KEY_CHECK, NULL, 0, NULL,
+				   0))
+		return -EIO;
+	i += ECRYPTFS_HMAC_TREE_NODE_SIZE;
+	memcpy(&header[i], tree->binding, ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	i += ECRYPTFS_HMAC_TREE_NODE_SIZE;
+	memcpy(&header[i], tree->root, ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+		return -EIO;
+	if (nodes_size && pwrite(fd, tree->nodes, nodes_size, sizeof(header))
+	    != (ssize_t)nodes_size)
+		return -EIO;
+	if (ftruncate(fd, sizeof(header) + nodes_size))
+		return -errno;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_write_path
+ * @index: Leaf passed to ecryptfs_hmac_tree_replace_leaf()
+ *
+ * Writes only the nodes from @index to the root, and the header, into
+ * a sidecar that ecryptfs_hmac_tree_write() wrote for this tree
+ */
+int ecryptfs_hmac_tree_write_path(struct ecryptfs_hmac_tree *tree, int fd,
+				  uint64_t index)
+{
+	uint32_t level;
+	off_t offset;
+
+	for (level = 0; level < tree->num_levels; level++) {
+		offset = (ECRYPTFS_HMAC_TREE_HEADER_SIZE
+			  + ((tree->level_start[level] + index)
+			     * ECRYPTFS_HMAC_TREE_NODE_SIZE));
+		if (pwrite(fd, node(tree, level, index),
+			   ECRYPTFS_HMAC_TREE_NODE_SIZE, offset)
+		    != ECRYPTFS_HMAC_TREE_NODE_SIZE)
+			return -EIO;
+		index /= 2;
+	}
+	offset = (ECRYPTFS_HMAC_TREE_MAGIC_SIZE + 8 + 8
+		  + ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	if (pwrite(fd, tree->binding, ECRYPTFS_HMAC_TREE_NODE_SIZE, offset)
+	    != ECRYPTFS_HMAC_TREE_NODE_SIZE
+	    || pwrite(fd, tree->root, ECRYPTFS_HMAC_TREE_NODE_SIZE,
+		      offset + ECRYPTFS_HMAC_TREE_NODE_SIZE)
+	    != ECRYPTFS_HMAC_TREE_NODE_SIZE)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * ecryptfs_hmac_tree_read
+ * @tree: Set to the tree stored in the sidecar @fd
+ * @key: The key the tree was built with
+ *
+ * Nothing in the sidecar is trusted until it has been checked against
+ * the root, which only the holder of @key can compute.
+ *
+ * Returns zero on success; -ENOKEY if the tree was built with another
+ * key
+ */
+int ecryptfs_hmac_tree_read(struct ecryptfs_hmac_tree **tree,
+			    const unsigned char *key, int fd)
+{
+	unsigned char header[ECRYPTFS_HMAC_TREE_HEADER_SIZE];
+	unsigned char key_check[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	struct ecryptfs_hmac_tree *new_tree = NULL;
+	size_t nodes_size;
+	size_t i = ECRYPTFS_HMAC_TREE_MAGIC_SIZE;
+	int rc;
+
+	if (pread(fd, header, sizeof(header), 0) != sizeof(header)
+	    || memcmp(header, ECRYPTFS_HMAC_TREE_MAGIC,
+		      strlen(ECRYPTFS_HMAC_TREE_MAGIC)))
+		return -EINVAL;
+	rc = ecryptfs_hmac_tree_create(&new_tree, key,
+				       ecryptfs_hmac_tree_get_be64(&header[i]),
+				       ecryptfs_hmac_tree_get_be64(
+					       &header[i + 8]));
+	if (rc)
+		return rc;
+	i += 16;
+	rc = ecryptfs_hmac_tree_mac(new_tree, key_check,
+				    ECRYPTFS_HMAC_TREE_KEY_CHECK, NULL, 0, NULL,
+				    0);
+	if (!rc && memcmp(key_check, &header[i], ECRYPTFS_HMAC_TREE_NODE_SIZE))
+		rc = -ENOKEY;
+	if (rc) {
+		ecryptfs_hmac_tree_destroy(new_tree);
+		return rc;
+	}
+	i += ECRYPTFS_HMAC_TREE_NODE_SIZE;
+	memcpy(new_tree->binding, &header[i], ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	i += ECRYPTFS_HMAC_TREE_NODE_SIZE;
+	memcpy(new_tree->root, &header[i], ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	nodes_size = (new_tree->num_nodes * ECRYPTFS_HMAC_TREE_NODE_SIZE);
+	if (nodes_size && pread(fd, new_tree->nodes, nodes_size,
+				sizeof(header)) != (ssize_t)nodes_size) {
+		ecryptfs_hmac_tree_destroy(new_tree);
+		return -EINVAL;
+	}
+	(*tree) = new_tree;
+	return 0;
+}
@@ -0,0 +1,482 @@
+/**
+ * A short-lived per-user agent that keeps copies of the FEKEK and FNEK
+ * auth toks after the last session unmounts the private directory, and
+ * puts them back into the user keyring at the next login so that the
+ * wrapped passphrase does not have to be unwrapped again
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <keyutils.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "../include/ecryptfs.h"
+
+/* Name of the listening socket in the abstract namespace, so that
+ * nothing is left behind on disk when the agent goes away */
+#define KEY_AGENT_SOCKET "ecryptfs-key-agent-%u"
+#define KEY_AGENT_MAX_KEYS 2
+/* How long a client waits for an answer, and the agent for a request */
+#define KEY_AGENT_IO_TIMEOUT_SEC 5
+#define KEY_AGENT_MAX_LINE 32
+
+/**
+ * struct key_agent_key - One auth tok held by the agent
+ * @sig: Description of the key in the user keyring
+ * @payload: The key payload exactly as keyctl_read() returned it
+ * @payload_size: Bytes of @payload in use
+ */
+struct key_agent_key {
+	char sig[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char payload[sizeof(struct ecryptfs_auth_tok)];
+	size_t payload_size;
+};
+
+static socklen_t key_agent_addr(struct sockaddr_un *addr, uid_t uid)
+{
+	int len;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+		       KEY_AGENT_SOCKET, (unsigned int)uid);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* Anyone can bind a name in the abstract namespace, so both ends check
+ * that the other one belongs to the same user */
+static int key_agent_peer_is_uid(int fd, uid_t uid)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+	return (cred.uid == uid);
+}
+
+static void key_agent_set_timeout(int fd)
+{
+	struct timeval tv = { .tv_sec = KEY_AGENT_IO_TIMEOUT_SEC };
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int key_agent_read_line(int fd, char *line, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = recv(fd, line + len, size - 1 - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+		len += n;
+		if (memchr(line, '\n', len))
+			break;
+	}
+	line[len] = '\0';
+	if (len == 0 || line[len - 1] != '\n')
+		return -EPROTO;
+	line[len - 1] = '\0';
+	return 0;
+}
+
+static void key_agent_wipe(struct key_agent_key *keys)
+{
+	size_t size = KEY_AGENT_MAX_KEYS * sizeof(*keys);
+
+	memset(keys, 0, size);
+	/* Keep the compiler from dropping the memset() */
+	__asm__ __volatile__("" : : "r"(keys) : "memory");
+	munlock(keys, size);
+	munmap(keys, size);
+}
+
+static long long key_agent_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Everything but the listening socket goes, in particular the flock()ed
+ * counter file of mount.ecryptfs_private and a cwd in the mount point */
+static void key_agent_detach(int sock)
+{
+	struct dirent *dirent;
+	DIR *dir;
+	int fd;
+
+	if (chdir("/"))
+		_exit(1);
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		for (fd = STDERR_FILENO + 1; fd < sysconf(_SC_OPEN_MAX); fd++)
+			if (fd != sock)
+				close(fd);
+		return;
+	}
+	while ((dirent = readdir(dir)) != NULL) {
+		fd = atoi(dirent->d_name);
+		if (fd > STDERR_FILENO && fd != sock && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
+static int key_agent_restore(struct key_agent_key *keys, int num_keys)
+{
+	int i;
+
+	for (i = 0; i < num_keys; i++)
+		if (add_key("user", keys[i].sig, keys[i].payload,
+			    keys[i].payload_size, KEY_SPEC_USER_KEYRING) < 0)
+			return -errno;
+	return 0;
+}
+
+/**
+ * key_agent_serve
+ *
+ * Answers requests until @grace seconds have gone by, a restore
+ * succeeded or a flush came in, then wipes the keys and exits. The
+ * listening socket is closed before the last answer goes out, so a
+ * client can bind a new agent as soon as it has read that answer.
+ */
+static void key_agent_serve(int sock, struct key_agent_key *keys,
+			    int num_keys, unsigned int grace)
+{
+	long long deadline = key_agent_now_ms() + (long long)grace * 1000;
+	long long remaining;
+	char line[KEY_AGENT_MAX_LINE];
+	uid_t uid = getuid();
+	struct pollfd pfd;
+	int done = 0;
+	int conn;
+	int rc;
+
+	while (!done && (remaining = deadline - key_agent_now_ms()) > 0) {
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, remaining > INT_MAX ? INT_MAX : remaining)
+		    <= 0)
+			continue;
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0)
+			continue;
+		key_agent_set_timeout(conn);
+		if (!key_agent_peer_is_uid(conn, uid)
+		    || key_agent_read_line(conn, line, sizeof(line))) {
+			close(conn);
+			continue;
+		}
+		if (strcmp(line, ECRYPTFS_KEY_AGENT_STATUS) == 0) {
+			snprintf(line, sizeof(line), "ok %lld\n",
+				 (remaining + 999) / 1000);
+		} else if (strcmp(line, ECRYPTFS_KEY_AGENT_RESTORE) == 0) {
+			rc = key_agent_restore(keys, num_keys);
+			if (rc == 0) {
+				done = 1;
+				strcpy(line, "ok\n");
+			} else
+				snprintf(line, sizeof(line), "error %d\n", -rc);
+		} else if (strcmp(line, ECRYPTFS_KEY_AGENT_FLUSH) == 0) {
+			done = 1;
+			strcpy(line, "ok\n");
+		} else
+			snprintf(line, sizeof(line), "error %d\n", EINVAL);
+		if (done)
+			close(sock);
+		send(conn, line, strlen(line), MSG_NOSIGNAL);
+		close(conn);
+	}
+	key_agent_wipe(keys);
+	_exit(0);
+}
+
+/**
+ * ecryptfs_key_agent_grace
+ * @pw_dir: Home directory of the user
+ * @grace: (out) Seconds the agent should keep the keys for
+ *
+ * The agent is opt-in: it is only used when ~/.ecryptfs/key-agent
+ * exists. The file holds the grace period in seconds; an empty file
+ * asks for ECRYPTFS_KEY_AGENT_DEFAULT_GRACE.
+ *
+ * Returns 0 if the user wants an agent, -ENOENT if not, and another
+ * negative errno if the file cannot be read
+ */
+int ecryptfs_key_agent_grace(char *pw_dir, unsigned int *grace)
+{
+	char buf[KEY_AGENT_MAX_LINE];
+	char *path = NULL;
+	char *end;
+	unsigned long val;
+	FILE *fh;
+	int rc = 0;
+
+	if (asprintf(&path, "%s/.ecryptfs/%s", pw_dir,
+		     ECRYPTFS_KEY_AGENT_FILE) < 0) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	fh = fopen(path, "r");
+	if (fh == NULL) {
+		rc = -errno;
+		goto out;
+	}
+	*grace = ECRYPTFS_KEY_AGENT_DEFAULT_GRACE;
+	if (fgets(buf, sizeof(buf), fh) != NULL) {
+		errno = 0;
+		val = strtoul(buf, &end, 10);
+		if (end != buf) {
+			if (errno || val > ECRYPTFS_KEY_AGENT_MAX_GRACE)
+				val = ECRYPTFS_KEY_AGENT_MAX_GRACE;
+			*grace = val;
+		}
+	}
+	fclose(fh);
+	/* A grace period of zero is the same as no agent at all */
+	if (*grace == 0)
+		rc = -ENOENT;
+out:
+	free(path);
+	return rc;
+}
+
+/**
+ * ecryptfs_key_agent_request
+ * @cmd: ECRYPTFS_KEY_AGENT_STATUS, _RESTORE or _FLUSH
+ * @reply: (out) Whatever followed "ok" in the answer; may be NULL
+ * @reply_size: Size of @reply
+ *
+ * Sends @cmd to the agent of the real uid. A restore puts the keys the
+ * agent holds into the user keyring of that uid.
+ *
+ * Returns 0 on success, -ECONNREFUSED or -ENOENT when there is no
+ * agent, and another negative errno if the agent refused the request
+ */
+int ecryptfs_key_agent_request(const char *cmd, char *reply,
+			       size_t reply_size)
+{
+	char line[KEY_AGENT_MAX_LINE];
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	uid_t uid = getuid();
+	int fd;
+	int rc;
+
+	addr_len = key_agent_addr(&addr, uid);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	key_agent_set_timeout(fd);
+	if (connect(fd, (struct sockaddr *)&addr, addr_len)) {
+		rc = -errno;
+		goto out;
+	}
+	if (!key_agent_peer_is_uid(fd, uid)) {
+		rc = -EPERM;
+		goto out;
+	}
+	snprintf(line, sizeof(line), "%s\n", cmd);
+	if (send(fd, line, strlen(line), MSG_NOSIGNAL) < 0) {
+		rc = -errno;
+		goto out;
+	}
+	rc = key_agent_read_line(fd, line, sizeof(line));
+	if (rc)
+		goto out;
+	if (strncmp(line, "ok", 2) == 0) {
+		if (reply && reply_size)
+			snprintf(reply, reply_size, "%s",
+				 line[2] == ' ' ? line + 3 : "");
+	} else if (sscanf(line, "error %d", &rc) == 1 && rc > 0)
+		rc = -rc;
+	else
+		rc = -EPROTO;
+out:
+	close(fd);
+	return rc;
+}
+
+/**
+ * ecryptfs_key_agent_hold
+ * @sigs: Signatures of the keys to hold; NULL entries are skipped
+ * @num_sigs: Number of entries in @sigs, at most 2
+ * @grace: Seconds to hold the keys for
+ *
+ * Copies the keys out of the user keyring into locked memory, replaces
+ * any agent the user already has and leaves a detached agent behind that
+ * runs as the real uid with every other privilege dropped. The keys are
+ * copied before this returns, so the caller is free to unlink them from
+ * the keyring straight away. Memory locks are not inherited across
+ * fork(), so the agent locks its own copy, and does not serve the keys
+ * if it cannot.
+ *
+ * Returns 0 once the agent is listening, negative errno otherwise
+ */
+int ecryptfs_key_agent_hold(char *sigs[], int num_sigs, unsigned int grace)
+{
+	size_t size = KEY_AGENT_MAX_KEYS * sizeof(struct key_agent_key);
+	struct key_agent_key *keys;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	key_serial_t key;
+	int num_keys = 0;
+	int status[2] = { -1, -1 };
+	int sock = -1;
+	pid_t pid;
+	long n;
+	int i;
+	int rc = 0;
+
+	if (num_sigs > KEY_AGENT_MAX_KEYS)
+		return -EINVAL;
+	keys = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (keys == MAP_FAILED)
+		return -errno;
+	/* Holding the keys in memory that may be swapped out would defeat
+	 * unlinking them from the keyring at all */
+	if (mlock(keys, size)) {
+		rc = -errno;
+		munmap(keys, size);
+		return rc;
+	}
+	madvise(keys, size, MADV_DONTDUMP);
+	for (i = 0; i < num_sigs; i++) {
+		if (sigs[i] == NULL)
+			continue;
+		key = keyctl_search(KEY_SPEC_USER_KEYRING, "user", sigs[i], 0);
+		if (key < 0) {
+			rc = -errno;
+			goto out;
+		}
+		n = keyctl_read(key, keys[num_keys].payload,
+				sizeof(keys[num_keys].payload));
+		if (n < 0) {
+			rc = -errno;
+			goto out;
+		}
+		if (n == 0 || (size_t)n > sizeof(keys[num_keys].payload)) {
+			rc = -EINVAL;
+			goto out;
+		}
+		keys[num_keys].payload_size = n;
+		snprintf(keys[num_keys].sig, sizeof(keys[num_keys].sig), "%s",
+			 sigs[i]);
+		num_keys++;
+	}
+	if (num_keys == 0) {
+		rc = -ENOKEY;
+		goto out;
+	}
+	ecryptfs_key_agent_request(ECRYPTFS_KEY_AGENT_FLUSH, NULL, 0);
+	addr_len = key_agent_addr(&addr, uid);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		rc = -errno;
+		goto out;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, addr_len)
+	    || listen(sock, 8)) {
+		rc = -errno;
+		goto out;
+	}
+	/* The agent reports whether it could lock the keys in memory */
+	if (pipe2(status, O_CLOEXEC)) {
+		rc = -errno;
+		goto out;
+	}
+	pid = fork();
+	if (pid < 0) {
+		rc = -errno;
+		goto out;
+	}
+	if (pid == 0) {
+		close(status[0]);
+		/* The caller may be setuid root; the agent must not be */
+		if (setresgid(gid, gid, gid) || setresuid(uid, uid, uid))
+			_exit(1);
+		/* No core dumps and no ptrace of the keys */
+		prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+		setsid();
+		if (fork() != 0)
+			_exit(0);
+		rc = mlock(keys, size) ? -errno : 0;
+		madvise(keys, size, MADV_DONTDUMP);
+		if (write(status[1], &rc, sizeof(rc)) != sizeof(rc) || rc) {
+			key_agent_wipe(keys);
+			_exit(1);
+		}
+		key_agent_detach(sock);
+		key_agent_serve(sock, keys, num_keys, grace);
+	}
+	close(status[1]);
+	status[1] = -1;
+	waitpid(pid, NULL, 0);
+	/* Nothing is read if the agent did not get as far as locking */
+	if (read(status[0], &rc, sizeof(rc)) != sizeof(rc))
+		rc = -ECHILD;
+out:
+	if (status[0] >= 0)
+		close(status[0]);
+	if (status[1] >= 0)
+		close(status[1]);
+	if (sock >= 0)
+		close(sock);
+	key_agent_wipe(keys);
+	if (rc)
+		syslog(LOG_ERR, "%s: Unable to hand the keys to the key "
+		       "agent; rc = [%d]\n", __FUNCTION__, rc);
+	return rc;
+}
@@ -572,10 +572,26 @@ out:
 int ecryptfs_insert_wrapped_passphrase_into_keyring(
 	char *auth_tok_sig, char *filename, char *wrapping_passphrase,
 	char *salt)
+{
+	return ecryptfs_insert_wrapped_passphrase_into_keyring_timed(
+		auth_tok_sig, filename, wrapping_passphrase, salt, NULL);
+}
+
+/**
+ * ecryptfs_insert_wrapped_passphrase_into_keyring_timed()
+ *
+ * As ecryptfs_insert_wrapped_passphrase_into_keyring(), adding the
+ * unwrap and each of the two inserts to @timing as their own phases.
+ * @timing may be NULL.
+ */
+int ecryptfs_insert_wrapped_passphrase_into_keyring_timed(
+	char *auth_tok_sig, char *filename, char *wrapping_passphrase,
+	char *salt, struct ecryptfs_timing *timing)
 {
 	char decrypted_passphrase[ECRYPTFS_MAX_PASSPHRASE_BYTES + 1] ;
 	int rc = 0;
 
+	ecryptfs_timing_begin(timing, "unwrap");
 	if ((rc = ecryptfs_unwrap_passphrase(decrypted_passphrase, filename,
 					     wrapping_passphrase, salt))) {
 		syslog(LOG_ERR, "Error attempting to unwrap passphrase from "
@@ -583,6 +599,7 @@ int ecryptfs_insert_wrapped_passphrase_into_keyring(
 		rc = -EIO;
 		goto out;
 	}
+	ecryptfs_timing_begin(timing, "insert_fnek");
 	if ((rc = ecryptfs_add_passphrase_key_to_keyring(auth_tok_sig,
 					decrypted_passphrase,
 					ECRYPTFS_DEFAULT_SALT_FNEK_HEX)) < 0) {
@@ -590,6 +607,7 @@ int ecryptfs_insert_wrapped_passphrase_into_keyring(
 		       "key to user session keyring; rc = [%d]\n", rc);
 		goto out;
 	}
+	ecryptfs_timing_begin(timing, "insert_fekek");
 	if ((rc = ecryptfs_add_passphrase_key_to_keyring(auth_tok_sig,
 							 decrypted_passphrase,
 							 salt)) < 0) {
@@ -597,6 +615,7 @@ int ecryptfs_insert_wrapped_passphrase_into_keyring(
 		       "user session keyring; rc = [%d]\n", rc);
 	}
 out:
+	ecryptfs_timing_end(timing);
 	return rc;
 }
 
@@ -23,7 +23,6 @@
 #include <errno.h>
 #include <nss.h>
 #include <pk11func.h>
-#include <mntent.h>
 #ifndef S_SPLINT_S
 #include <stdio.h>
 #endif
@@ -35,10 +34,11 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <keyutils.h>
-#include <sys/ipc.h>
 #include <sys/param.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "../include/ecryptfs.h"
 
 int ecryptfs_verbosity = 0;
@@ -138,57 +138,56 @@ char *ecryptfs_fetch_private_mnt(char *pw_dir) {
 /* Check if an ecryptfs private device or mount point is mounted.
  * Return 1 if a filesystem in mtab matches dev && mnt && sig.
  * Return 0 otherwise.
+ *
+ * A mount point is looked up on its own with ecryptfs_mount_find();
+ * only looking up a device needs the ecryptfs mounts indexed.
  */
 int ecryptfs_private_is_mounted(char *dev, char *mnt, char *sig, int mounting) {
-	FILE *fh = NULL;
-	struct mntent *m = NULL;
+	struct ecryptfs_mount_table *table = NULL;
+	struct ecryptfs_mount *m = NULL;
 	char *opt = NULL;
-	int mounted;
+	int mounted = 0;
+	int rc;
+
 	if (sig && asprintf(&opt, "ecryptfs_sig=%s", sig) < 0) {
 		perror("asprintf");
 		return 0;
 	}
-	fh = setmntent("/proc/mounts", "r");
-	if (fh == NULL) {
-		perror("setmntent");
-		return 0;
-	}
-	mounted = 0;
-	flockfile(fh);
-	while ((m = getmntent(fh)) != NULL) {
-		if (strcmp(m->mnt_type, "ecryptfs") != 0)
-			/* Skip if this entry is not an ecryptfs mount */
-			continue;
-		if (mounting == 1) {
-			/* If mounting, return "already mounted" if EITHER the
- 			 * dev or the mnt dir shows up in mtab/mounts;
- 			 * regardless of the signature of such mounts;
- 			 */
-			if (dev != NULL && strcmp(m->mnt_fsname, dev) == 0) {
-				mounted = 1;
-				break;
+	if (mounting == 1) {
+		/* If mounting, return "already mounted" if EITHER the
+		 * dev or the mnt dir shows up in mtab/mounts;
+		 * regardless of the signature of such mounts;
+		 */
+		if (dev != NULL) {
+			rc = ecryptfs_mount_table_load(&table, "ecryptfs");
+			if (rc) {
+				errno = -rc;
+				perror("ecryptfs_mount_table_load");
+				goto out;
 			}
-			if (mnt != NULL && strcmp(m->mnt_dir, mnt) == 0) {
+			if (ecryptfs_mount_table_find_source(table, dev) != NULL
+			    || (mnt != NULL &&
+				ecryptfs_mount_table_find_target(table, mnt)
+				!= NULL))
 				mounted = 1;
-				break;
-			}
-		} else {
-			/* Otherwise, we're unmounting, and we need to be
-			 * very conservative in finding a perfect match
-			 * to unmount.  The device, mountpoint, and signature
-			 * must *all* match perfectly.
-			 */
-			if (
-			    strcmp(m->mnt_fsname, dev) == 0 &&
-			    strcmp(m->mnt_dir, mnt) == 0 &&
-			    (!opt || hasmntopt(m, opt) != NULL)
-			) {
+			ecryptfs_mount_table_destroy(table);
+		} else if (mnt != NULL) {
+			if (ecryptfs_mount_find(mnt, "ecryptfs", &m) == 0)
 				mounted = 1;
-				break;
-			}
 		}
+	} else if (dev != NULL && mnt != NULL) {
+		/* Otherwise, we're unmounting, and we need to be
+		 * very conservative in finding a perfect match
+		 * to unmount.  The device, mountpoint, and signature
+		 * must *all* match perfectly.
+		 */
+		if (ecryptfs_mount_find(mnt, "ecryptfs", &m) == 0 &&
+		    strcmp(m->source, dev) == 0 &&
+		    (!opt || ecryptfs_mount_has_opt(m, opt)))
+			mounted = 1;
 	}
-	endmntent(fh);
+out:
+	ecryptfs_mount_free(m);
 	if (opt != NULL)
 		free(opt);
 	return mounted;
@@ -380,422 +379,402 @@ out:
 	return rc;
 }
 
-static int zombie_semaphore_get(void)
+/*
+ * The zombie session placeholders of a user are kept in a shared table,
+ * so that closing the session can find the placeholder by session id.
+ * The table is an open-addressed hash of (sid, pid) pairs in a file in
+ * /dev/shm that every process maps. Entries are claimed and released
+ * with compare-and-swap while holding a shared flock, so that sessions
+ * do not wait for each other; only growing the table, or dropping the
+ * entries of placeholders that are gone, takes the flock exclusively.
+ */
+#define ZOMBIE_TABLE "/dev/shm/ecryptfs-zombies-%u"
+#define ZOMBIE_TABLE_MAGIC 0x65637a74
+#define ZOMBIE_MIN_SLOTS 512
+#define ZOMBIE_MAX_SLOTS (1 << 20)
+/* sid 0 never belongs to a session */
+#define ZOMBIE_EMPTY ((uint64_t)0)
+#define ZOMBIE_TOMBSTONE ((uint64_t)1)
+
+struct zombie_table {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t live;
+	/* Live entries plus tombstones */
+	uint32_t used;
+	uint64_t entries[];
+};
+
+struct zombie_handle {
+	int fd;
+	struct zombie_table *table;
+	size_t size;
+};
+
+static uint64_t zombie_entry(pid_t sid, pid_t pid)
 {
-	int sem_id;
-	struct semid_ds semid_ds;
-	struct sembuf sb;
-	int i;
-	int rc;
+	return (((uint64_t)(uint32_t)sid << 32) | (uint32_t)pid);
+}
 
-	sem_id = semget(ECRYPTFS_SEM_KEY, 1, (0666 | IPC_EXCL | IPC_CREAT));
-	if (sem_id >= 0) {
-		sb.sem_op = 1;
-		sb.sem_flg = 0;
-		sb.sem_num = 0;
-
-		rc = semop(sem_id, &sb, 1);
-		if (rc == -1) {
-			semctl(sem_id, 0, IPC_RMID);
-			syslog(LOG_ERR, "Error initializing semaphore\n");
-			rc = -1;
-			goto out;
-		}
-	} else if (errno == EEXIST) {
-		int initialized = 0;
+static pid_t zombie_sid(uint64_t entry)
+{
+	return (pid_t)(entry >> 32);
+}
 
-		sem_id = semget(ECRYPTFS_SEM_KEY, 1, 0);
-		if (sem_id < 0) {
-			syslog(LOG_ERR, "Error getting existing semaphore");
-			rc = -1;
-			goto out;
-		}
-#define RETRY_LIMIT 3
-		for (i = 0; i < RETRY_LIMIT; i++) {
-			semctl(sem_id, 0, IPC_STAT, &semid_ds);
-			if (semid_ds.sem_otime != 0) {
-				initialized = 1;
-				break;
-			} else
-				sleep(1);
-		}
-		if (!initialized) {
-			syslog(LOG_ERR, "Waited too long for initialized "
-			       "semaphore; something's wrong\n");
-			rc = -1;
-			goto out;
-		}
-	} else {
-		syslog(LOG_ERR, "Error attempting to get semaphore\n");
-		rc = -1;
-		goto out;
-	}
-	rc = sem_id;
-out:
-	return rc;
+static pid_t zombie_pid(uint64_t entry)
+{
+	return (pid_t)(uint32_t)entry;
 }
 
-static void zombie_semaphore_lock(int sem_id)
+static size_t zombie_table_size(uint32_t slots)
 {
-	struct sembuf sb;
-	int i;
-	int rc;
+	return (sizeof(struct zombie_table) + slots * sizeof(uint64_t));
+}
 
-	sb.sem_num = 0;
-	sb.sem_op = -1;
-	sb.sem_flg = IPC_NOWAIT;
-	for (i = 0; i < RETRY_LIMIT; i++) {
-		rc = semop(sem_id, &sb, 1);
-		if (rc == -1 && errno == EAGAIN) {
-			sleep(1);
-		} else if (rc == -1) {
-			syslog(LOG_ERR, "Error locking semaphore; errno "
-			       "string = [%m]\n");
-			goto out;
-		} else
-			goto out;
-	}
-	syslog(LOG_ERR, "Error locking semaphore; hit max retries\n");
-out:
-	return;
+static uint32_t zombie_slot(struct zombie_table *table, pid_t sid)
+{
+	return ((uint32_t)((uint32_t)sid * 0x9e3779b1U) & (table->slots - 1));
 }
 
-static void zombie_semaphore_unlock(int sem_id)
+/* A placeholder that died, or whose sid was reused, no longer counts */
+static int zombie_alive(uint64_t entry)
 {
-	struct sembuf sb;
-	int rc;
+	pid_t pid = zombie_pid(entry);
 
-	sb.sem_num = 0;
-	sb.sem_op = 1;
-	sb.sem_flg = 0;
-	rc = semop(sem_id, &sb, 1);
-	if (rc == -1) {
-		syslog(LOG_ERR, "Error unlocking semaphore\n");
+	if (kill(pid, 0) && errno != EPERM)
+		return 0;
+	return (getsid(pid) == zombie_sid(entry));
+}
+
+/**
+ * zombie_table_map
+ *
+ * (Re)maps the table after another process grew it. Must be called with
+ * the flock held.
+ */
+static int zombie_table_map(struct zombie_handle *zh)
+{
+	struct stat s;
+	void *map;
+	int rc = 0;
+
+	if (zh->table && zh->size >= zombie_table_size(zh->table->slots))
+		goto out;
+	if (fstat(zh->fd, &s)) {
+		rc = -errno;
+		goto out;
+	}
+	if ((size_t)s.st_size < zombie_table_size(ZOMBIE_MIN_SLOTS)) {
+		rc = -EINVAL;
 		goto out;
 	}
+	map = mmap(NULL, s.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   zh->fd, 0);
+	if (map == MAP_FAILED) {
+		rc = -errno;
+		goto out;
+	}
+	if (zh->table)
+		munmap(zh->table, zh->size);
+	zh->table = map;
+	zh->size = s.st_size;
+	if (zh->table->magic != ZOMBIE_TABLE_MAGIC
+	    || zh->table->slots < ZOMBIE_MIN_SLOTS
+	    || zh->table->slots > ZOMBIE_MAX_SLOTS
+	    || (zh->table->slots & (zh->table->slots - 1))
+	    || zh->size < zombie_table_size(zh->table->slots))
+		rc = -EINVAL;
 out:
-	return;
+	return rc;
 }
 
-static int get_zombie_shared_mem_locked(int *shm_id, int *sem_id)
+/**
+ * zombie_table_rehash
+ * @grow: Make room for at least one more entry
+ *
+ * Rebuilds the table from the entries of placeholders that are still
+ * alive, dropping the tombstones. Must be called with the flock held
+ * exclusively.
+ */
+static int zombie_table_rehash(struct zombie_handle *zh, int grow)
 {
-	int rc;
-	
-	(*sem_id) = zombie_semaphore_get();
-	if ((*sem_id) == -1) {
-		syslog(LOG_ERR, "Error attempting to get zombie semaphore\n");
-		rc = -EIO;
-		goto out;
-	}
-	zombie_semaphore_lock((*sem_id));
-	rc = shmget(ECRYPTFS_SHM_KEY, ECRYPTFS_SHM_SIZE, (0666 | IPC_CREAT
-							  | IPC_EXCL));
-	if (rc == -1 && errno == EEXIST)
-		rc = shmget(ECRYPTFS_SHM_KEY, ECRYPTFS_SHM_SIZE, 0);
-	else {
-		char *shm_virt;
-
-		(*shm_id) = rc;
-		shm_virt = shmat((*shm_id), NULL, 0);
-		if (shm_virt == (void *)-1) {
-			syslog(LOG_ERR, "Error attaching to newly allocated "
-			       "shared memory; errno string = [%m]\n");
-			rc = -EIO;
-			zombie_semaphore_unlock((*sem_id));
+	struct zombie_table *table = zh->table;
+	uint64_t *entries = NULL;
+	uint32_t slots;
+	uint32_t live = 0;
+	uint32_t i;
+	uint32_t j;
+	int rc = 0;
+
+	for (i = 0; i < table->slots; i++)
+		if (table->entries[i] != ZOMBIE_EMPTY
+		    && table->entries[i] != ZOMBIE_TOMBSTONE
+		    && zombie_alive(table->entries[i]))
+			live++;
+	/* Keep the load factor under one half after a rehash */
+	for (slots = ZOMBIE_MIN_SLOTS; slots < (live + grow) * 2;
+	     slots <<= 1)
+		if (slots == ZOMBIE_MAX_SLOTS) {
+			syslog(LOG_ERR, "Too many zombie session "
+			       "placeholders\n");
+			rc = -ENOSPC;
 			goto out;
 		}
-		memset(shm_virt, 0, ECRYPTFS_SHM_SIZE);
-		if ((rc = shmdt(shm_virt))) {
-			rc = -EIO;
-			zombie_semaphore_unlock((*sem_id));
+	slots = MAX(slots, table->slots);
+	if (zombie_table_size(slots) > zh->size) {
+		if (ftruncate(zh->fd, zombie_table_size(slots))) {
+			rc = -errno;
 			goto out;
 		}
-		rc = shmget(ECRYPTFS_SHM_KEY, ECRYPTFS_SHM_SIZE, 0);
+		/* Makes zombie_table_map() pick up the new size */
+		table->slots = slots;
+		if ((rc = zombie_table_map(zh)))
+			goto out;
+		table = zh->table;
 	}
-	if (rc == -1) {
-		syslog(LOG_ERR, "Error attempting to get identifier for "
-		       "shared memory with key [0x%.8x]\n", ECRYPTFS_SHM_KEY);
-		rc = -EIO;
-		zombie_semaphore_unlock((*sem_id));
+	entries = calloc(slots, sizeof(uint64_t));
+	if (!entries) {
+		rc = -ENOMEM;
 		goto out;
 	}
-	(*shm_id) = rc;
-	rc = 0;
+	for (i = 0; i < table->slots; i++) {
+		uint64_t entry = table->entries[i];
+
+		if (entry == ZOMBIE_EMPTY || entry == ZOMBIE_TOMBSTONE
+		    || !zombie_alive(entry))
+			continue;
+		j = ((uint32_t)((uint32_t)zombie_sid(entry) * 0x9e3779b1U)
+		     & (slots - 1));
+		while (entries[j] != ZOMBIE_EMPTY)
+			j = (j + 1) & (slots - 1);
+		entries[j] = entry;
+	}
+	memcpy(table->entries, entries, slots * sizeof(uint64_t));
+	table->slots = slots;
+	table->live = live;
+	table->used = live;
 out:
+	free(entries);
 	return rc;
 }
 
-static int list_pid_sid_pairs(int shm_id)
+static void zombie_table_close(struct zombie_handle *zh)
+{
+	if (zh->table)
+		munmap(zh->table, zh->size);
+	zh->table = NULL;
+	if (zh->fd != -1)
+		close(zh->fd);
+	zh->fd = -1;
+}
+
+/**
+ * zombie_table_lock
+ * @operation: LOCK_SH to work on entries, LOCK_EX to rebuild the table
+ *
+ * On error the table must be closed, which also drops the flock.
+ */
+static int zombie_table_lock(struct zombie_handle *zh, int operation)
 {
-	pid_t sid_tmp;
-	pid_t pid_tmp;
-	char *shm_virt;
-	int i;
 	int rc;
 
-	if (sizeof(pid_t) != sizeof(uint32_t)) {
-		syslog(LOG_ERR, "sizeof(pid_t) != sizeof(uint32_t); the code "
-		       "needs some tweaking to work on this architecture\n");
-		rc = -EINVAL;
-		goto out;
-	}
-	shm_virt = shmat(shm_id, NULL, 0);
-	if (shm_virt == (void *)-1) {
-		rc = -EIO;
+	while ((rc = flock(zh->fd, operation)) && errno == EINTR)
+		;
+	if (rc) {
+		rc = -errno;
 		goto out;
 	}
-	i = 0;
-	memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	sid_tmp = ntohl(sid_tmp); /* uint32_t */
-	memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	while (!(sid_tmp == 0 && pid_tmp == 0)) {
-		if ((i + (2 * sizeof(pid_t))) > ECRYPTFS_SHM_SIZE)
-			break;
-		memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		sid_tmp = ntohl(sid_tmp); /* uint32_t */
-		memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	}
-	if ((rc = shmdt(shm_virt)))
-		rc = -EIO;
+	rc = zombie_table_map(zh);
 out:
 	return rc;
 }
 
-static int find_pid_for_this_sid(pid_t *pid, int shm_id)
+/**
+ * zombie_table_open
+ *
+ * Opens the table of the current user, creating it if needed, and
+ * returns with the flock held shared.
+ */
+static int zombie_table_open(struct zombie_handle *zh)
 {
-	pid_t sid_tmp;
-	pid_t sid;
-	pid_t pid_tmp;
-	pid_t this_pid;
-	char *shm_virt;
-	int i;
+	struct zombie_table *table;
+	struct stat s;
+	char *path;
 	int rc;
 
-	(*pid) = 0;
-	if (sizeof(pid_t) != sizeof(uint32_t)) {
-		syslog(LOG_ERR, "sizeof(pid_t) != sizeof(uint32_t); the code "
-		       "needs some tweaking to work on this architecture\n");
-		rc = -EINVAL;
+	zh->fd = -1;
+	zh->table = NULL;
+	zh->size = 0;
+	if (asprintf(&path, ZOMBIE_TABLE, geteuid()) < 0) {
+		rc = -ENOMEM;
 		goto out;
 	}
-	shm_virt = shmat(shm_id, NULL, 0);
-	if (shm_virt == (void *)-1) {
-		rc = -EIO;
+	zh->fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	free(path);
+	if (zh->fd == -1) {
+		rc = -errno;
 		goto out;
 	}
-	i = 0;
-	memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	sid_tmp = ntohl(sid_tmp); /* uint32_t */
-	memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	this_pid = getpid();
-	sid = getsid(this_pid);
-	while (!(sid_tmp == 0 && pid_tmp == 0)) {
-		if (sid_tmp == sid) {
-			(*pid) = pid_tmp;
-			goto end_search;
-		}
-		if ((i + (2 * sizeof(pid_t))) > ECRYPTFS_SHM_SIZE)
-			break;
-		memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		sid_tmp = ntohl(sid_tmp); /* uint32_t */
-		memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	}
-end_search:
-	if ((rc = shmdt(shm_virt))) {
-		rc = -EIO;
-		(*pid) = 0;
+	if (fstat(zh->fd, &s)) {
+		rc = -errno;
+		goto out;
+	}
+	if (!S_ISREG(s.st_mode) || s.st_uid != geteuid()
+	    || (s.st_mode & (S_IRWXG | S_IRWXO))) {
+		syslog(LOG_ERR, "Zombie session table is not a private file "
+		       "of the user\n");
+		rc = -EPERM;
+		goto out;
+	}
+	if ((rc = zombie_table_lock(zh, LOCK_SH)) != -EINVAL)
+		goto out;
+	/* New or damaged; start over unless someone else just did */
+	if ((rc = zombie_table_lock(zh, LOCK_EX)) != -EINVAL)
+		goto relock;
+	if (zh->table)
+		munmap(zh->table, zh->size);
+	zh->table = NULL;
+	if (ftruncate(zh->fd, 0)
+	    || ftruncate(zh->fd, zombie_table_size(ZOMBIE_MIN_SLOTS))) {
+		rc = -errno;
+		goto out;
 	}
+	table = mmap(NULL, zombie_table_size(ZOMBIE_MIN_SLOTS),
+		     PROT_READ | PROT_WRITE, MAP_SHARED, zh->fd, 0);
+	if (table == MAP_FAILED) {
+		rc = -errno;
+		goto out;
+	}
+	table->slots = ZOMBIE_MIN_SLOTS;
+	table->magic = ZOMBIE_TABLE_MAGIC;
+	munmap(table, zombie_table_size(ZOMBIE_MIN_SLOTS));
+	if ((rc = zombie_table_map(zh)))
+		goto out;
+relock:
+	if (!rc)
+		rc = zombie_table_lock(zh, LOCK_SH);
 out:
+	if (rc) {
+		syslog(LOG_ERR, "Error opening the zombie session table; "
+		       "rc = [%d]\n", rc);
+		zombie_table_close(zh);
+	}
 	return rc;
 }
 
-static int remove_pid_for_this_sid(int shm_id)
+static int zombie_table_insert(struct zombie_handle *zh, uint64_t entry)
 {
-	pid_t sid_tmp;
-	pid_t sid;
-	pid_t pid_tmp;
-	pid_t pid;
-	pid_t this_pid;
-	char *shm_virt;
-	int i;
+	struct zombie_table *table;
+	uint64_t old;
+	uint32_t i;
+	uint32_t n;
 	int rc;
 
-	pid = 0;
-	if (sizeof(pid_t) != sizeof(uint32_t)) {
-		syslog(LOG_ERR, "sizeof(pid_t) != sizeof(uint32_t); the code "
-		       "needs some tweaking to work on this architecture\n");
-		rc = -EINVAL;
-		goto out;
-	}
-	shm_virt = shmat(shm_id, NULL, 0);
-	if (shm_virt == (void *)-1) {
-		rc = -EIO;
-		goto out;
-	}
-	i = 0;
-	memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	sid_tmp = ntohl(sid_tmp); /* uint32_t */
-	memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	this_pid = getpid();
-	sid = getsid(this_pid);
-	while (!(sid_tmp == 0 && pid_tmp == 0)) {
-		if (sid_tmp == sid) {
-			pid = pid_tmp;
-			break;
-		}
-		if ((i + (2 * sizeof(pid_t))) > ECRYPTFS_SHM_SIZE)
-			break;
-		memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		sid_tmp = ntohl(sid_tmp); /* uint32_t */
-		memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	}
-	if (pid != 0) {
-		char *tmp;
-		int remainder = (ECRYPTFS_SHM_SIZE - i);
-
-		if (remainder != 0) {
-			if ((tmp = malloc(remainder)) == NULL) {
-				rc = -ENOMEM;
-				shmdt(shm_virt);
+retry:
+	table = zh->table;
+	if (__atomic_load_n(&table->used, __ATOMIC_RELAXED) + 1
+	    > table->slots / 4 * 3)
+		goto grow;
+	i = zombie_slot(table, zombie_sid(entry));
+	for (n = 0; n < table->slots; n++, i = (i + 1) & (table->slots - 1)) {
+		old = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+		while (old == ZOMBIE_EMPTY || old == ZOMBIE_TOMBSTONE) {
+			if (__atomic_compare_exchange_n(
+				    &table->entries[i], &old, entry, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				if (old == ZOMBIE_EMPTY)
+					__atomic_add_fetch(&table->used, 1,
+							   __ATOMIC_RELAXED);
+				__atomic_add_fetch(&table->live, 1,
+						   __ATOMIC_RELAXED);
+				rc = 0;
 				goto out;
 			}
-			memcpy(tmp, &shm_virt[i], remainder);
-			i -= (2 * sizeof(pid_t));
-			memcpy(&shm_virt[i], tmp, remainder);
-			i += remainder;
-		} else
-			i -= (2 * sizeof(pid_t));
-		memset(&shm_virt[i], 0, (2 * sizeof(pid_t)));
-		if (remainder != 0)
-			free(tmp);
-	}
-	if ((rc = shmdt(shm_virt)))
-		rc = -EIO;
+		}
+	}
+grow:
+	flock(zh->fd, LOCK_UN);
+	if ((rc = zombie_table_lock(zh, LOCK_EX)))
+		goto out;
+	/* Someone else may have made room meanwhile */
+	table = zh->table;
+	if (table->used + 1 > table->slots / 4 * 3
+	    && (rc = zombie_table_rehash(zh, 1)))
+		goto out;
+	if (!(rc = zombie_table_lock(zh, LOCK_SH)))
+		goto retry;
 out:
 	return rc;
 }
 
-static int add_sid_pid_pair_to_shm(int shm_id)
+/**
+ * zombie_table_find
+ * @pid: (out) The pid of a placeholder of @sid, or 0
+ */
+static void zombie_table_find(struct zombie_handle *zh, pid_t sid,
+			      pid_t *pid)
 {
-	pid_t sid_tmp;
-	pid_t sid;
-	pid_t pid_tmp;
-	pid_t pid;
-	char *shm_virt;
-	int i;
-	int rc;
+	struct zombie_table *table = zh->table;
+	uint64_t entry;
+	uint32_t i;
+	uint32_t n;
 
-	if (sizeof(pid_t) != sizeof(uint32_t)) {
-		syslog(LOG_ERR, "sizeof(pid_t) != sizeof(uint32_t); the code "
-		       "needs some tweaking to work on this architecture\n");
-		rc = -EINVAL;
-		goto out;
-	}
-	shm_virt = shmat(shm_id, NULL, 0);
-	if (shm_virt == (void *)-1) {
-		syslog(LOG_ERR, "Error attaching to shared memory; error "
-		       "string = [%m]\n");
-		shm_virt = shmat(shm_id, NULL, 0);
-		if (shm_virt == (void *)-1) {
-			syslog(LOG_ERR, "Error attaching to shared memory; error "
-			       "string = [%m]\n");
-			rc = -EIO;
-			goto out;
+	(*pid) = 0;
+	i = zombie_slot(table, sid);
+	for (n = 0; n < table->slots; n++, i = (i + 1) & (table->slots - 1)) {
+		entry = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+		if (entry == ZOMBIE_EMPTY)
+			break;
+		if (entry != ZOMBIE_TOMBSTONE && zombie_sid(entry) == sid) {
+			(*pid) = zombie_pid(entry);
+			break;
 		}
-		rc = -EIO;
-		goto out;
 	}
-	i = 0;
-	memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	sid_tmp = ntohl(sid_tmp); /* uint32_t */
-	memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-	i += sizeof(pid_t);
-	pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	while (!(sid_tmp == 0 && pid_tmp == 0)) {
-		if ((i + (2 * sizeof(pid_t))) > ECRYPTFS_SHM_SIZE) {
-			syslog(LOG_ERR,
-			       "No space left in shared memory region\n");
-			rc = -ENOMEM;
-			shmdt(shm_virt);
-			goto out;
+}
+
+static void zombie_table_remove(struct zombie_handle *zh, uint64_t entry)
+{
+	struct zombie_table *table = zh->table;
+	uint64_t old;
+	uint32_t i;
+	uint32_t n;
+
+	i = zombie_slot(table, zombie_sid(entry));
+	for (n = 0; n < table->slots; n++, i = (i + 1) & (table->slots - 1)) {
+		old = __atomic_load_n(&table->entries[i], __ATOMIC_ACQUIRE);
+		if (old == ZOMBIE_EMPTY)
+			break;
+		if (old == entry
+		    && __atomic_compare_exchange_n(
+			    &table->entries[i], &old, ZOMBIE_TOMBSTONE, 0,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			__atomic_sub_fetch(&table->live, 1, __ATOMIC_RELAXED);
+			break;
 		}
-		memcpy(&sid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		sid_tmp = ntohl(sid_tmp); /* uint32_t */
-		memcpy(&pid_tmp, &shm_virt[i], sizeof(pid_t));
-		i += sizeof(pid_t);
-		pid_tmp = ntohl(pid_tmp); /* uint32_t */
-	}
-	pid = getpid();
-	sid = getsid(pid);
-	sid = htonl(sid);
-	pid = htonl(pid);
-	i -= (2 * sizeof(pid_t));
-	memcpy(&shm_virt[i], &sid, sizeof(pid_t));
-	i += sizeof(pid_t);
-	memcpy(&shm_virt[i], &pid, sizeof(pid_t));
-	i += sizeof(pid_t);
-	if ((i + (2 * sizeof(pid_t))) <= ECRYPTFS_SHM_SIZE)
-		memset(&shm_virt[i], 0, (i + (2 * sizeof(pid_t))));
-	if ((rc = shmdt(shm_virt))) {
-		syslog(LOG_ERR, "Error detaching from shared memory\n");
-		rc = -EIO;
 	}
-out:
-	return rc;
 }
 
 int ecryptfs_set_zombie_session_placeholder(void)
 {
-	int shm_id;
-	int sem_id;
+	struct zombie_handle zh;
+	uint64_t entry;
 	int rc = 0;
 
-	if ((rc = get_zombie_shared_mem_locked(&shm_id, &sem_id))) {
-		syslog(LOG_ERR,
-		       "Error getting shared memory segment\n");
+	entry = zombie_entry(getsid(0), getpid());
+	if ((rc = zombie_table_open(&zh)))
 		goto out;
-	}
-	if ((rc = add_sid_pid_pair_to_shm(shm_id))) {
-		syslog(LOG_ERR, "Error adding sid/pid pair to shared memory "
-		       "segment; rc = [%d]\n", rc);
-		zombie_semaphore_unlock(sem_id);
+	if ((rc = zombie_table_insert(&zh, entry))) {
+		syslog(LOG_ERR, "Error adding sid/pid pair to the zombie "
+		       "session table; rc = [%d]\n", rc);
+		zombie_table_close(&zh);
 		goto out;
 	}
-	zombie_semaphore_unlock(sem_id);
+	zombie_table_close(&zh);
 	sleep(ECRYPTFS_ZOMBIE_SLEEP_SECONDS);
-	if ((rc = get_zombie_shared_mem_locked(&shm_id, &sem_id))) {
-		syslog(LOG_ERR,
-		       "Error getting shared memory segment\n");
+	if ((rc = zombie_table_open(&zh)))
 		goto out;
-	}
-	if ((rc = remove_pid_for_this_sid(shm_id))) {
-		syslog(LOG_ERR, "Error attempting to remove pid/sid "
-		       "pair from shared memory segment; rc = [%d]\n",
-		       rc);
-		zombie_semaphore_unlock(sem_id);
-		goto out;
-	}
-	zombie_semaphore_unlock(sem_id);
+	zombie_table_remove(&zh, entry);
+	zombie_table_close(&zh);
 	exit(1);
 out:
 	return rc;
@@ -803,60 +782,91 @@ out:
 
 int ecryptfs_kill_and_clear_zombie_session_placeholder(void)
 {
-	int shm_id;
-	int sem_id;
-	int pid;
+	struct zombie_handle zh;
+	pid_t sid;
+	pid_t pid;
 	int rc = 0;
 
-	if ((rc = get_zombie_shared_mem_locked(&shm_id, &sem_id))) {
-		syslog(LOG_ERR, "Error getting shared memory segment\n");
+	sid = getsid(0);
+	if ((rc = zombie_table_open(&zh)))
 		goto out;
-	}
-	if ((rc = find_pid_for_this_sid(&pid, shm_id))) {
-		syslog(LOG_ERR, "Error finding pid for sid in shared memory "
-		       "segment; rc = [%d]\n", rc);
-		zombie_semaphore_unlock(sem_id);
-		goto out;
-	}
+	zombie_table_find(&zh, sid, &pid);
 	if (pid == 0) {
 		syslog(LOG_WARNING, "No valid pid found for this sid\n");
-	} else {
-		if ((rc = kill(pid, SIGKILL))) {
-			syslog(LOG_ERR, "Error attempting to kill process "
-			       "[%d]; rc = [%d]; errno string = [%m]\n", pid,
-			       rc);
-		}
-		if ((rc = remove_pid_for_this_sid(shm_id))) {
-			syslog(LOG_ERR, "Error attempting to remove pid/sid "
-			       "pair from shared memory segment; rc = [%d]\n",
-			       rc);
-			zombie_semaphore_unlock(sem_id);
-			goto out;
-		}
+		goto out_close;
+	}
+	/* Never kill a process that merely reused the pid */
+	if (getsid(pid) == sid && (rc = kill(pid, SIGKILL))) {
+		syslog(LOG_ERR, "Error attempting to kill process "
+		       "[%d]; rc = [%d]; errno string = [%m]\n", pid, rc);
 	}
-	zombie_semaphore_unlock(sem_id);
+	zombie_table_remove(&zh, zombie_entry(sid, pid));
+out_close:
+	zombie_table_close(&zh);
 out:
 	return rc;
 }
 
+/**
+ * ecryptfs_list_zombie_session_placeholders
+ *
+ * Prints the sid and pid of every placeholder of the current user, one
+ * pair per line.
+ */
 int ecryptfs_list_zombie_session_placeholders(void)
 {
-	int shm_id;
-	int sem_id;
+	struct zombie_handle zh;
+	uint64_t entry;
+	uint32_t i;
+	int rc = 0;
+
+	if ((rc = zombie_table_open(&zh)))
+		goto out;
+	for (i = 0; i < zh.table->slots; i++) {
+		entry = __atomic_load_n(&zh.table->entries[i],
+					__ATOMIC_ACQUIRE);
+		if (entry != ZOMBIE_EMPTY && entry != ZOMBIE_TOMBSTONE)
+			printf("%d %d\n", zombie_sid(entry),
+			       zombie_pid(entry));
+	}
+	zombie_table_close(&zh);
+out:
+	return rc;
+}
+
+/**
+ * ecryptfs_clean_zombie_session_placeholders
+ *
+ * Drops the entries of placeholders that are gone and the tombstones
+ * left behind by removals, in one pass over the table. Does nothing if
+ * the user has no table yet. pam_ecryptfs calls this when a session
+ * closes.
+ */
+int ecryptfs_clean_zombie_session_placeholders(void)
+{
+	struct zombie_handle zh;
+	struct stat s;
+	char *path;
 	int rc = 0;
 
-	if ((rc = get_zombie_shared_mem_locked(&shm_id, &sem_id))) {
-		syslog(LOG_ERR,
-		       "Error getting shared memory segment\n");
+	if (asprintf(&path, ZOMBIE_TABLE, geteuid()) < 0) {
+		rc = -ENOMEM;
 		goto out;
 	}
-	if ((rc = list_pid_sid_pairs(shm_id))) {
-		syslog(LOG_ERR, "Error listing sid/pid pairs in shared memory "
-		       "segment; rc = [%d]\n", rc);
-		zombie_semaphore_unlock(sem_id);
+	rc = lstat(path, &s);
+	free(path);
+	if (rc) {
+		rc = (errno == ENOENT) ? 0 : -errno;
 		goto out;
 	}
-	zombie_semaphore_unlock(sem_id);
+	if ((rc = zombie_table_open(&zh)))
+		goto out;
+	flock(zh.fd, LOCK_UN);
+	if ((rc = zombie_table_lock(&zh, LOCK_EX)))
+		goto out_close;
+	rc = zombie_table_rehash(&zh, 0);
+out_close:
+	zombie_table_close(&zh);
 out:
 	return rc;
 }
@@ -0,0 +1,458 @@
+/**
+ * Mount table lookups that do not parse the whole of /proc/mounts: a
+ * mount point is resolved to its mount ID with statx() and only the
+ * line of /proc/self/mountinfo with that ID is parsed. Lookups by
+ * source, or on kernels without STATX_MNT_ID, go through a hash index
+ * built in one pass over the lines of the wanted file system type.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../include/ecryptfs.h"
+
+#define MOUNTINFO "/proc/self/mountinfo"
+
+/**
+ * struct ecryptfs_mount_table - Hash index over a set of mounts
+ * @mounts: The mounts, in mountinfo order
+ * @num_mounts: Entries in @mounts
+ * @by_target: Bucket heads, indices into @mounts plus one, hashed by
+ *             mount point
+ * @by_source: Same, hashed by source
+ * @next_target: Next entry in the same @by_target bucket, plus one
+ * @next_source: Next entry in the same @by_source bucket, plus one
+ * @mask: Number of buckets minus one
+ *
+ * Entries are linked in front of their buckets in mountinfo order, so
+ * a lookup finds the mount stacked last on a mount point first.
+ */
+struct ecryptfs_mount_table {
+	struct ecryptfs_mount *mounts;
+	size_t num_mounts;
+	size_t *by_target;
+	size_t *by_source;
+	size_t *next_target;
+	size_t *next_source;
+	size_t mask;
+};
+
+static uint32_t mount_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Undoes the \ooo escapes the kernel uses for spaces, tabs, newlines
+ * and backslashes in mountinfo, in place */
+static void mount_unescape(char *str)
+{
+	char *out = str;
+
+	while (*str) {
+		if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3'
+		    && str[2] >= '0' && str[2] <= '7'
+		    && str[3] >= '0' && str[3] <= '7') {
+			*out++ = ((str[1] - '0') << 6) | ((str[2] - '0') << 3)
+				 | (str[3] - '0');
+			str += 4;
+		} else
+			*out++ = *str++;
+	}
+	*out = '\0';
+}
+
+static char *mount_field(char **line)
+{
+	char *field = strsep(line, " ");
+
+	if (field == NULL || *field == '\0')
+		return NULL;
+	return field;
+}
+
+/**
+ * mount_fstype_matches
+ *
+ * Cheap test of the file system type of a mountinfo line, so that lines
+ * of other types are skipped without being parsed
+ */
+static int mount_fstype_matches(const char *line, const char *fstype)
+{
+	const char *sep = strstr(line, " - ");
+	size_t len;
+
+	if (fstype == NULL)
+		return 1;
+	if (sep == NULL)
+		return 0;
+	len = strlen(fstype);
+	return (strncmp(sep + 3, fstype, len) == 0 && sep[3 + len] == ' ');
+}
+
+/**
+ * mount_parse
+ * @line: A mountinfo line without the newline; it is modified
+ * @mnt: (out) The mount, with its strings allocated
+ *
+ * A mountinfo line reads
+ *   ID PARENT MAJ:MIN ROOT TARGET MOUNT-OPTS [OPTIONAL...] - TYPE SOURCE SUPER-OPTS
+ * The options are joined as /proc/mounts shows them, so that
+ * hasmntopt() finds per-mount and file system options alike.
+ */
+static int mount_parse(char *line, struct ecryptfs_mount *mnt)
+{
+	char *target, *mnt_opts, *fstype, *source, *super_opts;
+	char *field;
+	int i;
+
+	memset(mnt, 0, sizeof(*mnt));
+	if ((field = mount_field(&line)) == NULL)
+		return -EINVAL;
+	mnt->mnt_id = atoi(field);
+	for (i = 0; i < 3; i++)
+		if (mount_field(&line) == NULL)
+			return -EINVAL;
+	target = mount_field(&line);
+	mnt_opts = mount_field(&line);
+	if (target == NULL || mnt_opts == NULL)
+		return -EINVAL;
+	while ((field = mount_field(&line)) != NULL && strcmp(field, "-"))
+		;
+	if (field == NULL)
+		return -EINVAL;
+	fstype = mount_field(&line);
+	source = mount_field(&line);
+	super_opts = mount_field(&line);
+	if (fstype == NULL || source == NULL || super_opts == NULL)
+		return -EINVAL;
+	mount_unescape(target);
+	mount_unescape(source);
+	mnt->target = strdup(target);
+	mnt->fstype = strdup(fstype);
+	mnt->source = strdup(source);
+	if (asprintf(&mnt->options, "%s,%s", mnt_opts, super_opts) < 0)
+		mnt->options = NULL;
+	if (!mnt->target || !mnt->fstype || !mnt->source || !mnt->options) {
+		free(mnt->target);
+		free(mnt->fstype);
+		free(mnt->source);
+		free(mnt->options);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void mount_clear(struct ecryptfs_mount *mnt)
+{
+	free(mnt->target);
+	free(mnt->fstype);
+	free(mnt->source);
+	free(mnt->options);
+}
+
+/**
+ * ecryptfs_mount_free
+ * @mnt: A mount returned by ecryptfs_mount_find(); may be NULL
+ */
+void ecryptfs_mount_free(struct ecryptfs_mount *mnt)
+{
+	if (mnt == NULL)
+		return;
+	mount_clear(mnt);
+	free(mnt);
+}
+
+/**
+ * ecryptfs_mount_has_opt
+ *
+ * Returns 1 if @opt is among the options of @mnt, as hasmntopt() sees
+ * it, 0 otherwise
+ */
+int ecryptfs_mount_has_opt(struct ecryptfs_mount *mnt, const char *opt)
+{
+	struct mntent ent;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.mnt_opts = mnt->options;
+	return (hasmntopt(&ent, opt) != NULL);
+}
+
+/**
+ * ecryptfs_mount_table_load
+ * @table: (out) The index
+ * @fstype: Only index mounts of this type; NULL for all of them
+ *
+ * Reads /proc/self/mountinfo once; lines of other types are skipped
+ * without being parsed.
+ *
+ * Returns 0 on success, negative errno otherwise
+ */
+int ecryptfs_mount_table_load(struct ecryptfs_mount_table **table,
+			      const char *fstype)
+{
+	struct ecryptfs_mount_table *t;
+	struct ecryptfs_mount *mounts;
+	size_t alloced = 0;
+	size_t line_size = 0;
+	char *line = NULL;
+	ssize_t len;
+	size_t nbuckets;
+	size_t i, b;
+	FILE *fh;
+	int rc = 0;
+
+	*table = NULL;
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return -ENOMEM;
+	fh = fopen(MOUNTINFO, "re");
+	if (fh == NULL) {
+		rc = -errno;
+		goto out;
+	}
+	while ((len = getline(&line, &line_size, fh)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (!mount_fstype_matches(line, fstype))
+			continue;
+		if (t->num_mounts == alloced) {
+			alloced = alloced ? alloced * 2 : 8;
+			mounts = realloc(t->mounts, alloced * sizeof(*mounts));
+			if (mounts == NULL) {
+				rc = -ENOMEM;
+				goto out_close;
+			}
+			t->mounts = mounts;
+		}
+		rc = mount_parse(line, &t->mounts[t->num_mounts]);
+		if (rc == -EINVAL) {
+			rc = 0;
+			continue;
+		}
+		if (rc)
+			goto out_close;
+		t->num_mounts++;
+	}
+	for (nbuckets = 16; nbuckets < t->num_mounts * 2; nbuckets *= 2)
+		;
+	t->mask = nbuckets - 1;
+	t->by_target = calloc(nbuckets, sizeof(size_t));
+	t->by_source = calloc(nbuckets, sizeof(size_t));
+	t->next_target = calloc(t->num_mounts + 1, sizeof(size_t));
+	t->next_source = calloc(t->num_mounts + 1, sizeof(size_t));
+	if (!t->by_target || !t->by_source || !t->next_target
+	    || !t->next_source) {
+		rc = -ENOMEM;
+		goto out_close;
+	}
+	for (i = 0; i < t->num_mounts; i++) {
+		b = mount_hash(t->mounts[i].target) & t->mask;
+		t->next_target[i] = t->by_target[b];
+		t->by_target[b] = i + 1;
+		b = mount_hash(t->mounts[i].source) & t->mask;
+		t->next_source[i] = t->by_source[b];
+		t->by_source[b] = i + 1;
+	}
+out_close:
+	fclose(fh);
+out:
+	free(line);
+	if (rc)
+		ecryptfs_mount_table_destroy(t);
+	else
+		*table = t;
+	return rc;
+}
+
+/**
+ * ecryptfs_mount_table_destroy
+ * @table: The index; may be NULL
+ */
+void ecryptfs_mount_table_destroy(struct ecryptfs_mount_table *table)
+{
+	size_t i;
+
+	if (table == NULL)
+		return;
+	for (i = 0; i < table->num_mounts; i++)
+		mount_clear(&table->mounts[i]);
+	free(table->mounts);
+	free(table->by_target);
+	free(table->by_source);
+	free(table->next_target);
+	free(table->next_source);
+	free(table);
+}
+
+/**
+ * ecryptfs_mount_table_find_target
+ *
+ * Returns the mount stacked last on @target, or NULL; the mount
+ * belongs to @table
+ */
+struct ecryptfs_mount *
+ecryptfs_mount_table_find_target(struct ecryptfs_mount_table *table,
+				 const char *target)
+{
+	size_t i;
+
+	for (i = table->by_target[mount_hash(target) & table->mask]; i;
+	     i = table->next_target[i - 1])
+		if (strcmp(table->mounts[i - 1].target, target) == 0)
+			return &table->mounts[i - 1];
+	return NULL;
+}
+
+/**
+ * ecryptfs_mount_table_find_source
+ *
+ * Returns the last mount of @source, or NULL; the mount belongs to
+ * @table
+ */
+struct ecryptfs_mount *
+ecryptfs_mount_table_find_source(struct ecryptfs_mount_table *table,
+				 const char *source)
+{
+	size_t i;
+
+	for (i = table->by_source[mount_hash(source) & table->mask]; i;
+	     i = table->next_source[i - 1])
+		if (strcmp(table->mounts[i - 1].source, source) == 0)
+			return &table->mounts[i - 1];
+	return NULL;
+}
+
+/* Returns -ENOSYS when the mount ID cannot be had from statx() */
+static int mount_id_of(const char *target, int *mnt_id)
+{
+#if defined(HAVE_STATX) && defined(STATX_MNT_ID)
+	struct statx stx;
+
+	if (statx(AT_FDCWD, target, AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+		  STATX_MNT_ID, &stx))
+		return -errno;
+	if (!(stx.stx_mask & STATX_MNT_ID))
+		return -ENOSYS;
+	*mnt_id = stx.stx_mnt_id;
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/**
+ * mount_find_by_id
+ *
+ * Parses only the mountinfo line of @mnt_id. Returns 0 with @mnt
+ * filled in, -ENOENT if there is no such line, negative errno otherwise
+ */
+static int mount_find_by_id(int mnt_id, struct ecryptfs_mount *mnt)
+{
+	size_t line_size = 0;
+	char *line = NULL;
+	char *end;
+	ssize_t len;
+	FILE *fh;
+	int rc = -ENOENT;
+
+	fh = fopen(MOUNTINFO, "re");
+	if (fh == NULL)
+		return -errno;
+	while ((len = getline(&line, &line_size, fh)) > 0) {
+		if (strtol(line, &end, 10) != mnt_id || *end != ' ')
+			continue;
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		rc = mount_parse(line, mnt);
+		break;
+	}
+	fclose(fh);
+	free(line);
+	return rc;
+}
+
+/**
+ * ecryptfs_mount_find
+ * @target: Mount point, compared as a string like getmntent() callers do
+ * @fstype: Type the mount must have
+ * @mnt: (out) The mount, to be freed with ecryptfs_mount_free()
+ *
+ * Resolves @target to its mount ID and parses only that line of
+ * mountinfo. When statx() cannot tell, or the mount on top of @target is
+ * not of @fstype but another one may be stacked under it, falls back to
+ * an index of the @fstype mounts.
+ *
+ * Returns 0 if a mount of @fstype is on @target, -ENOENT if none is,
+ * negative errno otherwise
+ */
+int ecryptfs_mount_find(const char *target, const char *fstype,
+			struct ecryptfs_mount **mnt)
+{
+	struct ecryptfs_mount_table *table;
+	struct ecryptfs_mount *found;
+	int mnt_id;
+	int rc;
+
+	*mnt = malloc(sizeof(**mnt));
+	if (*mnt == NULL)
+		return -ENOMEM;
+	rc = mount_id_of(target, &mnt_id);
+	if (rc == 0)
+		rc = mount_find_by_id(mnt_id, *mnt);
+	if (rc == 0) {
+		if (strcmp((*mnt)->target, target) != 0) {
+			/* target is not a mount point */
+			mount_clear(*mnt);
+			rc = -ENOENT;
+			goto out;
+		}
+		if (strcmp((*mnt)->fstype, fstype) == 0)
+			goto out;
+		mount_clear(*mnt);
+	}
+	rc = ecryptfs_mount_table_load(&table, fstype);
+	if (rc)
+		goto out;
+	found = ecryptfs_mount_table_find_target(table, target);
+	if (found) {
+		/* Take the strings over from the table */
+		**mnt = *found;
+		memset(found, 0, sizeof(*found));
+	} else
+		rc = -ENOENT;
+	ecryptfs_mount_table_destroy(table);
+out:
+	if (rc) {
+		free(*mnt);
+		*mnt = NULL;
+	}
+	return rc;
+}
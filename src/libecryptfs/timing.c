@@ -0,0 +1,132 @@
+/**
+ * Per-phase timing of the login path, so that pam_ecryptfs and
+ * mount.ecryptfs_private can report where the time of a login went
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../include/ecryptfs.h"
+
+static uint64_t timing_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/**
+ * ecryptfs_timing_init
+ * @timing: The timing to start; the total runs from here
+ */
+void ecryptfs_timing_init(struct ecryptfs_timing *timing)
+{
+	memset(timing, 0, sizeof(*timing));
+	timing->created = timing_now_usec();
+}
+
+/**
+ * ecryptfs_timing_end
+ * @timing: The timing; may be NULL
+ *
+ * Adds the time since the last ecryptfs_timing_begin() to that phase.
+ * Does nothing if no phase is running.
+ */
+void ecryptfs_timing_end(struct ecryptfs_timing *timing)
+{
+	uint64_t usec;
+	int i;
+
+	if (timing == NULL || timing->current == NULL)
+		return;
+	usec = timing_now_usec() - timing->begin;
+	for (i = 0; i < timing->num_phases; i++)
+		if (strcmp(timing->phases[i].name, timing->current) == 0)
+			break;
+	if (i == timing->num_phases) {
+		if (i == ECRYPTFS_TIMING_MAX_PHASES)
+			goto out;
+		timing->phases[i].name = timing->current;
+		timing->phases[i].usec = 0;
+		timing->num_phases++;
+	}
+	timing->phases[i].usec += usec;
+out:
+	timing->current = NULL;
+}
+
+/**
+ * ecryptfs_timing_begin
+ * @timing: The timing; may be NULL, so that callers need not check
+ *          whether timing was asked for
+ * @phase: Name of the phase; must stay valid as long as @timing does
+ *
+ * Ends the running phase, if any, and starts @phase. A phase that
+ * runs more than once adds up.
+ */
+void ecryptfs_timing_begin(struct ecryptfs_timing *timing, const char *phase)
+{
+	if (timing == NULL)
+		return;
+	ecryptfs_timing_end(timing);
+	timing->current = phase;
+	timing->begin = timing_now_usec();
+}
+
+/**
+ * ecryptfs_timing_format
+ * @timing: The timing; a running phase is ended first
+ * @prefix: Put in front of every key, to tell programs apart
+ * @buf: (out) The record
+ * @size: Size of @buf
+ *
+ * Formats the phases in the order they first ran as space separated
+ * "<prefix><phase>_us=<microseconds>" fields, followed by
+ * "<prefix>total_us" since ecryptfs_timing_init().
+ *
+ * Returns 0 on success, -ENOSPC if @buf is too small
+ */
+int ecryptfs_timing_format(struct ecryptfs_timing *timing, const char *prefix,
+			   char *buf, size_t size)
+{
+	size_t len = 0;
+	int n;
+	int i;
+
+	ecryptfs_timing_end(timing);
+	for (i = 0; i <= timing->num_phases; i++) {
+		if (i < timing->num_phases)
+			n = snprintf(buf + len, size - len, "%s%s%s_us=%llu",
+				     len ? " " : "", prefix,
+				     timing->phases[i].name,
+				     (unsigned long long)timing->phases[i].usec);
+		else
+			n = snprintf(buf + len, size - len, "%s%stotal_us=%llu",
+				     len ? " " : "", prefix,
+				     (unsigned long long)(timing_now_usec()
+							  - timing->created));
+		if (n < 0 || (size_t)n >= size - len)
+			return -ENOSPC;
+		len += n;
+	}
+	return 0;
+}
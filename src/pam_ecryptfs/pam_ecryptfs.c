@@ -29,6 +29,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
 #include <syslog.h>
@@ -39,13 +40,26 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/fsuid.h>
+#include <sys/file.h>
 #include <grp.h>
 #include <fcntl.h>
+#include <time.h>
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
+#include <keyutils.h>
 #include "../include/ecryptfs.h"
 
 #define PRIVATE_DIR "Private"
+/* Held by the process deriving the user's keys in the background */
+#define KDF_LOCK_FILE "/dev/shm/.ecryptfs-kdf-%u"
+/* Longest that a login waits for another one's key derivation */
+#define KDF_JOIN_TIMEOUT_MS 30000
+#define KDF_JOIN_POLL_MS 10
+
+/* PAM data under which the auth record waits for the session to open */
+#define TIMING_DATA "ecryptfs_timing"
+/* PAM data set when this handle left a key derivation running */
+#define KDF_ASYNC_DATA "ecryptfs_kdf_async"
 
 static void error(const char *msg)
 {
@@ -91,6 +105,310 @@ out:
 	return rc;
 }
 
+static int has_option(int argc, const char **argv, const char *option)
+{
+	int i;
+
+	for (i = 0; i < argc; i++)
+		if (strcmp(argv[i], option) == 0)
+			return 1;
+	return 0;
+}
+
+/**
+ * timing_option
+ *
+ * Returns 1 if "timing" or "timing=<file>" is among the options, with
+ * *dump set to the file, or to NULL for syslog only
+ */
+static int timing_option(int argc, const char **argv, const char **dump)
+{
+	int i;
+
+	*dump = NULL;
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "timing") == 0)
+			return 1;
+		if (strncmp(argv[i], "timing=", 7) == 0) {
+			*dump = argv[i] + 7;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * timing_read
+ *
+ * Reads the one line record a child writes to @fd, up to EOF, then
+ * closes @fd
+ */
+static void timing_read(int fd, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < size - 1) {
+		n = read(fd, buf + len, size - 1 - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	close(fd);
+}
+
+static void timing_cleanup(pam_handle_t *pamh, void *data, int error_status)
+{
+	free(data);
+}
+
+/**
+ * timing_save
+ *
+ * Keeps the auth record until the session opens, so that a login ends
+ * up in a single record. @child_record is the record of the child that
+ * derived the keys, which carries on from a copy of @timing.
+ */
+static void timing_save(pam_handle_t *pamh, struct ecryptfs_timing *timing,
+			const char *child_record)
+{
+	char *record;
+
+	if (*child_record != '\0') {
+		record = strdup(child_record);
+	} else {
+		record = malloc(ECRYPTFS_TIMING_MAX_RECORD);
+		if (record && ecryptfs_timing_format(timing, "auth_", record,
+						ECRYPTFS_TIMING_MAX_RECORD)) {
+			free(record);
+			record = NULL;
+		}
+	}
+	if (record && pam_set_data(pamh, TIMING_DATA, record, timing_cleanup)
+	    != PAM_SUCCESS)
+		free(record);
+}
+
+/**
+ * timing_emit
+ *
+ * Logs the record of the whole login: the auth phases, the session
+ * phases and those of mount.ecryptfs_private, as space separated
+ * key=value fields. With @dump, the record is also appended to that
+ * file, after the time of day.
+ */
+static void timing_emit(pam_handle_t *pamh, struct ecryptfs_timing *timing,
+			const char *helper, const char *dump)
+{
+	char session[ECRYPTFS_TIMING_MAX_RECORD];
+	const char *username = NULL;
+	const void *auth = NULL;
+	char *record;
+	int fd;
+
+	if (pam_get_data(pamh, TIMING_DATA, &auth) != PAM_SUCCESS)
+		auth = NULL;
+	if (pam_get_user(pamh, &username, NULL) != PAM_SUCCESS)
+		username = NULL;
+	if (ecryptfs_timing_format(timing, "session_", session,
+				   sizeof(session)))
+		session[0] = '\0';
+	if (asprintf(&record, "user=%s%s%s %s%s%s",
+		     username ? username : "", auth ? " " : "",
+		     auth ? (const char *)auth : "", session,
+		     *helper ? " " : "", helper) < 0)
+		return;
+	syslog(LOG_INFO, "pam_ecryptfs: timing %s\n", record);
+	if (dump) {
+		fd = open(dump, O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW
+			  | O_CLOEXEC, 0600);
+		if (fd != -1) {
+			dprintf(fd, "%lld %s\n", (long long)time(NULL), record);
+			close(fd);
+		} else
+			syslog(LOG_WARNING, "pam_ecryptfs: Cannot open timing file [%s]: %m\n", dump);
+	}
+	/* One record per login, should the session be opened again */
+	if (auth)
+		pam_set_data(pamh, TIMING_DATA, NULL, NULL);
+	free(record);
+}
+
+/**
+ * kdf_lock_open
+ * @uid: The user whose keys are derived
+ * @create: Create the file, for the deriving side
+ *
+ * The lock is an flock() on a file in /dev/shm, so that it is released
+ * whenever the deriving process goes away and is seen by whichever
+ * process of the PAM application opens the session.
+ *
+ * Returns an open descriptor, or -1
+ */
+static int kdf_lock_open(uid_t uid, int create)
+{
+	char *lock_file;
+	struct stat s;
+	int fd;
+
+	if (asprintf(&lock_file, KDF_LOCK_FILE, uid) == -1)
+		return -1;
+	fd = open(lock_file, create ? (O_RDWR | O_CREAT | O_NOFOLLOW)
+		  : (O_RDONLY | O_NOFOLLOW), S_IRUSR | S_IWUSR);
+	free(lock_file);
+	if (fd == -1)
+		return -1;
+	/* Anybody could have created it; only trust the user's own */
+	if (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_uid != uid) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * kdf_lock_wait
+ * @operation: LOCK_SH or LOCK_EX
+ *
+ * Returns 0 once the lock is taken, -1 after KDF_JOIN_TIMEOUT_MS
+ */
+static int kdf_lock_wait(int fd, int operation)
+{
+	struct timespec poll = { 0, KDF_JOIN_POLL_MS * 1000000L };
+	int waited = 0;
+
+	while (flock(fd, operation | LOCK_NB) != 0) {
+		if (errno != EWOULDBLOCK || waited >= KDF_JOIN_TIMEOUT_MS)
+			return -1;
+		nanosleep(&poll, NULL);
+		waited += KDF_JOIN_POLL_MS;
+	}
+	return 0;
+}
+
+/**
+ * kdf_join
+ *
+ * Waits for the keys that pam_sm_authenticate() started deriving in
+ * the background, if it did for this handle, to be in the keyring. The
+ * derivations of other logins of the user are not waited for.
+ */
+static void kdf_join(pam_handle_t *pamh, uid_t uid)
+{
+	const void *async;
+	int fd;
+
+	if (pam_get_data(pamh, KDF_ASYNC_DATA, &async) != PAM_SUCCESS
+	    || async == NULL)
+		return;
+	pam_set_data(pamh, KDF_ASYNC_DATA, NULL, NULL);
+	if ((fd = kdf_lock_open(uid, 0)) == -1)
+		return;
+	if (kdf_lock_wait(fd, LOCK_SH) != 0)
+		syslog(LOG_WARNING, "pam_ecryptfs: Gave up waiting for the key derivation\n");
+	close(fd);
+}
+
+/**
+ * keys_in_keyring
+ *
+ * Reads the signatures in ~/.ecryptfs/Private.sig the way fetch_sig()
+ * in mount.ecryptfs_private does, and looks each one up in the user
+ * keyring. The user keyring is that of the real uid, so this has to run
+ * after setuid().
+ *
+ * Returns 1 if the file has a signature and every one resolves, 0
+ * otherwise
+ */
+static int keys_in_keyring(const char *homedir)
+{
+	char sig[ECRYPTFS_SIG_SIZE_HEX + 2];
+	char *sig_file;
+	FILE *fh;
+	int rc = 0;
+	int i, j;
+
+	if (asprintf(&sig_file, "%s/.ecryptfs/%s.sig", homedir,
+		     PRIVATE_DIR) == -1)
+		return 0;
+	fh = fopen(sig_file, "r");
+	free(sig_file);
+	if (fh == NULL)
+		return 0;
+	for (i = 0; i < 2; i++) {
+		if (fgets(sig, sizeof(sig), fh) == NULL)
+			break;
+		for (j = 0; sig[j] != '\0' && isxdigit(sig[j]); j++)
+			;
+		if (sig[j] != '\0' && !isspace(sig[j])) {
+			rc = 0;
+			break;
+		}
+		sig[j] = '\0';
+		/* No second signature: filename encryption is not in use */
+		if (i == 1 && j == 0)
+			break;
+		if (j != ECRYPTFS_SIG_SIZE_HEX
+		    || keyctl_search(KEY_SPEC_USER_KEYRING, "user", sig, 0) < 0) {
+			rc = 0;
+			break;
+		}
+		rc = 1;
+	}
+	fclose(fh);
+	return rc;
+}
+
+/**
+ * keys_available
+ *
+ * Like keys_in_keyring(), but when the keys are missing, asks the key
+ * agent that the last auto-umount may have left behind (see
+ * ecryptfs-key-agent(1)) to put them back first
+ */
+static int keys_available(const char *homedir, struct ecryptfs_timing *timing)
+{
+	int rc = 0;
+
+	ecryptfs_timing_begin(timing, "keyring_check");
+	if (keys_in_keyring(homedir)) {
+		rc = 1;
+		goto out;
+	}
+	if (ecryptfs_key_agent_request(ECRYPTFS_KEY_AGENT_RESTORE, NULL, 0))
+		goto out;
+	syslog(LOG_DEBUG, "pam_ecryptfs: Keys restored by the key agent\n");
+	rc = keys_in_keyring(homedir);
+out:
+	ecryptfs_timing_end(timing);
+	return rc;
+}
+
+/**
+ * verify_wrapped_passphrase
+ *
+ * Returns 1 if @passphrase unwraps @wrapped_pw_filename, <0 otherwise
+ */
+static int verify_wrapped_passphrase(char *wrapped_pw_filename,
+				     char *passphrase, char *salt)
+{
+	char unwrapped[ECRYPTFS_MAX_PASSPHRASE_BYTES + 1];
+	int rc;
+
+	rc = ecryptfs_unwrap_passphrase(unwrapped, wrapped_pw_filename,
+					passphrase, salt);
+	memset(unwrapped, 0, sizeof(unwrapped));
+	if (rc) {
+		syslog(LOG_ERR, "pam_ecryptfs: Error attempting to unwrap passphrase; rc = [%d]\n", rc);
+		return (rc < 0) ? rc : -EIO;
+	}
+	return 1;
+}
+
 static int wrap_passphrase_if_necessary(const char *username, uid_t uid, char *wrapped_pw_filename, char *passphrase, char *salt)
 {
 	char *unwrapped_pw_filename = NULL;
@@ -135,8 +453,22 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 	char *auth_tok_sig;
 	char *private_mnt = NULL;
 	pid_t child_pid, tmp_pid;
+	int async = has_option(argc, argv, "async");
+	int verify = has_option(argc, argv, "verify");
+	int kdf_fd = -1;
+	int kdf_locked = 0;
+	struct ecryptfs_timing timing_buf;
+	struct ecryptfs_timing *timing = NULL;
+	char child_record[ECRYPTFS_TIMING_MAX_RECORD] = "";
+	int timing_pipe[2] = { -1, -1 };
+	const char *dump;
 	long rc;
 
+	if (timing_option(argc, argv, &dump)) {
+		ecryptfs_timing_init(&timing_buf);
+		timing = &timing_buf;
+	}
+	ecryptfs_timing_begin(timing, "passwd");
 	rc = pam_get_user(pamh, &username, NULL);
 	if (rc == PAM_SUCCESS) {
 		struct passwd *pwd;
@@ -163,15 +495,19 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 		goto out;
 	}
 
+	ecryptfs_timing_begin(timing, "dotecryptfs");
 	if (!file_exists_dotecryptfs(homedir, "auto-mount"))
 		goto out;
 	private_mnt = ecryptfs_fetch_private_mnt(homedir);
+	ecryptfs_timing_begin(timing, "mounted");
 	if (ecryptfs_private_is_mounted(NULL, private_mnt, NULL, 1)) {
 		syslog(LOG_DEBUG, "pam_ecryptfs: %s: %s is already mounted\n", __FUNCTION__, homedir);
 		/* If private/home is already mounted, then we can skip
 		   costly loading of keys */
 		goto out;
 	}
+	/* Time spent at the passphrase prompt is not ours */
+	ecryptfs_timing_end(timing);
 	if(file_exists_dotecryptfs(homedir, "wrapping-independent") == 1)
 		rc = pam_prompt(pamh, PAM_PROMPT_ECHO_OFF, &passphrase, "Encryption passphrase: ");
 	else
@@ -192,12 +528,42 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 		from_hex(salt, ECRYPTFS_DEFAULT_SALT_HEX, ECRYPTFS_SALT_SIZE);
 	} else
 		from_hex(salt, salt_hex, ECRYPTFS_SALT_SIZE);
+	/* Concurrent logins of one user take turns: the process deriving
+	   holds the lock until the keys are in the keyring, and the next
+	   one to get it finds them there and skips the derivation. With
+	   async, the keys are derived by a grandchild and the rest of the
+	   stack carries on; opening the session joins it */
+	if ((kdf_fd = kdf_lock_open(uid, 1)) != -1)
+		kdf_locked = (flock(kdf_fd, LOCK_EX | LOCK_NB) == 0);
+	else if (async)
+		syslog(LOG_WARNING, "pam_ecryptfs: Cannot open the key derivation lock; deriving in the foreground\n");
+	/* The child reports the phases it times back through a pipe */
+	if (timing && pipe2(timing_pipe, O_CLOEXEC)) {
+		timing_pipe[0] = -1;
+		timing_pipe[1] = -1;
+	}
 	if ((child_pid = fork()) == 0) {
+		if (timing_pipe[0] != -1)
+			close(timing_pipe[0]);
 		/* temp regain uid 0 to drop privs */
 		seteuid(oeuid);
 		/* setgroups() already called */
 		if (setgid(gid) < 0 || setuid(uid) < 0)
 			goto out_child;
+		if (kdf_fd != -1 && async) {
+			if (fork() > 0)
+				exit(0);
+			/* Nobody waits for a background derivation */
+			if (timing_pipe[1] != -1) {
+				close(timing_pipe[1]);
+				timing_pipe[1] = -1;
+			}
+		}
+		ecryptfs_timing_begin(timing, "kdf_wait");
+		if (kdf_fd != -1 && !kdf_locked
+		    && kdf_lock_wait(kdf_fd, LOCK_EX) != 0)
+			syslog(LOG_WARNING, "pam_ecryptfs: Gave up waiting for another login's key derivation\n");
+		ecryptfs_timing_end(timing);
 
 		if (passphrase == NULL) {
 			syslog(LOG_ERR, "pam_ecryptfs: NULL passphrase; aborting\n");
@@ -208,8 +574,7 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 			syslog(LOG_WARNING, "pam_ecryptfs: Cannot validate keyring integrity\n");
 		}
 		rc = 0;
-		if ((argc == 1)
-		    && (memcmp(argv[0], "unwrap\0", 7) == 0)) {
+		if (has_option(argc, argv, "unwrap")) {
 			char *wrapped_pw_filename;
 			char *unwrapped_pw_filename;
 			struct stat s;
@@ -228,13 +593,36 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 			} else {
 				goto out_child;
 			}
-			rc = ecryptfs_insert_wrapped_passphrase_into_keyring(
-				auth_tok_sig, wrapped_pw_filename, passphrase,
-				salt);
+			/* Keys left in the keyring by an earlier session
+			   need no derivation; with verify, the login
+			   passphrase is still checked against the wrapped
+			   file, which costs a single derivation */
+			if (keys_available(homedir, timing)) {
+				/* Nothing left to derive; the other logins
+				   of the user need not wait for this one to
+				   check its passphrase */
+				if (kdf_fd != -1)
+					flock(kdf_fd, LOCK_UN);
+				ecryptfs_timing_begin(timing, "unwrap");
+				rc = verify ? verify_wrapped_passphrase(
+					wrapped_pw_filename, passphrase, salt)
+					: 1;
+				ecryptfs_timing_end(timing);
+				if (rc == 1)
+					syslog(LOG_DEBUG, "pam_ecryptfs: Keys already in the user keyring; skipping key derivation\n");
+			} else
+				rc = ecryptfs_insert_wrapped_passphrase_into_keyring_timed(
+					auth_tok_sig, wrapped_pw_filename,
+					passphrase, salt, timing);
 			free(wrapped_pw_filename);
+		} else if (!verify && keys_available(homedir, timing)) {
+			syslog(LOG_DEBUG, "pam_ecryptfs: Keys already in the user keyring; skipping key derivation\n");
+			rc = 1;
 		} else {
+			ecryptfs_timing_begin(timing, "insert_fekek");
 			rc = ecryptfs_add_passphrase_key_to_keyring(
 				auth_tok_sig, passphrase, salt);
+			ecryptfs_timing_end(timing);
 		}
 		if (rc == 1) {
 			goto out_child;
@@ -243,19 +631,48 @@ PAM_EXTERN int pam_sm_authenticate(pam_handle_t *pamh, int flags, int argc,
 			syslog(LOG_ERR, "pam_ecryptfs: Error adding passphrase key token to user session keyring; rc = [%ld]\n", rc);
 			goto out_child;
 		}
+		/* The placeholder lives for the whole session; it must not
+		   keep the lock */
+		if (kdf_fd != -1) {
+			close(kdf_fd);
+			kdf_fd = -1;
+		}
 		if (fork() == 0) {
+			/* Nor the timing pipe, or the parent would wait on
+			   it for the whole session */
+			if (timing_pipe[1] != -1) {
+				close(timing_pipe[1]);
+				timing_pipe[1] = -1;
+			}
 			if ((rc = ecryptfs_set_zombie_session_placeholder())) {
 				syslog(LOG_ERR, "pam_ecryptfs: Error attempting to create and register zombie process; rc = [%ld]\n", rc);
 			}
 		}
 out_child:
+		if (timing_pipe[1] != -1
+		    && ecryptfs_timing_format(timing, "auth_", child_record,
+					      sizeof(child_record)) == 0)
+			dprintf(timing_pipe[1], "%s\n", child_record);
 		free(auth_tok_sig);
 		exit(0);
 	}
+	if (kdf_fd != -1) {
+		if (async)
+			pam_set_data(pamh, KDF_ASYNC_DATA, (void *)KDF_LOCK_FILE,
+				     NULL);
+		close(kdf_fd);
+	}
+	if (timing_pipe[1] != -1)
+		close(timing_pipe[1]);
+	if (timing_pipe[0] != -1)
+		timing_read(timing_pipe[0], child_record,
+			    sizeof(child_record));
 	tmp_pid = waitpid(child_pid, NULL, 0);
 	if (tmp_pid == -1)
 		syslog(LOG_WARNING, "pam_ecryptfs: waitpid() returned with error condition\n");
 out:
+	if (timing)
+		timing_save(pamh, timing, child_record);
 
 	seteuid(oeuid);
 	setegid(oegid);
@@ -292,7 +709,14 @@ static struct passwd *fetch_pwd(pam_handle_t *pamh)
 	return pwd;
 }
 
-static int private_dir(pam_handle_t *pamh, int mount)
+/**
+ * private_dir
+ * @timing: When mounting, phases are added to it if not NULL, and
+ *          mount.ecryptfs_private writes its own record to @helper
+ */
+static int private_dir(pam_handle_t *pamh, int mount,
+		       struct ecryptfs_timing *timing, char *helper,
+		       size_t helper_size)
 {
 	int rc, fd;
 	struct passwd *pwd = NULL;
@@ -306,11 +730,15 @@ static int private_dir(pam_handle_t *pamh, int mount)
 	pid_t pid;
 	struct utmp *u;
 	int count = 0;
+	int timing_pipe[2] = { -1, -1 };
+	char timing_fd[16];
 
+	ecryptfs_timing_begin(timing, "passwd");
 	if ((pwd = fetch_pwd(pamh)) == NULL) {
 		/* fetch_pwd() logged a message */
 		return 1;
 	}
+	ecryptfs_timing_begin(timing, "dotecryptfs");
 	if (mount == 1) {
 		a = automount;
 	} else {
@@ -336,8 +764,20 @@ static int private_dir(pam_handle_t *pamh, int mount)
 		/* No sigfile, no need to mount private dir */
 		goto out;
 	}
+	if (mount == 1) {
+		ecryptfs_timing_begin(timing, "kdf_join");
+		kdf_join(pamh, pwd->pw_uid);
+	}
+	ecryptfs_timing_begin(timing, "mount_helper");
+	/* Unlike the read end, the write end has to survive the exec */
+	if (timing && mount == 1 && pipe(timing_pipe) == 0)
+		fcntl(timing_pipe[0], F_SETFD, FD_CLOEXEC);
 	if ((pid = fork()) < 0) {
 		syslog(LOG_ERR, "pam_ecryptfs: Error setting up private mount");
+		if (timing_pipe[1] != -1) {
+			close(timing_pipe[0]);
+			close(timing_pipe[1]);
+		}
 		return 1;
 	}
 	if (pid == 0) {
@@ -361,6 +801,11 @@ static int private_dir(pam_handle_t *pamh, int mount)
 				exit(0);
 			}
 			clearenv();
+			if (timing_pipe[1] != -1) {
+				snprintf(timing_fd, sizeof(timing_fd), "%d",
+					 timing_pipe[1]);
+				setenv(ECRYPTFS_TIMING_FD_ENV, timing_fd, 1);
+			}
 			if (setgroups(1, &pwd->pw_gid) < 0 || setgid(pwd->pw_gid) < 0)
 				return -1;
 			/* run mount.ecryptfs_private as the user */
@@ -369,44 +814,63 @@ static int private_dir(pam_handle_t *pamh, int mount)
 			execl("/sbin/mount.ecryptfs_private",
 			      "mount.ecryptfs_private", NULL);
 		} else {
-			if (stat(autofile, &s) != 0) {
-				/* User does not want to auto-unmount */
-				syslog(LOG_DEBUG, "pam_ecryptfs: Skipping automatic eCryptfs unmount");
-				exit(0);
-			}
 			clearenv();
 			if (setgroups(1, &pwd->pw_gid) < 0 || setgid(pwd->pw_gid) < 0)
 				return -1;
 			/* run umount.ecryptfs_private as the user */
 			if (setresuid(pwd->pw_uid, pwd->pw_uid, pwd->pw_uid) < 0)
 				return -1;
+			/* The zombie table is per user; reap it as the user */
+			ecryptfs_clean_zombie_session_placeholders();
+			if (stat(autofile, &s) != 0) {
+				/* User does not want to auto-unmount */
+				syslog(LOG_DEBUG, "pam_ecryptfs: Skipping automatic eCryptfs unmount");
+				exit(0);
+			}
 			execl("/sbin/umount.ecryptfs_private",
  			      "umount.ecryptfs_private", NULL);
 			exit(1);
 		}
 		exit(1);
 	} else {
+		if (timing_pipe[1] != -1) {
+			close(timing_pipe[1]);
+			timing_read(timing_pipe[0], helper, helper_size);
+		}
 		waitpid(pid, &rc, 0);
 	}
 out:
+	ecryptfs_timing_end(timing);
 	return 0;
 }
 
-static int mount_private_dir(pam_handle_t *pamh)
+static int mount_private_dir(pam_handle_t *pamh,
+			     struct ecryptfs_timing *timing, char *helper,
+			     size_t helper_size)
 {
-	return private_dir(pamh, 1);
+	return private_dir(pamh, 1, timing, helper, helper_size);
 }
 
 static int umount_private_dir(pam_handle_t *pamh)
 {
-	return private_dir(pamh, 0);
+	return private_dir(pamh, 0, NULL, NULL, 0);
 }
 
 PAM_EXTERN int
 pam_sm_open_session(pam_handle_t *pamh, int flags,
 		    int argc, const char *argv[])
 {
-	mount_private_dir(pamh);
+	struct ecryptfs_timing timing;
+	char helper[ECRYPTFS_TIMING_MAX_RECORD] = "";
+	const char *dump;
+
+	if (!timing_option(argc, argv, &dump)) {
+		mount_private_dir(pamh, NULL, NULL, 0);
+		return PAM_SUCCESS;
+	}
+	ecryptfs_timing_init(&timing);
+	mount_private_dir(pamh, &timing, helper, sizeof(helper));
+	timing_emit(pamh, &timing, helper, dump);
 	return PAM_SUCCESS;
 }
 
@@ -0,0 +1,1193 @@
+/**
+ * ecryptfs-backup: Incremental backup of an eCryptfs lower tree from a
+ * manifest of per-extent ciphertext hashes, and restore of the deltas
+ * it writes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <nss.h>
+#include <pk11pub.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+#define BACKUP_MANIFEST_MAGIC "eCryptfs manifest 1\n"
+#define BACKUP_DELTA_MAGIC "eCryptfs delta 1\n"
+/* Truncated SHA-256 of each ciphertext extent */
+#define BACKUP_HASH_SIZE 16
+/* Extents read and hashed per system call */
+#define BACKUP_BATCH_EXTENTS 256
+#define BACKUP_FLUSH_BYTES (1024 * 1024)
+#define BACKUP_UNCHANGED 1
+
+#define BACKUP_TYPE_FILE 'F'
+#define BACKUP_TYPE_SYMLINK 'L'
+#define BACKUP_TYPE_DIR 'M'
+#define BACKUP_TYPE_DELETE 'D'
+#define BACKUP_TYPE_END 'Z'
+
+/* type, path, then lower size, mtime seconds and nanoseconds, header
+ * size and number of extents */
+#define BACKUP_RECORD_FIXED_BYTES (8 + 8 + 4 + 4 + 8)
+
+/**
+ * A manifest record, pointing into the mapped manifest
+ * @hashes: @num_extents hashes of BACKUP_HASH_SIZE bytes
+ * @len: Bytes the whole record takes
+ */
+struct backup_record {
+	char type;
+	const char *path;
+	uint64_t lower_size;
+	uint64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t header_size;
+	uint64_t num_extents;
+	const unsigned char *hashes;
+	size_t len;
+};
+
+struct backup_entry {
+	struct backup_record rec;
+	int seen;
+};
+
+/**
+ * The previous manifest, mapped, with its records indexed by path
+ */
+struct backup_manifest {
+	char *map;
+	size_t size;
+	struct backup_entry *entries;
+	size_t mask;
+	size_t count;
+};
+
+struct backup_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct backup_totals {
+	uint64_t unchanged;
+	uint64_t changed;
+	uint64_t added;
+	uint64_t extents;
+	uint64_t extents_sent;
+	uint64_t bytes_sent;
+	uint64_t failed;
+};
+
+struct backup_worker {
+	struct backup_totals totals;
+	struct backup_buf manifest;
+	struct backup_buf delta;
+	char *buf;
+	unsigned char *hashes;
+	size_t hashes_size;
+	uint64_t *changed;
+	size_t changed_size;
+};
+
+/**
+ * struct backup - State shared by every worker
+ * @root_len: Length of the lower root; entry paths start with it
+ * @all: Hash every file, even those whose size and mtime match
+ * @delta_lock: Held while a worker writes one file's records, so that
+ *              records of different files do not interleave
+ */
+struct backup {
+	size_t root_len;
+	int all;
+	struct backup_manifest old;
+	struct backup_worker *workers;
+	pthread_mutex_t manifest_lock;
+	FILE *manifest;
+	pthread_mutex_t delta_lock;
+	FILE *delta;
+	int write_error;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s -m <manifest> [-o <delta>] [-t <threads>] [-c] "
+		"<lower-dir>\n"
+		"%s -a <lower-dir> [<delta>]\n\n"
+		"Writes the files of the eCryptfs lower directory <lower-dir> "
+		"that changed\n"
+		"since <manifest> was written, as a delta holding only their "
+		"headers and the\n"
+		"extents that changed, and updates <manifest>. Without a "
+		"manifest, every\n"
+		"file is written.\n"
+		"With -a, applies a delta to the copy of the lower directory "
+		"at <lower-dir>.\n\n"
+		"  -m  Manifest of the previous backup\n"
+		"  -o  Write the delta here (default: stdout)\n"
+		"  -t  Number of hashing threads (default: online CPUs)\n"
+		"  -c  Hash every file, even when size and mtime are "
+		"unchanged\n"
+		"  -a  Apply a delta, read from <delta> or stdin\n",
+		name, name);
+}
+
+static uint64_t backup_get_be(const unsigned char *p, int bytes)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		value = ((value << 8) | p[i]);
+	return value;
+}
+
+static int backup_buf_append(struct backup_buf *buf, const void *data,
+			     size_t len)
+{
+	if (buf->len + len > buf->size) {
+		size_t size = (buf->size ? buf->size : 4096);
+		char *new_data;
+
+		while (buf->len + len > size)
+			size *= 2;
+		new_data = realloc(buf->data, size);
+		if (!new_data)
+			return -ENOMEM;
+		buf->data = new_data;
+		buf->size = size;
+	}
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+	return 0;
+}
+
+static int backup_buf_put_be(struct backup_buf *buf, uint64_t value,
+			     int bytes)
+{
+	unsigned char p[8];
+	int i;
+
+	for (i = (bytes - 1); i >= 0; i--) {
+		p[i] = (value & 0xFF);
+		value >>= 8;
+	}
+	return backup_buf_append(buf, p, bytes);
+}
+
+/**
+ * backup_parse_record
+ * @p: Start of the record
+ * @avail: Bytes from @p to the end of the manifest
+ *
+ * Returns zero on success, -EINVAL if the record runs past the end
+ */
+static int backup_parse_record(const char *p, size_t avail,
+			       struct backup_record *rec)
+{
+	const unsigned char *f;
+	size_t path_len;
+
+	if (avail < 2)
+		return -EINVAL;
+	rec->type = p[0];
+	rec->path = &p[1];
+	path_len = strnlen(rec->path, (avail - 1));
+	if (1 + path_len + 1 + BACKUP_RECORD_FIXED_BYTES > avail)
+		return -EINVAL;
+	f = (const unsigned char *)&rec->path[path_len + 1];
+	rec->lower_size = backup_get_be(f, 8);
+	rec->mtime_sec = backup_get_be(&f[8], 8);
+	rec->mtime_nsec = backup_get_be(&f[16], 4);
+	rec->header_size = backup_get_be(&f[20], 4);
+	rec->num_extents = backup_get_be(&f[24], 8);
+	rec->hashes = &f[BACKUP_RECORD_FIXED_BYTES];
+	rec->len = (1 + path_len + 1 + BACKUP_RECORD_FIXED_BYTES);
+	if (rec->num_extents > ((avail - rec->len) / BACKUP_HASH_SIZE))
+		return -EINVAL;
+	rec->len += (rec->num_extents * BACKUP_HASH_SIZE);
+	return 0;
+}
+
+static size_t backup_hash_path(const char *path)
+{
+	size_t hash = 5381;
+
+	while (*path)
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+	return hash;
+}
+
+static struct backup_entry *backup_lookup(struct backup_manifest *old,
+					  const char *path)
+{
+	size_t i;
+
+	if (!old->entries)
+		return NULL;
+	for (i = backup_hash_path(path) & old->mask; old->entries[i].rec.path;
+	     i = (i + 1) & old->mask)
+		if (!strcmp(old->entries[i].rec.path, path))
+			return &old->entries[i];
+	return NULL;
+}
+
+/**
+ * backup_load_manifest
+ *
+ * A missing manifest is an empty one: the first backup is a full one.
+ */
+static int backup_load_manifest(struct backup_manifest *old,
+				const char *path)
+{
+	size_t magic_len = strlen(BACKUP_MANIFEST_MAGIC);
+	struct backup_record rec;
+	struct stat st;
+	size_t count = 0;
+	size_t off;
+	int fd;
+	int rc = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+	if (fstat(fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	if ((size_t)st.st_size < magic_len) {
+		rc = -EINVAL;
+		goto out;
+	}
+	old->size = st.st_size;
+	old->map = mmap(NULL, old->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (old->map == MAP_FAILED) {
+		old->map = NULL;
+		rc = -errno;
+		goto out;
+	}
+	if (memcmp(old->map, BACKUP_MANIFEST_MAGIC, magic_len)) {
+		rc = -EINVAL;
+		goto out;
+	}
+	for (off = magic_len; off < old->size; off += rec.len) {
+		rc = backup_parse_record(&old->map[off], (old->size - off),
+					 &rec);
+		if (rc)
+			goto out;
+		count++;
+	}
+	for (old->mask = 1023; old->mask < (count * 2); )
+		old->mask = ((old->mask << 1) | 1);
+	old->entries = calloc(old->mask + 1, sizeof(*old->entries));
+	if (!old->entries) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (off = magic_len; off < old->size; off += rec.len) {
+		size_t i;
+
+		backup_parse_record(&old->map[off], (old->size - off), &rec);
+		for (i = backup_hash_path(rec.path) & old->mask;
+		     old->entries[i].rec.path; i = (i + 1) & old->mask)
+			if (!strcmp(old->entries[i].rec.path, rec.path))
+				break;
+		if (!old->entries[i].rec.path)
+			old->count++;
+		old->entries[i].rec = rec;
+	}
+out:
+	close(fd);
+	return rc;
+}
+
+static int backup_manifest_record(struct backup_worker *w, char type,
+				  const char *rel, struct stat *st,
+				  uint32_t header_size, uint64_t num_extents)
+{
+	struct backup_buf *m = &w->manifest;
+	int rc;
+
+	rc = backup_buf_append(m, &type, 1);
+	if (!rc)
+		rc = backup_buf_append(m, rel, strlen(rel) + 1);
+	if (!rc)
+		rc = backup_buf_put_be(m, st->st_size, 8);
+	if (!rc)
+		rc = backup_buf_put_be(m, st->st_mtim.tv_sec, 8);
+	if (!rc)
+		rc = backup_buf_put_be(m, st->st_mtim.tv_nsec, 4);
+	if (!rc)
+		rc = backup_buf_put_be(m, header_size, 4);
+	if (!rc)
+		rc = backup_buf_put_be(m, num_extents, 8);
+	if (!rc && num_extents)
+		rc = backup_buf_append(m, w->hashes,
+				       (num_extents * BACKUP_HASH_SIZE));
+	return rc;
+}
+
+static void backup_flush_manifest(struct backup *bk, struct backup_worker *w)
+{
+	pthread_mutex_lock(&bk->manifest_lock);
+	if (w->manifest.len
+	    && fwrite(w->manifest.data, 1, w->manifest.len, bk->manifest)
+	    != w->manifest.len)
+		bk->write_error = -EIO;
+	pthread_mutex_unlock(&bk->manifest_lock);
+	w->manifest.len = 0;
+}
+
+/**
+ * backup_delta_header
+ *
+ * Starts a delta record: the type, the path, and for files and
+ * directories the size, mode and times
+ */
+static int backup_delta_header(struct backup_buf *d, char type,
+			       const char *rel, struct stat *st)
+{
+	int rc;
+
+	d->len = 0;
+	rc = backup_buf_append(d, &type, 1);
+	if (!rc)
+		rc = backup_buf_append(d, rel, strlen(rel) + 1);
+	if (rc || type == BACKUP_TYPE_DELETE || type == BACKUP_TYPE_SYMLINK)
+		return rc;
+	rc = backup_buf_put_be(d, st->st_size, 8);
+	if (!rc)
+		rc = backup_buf_put_be(d, (st->st_mode & 07777), 4);
+	if (!rc)
+		rc = backup_buf_put_be(d, st->st_mtim.tv_sec, 8);
+	if (!rc)
+		rc = backup_buf_put_be(d, st->st_mtim.tv_nsec, 4);
+	return rc;
+}
+
+static int backup_delta_write(struct backup *bk, const void *data,
+			      size_t len)
+{
+	if (fwrite(data, 1, len, bk->delta) != len)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * backup_hash_file
+ * @header_size: Set to the bytes in front of the first extent
+ * @num_extents: Set to the number of extents hashed into w->hashes
+ *
+ * Extents start after the header, whose size comes from the metadata,
+ * and are ECRYPTFS_DEFAULT_EXTENT_SIZE bytes each. Files that are not
+ * eCryptfs files are hashed as if they had no header.
+ */
+static int backup_hash_file(struct backup_worker *w, int fd,
+			    struct stat *st, uint32_t *header_size,
+			    uint64_t *num_extents)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	char meta[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE];
+	uint64_t lower_header_size = 0;
+	uint64_t extent = 0;
+	uint64_t n;
+
+	if (ecryptfs_read_lower_metadata(fd, meta, sizeof(meta), &crypt_stat,
+					 &packet_set, &lower_header_size)
+	    || lower_header_size > (uint64_t)st->st_size)
+		lower_header_size = 0;
+	(*header_size) = lower_header_size;
+	n = ((st->st_size - lower_header_size + ECRYPTFS_DEFAULT_EXTENT_SIZE
+	      - 1) / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	if (n * BACKUP_HASH_SIZE > w->hashes_size) {
+		unsigned char *hashes = realloc(w->hashes,
+						(n * BACKUP_HASH_SIZE));
+
+		if (!hashes)
+			return -ENOMEM;
+		w->hashes = hashes;
+		w->hashes_size = (n * BACKUP_HASH_SIZE);
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (extent < n) {
+		off_t offset = (lower_header_size
+				+ (extent * ECRYPTFS_DEFAULT_EXTENT_SIZE));
+		ssize_t got;
+		size_t i;
+
+		got = pread(fd, w->buf, (BACKUP_BATCH_EXTENTS
+					 * ECRYPTFS_DEFAULT_EXTENT_SIZE),
+			    offset);
+		if (got < 0)
+			return -errno;
+		if (!got)
+			return -EAGAIN;
+		for (i = 0; i < (size_t)got && extent < n;
+		     i += ECRYPTFS_DEFAULT_EXTENT_SIZE, extent++) {
+			unsigned char digest[32];
+			size_t len = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+
+			if (got - i < len)
+				len = (got - i);
+			if (PK11_HashBuf(SEC_OID_SHA256, digest,
+					 (unsigned char *)&w->buf[i], len)
+			    != SECSuccess)
+				return -EIO;
+			memcpy(&w->hashes[extent * BACKUP_HASH_SIZE], digest,
+			       BACKUP_HASH_SIZE);
+		}
+	}
+	(*num_extents) = n;
+	return 0;
+}
+
+/**
+ * backup_send_file
+ * @old: Previous record for the file, or NULL
+ *
+ * Writes the header, or the xattr metadata, and every extent whose
+ * hash differs from @old. The extents were hashed first with the delta
+ * unlocked; the changed ones are read again under the lock, most
+ * likely from the page cache.
+ *
+ * Returns BACKUP_UNCHANGED if a file hashed only because of -c matches
+ * @old, and nothing was written.
+ */
+static int backup_send_file(struct backup *bk, struct backup_worker *w,
+			    int fd, const char *rel, struct stat *st,
+			    struct backup_record *old, uint32_t header_size,
+			    uint64_t num_extents)
+{
+	char meta[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE * 2];
+	size_t num_changed = 0;
+	ssize_t meta_len = 0;
+	uint64_t i;
+	int rc;
+
+	if (num_extents > w->changed_size) {
+		uint64_t *changed = realloc(w->changed,
+					    (num_extents * sizeof(*changed)));
+
+		if (!changed)
+			return -ENOMEM;
+		w->changed = changed;
+		w->changed_size = num_extents;
+	}
+	for (i = 0; i < num_extents; i++)
+		if (!old || old->type != BACKUP_TYPE_FILE
+		    || old->header_size != header_size
+		    || i >= old->num_extents
+		    || memcmp(&old->hashes[i * BACKUP_HASH_SIZE],
+			      &w->hashes[i * BACKUP_HASH_SIZE],
+			      BACKUP_HASH_SIZE))
+			w->changed[num_changed++] = i;
+	w->totals.extents += num_extents;
+	if (!num_changed && old && old->type == BACKUP_TYPE_FILE
+	    && old->header_size == header_size
+	    && old->num_extents == num_extents
+	    && old->lower_size == (uint64_t)st->st_size
+	    && old->mtime_sec == (uint64_t)st->st_mtim.tv_sec
+	    && old->mtime_nsec == (uint32_t)st->st_mtim.tv_nsec)
+		return BACKUP_UNCHANGED;
+	if (header_size) {
+		if (header_size > sizeof(meta))
+			return -EINVAL;
+		meta_len = pread(fd, meta, header_size, 0);
+		if (meta_len != (ssize_t)header_size)
+			return -EIO;
+	} else {
+		meta_len = fgetxattr(fd, ECRYPTFS_XATTR_NAME, meta,
+				     sizeof(meta));
+		if (meta_len < 0)
+			meta_len = 0;
+	}
+	rc = backup_delta_header(&w->delta, BACKUP_TYPE_FILE, rel, st);
+	if (!rc)
+		rc = backup_buf_put_be(&w->delta, header_size, 4);
+	if (!rc)
+		rc = backup_buf_put_be(&w->delta, meta_len, 4);
+	if (!rc)
+		rc = backup_buf_append(&w->delta, meta, meta_len);
+	if (!rc)
+		rc = backup_buf_put_be(&w->delta, num_changed, 8);
+	if (rc)
+		return rc;
+	pthread_mutex_lock(&bk->delta_lock);
+	rc = backup_delta_write(bk, w->delta.data, w->delta.len);
+	for (i = 0; !rc && i < num_changed; i++) {
+		unsigned char p[12];
+		uint64_t index = w->changed[i];
+		ssize_t got;
+		int j;
+
+		got = pread(fd, w->buf, ECRYPTFS_DEFAULT_EXTENT_SIZE,
+			    (header_size
+			     + (index * ECRYPTFS_DEFAULT_EXTENT_SIZE)));
+		if (got < 0) {
+			rc = -errno;
+			break;
+		}
+		for (j = 7; j >= 0; j--, index >>= 8)
+			p[j] = (index & 0xFF);
+		for (j = 11; j >= 8; j--, got >>= 8)
+			p[j] = (got & 0xFF);
+		got = backup_get_be(&p[8], 4);
+		rc = backup_delta_write(bk, p, sizeof(p));
+		if (!rc)
+			rc = backup_delta_write(bk, w->buf, got);
+		w->totals.bytes_sent += (sizeof(p) + got);
+	}
+	pthread_mutex_unlock(&bk->delta_lock);
+	w->totals.bytes_sent += (w->delta.len);
+	w->totals.extents_sent += num_changed;
+	return rc;
+}
+
+static int backup_file(struct backup *bk, struct backup_worker *w,
+		       struct ecryptfs_walk_entry *entry, const char *rel,
+		       struct stat *st, struct backup_record *old)
+{
+	uint32_t header_size = 0;
+	uint64_t num_extents = 0;
+	int fd;
+	int rc;
+
+	fd = openat(entry->dirfd, entry->name,
+		    O_RDONLY | O_NOFOLLOW | O_NOATIME);
+	if (fd == -1 && errno == EPERM)
+		fd = openat(entry->dirfd, entry->name, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	rc = backup_hash_file(w, fd, st, &header_size, &num_extents);
+	if (!rc)
+		rc = backup_send_file(bk, w, fd, rel, st, old, header_size,
+				      num_extents);
+	if (rc >= 0) {
+		int rc_record = backup_manifest_record(w, BACKUP_TYPE_FILE,
+						       rel, st, header_size,
+						       num_extents);
+
+		if (rc_record)
+			rc = rc_record;
+	}
+	close(fd);
+	return rc;
+}
+
+static int backup_other(struct backup *bk, struct backup_worker *w,
+			struct ecryptfs_walk_entry *entry, const char *rel,
+			struct stat *st)
+{
+	char target[PATH_MAX];
+	char type = S_ISDIR(st->st_mode) ? BACKUP_TYPE_DIR
+		: BACKUP_TYPE_SYMLINK;
+	int rc;
+
+	rc = backup_delta_header(&w->delta, type, rel, st);
+	if (rc)
+		return rc;
+	if (type == BACKUP_TYPE_SYMLINK) {
+		ssize_t len = readlinkat(entry->dirfd, entry->name, target,
+					 sizeof(target) - 1);
+
+		if (len < 0)
+			return -errno;
+		target[len] = '\0';
+		rc = backup_buf_append(&w->delta, target, len + 1);
+		if (rc)
+			return rc;
+	}
+	pthread_mutex_lock(&bk->delta_lock);
+	rc = backup_delta_write(bk, w->delta.data, w->delta.len);
+	pthread_mutex_unlock(&bk->delta_lock);
+	w->totals.bytes_sent += w->delta.len;
+	if (!rc)
+		rc = backup_manifest_record(w, type, rel, st, 0, 0);
+	return rc;
+}
+
+static int backup_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			int worker)
+{
+	struct backup *bk = priv;
+	struct backup_worker *w = &bk->workers[worker];
+	const char *rel = (entry->path + bk->root_len + 1);
+	struct backup_entry *old;
+	struct stat st;
+	char type;
+	int rc;
+
+	if (fstatat(entry->dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW)) {
+		fprintf(stderr, "Error reading [%s]: %m\n", entry->path);
+		w->totals.failed++;
+		return 0;
+	}
+	if (S_ISREG(st.st_mode))
+		type = BACKUP_TYPE_FILE;
+	else if (S_ISDIR(st.st_mode))
+		type = BACKUP_TYPE_DIR;
+	else if (S_ISLNK(st.st_mode))
+		type = BACKUP_TYPE_SYMLINK;
+	else
+		return 0;
+	old = backup_lookup(&bk->old, rel);
+	if (old)
+		old->seen = 1;
+	if (old && old->rec.type == type
+	    && old->rec.lower_size == (uint64_t)st.st_size
+	    && old->rec.mtime_sec == (uint64_t)st.st_mtim.tv_sec
+	    && old->rec.mtime_nsec == (uint32_t)st.st_mtim.tv_nsec
+	    && (!bk->all || type != BACKUP_TYPE_FILE)) {
+		rc = backup_buf_append(&w->manifest, old->rec.path - 1,
+				       old->rec.len);
+		w->totals.unchanged++;
+		w->totals.extents += old->rec.num_extents;
+	} else {
+		if (type == BACKUP_TYPE_FILE)
+			rc = backup_file(bk, w, entry, rel, &st,
+					 old ? &old->rec : NULL);
+		else
+			rc = backup_other(bk, w, entry, rel, &st);
+		if (rc == BACKUP_UNCHANGED) {
+			w->totals.unchanged++;
+			rc = 0;
+		} else if (!rc && old)
+			w->totals.changed++;
+		else if (!rc)
+			w->totals.added++;
+	}
+	if (rc) {
+		fprintf(stderr, "Error backing up [%s]; rc = [%d]\n",
+			entry->path, rc);
+		w->totals.failed++;
+	}
+	if (w->manifest.len >= BACKUP_FLUSH_BYTES)
+		backup_flush_manifest(bk, w);
+	return 0;
+}
+
+static int backup_deepest_first(const void *a, const void *b)
+{
+	return strcmp(*(const char **)b, *(const char **)a);
+}
+
+/**
+ * backup_send_deletes
+ *
+ * Paths in the old manifest that the walk did not find. Sorted in
+ * reverse, a directory comes after everything under it.
+ */
+static int backup_send_deletes(struct backup *bk, uint64_t *deleted)
+{
+	struct backup_buf d;
+	const char **paths;
+	size_t count = 0;
+	size_t i;
+	int rc = 0;
+
+	(*deleted) = 0;
+	if (!bk->old.count)
+		return 0;
+	paths = calloc(bk->old.count, sizeof(*paths));
+	if (!paths)
+		return -ENOMEM;
+	for (i = 0; i <= bk->old.mask; i++)
+		if (bk->old.entries[i].rec.path && !bk->old.entries[i].seen)
+			paths[count++] = bk->old.entries[i].rec.path;
+	qsort(paths, count, sizeof(*paths), backup_deepest_first);
+	memset(&d, 0, sizeof(d));
+	for (i = 0; !rc && i < count; i++) {
+		rc = backup_delta_header(&d, BACKUP_TYPE_DELETE, paths[i],
+					 NULL);
+		if (!rc)
+			rc = backup_delta_write(bk, d.data, d.len);
+	}
+	free(d.data);
+	free(paths);
+	(*deleted) = count;
+	return rc;
+}
+
+/**
+ * backup_commit_manifest
+ *
+ * The new manifest only replaces the old one once the delta it
+ * describes is safely written; until then the next run starts from
+ * the old one again.
+ */
+static int backup_commit_manifest(struct backup *bk, const char *path,
+				  const char *new_path)
+{
+	if (fflush(bk->delta) || (bk->delta != stdout
+				  && fsync(fileno(bk->delta))
+				  && errno != EINVAL))
+		return -EIO;
+	if (fflush(bk->manifest) || fsync(fileno(bk->manifest)))
+		return -EIO;
+	if (rename(new_path, path))
+		return -errno;
+	return 0;
+}
+
+static int backup_read(FILE *in, void *data, size_t len)
+{
+	return (fread(data, 1, len, in) == len) ? 0 : -EIO;
+}
+
+static int backup_read_be(FILE *in, uint64_t *value, int bytes)
+{
+	unsigned char p[8];
+
+	if (backup_read(in, p, bytes))
+		return -EIO;
+	(*value) = backup_get_be(p, bytes);
+	return 0;
+}
+
+static int backup_read_string(FILE *in, char *str, size_t size)
+{
+	size_t i;
+	int c;
+
+	for (i = 0; i < size; i++) {
+		c = getc(in);
+		if (c == EOF)
+			return -EIO;
+		str[i] = c;
+		if (!c)
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/**
+ * backup_read_path
+ *
+ * Paths in a delta must stay below the directory it is applied to
+ */
+static int backup_read_path(FILE *in, char *path, size_t size)
+{
+	size_t len;
+	int rc;
+
+	rc = backup_read_string(in, path, size);
+	if (rc)
+		return rc;
+	len = strlen(path);
+	if (!len || path[0] == '/' || !strcmp(path, "..")
+	    || !strncmp(path, "../", 3) || strstr(path, "/../")
+	    || (len >= 3 && !strcmp(&path[len - 3], "/..")))
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * backup_make_parents
+ *
+ * Parents that the delta creates come before their children; this
+ * only matters when a file shows up in a directory that was pruned
+ */
+static int backup_make_parents(int root_fd, char *path)
+{
+	char *slash;
+
+	for (slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdirat(root_fd, path, S_IRWXU) && errno != EEXIST) {
+			*slash = '/';
+			return -errno;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+static int backup_apply_file(FILE *in, int root_fd, char *path, char *buf)
+{
+	uint64_t size, mode, mtime_sec, mtime_nsec, header_size, meta_len;
+	uint64_t num_changed, i;
+	struct timespec times[2];
+	int fd;
+	int rc;
+
+	rc = backup_read_be(in, &size, 8);
+	if (!rc)
+		rc = backup_read_be(in, &mode, 4);
+	if (!rc)
+		rc = backup_read_be(in, &mtime_sec, 8);
+	if (!rc)
+		rc = backup_read_be(in, &mtime_nsec, 4);
+	if (!rc)
+		rc = backup_read_be(in, &header_size, 4);
+	if (!rc)
+		rc = backup_read_be(in, &meta_len, 4);
+	if (rc)
+		return rc;
+	if (meta_len > (ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE * 2))
+		return -EINVAL;
+	rc = backup_read(in, buf, meta_len);
+	if (!rc)
+		rc = backup_read_be(in, &num_changed, 8);
+	if (rc)
+		return rc;
+	rc = backup_make_parents(root_fd, path);
+	if (rc)
+		return rc;
+	fd = openat(root_fd, path, O_WRONLY | O_CREAT | O_NOFOLLOW,
+		    S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return -errno;
+	if (header_size) {
+		if (pwrite(fd, buf, meta_len, 0) != (ssize_t)meta_len)
+			rc = -EIO;
+	} else if (meta_len && fsetxattr(fd, ECRYPTFS_XATTR_NAME, buf,
+					 meta_len, 0))
+		rc = -errno;
+	if (!rc && ftruncate(fd, size))
+		rc = -errno;
+	for (i = 0; !rc && i < num_changed; i++) {
+		uint64_t index, len;
+
+		rc = backup_read_be(in, &index, 8);
+		if (!rc)
+			rc = backup_read_be(in, &len, 4);
+		if (!rc && len > ECRYPTFS_DEFAULT_EXTENT_SIZE)
+			rc = -EINVAL;
+		if (!rc)
+			rc = backup_read(in, buf, len);
+		if (!rc && pwrite(fd, buf, len, (header_size + (index
+				  * ECRYPTFS_DEFAULT_EXTENT_SIZE)))
+		    != (ssize_t)len)
+			rc = -EIO;
+	}
+	if (!rc && fchmod(fd, mode))
+		rc = -errno;
+	times[0].tv_sec = mtime_sec;
+	times[0].tv_nsec = mtime_nsec;
+	times[1] = times[0];
+	if (!rc && futimens(fd, times))
+		rc = -errno;
+	close(fd);
+	return rc;
+}
+
+static int backup_apply_other(FILE *in, int root_fd, char type, char *path,
+			      char *buf)
+{
+	uint64_t size, mode, mtime_sec, mtime_nsec;
+	int rc;
+
+	if (type == BACKUP_TYPE_DELETE) {
+		if (unlinkat(root_fd, path, 0) && errno == EISDIR)
+			unlinkat(root_fd, path, AT_REMOVEDIR);
+		return 0;
+	}
+	rc = backup_make_parents(root_fd, path);
+	if (rc)
+		return rc;
+	if (type == BACKUP_TYPE_SYMLINK) {
+		rc = backup_read_string(in, buf, PATH_MAX);
+		if (rc)
+			return rc;
+		unlinkat(root_fd, path, 0);
+		if (symlinkat(buf, root_fd, path))
+			return -errno;
+		return 0;
+	}
+	rc = backup_read_be(in, &size, 8);
+	if (!rc)
+		rc = backup_read_be(in, &mode, 4);
+	if (!rc)
+		rc = backup_read_be(in, &mtime_sec, 8);
+	if (!rc)
+		rc = backup_read_be(in, &mtime_nsec, 4);
+	if (rc)
+		return rc;
+	if (mkdirat(root_fd, path, S_IRWXU) && errno != EEXIST)
+		return -errno;
+	if (fchmodat(root_fd, path, mode, 0))
+		return -errno;
+	return 0;
+}
+
+/**
+ * backup_apply
+ *
+ * Deltas are applied in the order they were written, on top of the
+ * tree the first, full, delta created.
+ */
+static int backup_apply(const char *root, const char *delta_path)
+{
+	char magic[sizeof(BACKUP_DELTA_MAGIC) - 1];
+	char path[PATH_MAX];
+	uint64_t records = 0;
+	FILE *in = stdin;
+	char *buf;
+	int root_fd;
+	int rc = 0;
+
+	buf = malloc(PATH_MAX + (ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE * 2));
+	if (!buf)
+		return -ENOMEM;
+	if (delta_path) {
+		in = fopen(delta_path, "r");
+		if (!in) {
+			rc = -errno;
+			fprintf(stderr, "Error opening [%s]: %m\n", delta_path);
+			goto out;
+		}
+	}
+	root_fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (root_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", root);
+		goto out;
+	}
+	if (backup_read(in, magic, sizeof(magic))
+	    || memcmp(magic, BACKUP_DELTA_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "Not an eCryptfs delta\n");
+		rc = -EINVAL;
+		goto out_close;
+	}
+	for (;;) {
+		int type = getc(in);
+
+		if (type == BACKUP_TYPE_END)
+			break;
+		if (type == EOF) {
+			fprintf(stderr, "The delta is incomplete\n");
+			rc = -EIO;
+			break;
+		}
+		rc = backup_read_path(in, path, sizeof(path));
+		if (rc) {
+			fprintf(stderr, "Bad path in the delta\n");
+			break;
+		}
+		if (type == BACKUP_TYPE_FILE)
+			rc = backup_apply_file(in, root_fd, path, buf);
+		else if (type == BACKUP_TYPE_DIR || type == BACKUP_TYPE_SYMLINK
+			 || type == BACKUP_TYPE_DELETE)
+			rc = backup_apply_other(in, root_fd, type, path, buf);
+		else
+			rc = -EINVAL;
+		if (rc) {
+			fprintf(stderr, "Error applying [%s]; rc = [%d]\n",
+				path, rc);
+			break;
+		}
+		records++;
+	}
+	fprintf(stderr, "Applied: [%llu]\n", (unsigned long long)records);
+out_close:
+	close(root_fd);
+out:
+	if (in && in != stdin)
+		fclose(in);
+	free(buf);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct backup_totals sum;
+	struct ecryptfs_walk walk;
+	struct backup bk;
+	char *manifest_path = NULL;
+	char *new_manifest_path = NULL;
+	char *delta_path = NULL;
+	char *apply_root = NULL;
+	char end = BACKUP_TYPE_END;
+	uint64_t deleted = 0;
+	int num_threads = 0;
+	char *root;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&bk, 0, sizeof(bk));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	pthread_mutex_init(&bk.manifest_lock, NULL);
+	pthread_mutex_init(&bk.delta_lock, NULL);
+	while ((c = getopt(argc, argv, "m:o:t:ca:h")) != -1) {
+		switch (c) {
+		case 'm':
+			manifest_path = optarg;
+			break;
+		case 'o':
+			delta_path = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'c':
+			bk.all = 1;
+			break;
+		case 'a':
+			apply_root = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (apply_root) {
+		if ((argc - optind) > 1) {
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+		rc = backup_apply(apply_root, (optind < argc) ? argv[optind]
+				  : NULL);
+		goto out;
+	}
+	if (optind != (argc - 1) || !manifest_path || num_threads < 0) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	root = argv[optind];
+	while (strlen(root) > 1 && root[strlen(root) - 1] == '/')
+		root[strlen(root) - 1] = '\0';
+	bk.root_len = strlen(root);
+	NSS_NoDB_Init(NULL);
+	rc = backup_load_manifest(&bk.old, manifest_path);
+	if (rc) {
+		fprintf(stderr, "Error reading manifest [%s]; rc = [%d]\n",
+			manifest_path, rc);
+		goto out;
+	}
+	if (asprintf(&new_manifest_path, "%s.new", manifest_path) == -1) {
+		new_manifest_path = NULL;
+		rc = -ENOMEM;
+		goto out;
+	}
+	bk.manifest = fopen(new_manifest_path, "w");
+	if (!bk.manifest) {
+		rc = -errno;
+		fprintf(stderr, "Error creating [%s]: %m\n", new_manifest_path);
+		goto out;
+	}
+	bk.delta = delta_path ? fopen(delta_path, "w") : stdout;
+	if (!bk.delta) {
+		rc = -errno;
+		fprintf(stderr, "Error creating [%s]: %m\n", delta_path);
+		goto out;
+	}
+	fputs(BACKUP_MANIFEST_MAGIC, bk.manifest);
+	fputs(BACKUP_DELTA_MAGIC, bk.delta);
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	bk.workers = calloc(num_threads, sizeof(*bk.workers));
+	if (!bk.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		bk.workers[i].buf = malloc(BACKUP_BATCH_EXTENTS
+					   * ECRYPTFS_DEFAULT_EXTENT_SIZE);
+		if (!bk.workers[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	walk.num_threads = num_threads;
+	walk.flags = (ECRYPTFS_WALK_DIRS | ECRYPTFS_WALK_XDEV);
+	walk.fn = backup_visit;
+	walk.priv = &bk;
+	rc = ecryptfs_walk_tree(&walk, root);
+	if (rc)
+		fprintf(stderr, "Error walking [%s]; rc = [%d]\n", root, rc);
+	for (i = 0; i < num_threads; i++) {
+		struct backup_totals *t = &bk.workers[i].totals;
+
+		backup_flush_manifest(&bk, &bk.workers[i]);
+		sum.unchanged += t->unchanged;
+		sum.changed += t->changed;
+		sum.added += t->added;
+		sum.extents += t->extents;
+		sum.extents_sent += t->extents_sent;
+		sum.bytes_sent += t->bytes_sent;
+		sum.failed += t->failed;
+	}
+	/* A failed walk leaves paths unseen that still exist */
+	if (!rc && !walk.num_errors)
+		rc = backup_send_deletes(&bk, &deleted);
+	if (!rc)
+		rc = backup_delta_write(&bk, &end, 1);
+	if (!rc)
+		rc = bk.write_error;
+	fprintf(stderr, "Unchanged: [%llu]\n",
+		(unsigned long long)sum.unchanged);
+	fprintf(stderr, "Changed: [%llu]\n", (unsigned long long)sum.changed);
+	fprintf(stderr, "New: [%llu]\n", (unsigned long long)sum.added);
+	fprintf(stderr, "Deleted: [%llu]\n", (unsigned long long)deleted);
+	fprintf(stderr, "Failed: [%llu]\n", (unsigned long long)sum.failed);
+	fprintf(stderr, "Extents sent: [%llu/%llu]; delta bytes: [%llu]\n",
+		(unsigned long long)sum.extents_sent,
+		(unsigned long long)sum.extents,
+		(unsigned long long)sum.bytes_sent);
+	if (!rc && (sum.failed || walk.num_errors))
+		rc = -EIO;
+	if (!rc)
+		rc = backup_commit_manifest(&bk, manifest_path,
+					    new_manifest_path);
+	if (rc)
+		fprintf(stderr, "Manifest [%s] not updated\n", manifest_path);
+out:
+	if (bk.workers) {
+		for (i = 0; i < num_threads; i++) {
+			free(bk.workers[i].buf);
+			free(bk.workers[i].hashes);
+			free(bk.workers[i].changed);
+			free(bk.workers[i].manifest.data);
+			free(bk.workers[i].delta.data);
+		}
+		free(bk.workers);
+	}
+	if (bk.manifest) {
+		fclose(bk.manifest);
+		if (rc)
+			unlink(new_manifest_path);
+	}
+	if (bk.delta && bk.delta != stdout)
+		fclose(bk.delta);
+	if (bk.old.map)
+		munmap(bk.old.map, bk.old.size);
+	free(bk.old.entries);
+	free(new_manifest_path);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,480 @@
+/**
+ * ecryptfs-cat: Decrypt an eCryptfs lower file to stdout without
+ * mounting anything
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+
+/* Extents per unit of work handed to a decryption thread */
+#define CAT_DEFAULT_BATCH_EXTENTS 64
+/* Batches in flight between the reader and the writer, per thread */
+#define CAT_DEFAULT_DEPTH_PER_THREAD 2
+#define CAT_MAX_THREADS 256
+
+enum cat_slot_state {
+	CAT_SLOT_EMPTY,
+	CAT_SLOT_READ,
+	CAT_SLOT_DECRYPTING,
+	CAT_SLOT_DONE
+};
+
+/**
+ * struct cat_slot - One batch of extents moving through the pipeline
+ * @seq: Batch number; batch N holds extents [N * batch, (N + 1) * batch)
+ * @num_extents: Number of extents in this batch
+ * @buf: Ciphertext after the read, plaintext once decrypted in place
+ */
+struct cat_slot {
+	enum cat_slot_state state;
+	uint64_t seq;
+	size_t num_extents;
+	char *buf;
+};
+
+/**
+ * struct cat_pipeline - State shared by the reader, workers and writer
+ * @slots: Ring of @depth batches; batch N always lives in slot N % depth
+ * @next_decrypt: Lowest batch number not yet claimed by a worker
+ * @num_batches: Total number of batches in the file
+ * @rc: First error hit by any thread; stops the pipeline
+ *
+ * The reader fills slots in order, any worker decrypts any read slot,
+ * and the writer drains slots in order. A single lock covers the slot
+ * states; with batches of CAT_DEFAULT_BATCH_EXTENTS extents it is taken
+ * a handful of times per quarter megabyte.
+ */
+struct cat_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct cat_slot *slots;
+	size_t depth;
+	size_t batch_extents;
+	uint64_t next_decrypt;
+	uint64_t num_batches;
+	int rc;
+	int lower_fd;
+	int out_fd;
+	uint64_t header_size;
+	size_t extent_size;
+	uint64_t file_size;
+	uint8_t cipher_code;
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	size_t key_size;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-w <wrapped-passphrase-file>] [-t <threads>] "
+		"[-b <extents>] [-q <batches>] <lower-file>\n\n"
+		"Decrypts an eCryptfs lower file and writes the plaintext to "
+		"stdout.\n"
+		"The mount passphrase, or with -w the wrapping passphrase, "
+		"is read from stdin.\n\n"
+		"  -w  Unwrap the mount passphrase from this file\n"
+		"  -t  Number of decryption threads (default: online CPUs)\n"
+		"  -b  Extents per batch (default %d)\n"
+		"  -q  Batches in flight (default %d per thread)\n",
+		name, CAT_DEFAULT_BATCH_EXTENTS,
+		CAT_DEFAULT_DEPTH_PER_THREAD);
+}
+
+static void cat_set_error(struct cat_pipeline *p, int rc)
+{
+	pthread_mutex_lock(&p->lock);
+	if (!p->rc)
+		p->rc = rc;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *cat_worker_fn(void *arg)
+{
+	struct cat_pipeline *p = arg;
+	struct ecryptfs_extent_ctx *ctx = NULL;
+	int rc;
+
+	rc = ecryptfs_extent_ctx_create(&ctx, p->cipher_code, p->fek,
+					p->key_size, p->extent_size);
+	if (rc) {
+		cat_set_error(p, rc);
+		return NULL;
+	}
+	pthread_mutex_lock(&p->lock);
+	while (!p->rc && p->next_decrypt < p->num_batches) {
+		struct cat_slot *slot;
+		uint64_t seq = p->next_decrypt;
+		uint64_t first;
+		size_t i;
+
+		slot = &p->slots[seq % p->depth];
+		if (slot->state != CAT_SLOT_READ || slot->seq != seq) {
+			pthread_cond_wait(&p->cond, &p->lock);
+			continue;
+		}
+		slot->state = CAT_SLOT_DECRYPTING;
+		p->next_decrypt++;
+		pthread_mutex_unlock(&p->lock);
+		first = (seq * p->batch_extents);
+		for (i = 0; i < slot->num_extents; i++) {
+			char *extent = &slot->buf[i * p->extent_size];
+
+			rc = ecryptfs_decrypt_extent(ctx, extent, extent,
+						     first + i);
+			if (rc)
+				break;
+		}
+		pthread_mutex_lock(&p->lock);
+		if (rc && !p->rc)
+			p->rc = rc;
+		slot->state = CAT_SLOT_DONE;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	ecryptfs_extent_ctx_destroy(ctx);
+	return NULL;
+}
+
+static int cat_write_all(int fd, const char *buf, size_t size)
+{
+	while (size) {
+		ssize_t written = write(fd, buf, size);
+
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += written;
+		size -= written;
+	}
+	return 0;
+}
+
+static void *cat_writer_fn(void *arg)
+{
+	struct cat_pipeline *p = arg;
+	uint64_t batch_bytes = ((uint64_t)p->batch_extents * p->extent_size);
+	uint64_t seq;
+	int rc = 0;
+
+	for (seq = 0; seq < p->num_batches; seq++) {
+		struct cat_slot *slot = &p->slots[seq % p->depth];
+		uint64_t offset = (seq * batch_bytes);
+		uint64_t size;
+
+		pthread_mutex_lock(&p->lock);
+		while (!p->rc && (slot->state != CAT_SLOT_DONE
+				  || slot->seq != seq))
+			pthread_cond_wait(&p->cond, &p->lock);
+		rc = p->rc;
+		pthread_mutex_unlock(&p->lock);
+		if (rc)
+			break;
+		/* The last extent is zero padded past the end of the file */
+		size = ((uint64_t)slot->num_extents * p->extent_size);
+		if (offset + size > p->file_size)
+			size = (p->file_size - offset);
+		rc = cat_write_all(p->out_fd, slot->buf, size);
+		if (rc) {
+			cat_set_error(p, rc);
+			break;
+		}
+		pthread_mutex_lock(&p->lock);
+		slot->state = CAT_SLOT_EMPTY;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/**
+ * cat_read_batches
+ * @p: Pipeline
+ *
+ * Runs on the main thread. Reads stay up to @depth batches ahead of the
+ * writer, and the kernel is told the access is sequential so that its
+ * own readahead runs ahead of that.
+ */
+static int cat_read_batches(struct cat_pipeline *p)
+{
+	uint64_t num_extents = (p->file_size / p->extent_size)
+		+ ((p->file_size % p->extent_size) ? 1 : 0);
+	uint64_t seq;
+	int rc = 0;
+
+	posix_fadvise(p->lower_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (seq = 0; seq < p->num_batches; seq++) {
+		struct cat_slot *slot = &p->slots[seq % p->depth];
+		uint64_t first = (seq * p->batch_extents);
+		size_t num = p->batch_extents;
+		size_t size, done = 0;
+		off_t offset;
+
+		if (first + num > num_extents)
+			num = (num_extents - first);
+		size = (num * p->extent_size);
+		offset = (p->header_size + first * p->extent_size);
+		pthread_mutex_lock(&p->lock);
+		while (!p->rc && slot->state != CAT_SLOT_EMPTY)
+			pthread_cond_wait(&p->cond, &p->lock);
+		rc = p->rc;
+		pthread_mutex_unlock(&p->lock);
+		if (rc)
+			break;
+		while (done < size) {
+			ssize_t n = pread(p->lower_fd, &slot->buf[done],
+					  (size - done), (offset + done));
+
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				rc = (n == -1) ? -errno : -EIO;
+				break;
+			}
+			done += n;
+		}
+		if (rc) {
+			if (rc == -EIO)
+				fprintf(stderr, "Lower file is shorter than its "
+					"header says it should be\n");
+			cat_set_error(p, rc);
+			break;
+		}
+		pthread_mutex_lock(&p->lock);
+		slot->seq = seq;
+		slot->num_extents = num;
+		slot->state = CAT_SLOT_READ;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return rc;
+}
+
+/**
+ * cat_run
+ * @p: Pipeline, with the key and file geometry filled in
+ * @num_threads: Number of decryption threads
+ */
+static int cat_run(struct cat_pipeline *p, int num_threads)
+{
+	pthread_t *workers;
+	pthread_t writer;
+	int started = 0;
+	int writer_started = 0;
+	size_t i;
+	int rc = 0;
+
+	p->num_batches = ((p->file_size + p->extent_size - 1)
+			  / p->extent_size + p->batch_extents - 1)
+		/ p->batch_extents;
+	if (!p->num_batches)
+		return 0;
+	workers = calloc(num_threads, sizeof(pthread_t));
+	p->slots = calloc(p->depth, sizeof(struct cat_slot));
+	if (!workers || !p->slots) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < p->depth; i++) {
+		p->slots[i].buf = malloc(p->batch_extents * p->extent_size);
+		if (!p->slots[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	for (started = 0; started < num_threads; started++) {
+		rc = pthread_create(&workers[started], NULL, cat_worker_fn, p);
+		if (rc) {
+			rc = -rc;
+			break;
+		}
+	}
+	if (!rc) {
+		rc = pthread_create(&writer, NULL, cat_writer_fn, p);
+		if (rc)
+			rc = -rc;
+		else
+			writer_started = 1;
+	}
+	if (rc)
+		cat_set_error(p, rc);
+	else
+		cat_read_batches(p);
+	if (writer_started)
+		pthread_join(writer, NULL);
+	/* Wake workers waiting on batches that will never be read */
+	pthread_mutex_lock(&p->lock);
+	p->next_decrypt = p->num_batches;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	for (i = 0; i < (size_t)started; i++)
+		pthread_join(workers[i], NULL);
+	rc = p->rc;
+out:
+	if (p->slots)
+		for (i = 0; i < p->depth; i++) {
+			if (!p->slots[i].buf)
+				continue;
+			memset(p->slots[i].buf, 0,
+			       p->batch_extents * p->extent_size);
+			free(p->slots[i].buf);
+		}
+	free(p->slots);
+	p->slots = NULL;
+	free(workers);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	struct cat_pipeline p;
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	char *header = NULL;
+	char *wrapped_file = NULL;
+	char *path;
+	int num_threads = 0;
+	long depth = 0;
+	long batch = CAT_DEFAULT_BATCH_EXTENTS;
+	int lock_init = 0;
+	int c;
+	int rc = 0;
+
+	memset(&p, 0, sizeof(p));
+	memset(passphrase, 0, sizeof(passphrase));
+	p.lower_fd = -1;
+	p.out_fd = STDOUT_FILENO;
+	while ((c = getopt(argc, argv, "w:t:b:q:h")) != -1) {
+		switch (c) {
+		case 'w':
+			wrapped_file = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'b':
+			batch = atol(optarg);
+			break;
+		case 'q':
+			depth = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (optind != (argc - 1) || num_threads < 0
+	    || num_threads > CAT_MAX_THREADS || batch <= 0 || depth < 0) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	path = argv[optind];
+	if (!num_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		num_threads = (cpus > 0) ? cpus : 1;
+		if (num_threads > CAT_MAX_THREADS)
+			num_threads = CAT_MAX_THREADS;
+	}
+	if (!depth)
+		depth = (num_threads * CAT_DEFAULT_DEPTH_PER_THREAD) + 1;
+	p.lower_fd = open(path, O_RDONLY);
+	if (p.lower_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", path);
+		goto out;
+	}
+	header = malloc(ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE);
+	if (!header) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memset(&crypt_stat, 0, sizeof(crypt_stat));
+	rc = ecryptfs_read_lower_metadata(p.lower_fd, header,
+					  ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE,
+					  &crypt_stat, &packet_set,
+					  &p.header_size);
+	if (rc) {
+		fprintf(stderr, "[%s] does not have a valid eCryptfs header\n",
+			path);
+		goto out;
+	}
+	if (!(crypt_stat.flags & ECRYPTFS_ENCRYPTED)) {
+		fprintf(stderr, "[%s] is not marked as encrypted\n", path);
+		rc = -EINVAL;
+		goto out;
+	}
+	rc = ecryptfs_utils_get_passphrase(passphrase, wrapped_file, NULL);
+	if (rc)
+		goto out;
+	rc = ecryptfs_find_fek_with_passphrase(p.fek, &p.key_size,
+					       &packet_set, passphrase);
+	if (rc == -ENOKEY) {
+		fprintf(stderr, "The passphrase does not match any key that "
+			"[%s] is encrypted under\n", path);
+		goto out;
+	} else if (rc) {
+		fprintf(stderr, "Error recovering the file encryption key of "
+			"[%s]; cipher [%s]; rc = [%d]\n", path,
+			ecryptfs_cipher_code_to_string(packet_set.cipher_code),
+			rc);
+		goto out;
+	}
+	p.cipher_code = packet_set.cipher_code;
+	/* The kernel does not record the extent size; it is always the
+	 * default */
+	p.extent_size = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	p.file_size = crypt_stat.file_size;
+	p.batch_extents = batch;
+	p.depth = depth;
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	lock_init = 1;
+	rc = cat_run(&p, num_threads);
+	if (rc)
+		fprintf(stderr, "Error decrypting [%s]; rc = [%d]\n", path, rc);
+out:
+	if (lock_init) {
+		pthread_cond_destroy(&p.cond);
+		pthread_mutex_destroy(&p.lock);
+	}
+	memset(passphrase, 0, sizeof(passphrase));
+	memset(p.fek, 0, sizeof(p.fek));
+	free(header);
+	if (p.lower_fd != -1)
+		close(p.lower_fd);
+	return rc ? 1 : 0;
+}
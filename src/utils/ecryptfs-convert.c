@@ -0,0 +1,570 @@
+/**
+ * ecryptfs-convert: Move the metadata of every file in a lower tree
+ * between the header extent and the user.ecryptfs xattr
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+/* Offset of the flag vector in the metadata */
+#define CONVERT_FLAGS_OFFSET (ECRYPTFS_FILE_SIZE_BYTES \
+			      + MAGIC_ECRYPTFS_MARKER_SIZE_BYTES)
+#define CONVERT_FLAG_XATTR 0x00000004
+#define CONVERT_BUF_SIZE (1024 * 1024)
+/* Converted files whose temporary copies are synced together before
+ * any of them is renamed into place */
+#define CONVERT_BATCH 64
+#define CONVERT_TEMP_TRIES 100
+/* Temporary copies get a name of their own, whatever the length of the
+ * original; the pending entry maps each back to its original */
+#define CONVERT_TEMP_PREFIX ".ecryptfs-convert."
+
+struct convert_totals {
+	uint64_t converted;
+	uint64_t already;
+	uint64_t not_ecryptfs;
+	uint64_t linked;
+	uint64_t failed;
+	uint64_t old_bytes;
+	uint64_t new_bytes;
+};
+
+/**
+ * A converted copy waiting for the next sync before it replaces the
+ * original
+ */
+struct convert_pending {
+	char *tmp_path;
+	char *path;
+	struct stat st;
+};
+
+struct convert_worker {
+	struct convert_totals totals;
+	char *buf;
+	unsigned int seed;
+	struct convert_pending pending[CONVERT_BATCH];
+	int num_pending;
+};
+
+/**
+ * struct convert - State shared by every worker
+ * @to_xattr: Direction; header to xattr when set, xattr to header
+ *            otherwise
+ * @dry_run: Only count what would be converted, and the space saved
+ * @sync_fd: Any descriptor on the lower file system, for syncfs()
+ */
+struct convert {
+	int to_xattr;
+	int dry_run;
+	int set_owner;
+	int sync_fd;
+	struct convert_worker *workers;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s -m xattr|header [-t <threads>] [-n] <lower-dir>\n\n"
+		"Moves the metadata of every eCryptfs file under <lower-dir> "
+		"into the\n"
+		"user.ecryptfs xattr, or back into a header extent at the "
+		"front of the\n"
+		"file. The lower directory must not be mounted.\n\n"
+		"  -m  Where the metadata should end up\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -n  Only report what would be converted\n", name);
+}
+
+/**
+ * convert_flush
+ *
+ * Syncs the lower file system once for the whole batch, so that a
+ * crash can never leave a renamed file whose contents did not make it
+ * to disk, then moves each copy over its original. A crash before the
+ * rename leaves the original untouched and a .ecryptfs-convert.XXXXXX
+ * copy that ecryptfs-fsck reports.
+ */
+static void convert_flush(struct convert *cvt, struct convert_worker *w)
+{
+	int i;
+
+	if (!w->num_pending)
+		return;
+	syncfs(cvt->sync_fd);
+	for (i = 0; i < w->num_pending; i++) {
+		struct convert_pending *p = &w->pending[i];
+		struct stat st;
+
+		/* Left alone if something replaced the original meanwhile */
+		if (lstat(p->path, &st) || st.st_ino != p->st.st_ino
+		    || st.st_size != p->st.st_size
+		    || st.st_mtim.tv_sec != p->st.st_mtim.tv_sec
+		    || st.st_mtim.tv_nsec != p->st.st_mtim.tv_nsec) {
+			fprintf(stderr, "[%s] changed while it was being "
+				"converted\n", p->path);
+			unlink(p->tmp_path);
+			w->totals.failed++;
+		} else if (rename(p->tmp_path, p->path)) {
+			fprintf(stderr, "Error renaming [%s] to [%s]: %m\n",
+				p->tmp_path, p->path);
+			unlink(p->tmp_path);
+			w->totals.failed++;
+		} else
+			w->totals.converted++;
+		free(p->tmp_path);
+		free(p->path);
+	}
+	w->num_pending = 0;
+}
+
+/**
+ * convert_copy_data
+ * @from: Offset of the first extent in @src_fd
+ * @to: Offset of the first extent in @fd
+ *
+ * The extents are moved as they are: their IVs derive from the extent
+ * index, not from where they sit in the lower file. copy_file_range()
+ * keeps the data in the kernel, and lets file systems that can share
+ * blocks do so.
+ */
+static int convert_copy_data(struct convert_worker *w, int src_fd, int fd,
+			     off_t from, off_t to, off_t size)
+{
+	off_t done = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < size) {
+		loff_t in = (from + done);
+		loff_t out = (to + done);
+		ssize_t n;
+
+		n = copy_file_range(src_fd, &in, fd, &out, (size - done), 0);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+#endif
+	while (done < size) {
+		size_t want = CONVERT_BUF_SIZE;
+		ssize_t got;
+		ssize_t n;
+
+		if ((uint64_t)(size - done) < want)
+			want = (size - done);
+		got = pread(src_fd, w->buf, want, (from + done));
+		if (got < 0)
+			return -errno;
+		if (!got)
+			return -EIO;
+		n = pwrite(fd, w->buf, got, (to + done));
+		if (n != got)
+			return (n < 0) ? -errno : -EIO;
+		done += got;
+	}
+	return 0;
+}
+
+/**
+ * convert_copy_xattrs
+ *
+ * Everything but the eCryptfs metadata itself, which is written
+ * separately
+ */
+static int convert_copy_xattrs(int src_fd, int fd)
+{
+	char names[4096];
+	char *value = NULL;
+	ssize_t len;
+	ssize_t i;
+	int rc = 0;
+
+	len = flistxattr(src_fd, names, sizeof(names));
+	if (len < 0)
+		return (errno == ENOTSUP) ? 0 : -errno;
+	for (i = 0; i < len; i += (strlen(&names[i]) + 1)) {
+		ssize_t size;
+
+		if (!strcmp(&names[i], ECRYPTFS_XATTR_NAME))
+			continue;
+		size = fgetxattr(src_fd, &names[i], NULL, 0);
+		if (size < 0) {
+			rc = -errno;
+			goto out;
+		}
+		free(value);
+		value = malloc(size ? size : 1);
+		if (!value) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		size = fgetxattr(src_fd, &names[i], value, size);
+		if (size < 0 || fsetxattr(fd, &names[i], value, size, 0)) {
+			rc = -errno;
+			goto out;
+		}
+	}
+out:
+	free(value);
+	return rc;
+}
+
+static int convert_temp(struct convert_worker *w, struct ecryptfs_walk_entry
+			*entry, char *tmp, size_t tmp_size)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	int fd;
+	int i;
+	int j;
+
+	for (i = 0; i < CONVERT_TEMP_TRIES; i++) {
+		size_t len = snprintf(tmp, tmp_size, "%s",
+				      CONVERT_TEMP_PREFIX);
+
+		for (j = 0; j < 6; j++)
+			tmp[len + j] = chars[rand_r(&w->seed)
+					     % (sizeof(chars) - 1)];
+		tmp[len + 6] = '\0';
+		fd = openat(entry->dirfd, tmp, O_RDWR | O_CREAT | O_EXCL
+			    | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+		if (fd != -1)
+			return fd;
+		if (errno != EEXIST)
+			return -errno;
+	}
+	return -EEXIST;
+}
+
+enum convert_result {
+	CONVERT_QUEUED,
+	CONVERT_ALREADY,
+	CONVERT_NOT_ECRYPTFS,
+	CONVERT_LINKED,
+	CONVERT_FAILED
+};
+
+/**
+ * convert_file
+ *
+ * Writes the file in its new layout to a temporary file beside it and
+ * queues that to replace it. Only the metadata is rewritten; the flag
+ * vector says where it lives, and the kernel checks that against where
+ * it finds it.
+ */
+static enum convert_result convert_file(struct convert *cvt,
+					struct convert_worker *w,
+					struct ecryptfs_walk_entry *entry,
+					int src_fd, struct stat *st)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	char meta[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE];
+	char tmp[NAME_MAX + 1];
+	struct convert_pending *p;
+	struct timespec times[2];
+	uint64_t header_size;
+	uint64_t new_header_size;
+	size_t meta_size;
+	size_t dir_len;
+	uint32_t flags;
+	off_t data_size;
+	int fd = -1;
+	int rc;
+
+	memset(meta, 0, sizeof(meta));
+	if (ecryptfs_read_lower_metadata(src_fd, meta, sizeof(meta),
+					 &crypt_stat, &packet_set,
+					 &header_size))
+		return CONVERT_NOT_ECRYPTFS;
+	if ((header_size == 0) == cvt->to_xattr)
+		return CONVERT_ALREADY;
+	if ((uint64_t)st->st_size < header_size) {
+		fprintf(stderr, "[%s] is shorter than its header\n",
+			entry->path);
+		return CONVERT_FAILED;
+	}
+	/* Converting one name of a hard-linked file would split it */
+	if (st->st_nlink > 1)
+		return CONVERT_LINKED;
+	meta_size = (ECRYPTFS_HEADER_METADATA_BYTES + packet_set.size);
+	memcpy(&flags, &meta[CONVERT_FLAGS_OFFSET], sizeof(flags));
+	flags = ntohl(flags);
+	if (cvt->to_xattr) {
+		flags |= CONVERT_FLAG_XATTR;
+		new_header_size = 0;
+	} else {
+		flags &= ~CONVERT_FLAG_XATTR;
+		new_header_size = crypt_stat.num_header_bytes_at_front;
+		if (new_header_size < ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE)
+			new_header_size = ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE;
+		memset(&meta[meta_size], 0, (sizeof(meta) - meta_size));
+	}
+	flags = htonl(flags);
+	memcpy(&meta[CONVERT_FLAGS_OFFSET], &flags, sizeof(flags));
+	data_size = (st->st_size - header_size);
+	w->totals.old_bytes += st->st_size;
+	w->totals.new_bytes += (new_header_size + data_size);
+	if (cvt->dry_run)
+		return CONVERT_QUEUED;
+	fd = convert_temp(w, entry, tmp, sizeof(tmp));
+	if (fd < 0) {
+		rc = fd;
+		fd = -1;
+		goto out;
+	}
+	if (cvt->to_xattr)
+		rc = fsetxattr(fd, ECRYPTFS_XATTR_NAME, meta, meta_size,
+			       XATTR_CREATE) ? -errno : 0;
+	else {
+		/* The metadata fits in the first extent; the rest of the
+		 * header is left a hole, which reads as the zeros the
+		 * kernel would have written */
+		rc = 0;
+		if (pwrite(fd, meta, ECRYPTFS_DEFAULT_EXTENT_SIZE, 0)
+		    != ECRYPTFS_DEFAULT_EXTENT_SIZE
+		    || ftruncate(fd, new_header_size))
+			rc = -EIO;
+	}
+	if (rc)
+		goto out_unlink;
+	rc = convert_copy_data(w, src_fd, fd, header_size, new_header_size,
+			       data_size);
+	if (rc)
+		goto out_unlink;
+	rc = convert_copy_xattrs(src_fd, fd);
+	if (rc)
+		goto out_unlink;
+	if (cvt->set_owner && fchown(fd, st->st_uid, st->st_gid)) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	if (fchmod(fd, (st->st_mode & 07777))) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	/* eCryptfs shows the lower times as the upper ones */
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if (futimens(fd, times)) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	p = &w->pending[w->num_pending];
+	p->path = strdup(entry->path);
+	p->tmp_path = malloc(strlen(entry->path) + strlen(tmp) + 1);
+	if (!p->path || !p->tmp_path) {
+		free(p->path);
+		free(p->tmp_path);
+		rc = -ENOMEM;
+		goto out_unlink;
+	}
+	dir_len = (strrchr(entry->path, '/') + 1 - entry->path);
+	memcpy(p->tmp_path, entry->path, dir_len);
+	strcpy(&p->tmp_path[dir_len], tmp);
+	p->st = (*st);
+	w->num_pending++;
+	close(fd);
+	return CONVERT_QUEUED;
+out_unlink:
+	unlinkat(entry->dirfd, tmp, 0);
+out:
+	if (fd != -1)
+		close(fd);
+	fprintf(stderr, "Error converting [%s]; rc = [%d]\n", entry->path,
+		rc);
+	return CONVERT_FAILED;
+}
+
+static int convert_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			 int worker)
+{
+	struct convert *cvt = priv;
+	struct convert_worker *w = &cvt->workers[worker];
+	struct stat st;
+	int fd;
+
+	if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+		return 0;
+	/* Another worker's copy, not yet renamed */
+	if (!strncmp(entry->name, CONVERT_TEMP_PREFIX,
+		     (sizeof(CONVERT_TEMP_PREFIX) - 1)))
+		return 0;
+	fd = openat(entry->dirfd, entry->name,
+		    O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1) {
+		if (errno != ELOOP) {
+			fprintf(stderr, "Error opening [%s]: %m\n",
+				entry->path);
+			w->totals.failed++;
+		}
+		return 0;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	switch (convert_file(cvt, w, entry, fd, &st)) {
+	case CONVERT_QUEUED:
+		if (cvt->dry_run)
+			w->totals.converted++;
+		break;
+	case CONVERT_ALREADY:
+		w->totals.already++;
+		break;
+	case CONVERT_NOT_ECRYPTFS:
+		w->totals.not_ecryptfs++;
+		break;
+	case CONVERT_LINKED:
+		fprintf(stderr, "Not converting [%s]; it has [%lu] hard "
+			"links\n", entry->path, (unsigned long)st.st_nlink);
+		w->totals.linked++;
+		break;
+	default:
+		w->totals.failed++;
+	}
+	close(fd);
+	if (w->num_pending == CONVERT_BATCH)
+		convert_flush(cvt, w);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct convert_totals sum;
+	struct ecryptfs_walk walk;
+	struct convert cvt;
+	char *mode = NULL;
+	int num_threads = 0;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&cvt, 0, sizeof(cvt));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	cvt.sync_fd = -1;
+	while ((c = getopt(argc, argv, "m:t:nh")) != -1) {
+		switch (c) {
+		case 'm':
+			mode = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'n':
+			cvt.dry_run = 1;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (optind != (argc - 1) || !mode || num_threads < 0
+	    || (strcmp(mode, "xattr") && strcmp(mode, "header"))) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	cvt.to_xattr = !strcmp(mode, "xattr");
+	cvt.set_owner = (geteuid() == 0);
+	cvt.sync_fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (cvt.sync_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", argv[optind]);
+		goto out;
+	}
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	cvt.workers = calloc(num_threads, sizeof(*cvt.workers));
+	if (!cvt.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		cvt.workers[i].seed = (unsigned int)(time(NULL) ^ getpid()) + i;
+		cvt.workers[i].buf = malloc(CONVERT_BUF_SIZE);
+		if (!cvt.workers[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	walk.num_threads = num_threads;
+	walk.flags = ECRYPTFS_WALK_XDEV;
+	walk.fn = convert_visit;
+	walk.priv = &cvt;
+	rc = ecryptfs_walk_tree(&walk, argv[optind]);
+	for (i = 0; i < num_threads; i++)
+		convert_flush(&cvt, &cvt.workers[i]);
+	if (rc)
+		fprintf(stderr, "Error walking [%s]; rc = [%d]\n",
+			argv[optind], rc);
+	for (i = 0; i < num_threads; i++) {
+		struct convert_totals *t = &cvt.workers[i].totals;
+
+		sum.converted += t->converted;
+		sum.already += t->already;
+		sum.not_ecryptfs += t->not_ecryptfs;
+		sum.linked += t->linked;
+		sum.failed += t->failed;
+		sum.old_bytes += t->old_bytes;
+		sum.new_bytes += t->new_bytes;
+	}
+	printf("%s: [%llu]\n", cvt.dry_run ? "To convert" : "Converted",
+	       (unsigned long long)sum.converted);
+	printf("Already in the %s: [%llu]\n",
+	       cvt.to_xattr ? "xattr" : "header",
+	       (unsigned long long)sum.already);
+	printf("Not eCryptfs files: [%llu]\n",
+	       (unsigned long long)sum.not_ecryptfs);
+	printf("Hard linked, not converted: [%llu]\n",
+	       (unsigned long long)sum.linked);
+	printf("Failed: [%llu]\n", (unsigned long long)sum.failed);
+	printf("Lower bytes: [%llu] -> [%llu]\n",
+	       (unsigned long long)sum.old_bytes,
+	       (unsigned long long)sum.new_bytes);
+	if (!rc && (sum.failed || walk.num_errors))
+		rc = -EIO;
+out:
+	if (cvt.workers) {
+		for (i = 0; i < num_threads; i++)
+			free(cvt.workers[i].buf);
+		free(cvt.workers);
+	}
+	if (cvt.sync_fd != -1)
+		close(cvt.sync_fd);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,316 @@
+/**
+ * ecryptfs-estimate: Work out how much space a plaintext tree will take
+ * once copied into an eCryptfs mount, and which of its names will not
+ * fit once encrypted
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+/* Exit status when every byte fits but some names do not */
+#define ESTIMATE_EXIT_LONG_NAMES 2
+
+/* Bytes a name takes in a directory block: ext4 keeps an 8 byte
+ * record header and pads the name to 4 bytes */
+#define ESTIMATE_DIRENT_BYTES(len) (8 + (((len) + 3) & ~(size_t)3))
+
+struct estimate_totals {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t symlinks;
+	uint64_t others;
+	uint64_t plaintext_bytes;
+	uint64_t lower_bytes;
+	uint64_t dirent_bytes;
+	uint64_t long_names;
+	uint64_t errors;
+};
+
+/**
+ * struct estimate - State shared by every worker
+ * @header_size: Bytes of metadata in front of every lower file; zero
+ *               with the metadata in the xattr
+ * @block_size: Allocation unit of the file system the lower files go to
+ * @names: Check names against NAME_MAX as encrypted filenames
+ */
+struct estimate {
+	size_t header_size;
+	uint64_t block_size;
+	int names;
+	struct estimate_totals *totals;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-t <threads>] [-x] [-f] [-d <lower-dir>] [-q] <path>\n\n"
+		"Computes the space the files under <path> will take once "
+		"copied into an\n"
+		"eCryptfs mount, from their sizes rather than their current "
+		"disk usage.\n\n"
+		"  -t  Number of scanning threads (default: online CPUs)\n"
+		"  -x  Metadata will be kept in the user.ecryptfs xattr\n"
+		"  -f  Filenames will be encrypted; report every name that "
+		"will not fit\n"
+		"  -d  Directory on the file system the lower files will be "
+		"written to\n"
+		"      (default: <path>)\n"
+		"  -q  Only print the KiB and the inodes needed\n", name);
+}
+
+static uint64_t estimate_round_up(uint64_t size, uint64_t block_size)
+{
+	return (((size + block_size - 1) / block_size) * block_size);
+}
+
+/**
+ * estimate_stat
+ * @st_mode: Set to the file type
+ * @st_size: Set to the file size
+ *
+ * Only the type and the size are asked for; statx() lets the file
+ * system skip the rest, and does not sync with the server on network
+ * file systems.
+ */
+static int estimate_stat(struct ecryptfs_walk_entry *entry, mode_t *st_mode,
+			 uint64_t *st_size)
+{
+#ifdef HAVE_STATX
+	struct statx stx;
+
+	if (!statx(entry->dirfd, entry->name,
+		   (AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT
+		    | AT_STATX_DONT_SYNC), (STATX_TYPE | STATX_SIZE), &stx)) {
+		(*st_mode) = stx.stx_mode;
+		(*st_size) = stx.stx_size;
+		return 0;
+	}
+	if (errno != ENOSYS)
+		return -errno;
+#endif
+	{
+		struct stat st;
+
+		if (fstatat(entry->dirfd, entry->name, &st,
+			    AT_SYMLINK_NOFOLLOW))
+			return -errno;
+		(*st_mode) = st.st_mode;
+		(*st_size) = st.st_size;
+	}
+	return 0;
+}
+
+static int estimate_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			  int worker)
+{
+	struct estimate *est = priv;
+	struct estimate_totals *totals = &est->totals[worker];
+	size_t name_size = strlen(entry->name);
+	mode_t mode = 0;
+	uint64_t size = 0;
+	int rc;
+
+	if (est->names) {
+		size_t lower_size = ecryptfs_encrypted_filename_size(
+			name_size);
+
+		if (lower_size > NAME_MAX) {
+			totals->long_names++;
+			fprintf(stderr, "Name too long to encrypt: [%s]; "
+				"[%zu] bytes\n", entry->path, name_size);
+		}
+		totals->dirent_bytes += ESTIMATE_DIRENT_BYTES(lower_size);
+	} else
+		totals->dirent_bytes += ESTIMATE_DIRENT_BYTES(name_size);
+	switch (entry->d_type) {
+	case DT_DIR:
+		mode = S_IFDIR;
+		break;
+	case DT_LNK:
+		mode = S_IFLNK;
+		break;
+	case DT_REG:
+	case DT_UNKNOWN:
+		rc = estimate_stat(entry, &mode, &size);
+		if (rc) {
+			totals->errors++;
+			fprintf(stderr, "Error reading the size of [%s]; "
+				"rc = [%d]\n", entry->path, rc);
+			return 0;
+		}
+		break;
+	default:
+		mode = 0;
+	}
+	if (S_ISREG(mode)) {
+		totals->files++;
+		totals->plaintext_bytes += size;
+		totals->lower_bytes += estimate_round_up(
+			ecryptfs_upper_size_to_lower_size(
+				est->header_size,
+				ECRYPTFS_DEFAULT_EXTENT_SIZE, size),
+			est->block_size);
+	} else if (S_ISDIR(mode)) {
+		totals->dirs++;
+		totals->lower_bytes += est->block_size;
+	} else if (S_ISLNK(mode)) {
+		/* The encrypted target is too long to live in the inode */
+		totals->symlinks++;
+		totals->lower_bytes += est->block_size;
+	} else
+		totals->others++;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct estimate_totals sum;
+	struct ecryptfs_walk walk;
+	struct estimate est;
+	struct statvfs vfs;
+	char *lower_dir = NULL;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int num_threads = 0;
+	int xattr = 0;
+	int quiet = 0;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&est, 0, sizeof(est));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	while ((c = getopt(argc, argv, "t:xfd:qh")) != -1) {
+		switch (c) {
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'x':
+			xattr = 1;
+			break;
+		case 'f':
+			est.names = 1;
+			break;
+		case 'd':
+			lower_dir = optarg;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	/* The kernel gives the header a whole page when pages are larger
+	 * than the minimum header */
+	if (!xattr)
+		est.header_size = ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE;
+	if (!xattr && page_size > ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE)
+		est.header_size = page_size;
+	if (statvfs(lower_dir ? lower_dir : argv[optind], &vfs)) {
+		rc = -errno;
+		fprintf(stderr, "Error reading the file system of [%s]: %m\n",
+			lower_dir ? lower_dir : argv[optind]);
+		goto out;
+	}
+	est.block_size = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	est.totals = calloc(num_threads, sizeof(*est.totals));
+	if (!est.totals) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	walk.num_threads = num_threads;
+	walk.flags = ECRYPTFS_WALK_DIRS;
+	walk.fn = estimate_visit;
+	walk.priv = &est;
+	rc = ecryptfs_walk_tree(&walk, argv[optind]);
+	if (rc) {
+		fprintf(stderr, "Error scanning [%s]; rc = [%d]\n",
+			argv[optind], rc);
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		struct estimate_totals *t = &est.totals[i];
+
+		sum.files += t->files;
+		sum.dirs += t->dirs;
+		sum.symlinks += t->symlinks;
+		sum.others += t->others;
+		sum.plaintext_bytes += t->plaintext_bytes;
+		sum.lower_bytes += t->lower_bytes;
+		sum.dirent_bytes += t->dirent_bytes;
+		sum.long_names += t->long_names;
+		sum.errors += t->errors;
+	}
+	/* The root directory, and the names; every directory already has
+	 * a block counted, so this errs on the side of too much */
+	sum.lower_bytes += (est.block_size
+			    + estimate_round_up(sum.dirent_bytes,
+						est.block_size));
+	if (quiet)
+		printf("%llu %llu\n",
+		       (unsigned long long)((sum.lower_bytes + 1023) / 1024),
+		       (unsigned long long)(1 + sum.files + sum.dirs
+					    + sum.symlinks + sum.others));
+	else {
+		printf("Files: [%llu]; plaintext bytes: [%llu]\n",
+		       (unsigned long long)sum.files,
+		       (unsigned long long)sum.plaintext_bytes);
+		printf("Directories: [%llu]\n", (unsigned long long)sum.dirs);
+		printf("Symlinks: [%llu]\n", (unsigned long long)sum.symlinks);
+		printf("Other files: [%llu]\n", (unsigned long long)sum.others);
+		printf("Lower bytes needed: [%llu]\n",
+		       (unsigned long long)sum.lower_bytes);
+		printf("Lower inodes needed: [%llu]\n",
+		       (unsigned long long)(1 + sum.files + sum.dirs
+					    + sum.symlinks + sum.others));
+		if (est.names)
+			printf("Names too long to encrypt: [%llu]\n",
+			       (unsigned long long)sum.long_names);
+	}
+	if (sum.errors || walk.num_errors)
+		rc = -EIO;
+out:
+	free(est.totals);
+	if (rc)
+		return 1;
+	return sum.long_names ? ESTIMATE_EXIT_LONG_NAMES : 0;
+}
@@ -0,0 +1,633 @@
+/**
+ * ecryptfs-filename: Translate between encrypted lower filenames and
+ * their plaintext without a mount, optionally keeping a per-directory
+ * index of the translations
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+
+#define INDEX_MAGIC "ecryptfs-filename-index 1"
+/* Names decrypted per ecryptfs_decrypt_filenames() call */
+#define FILENAME_BATCH 1024
+
+/**
+ * struct name_index - Translations for the entries of one directory
+ * @mtime: Directory modification time the index was built at
+ * @buf: Backing store for every name, as "lower\0upper\0" records
+ * @lower, @upper: Open addressed tables of entry numbers plus one,
+ *                 keyed by the lower and the upper name
+ */
+struct name_index {
+	struct timespec mtime;
+	char *buf;
+	size_t buf_size;
+	size_t buf_len;
+	struct name_entry {
+		size_t lower;
+		size_t upper;
+	} *entries;
+	size_t num_entries;
+	size_t max_entries;
+	uint32_t *lower;
+	uint32_t *upper;
+	size_t mask;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-w <wrapped-passphrase-file>] [-k <key-bytes>] "
+		"<name>...\n"
+		"%s [-w <wrapped-passphrase-file>] [-k <key-bytes>] "
+		"[-I <index-dir>] -l <lower-dir> [<name>...]\n\n"
+		"Decrypts ECRYPTFS_FNEK_ENCRYPTED. names and paths, and "
+		"encrypts plaintext ones.\n"
+		"With -l, lists <lower-dir> as lower and upper name pairs, or "
+		"only the entries\n"
+		"matching a given lower or upper <name>.\n"
+		"The mount passphrase, or with -w the wrapping passphrase, "
+		"is read from stdin.\n\n"
+		"  -k  Filename key size in bytes (default 16)\n"
+		"  -l  Lower directory to list\n"
+		"  -I  Keep an index of every listed directory here, and only "
+		"decrypt names\n"
+		"      that are new since the directory last changed\n"
+		"  -w  Unwrap the mount passphrase from this file\n",
+		name, name);
+}
+
+static size_t index_hash(const char *name)
+{
+	size_t hash = 5381;
+
+	while (*name)
+		hash = ((hash << 5) + hash) + (unsigned char)*name++;
+	return hash;
+}
+
+static void index_free(struct name_index *index)
+{
+	free(index->buf);
+	free(index->entries);
+	free(index->lower);
+	free(index->upper);
+	memset(index, 0, sizeof(*index));
+}
+
+static void index_insert(struct name_index *index, size_t i)
+{
+	size_t slot;
+
+	slot = (index_hash(&index->buf[index->entries[i].lower])
+		& index->mask);
+	while (index->lower[slot])
+		slot = ((slot + 1) & index->mask);
+	index->lower[slot] = (i + 1);
+	slot = (index_hash(&index->buf[index->entries[i].upper])
+		& index->mask);
+	while (index->upper[slot])
+		slot = ((slot + 1) & index->mask);
+	index->upper[slot] = (i + 1);
+}
+
+/**
+ * index_rehash
+ *
+ * Keeps both tables at most half full
+ */
+static int index_rehash(struct name_index *index, size_t num_entries)
+{
+	size_t size = 64;
+	size_t i;
+
+	while (size < (num_entries * 2))
+		size <<= 1;
+	free(index->lower);
+	free(index->upper);
+	index->lower = calloc(size, sizeof(uint32_t));
+	index->upper = calloc(size, sizeof(uint32_t));
+	if (!index->lower || !index->upper)
+		return -ENOMEM;
+	index->mask = (size - 1);
+	for (i = 0; i < index->num_entries; i++)
+		index_insert(index, i);
+	return 0;
+}
+
+static int index_add(struct name_index *index, const char *lower,
+		     const char *upper)
+{
+	size_t lower_len = (strlen(lower) + 1);
+	size_t upper_len = (strlen(upper) + 1);
+	struct name_entry *entry;
+	int rc;
+
+	if ((index->buf_len + lower_len + upper_len) > index->buf_size) {
+		size_t size = ((index->buf_size + lower_len + upper_len) * 2);
+		char *buf = realloc(index->buf, size);
+
+		if (!buf)
+			return -ENOMEM;
+		index->buf = buf;
+		index->buf_size = size;
+	}
+	if (index->num_entries == index->max_entries) {
+		size_t max = (index->max_entries ? (index->max_entries * 2)
+			      : 64);
+		struct name_entry *entries;
+
+		entries = realloc(index->entries, (max * sizeof(*entries)));
+		if (!entries)
+			return -ENOMEM;
+		index->entries = entries;
+		index->max_entries = max;
+	}
+	if (!index->lower
+	    || ((index->num_entries + 1) * 2) > (index->mask + 1)) {
+		rc = index_rehash(index, (index->num_entries + 1));
+		if (rc)
+			return rc;
+	}
+	entry = &index->entries[index->num_entries];
+	entry->lower = index->buf_len;
+	entry->upper = (index->buf_len + lower_len);
+	memcpy(&index->buf[entry->lower], lower, lower_len);
+	memcpy(&index->buf[entry->upper], upper, upper_len);
+	index->buf_len += (lower_len + upper_len);
+	index_insert(index, index->num_entries++);
+	return 0;
+}
+
+/**
+ * index_find
+ * @by_upper: Look @name up as an upper name rather than a lower one
+ *
+ * Returns the entry, or NULL
+ */
+static struct name_entry *index_find(struct name_index *index,
+				     const char *name, int by_upper)
+{
+	uint32_t *table = by_upper ? index->upper : index->lower;
+	size_t slot;
+
+	if (!table)
+		return NULL;
+	slot = (index_hash(name) & index->mask);
+	while (table[slot]) {
+		struct name_entry *entry = &index->entries[table[slot] - 1];
+
+		if (!strcmp(&index->buf[by_upper ? entry->upper
+					: entry->lower], name))
+			return entry;
+		slot = ((slot + 1) & index->mask);
+	}
+	return NULL;
+}
+
+/**
+ * index_load
+ * @sig_hex: Filename key signature the index must have been built with
+ *
+ * A missing, stale or unreadable index just leaves @index empty.
+ */
+static void index_load(struct name_index *index, const char *path,
+		       const char *sig_hex)
+{
+	char header[sizeof(INDEX_MAGIC) + ECRYPTFS_SIG_SIZE_HEX + 64];
+	char magic_sig[sizeof(INDEX_MAGIC) + ECRYPTFS_SIG_SIZE_HEX + 2];
+	long long sec, nsec;
+	struct stat st;
+	char *data = NULL;
+	char *p, *end;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) || !st.st_size)
+		goto out;
+	data = malloc(st.st_size + 1);
+	if (!data || read(fd, data, st.st_size) != st.st_size)
+		goto out;
+	data[st.st_size] = '\0';
+	end = &data[st.st_size];
+	p = memchr(data, '\n', st.st_size);
+	if (!p || (size_t)(p - data) >= sizeof(header))
+		goto out;
+	memcpy(header, data, (p - data));
+	header[p - data] = '\0';
+	snprintf(magic_sig, sizeof(magic_sig), "%s %s", INDEX_MAGIC, sig_hex);
+	if (strncmp(header, magic_sig, strlen(magic_sig))
+	    || sscanf(&header[strlen(magic_sig)], " %lld %lld", &sec,
+		      &nsec) != 2)
+		goto out;
+	p++;
+	while (p < end) {
+		char *lower = p;
+		char *upper = (p + strlen(p) + 1);
+
+		if (upper >= end)
+			break;
+		p = (upper + strlen(upper) + 1);
+		if (p > end || index_add(index, lower, upper)) {
+			index_free(index);
+			goto out;
+		}
+	}
+	index->mtime.tv_sec = sec;
+	index->mtime.tv_nsec = nsec;
+out:
+	free(data);
+	close(fd);
+}
+
+/**
+ * index_save
+ *
+ * Written to a temporary file and renamed over @path, so that readers
+ * never see half an index.
+ */
+static int index_save(struct name_index *index, const char *path,
+		      const char *sig_hex)
+{
+	char *tmp_path = NULL;
+	FILE *fp = NULL;
+	int fd;
+	int rc = 0;
+
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) == -1)
+		return -ENOMEM;
+	fd = mkstemp(tmp_path);
+	if (fd == -1) {
+		rc = -errno;
+		goto out;
+	}
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		rc = -errno;
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+	fprintf(fp, "%s %s %lld %lld\n", INDEX_MAGIC, sig_hex,
+		(long long)index->mtime.tv_sec,
+		(long long)index->mtime.tv_nsec);
+	fwrite(index->buf, 1, index->buf_len, fp);
+	if (fclose(fp) || rename(tmp_path, path)) {
+		rc = -EIO;
+		unlink(tmp_path);
+	}
+out:
+	free(tmp_path);
+	return rc;
+}
+
+/**
+ * filename_flush_batch
+ *
+ * Decrypts the queued names into @index; names that cannot be
+ * decrypted are reported and left out.
+ */
+static int filename_flush_batch(struct ecryptfs_fn_ctx *fn_ctx,
+				struct name_index *index,
+				struct ecryptfs_filename *batch, size_t *count,
+				const char *dir)
+{
+	size_t i;
+	int rc;
+
+	rc = ecryptfs_decrypt_filenames(fn_ctx, batch, (*count));
+	for (i = 0; !rc && i < (*count); i++) {
+		if (batch[i].rc) {
+			fprintf(stderr, "Cannot decrypt [%s/%s]; rc = [%d]\n",
+				dir, batch[i].lower, batch[i].rc);
+			continue;
+		}
+		rc = index_add(index, batch[i].lower, batch[i].upper);
+	}
+	for (i = 0; i < (*count); i++)
+		free((char *)batch[i].lower);
+	(*count) = 0;
+	return rc;
+}
+
+/**
+ * filename_scan_dir
+ * @old: Index from an earlier scan; names found in it are not decrypted
+ *       again
+ * @index: Filled in with every entry of @dir
+ */
+static int filename_scan_dir(struct ecryptfs_fn_ctx *fn_ctx, int dir_fd,
+			     const char *dir, struct name_index *old,
+			     struct name_index *index)
+{
+	struct ecryptfs_filename *batch;
+	struct dirent *ep;
+	size_t count = 0;
+	DIR *dp;
+	int rc = 0;
+
+	batch = calloc(FILENAME_BATCH, sizeof(*batch));
+	if (!batch)
+		return -ENOMEM;
+	dp = fdopendir(dup(dir_fd));
+	if (!dp) {
+		rc = -errno;
+		goto out;
+	}
+	while ((ep = readdir(dp))) {
+		struct name_entry *entry;
+
+		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+			continue;
+		entry = index_find(old, ep->d_name, 0);
+		if (entry) {
+			rc = index_add(index, ep->d_name,
+				       &old->buf[entry->upper]);
+			if (rc)
+				break;
+			continue;
+		}
+		batch[count].lower = strdup(ep->d_name);
+		if (!batch[count].lower) {
+			rc = -ENOMEM;
+			break;
+		}
+		batch[count].lower_size = strlen(ep->d_name);
+		if (++count == FILENAME_BATCH) {
+			rc = filename_flush_batch(fn_ctx, index, batch, &count,
+						  dir);
+			if (rc)
+				break;
+		}
+	}
+	closedir(dp);
+	if (!rc)
+		rc = filename_flush_batch(fn_ctx, index, batch, &count, dir);
+out:
+	while (count)
+		free((char *)batch[--count].lower);
+	free(batch);
+	return rc;
+}
+
+static int filename_list(struct ecryptfs_fn_ctx *fn_ctx, const char *dir,
+			 const char *index_dir, const char *sig_hex,
+			 char **names, int num_names)
+{
+	struct name_index old, index;
+	char *index_path = NULL;
+	struct stat st;
+	int dir_fd;
+	int i;
+	int rc = 0;
+
+	memset(&old, 0, sizeof(old));
+	memset(&index, 0, sizeof(index));
+	dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (dir_fd == -1 || fstat(dir_fd, &st)) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", dir);
+		goto out;
+	}
+	if (index_dir) {
+		if (asprintf(&index_path, "%s/%llx-%llx", index_dir,
+			     (unsigned long long)st.st_dev,
+			     (unsigned long long)st.st_ino) == -1) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		index_load(&old, index_path, sig_hex);
+	}
+	/* The directory has not changed since the index was built */
+	if (old.num_entries && old.mtime.tv_sec == st.st_mtim.tv_sec
+	    && old.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		index = old;
+		memset(&old, 0, sizeof(old));
+	} else {
+		rc = filename_scan_dir(fn_ctx, dir_fd, dir, &old, &index);
+		if (rc) {
+			fprintf(stderr, "Error reading [%s]; rc = [%d]\n", dir,
+				rc);
+			goto out;
+		}
+		index.mtime = st.st_mtim;
+		if (index_path && index_save(&index, index_path, sig_hex))
+			fprintf(stderr, "Could not write the index [%s]\n",
+				index_path);
+	}
+	if (!num_names) {
+		size_t j;
+
+		for (j = 0; j < index.num_entries; j++)
+			printf("%s\t%s\n", &index.buf[index.entries[j].lower],
+			       &index.buf[index.entries[j].upper]);
+		goto out;
+	}
+	for (i = 0; i < num_names; i++) {
+		struct name_entry *entry;
+
+		entry = index_find(&index, names[i], 0);
+		if (!entry)
+			entry = index_find(&index, names[i], 1);
+		if (!entry) {
+			fprintf(stderr, "[%s] not found in [%s]\n", names[i],
+				dir);
+			rc = -ENOENT;
+			continue;
+		}
+		printf("%s\t%s\n", &index.buf[entry->lower],
+		       &index.buf[entry->upper]);
+	}
+out:
+	index_free(&old);
+	index_free(&index);
+	free(index_path);
+	if (dir_fd != -1)
+		close(dir_fd);
+	return rc;
+}
+
+/**
+ * filename_translate
+ * @path: Name or path; when any component is encrypted every encrypted
+ *        component is decrypted, otherwise every component is
+ *        encrypted, the same way ecryptfs-find picks its direction
+ */
+static int filename_translate(struct ecryptfs_fn_ctx *fn_ctx,
+			      const char *path)
+{
+	struct ecryptfs_filename *comps = NULL;
+	char *copy, *p, *save = NULL;
+	char name[NAME_MAX + 1];
+	size_t num = 0, max = 0, i;
+	int decrypt;
+	int rc = 0;
+
+	decrypt = (strstr(path, ECRYPTFS_FNEK_ENCRYPTED_FILENAME_PREFIX)
+		   != NULL);
+	copy = strdup(path);
+	if (!copy)
+		return -ENOMEM;
+	for (p = strtok_r(copy, "/", &save); p;
+	     p = strtok_r(NULL, "/", &save)) {
+		if (num == max) {
+			struct ecryptfs_filename *c;
+
+			max = max ? (max * 2) : 8;
+			c = realloc(comps, (max * sizeof(*comps)));
+			if (!c) {
+				rc = -ENOMEM;
+				goto out;
+			}
+			comps = c;
+		}
+		comps[num].lower = p;
+		comps[num].lower_size = strlen(p);
+		num++;
+	}
+	if (decrypt) {
+		rc = ecryptfs_decrypt_filenames(fn_ctx, comps, num);
+		for (i = 0; !rc && i < num; i++)
+			rc = comps[i].rc;
+	}
+	if (rc) {
+		fprintf(stderr, "Cannot decrypt [%s]; rc = [%d]\n", path, rc);
+		goto out;
+	}
+	if (path[0] == '/')
+		putchar('/');
+	for (i = 0; i < num; i++) {
+		if (decrypt) {
+			fputs(comps[i].upper, stdout);
+		} else {
+			rc = ecryptfs_encrypt_filename(fn_ctx, name,
+						       sizeof(name),
+						       comps[i].lower,
+						       comps[i].lower_size);
+			if (rc) {
+				putchar('\n');
+				fprintf(stderr, "Cannot encrypt [%s]; "
+					"rc = [%d]\n", comps[i].lower, rc);
+				goto out;
+			}
+			fputs(name, stdout);
+		}
+		if (i < (num - 1))
+			putchar('/');
+	}
+	putchar('\n');
+out:
+	free(comps);
+	free(copy);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct ecryptfs_fn_ctx *fn_ctx = NULL;
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char fnek_sig[ECRYPTFS_SIG_SIZE];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char *wrapped_file = NULL;
+	char *list_dir = NULL;
+	char *index_dir = NULL;
+	uint8_t cipher_code;
+	int key_bytes = 16;
+	int i, c;
+	int rc = 0;
+
+	memset(passphrase, 0, sizeof(passphrase));
+	memset(fnek, 0, sizeof(fnek));
+	while ((c = getopt(argc, argv, "w:k:l:I:h")) != -1) {
+		switch (c) {
+		case 'w':
+			wrapped_file = optarg;
+			break;
+		case 'k':
+			key_bytes = atoi(optarg);
+			break;
+		case 'l':
+			list_dir = optarg;
+			break;
+		case 'I':
+			index_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	cipher_code = ecryptfs_code_for_cipher_string("aes", key_bytes);
+	if (!cipher_code || (index_dir && !list_dir)
+	    || (!list_dir && optind == argc)) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	rc = ecryptfs_utils_get_passphrase(passphrase, wrapped_file, NULL);
+	if (rc)
+		goto out;
+	rc = ecryptfs_derive_fnek(fnek, fnek_sig, passphrase);
+	if (rc) {
+		fprintf(stderr, "Error deriving the filename key; rc = [%d]\n",
+			rc);
+		goto out;
+	}
+	to_hex(sig_hex, fnek_sig, ECRYPTFS_SIG_SIZE);
+	rc = ecryptfs_fn_ctx_create(&fn_ctx, cipher_code, fnek, key_bytes,
+				    fnek_sig);
+	if (rc) {
+		fprintf(stderr, "Error setting up filename encryption; "
+			"rc = [%d]\n", rc);
+		goto out;
+	}
+	if (list_dir) {
+		rc = filename_list(fn_ctx, list_dir, index_dir, sig_hex,
+				   &argv[optind], (argc - optind));
+		goto out;
+	}
+	for (i = optind; i < argc; i++) {
+		int this_rc = filename_translate(fn_ctx, argv[i]);
+
+		if (this_rc)
+			rc = this_rc;
+	}
+out:
+	ecryptfs_fn_ctx_destroy(fn_ctx);
+	memset(fnek, 0, sizeof(fnek));
+	memset(passphrase, 0, sizeof(passphrase));
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,881 @@
+/**
+ * ecryptfs-fsck: Check the lower files of an eCryptfs tree for damage
+ * without mounting it
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+#include "walker.h"
+
+#define FSCK_FORMAT_JSON 0
+#define FSCK_FORMAT_CSV  1
+
+/* Number of distinct salts whose session key encryption key is
+ * remembered; every file written by one mount shares a single salt */
+#define FSCK_MAX_KEKS 16
+#define FSCK_DEFAULT_SAMPLES 2
+
+/* Exit status */
+#define FSCK_EXIT_CLEAN    0
+#define FSCK_EXIT_PROBLEMS 1
+#define FSCK_EXIT_ERROR    2
+
+/* Flag bits the kernel defines in the header flag vector */
+#define FSCK_KNOWN_FLAGS   0x0000000F
+#define FSCK_FLAG_ENCRYPTED 0x00000002
+#define FSCK_FLAG_XATTR    0x00000004
+
+#define FSCK_EMPTY           0x00000001
+#define FSCK_NO_MARKER       0x00000002
+#define FSCK_BAD_VERSION     0x00000004
+#define FSCK_BAD_FLAGS       0x00000008
+#define FSCK_BAD_HEADER_SIZE 0x00000010
+#define FSCK_BAD_PACKETS     0x00000020
+#define FSCK_TRUNCATED       0x00000040
+#define FSCK_PARTIAL_EXTENT  0x00000080
+#define FSCK_TRAILING_DATA   0x00000100
+#define FSCK_TEMP_FILE       0x00000200
+#define FSCK_NO_KEY          0x00000400
+#define FSCK_ZERO_EXTENT     0x00000800
+#define FSCK_BAD_TAIL        0x00001000
+#define FSCK_BAD_NAME        0x00002000
+#define FSCK_UNREADABLE      0x00004000
+#define FSCK_NUM_PROBLEMS    15
+
+/* Indexed by bit number; these are the names used in the report */
+static const char *fsck_problem_names[FSCK_NUM_PROBLEMS] = {
+	"empty",
+	"no-marker",
+	"bad-version",
+	"bad-flags",
+	"bad-header-size",
+	"bad-packets",
+	"truncated",
+	"partial-extent",
+	"trailing-data",
+	"temp-file",
+	"no-key",
+	"zero-extent",
+	"bad-tail",
+	"bad-name",
+	"unreadable"
+};
+
+/**
+ * @salt: Salt found in a tag 3 packet
+ * @sig: Binary signature of @fekek
+ * @fekek: Passphrase run through the KDF with @salt
+ */
+struct fsck_kek {
+	char salt[ECRYPTFS_SALT_SIZE];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+};
+
+struct fsck_totals {
+	uint64_t files;
+	uint64_t clean;
+	uint64_t damaged;
+	uint64_t problems[FSCK_NUM_PROBLEMS];
+};
+
+struct fsck_out {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/**
+ * Everything a worker touches without locking
+ * @seed: For picking which extents to sample
+ * @fn_ctx: Filename decryption context, with -f
+ */
+struct fsck_worker {
+	struct fsck_totals totals;
+	struct fsck_out out;
+	unsigned int seed;
+	struct ecryptfs_fn_ctx *fn_ctx;
+	char meta[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	char extent[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	char plain[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+};
+
+/**
+ * struct fsck - State shared by every worker
+ * @passphrase: Mount passphrase, or NULL when checking without the key
+ * @keks: Cache of session key encryption keys, by salt; the KDF costs
+ *        65536 SHA-512 rounds, far more than checking a file
+ * @samples: Extents per file to look at
+ * @all: Report clean files too
+ */
+struct fsck {
+	int format;
+	int all;
+	int samples;
+	char *passphrase;
+	pthread_mutex_t kek_lock;
+	struct fsck_kek keks[FSCK_MAX_KEKS];
+	int num_keks;
+	struct fsck_worker *workers;
+};
+
+/**
+ * What was found in the metadata of one lower file
+ * @header_size: Bytes in front of the first extent; 0 in xattr mode
+ * @header_valid: Whether @header_size can be trusted for the size checks
+ */
+struct fsck_file {
+	uint64_t lower_size;
+	uint64_t file_size;
+	uint64_t expected_lower_size;
+	size_t header_size;
+	int have_metadata;
+	int header_valid;
+	int in_xattr;
+	struct ecryptfs_packet_set_user packet_set;
+	int have_packets;
+	uint32_t problems;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-o json|csv] [-t <threads>] [-a] [-s <extents>] "
+		"[-p | -w <wrapped-passphrase-file>] [-f] [-k <key bytes>] "
+		"<lower-path>\n\n"
+		"Checks every eCryptfs lower file under <lower-path> for "
+		"damaged headers, size\n"
+		"mismatches, lost extents and leftover temporary files, and "
+		"reports each damaged\n"
+		"file. Exits 0 when nothing was found, 1 when damage was "
+		"found and 2 when the\n"
+		"check could not be completed.\n\n"
+		"  -o  Record format (default json)\n"
+		"  -t  Number of checking threads (default: online CPUs)\n"
+		"  -a  Report clean files too\n"
+		"  -s  Extents per file to sample for lost data (default %d; "
+		"0 disables)\n"
+		"  -p  Read the mount passphrase from stdin and check that "
+		"each file's key\n"
+		"      unwraps and that the sampled tails decrypt cleanly\n"
+		"  -w  As -p, but unwrap the mount passphrase from this file\n"
+		"  -f  Also decrypt the filenames (requires -p or -w)\n"
+		"  -k  Filename key size in bytes (default 16)\n",
+		name, FSCK_DEFAULT_SAMPLES);
+}
+
+static int fsck_out_append(struct fsck_out *out, const char *str, size_t len)
+{
+	if (out->len + len + 1 > out->size) {
+		size_t size = (out->size ? out->size : 512);
+		char *data;
+
+		while (out->len + len + 1 > size)
+			size *= 2;
+		data = realloc(out->data, size);
+		if (!data)
+			return -ENOMEM;
+		out->data = data;
+		out->size = size;
+	}
+	memcpy(&out->data[out->len], str, len);
+	out->len += len;
+	out->data[out->len] = '\0';
+	return 0;
+}
+
+static int fsck_out_printf(struct fsck_out *out, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int fsck_out_printf(struct fsck_out *out, const char *fmt, ...)
+{
+	char tmp[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return -EINVAL;
+	return fsck_out_append(out, tmp, len);
+}
+
+static int fsck_out_path(struct fsck_out *out, const char *path, int format)
+{
+	const char *p;
+	int rc;
+
+	if ((rc = fsck_out_append(out, "\"", 1)))
+		return rc;
+	for (p = path; *p && !rc; p++) {
+		unsigned char c = (unsigned char)*p;
+
+		if (format == FSCK_FORMAT_CSV) {
+			rc = (c == '"') ? fsck_out_append(out, "\"\"", 2)
+				: fsck_out_append(out, p, 1);
+		} else if (c == '"' || c == '\\') {
+			char esc[2] = { '\\', c };
+
+			rc = fsck_out_append(out, esc, 2);
+		} else if (c < 0x20) {
+			rc = fsck_out_printf(out, "\\u%04x", c);
+		} else
+			rc = fsck_out_append(out, p, 1);
+	}
+	if (!rc)
+		rc = fsck_out_append(out, "\"", 1);
+	return rc;
+}
+
+/**
+ * fsck_is_temp_name
+ *
+ * rsync and most tools that replace files atomically write to
+ * ".<name>.XXXXXX" from mkstemp() and rename over the target; after a
+ * crash those are left behind, unreferenced.
+ */
+static int fsck_is_temp_name(const char *name, size_t len)
+{
+	size_t i;
+
+	if (len < 9 || name[0] != '.' || name[len - 7] != '.')
+		return 0;
+	for (i = (len - 6); i < len; i++)
+		if (!((name[i] >= '0' && name[i] <= '9')
+		      || (name[i] >= 'A' && name[i] <= 'Z')
+		      || (name[i] >= 'a' && name[i] <= 'z')))
+			return 0;
+	return 1;
+}
+
+/**
+ * fsck_check_metadata
+ * @file: Receives the findings
+ * @meta: Metadata, from the front of the lower file or from the xattr
+ * @meta_size: Bytes available at @meta
+ *
+ * Looks at each field on its own, rather than through
+ * ecryptfs_parse_stat(), so that the report can say which one is bad.
+ */
+static void fsck_check_metadata(struct fsck_file *file, char *meta,
+				size_t meta_size)
+{
+	uint32_t flags, header_extent_size;
+	uint16_t num_header_extents;
+	int version;
+	int i;
+
+	if (meta_size < ECRYPTFS_HEADER_METADATA_BYTES
+	    || !ecryptfs_contains_ecryptfs_marker(
+		    &meta[ECRYPTFS_FILE_SIZE_BYTES])) {
+		file->problems |= FSCK_NO_MARKER;
+		return;
+	}
+	file->have_metadata = 1;
+	for (i = 0; i < ECRYPTFS_FILE_SIZE_BYTES; i++)
+		file->file_size = ((file->file_size << 8)
+				   | (unsigned char)meta[i]);
+	memcpy(&flags, &meta[16], sizeof(flags));
+	flags = ntohl(flags);
+	memcpy(&header_extent_size, &meta[20], sizeof(header_extent_size));
+	header_extent_size = ntohl(header_extent_size);
+	memcpy(&num_header_extents, &meta[24], sizeof(num_header_extents));
+	num_header_extents = ntohs(num_header_extents);
+	version = ((flags >> 24) & 0xFF);
+	if (!version || version > ECRYPTFS_SUPPORTED_FILE_VERSION)
+		file->problems |= FSCK_BAD_VERSION;
+	if ((flags & 0x00FFFFFF & ~FSCK_KNOWN_FLAGS)
+	    || !(flags & FSCK_FLAG_ENCRYPTED)
+	    || (!(flags & FSCK_FLAG_XATTR) != !file->in_xattr))
+		file->problems |= FSCK_BAD_FLAGS;
+	if (!file->in_xattr) {
+		file->header_size = ((size_t)header_extent_size
+				     * num_header_extents);
+		if (header_extent_size != ECRYPTFS_DEFAULT_EXTENT_SIZE
+		    || file->header_size < ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE)
+			file->problems |= FSCK_BAD_HEADER_SIZE;
+		else
+			file->header_valid = 1;
+	} else
+		file->header_valid = 1;
+	if (ecryptfs_parse_packet_set(
+		    &file->packet_set,
+		    (unsigned char *)&meta[ECRYPTFS_HEADER_METADATA_BYTES],
+		    (meta_size - ECRYPTFS_HEADER_METADATA_BYTES)))
+		file->problems |= FSCK_BAD_PACKETS;
+	else
+		file->have_packets = 1;
+}
+
+/**
+ * fsck_check_sizes
+ *
+ * The kernel grows the lower file an extent at a time and records the
+ * plaintext size in the header, so the two must agree to the extent.
+ * A lower file that is short has lost data; one that is long has data
+ * written after the last header update, which a mount will not show.
+ */
+static void fsck_check_sizes(struct fsck_file *file)
+{
+	if (!file->have_metadata || !file->header_valid)
+		return;
+	file->expected_lower_size = ecryptfs_upper_size_to_lower_size(
+		file->header_size, ECRYPTFS_DEFAULT_EXTENT_SIZE,
+		file->file_size);
+	if (file->lower_size < file->header_size) {
+		file->problems |= FSCK_TRUNCATED;
+		return;
+	}
+	if ((file->lower_size - file->header_size)
+	    % ECRYPTFS_DEFAULT_EXTENT_SIZE)
+		file->problems |= FSCK_PARTIAL_EXTENT;
+	if (file->lower_size < file->expected_lower_size)
+		file->problems |= FSCK_TRUNCATED;
+	else if (file->lower_size > file->expected_lower_size)
+		file->problems |= FSCK_TRAILING_DATA;
+}
+
+/**
+ * fsck_get_kek
+ * @kek: Set to the session key encryption key for @salt
+ *
+ * The KDF runs outside the lock; two threads racing on a new salt both
+ * derive it, and only one copy is kept.
+ */
+static int fsck_get_kek(struct fsck *fsck, struct fsck_kek *kek,
+			const unsigned char *salt)
+{
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	int i;
+	int rc;
+
+	pthread_mutex_lock(&fsck->kek_lock);
+	for (i = 0; i < fsck->num_keks; i++)
+		if (!memcmp(fsck->keks[i].salt, salt, ECRYPTFS_SALT_SIZE)) {
+			memcpy(kek, &fsck->keks[i], sizeof(*kek));
+			pthread_mutex_unlock(&fsck->kek_lock);
+			return 0;
+		}
+	pthread_mutex_unlock(&fsck->kek_lock);
+	memcpy(kek->salt, salt, ECRYPTFS_SALT_SIZE);
+	rc = generate_passphrase_sig(sig_hex, kek->fekek, kek->salt,
+				     fsck->passphrase);
+	if (rc)
+		return rc;
+	from_hex(kek->sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	pthread_mutex_lock(&fsck->kek_lock);
+	for (i = 0; i < fsck->num_keks; i++)
+		if (!memcmp(fsck->keks[i].salt, salt, ECRYPTFS_SALT_SIZE))
+			break;
+	if (i == fsck->num_keks && i < FSCK_MAX_KEKS) {
+		memcpy(&fsck->keks[i], kek, sizeof(*kek));
+		fsck->num_keks++;
+	}
+	pthread_mutex_unlock(&fsck->kek_lock);
+	return 0;
+}
+
+/**
+ * fsck_find_fek
+ *
+ * Returns zero on success; -ENOKEY if no packet is wrapped under the
+ * passphrase
+ */
+static int fsck_find_fek(struct fsck *fsck, struct fsck_file *file,
+			 unsigned char *fek, size_t *key_size)
+{
+	struct fsck_kek kek;
+	uint32_t i;
+	int rc = -ENOKEY;
+
+	for (i = 0; i < file->packet_set.num_keys; i++) {
+		struct ecryptfs_key_packet_user *key =
+			&file->packet_set.keys[i];
+
+		if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE || !key->sig)
+			continue;
+		rc = fsck_get_kek(fsck, &kek, key->salt);
+		if (rc)
+			break;
+		if (memcmp(kek.sig, key->sig, ECRYPTFS_SIG_SIZE)) {
+			rc = -ENOKEY;
+			continue;
+		}
+		rc = ecryptfs_decrypt_fek(fek, key, kek.fekek);
+		if (!rc)
+			(*key_size) = key->key_size;
+		break;
+	}
+	memset(&kek, 0, sizeof(kek));
+	return rc;
+}
+
+static int fsck_is_zero(const char *buf, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (buf[i])
+			return 0;
+	return 1;
+}
+
+/**
+ * fsck_sample_extents
+ *
+ * The kernel never leaves a hole in a lower file, and no extent
+ * encrypts to all zeros, so a zero extent is one whose data never
+ * reached the disk. The first and the last extents are always looked
+ * at, since that is where interrupted writes land; the rest are picked
+ * at random. With the key, the last extent is decrypted too: the
+ * kernel zeroes the end of the last page before encrypting it, so
+ * anything else past the file size means a torn write or the wrong key.
+ */
+static int fsck_sample_extents(struct fsck *fsck, struct fsck_worker *w,
+			       int fd, struct fsck_file *file)
+{
+	struct ecryptfs_extent_ctx *ctx = NULL;
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	size_t key_size = 0;
+	size_t tail = (file->file_size % ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	uint64_t num_extents, last, extent;
+	int i;
+	int rc = 0;
+
+	if (file->expected_lower_size < file->lower_size)
+		num_extents = file->expected_lower_size;
+	else
+		num_extents = file->lower_size;
+	num_extents = ((num_extents - file->header_size)
+		       / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	if (fsck->passphrase && file->have_packets) {
+		rc = fsck_find_fek(fsck, file, fek, &key_size);
+		if (rc == -ENOKEY) {
+			file->problems |= FSCK_NO_KEY;
+			rc = 0;
+		} else if (!rc && ecryptfs_cipher_code_is_aes(
+				   file->packet_set.cipher_code))
+			rc = ecryptfs_extent_ctx_create(
+				&ctx, file->packet_set.cipher_code, fek,
+				key_size, ECRYPTFS_DEFAULT_EXTENT_SIZE);
+		if (rc)
+			goto out;
+	}
+	if (!num_extents || !fsck->samples)
+		goto out;
+	last = (num_extents - 1);
+	for (i = 0; i < fsck->samples && i < num_extents; i++) {
+		ssize_t size;
+
+		if (i == 0)
+			extent = last;
+		else if (i == 1)
+			extent = 0;
+		else
+			extent = (rand_r(&w->seed) % num_extents);
+		size = pread(fd, w->extent, ECRYPTFS_DEFAULT_EXTENT_SIZE,
+			     (file->header_size
+			      + (extent * ECRYPTFS_DEFAULT_EXTENT_SIZE)));
+		if (size == -1) {
+			rc = -errno;
+			goto out;
+		}
+		if (size != ECRYPTFS_DEFAULT_EXTENT_SIZE)
+			continue;
+		if (fsck_is_zero(w->extent, ECRYPTFS_DEFAULT_EXTENT_SIZE)) {
+			file->problems |= FSCK_ZERO_EXTENT;
+			continue;
+		}
+		if (!ctx || !tail || extent != last
+		    || (extent + 1) * ECRYPTFS_DEFAULT_EXTENT_SIZE
+		       < file->file_size)
+			continue;
+		rc = ecryptfs_decrypt_extent(ctx, w->plain, w->extent, extent);
+		if (rc)
+			goto out;
+		if (!fsck_is_zero(&w->plain[tail],
+				  ECRYPTFS_DEFAULT_EXTENT_SIZE - tail))
+			file->problems |= FSCK_BAD_TAIL;
+	}
+out:
+	ecryptfs_extent_ctx_destroy(ctx);
+	memset(fek, 0, sizeof(fek));
+	return rc;
+}
+
+static int fsck_out_record(struct fsck *fsck, struct fsck_out *out,
+			   const char *path, struct fsck_file *file)
+{
+	int format = fsck->format;
+	int first = 1;
+	int i;
+	int rc;
+
+	out->len = 0;
+	if (format == FSCK_FORMAT_JSON) {
+		rc = fsck_out_append(out, "{\"path\":", 8);
+		if (!rc)
+			rc = fsck_out_path(out, path, format);
+		if (!rc)
+			rc = fsck_out_printf(out, ",\"lower_size\":%llu",
+					     (unsigned long long)
+					     file->lower_size);
+		if (!rc && file->have_metadata)
+			rc = fsck_out_printf(out, ",\"size\":%llu,"
+					     "\"metadata\":\"%s\"",
+					     (unsigned long long)
+					     file->file_size,
+					     file->in_xattr ? "xattr"
+					     : "header");
+		if (!rc && file->header_valid)
+			rc = fsck_out_printf(out, ",\"expected_lower_size\":"
+					     "%llu", (unsigned long long)
+					     file->expected_lower_size);
+		if (!rc)
+			rc = fsck_out_append(out, ",\"problems\":[", 13);
+	} else {
+		rc = fsck_out_path(out, path, format);
+		if (!rc)
+			rc = fsck_out_printf(out, ",%llu,",
+					     (unsigned long long)
+					     file->lower_size);
+		if (!rc && file->have_metadata)
+			rc = fsck_out_printf(out, "%llu,%s",
+					     (unsigned long long)
+					     file->file_size,
+					     file->in_xattr ? "xattr"
+					     : "header");
+		else if (!rc)
+			rc = fsck_out_append(out, ",", 1);
+		if (!rc && file->header_valid)
+			rc = fsck_out_printf(out, ",%llu,",
+					     (unsigned long long)
+					     file->expected_lower_size);
+		else if (!rc)
+			rc = fsck_out_append(out, ",,", 2);
+	}
+	for (i = 0; !rc && i < FSCK_NUM_PROBLEMS; i++) {
+		if (!(file->problems & (1 << i)))
+			continue;
+		if (format == FSCK_FORMAT_JSON)
+			rc = fsck_out_printf(out, "%s\"%s\"", first ? "" : ",",
+					     fsck_problem_names[i]);
+		else
+			rc = fsck_out_printf(out, "%s%s", first ? "" : " ",
+					     fsck_problem_names[i]);
+		first = 0;
+	}
+	if (!rc)
+		rc = (format == FSCK_FORMAT_JSON)
+			? fsck_out_append(out, "]}\n", 3)
+			: fsck_out_append(out, "\n", 1);
+	/* One stdio call per record keeps records from interleaving */
+	if (!rc)
+		fwrite(out->data, 1, out->len, stdout);
+	return rc;
+}
+
+static int fsck_visit(struct ecryptfs_walk_entry *entry, void *priv,
+		      int worker)
+{
+	struct fsck *fsck = priv;
+	struct fsck_worker *w = &fsck->workers[worker];
+	struct fsck_file file;
+	const char *name = entry->name;
+	size_t name_size = strlen(entry->name);
+	char upper[NAME_MAX + 1];
+	struct stat st;
+	ssize_t size;
+	int fd;
+	int i;
+	int rc = 0;
+
+	if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+		return 0;
+	memset(&file, 0, sizeof(file));
+	fd = openat(entry->dirfd, entry->name,
+		    O_RDONLY | O_NOFOLLOW | O_NOATIME | O_NONBLOCK);
+	if (fd == -1 && errno == EPERM)
+		fd = openat(entry->dirfd, entry->name,
+			    O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1) {
+		if (errno == ELOOP)
+			return 0;
+		file.problems |= FSCK_UNREADABLE;
+		goto report;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	file.lower_size = st.st_size;
+	size = 0;
+	if (st.st_size >= ECRYPTFS_HEADER_METADATA_BYTES)
+		size = pread(fd, w->meta, sizeof(w->meta), 0);
+	if (size == -1) {
+		file.problems |= FSCK_UNREADABLE;
+		goto close;
+	}
+	if (size < ECRYPTFS_HEADER_METADATA_BYTES
+	    || !ecryptfs_contains_ecryptfs_marker(
+		    &w->meta[ECRYPTFS_FILE_SIZE_BYTES])) {
+		/* The metadata may live in the user.ecryptfs xattr */
+		size = fgetxattr(fd, ECRYPTFS_XATTR_NAME, w->meta,
+				 sizeof(w->meta));
+		if (size == -1) {
+			file.problems |= (st.st_size ? FSCK_NO_MARKER
+					  : FSCK_EMPTY);
+			goto close;
+		}
+		file.in_xattr = 1;
+	}
+	fsck_check_metadata(&file, w->meta, size);
+	fsck_check_sizes(&file);
+	if (file.header_valid && (fsck->samples || fsck->passphrase)) {
+		rc = fsck_sample_extents(fsck, w, fd, &file);
+		if (rc) {
+			file.problems |= FSCK_UNREADABLE;
+			rc = 0;
+		}
+	}
+close:
+	close(fd);
+report:
+	if (w->fn_ctx && ecryptfs_is_encrypted_filename(name, name_size)) {
+		rc = ecryptfs_decrypt_filename(w->fn_ctx, upper, name,
+					       name_size);
+		if (!rc) {
+			name = upper;
+			name_size = strlen(upper);
+		} else if (rc != -ENOKEY)
+			file.problems |= FSCK_BAD_NAME;
+		rc = 0;
+	}
+	if (fsck_is_temp_name(name, name_size))
+		file.problems |= FSCK_TEMP_FILE;
+	w->totals.files++;
+	if (!file.problems)
+		w->totals.clean++;
+	else
+		w->totals.damaged++;
+	for (i = 0; i < FSCK_NUM_PROBLEMS; i++)
+		if (file.problems & (1 << i))
+			w->totals.problems[i]++;
+	if (file.problems || fsck->all)
+		rc = fsck_out_record(fsck, &w->out, entry->path, &file);
+	return rc;
+}
+
+static void fsck_print_totals(struct fsck_totals *t, int format,
+			      unsigned long long dir_errors)
+{
+	FILE *fp = (format == FSCK_FORMAT_JSON) ? stdout : stderr;
+	int first = 1;
+	int i;
+
+	if (format == FSCK_FORMAT_JSON) {
+		fprintf(fp, "{\"totals\":{\"files\":%llu,\"clean\":%llu,"
+			"\"damaged\":%llu,\"directory_errors\":%llu,"
+			"\"problems\":{", (unsigned long long)t->files,
+			(unsigned long long)t->clean,
+			(unsigned long long)t->damaged, dir_errors);
+		for (i = 0; i < FSCK_NUM_PROBLEMS; i++) {
+			if (!t->problems[i])
+				continue;
+			fprintf(fp, "%s\"%s\":%llu", first ? "" : ",",
+				fsck_problem_names[i],
+				(unsigned long long)t->problems[i]);
+			first = 0;
+		}
+		fprintf(fp, "}}}\n");
+		return;
+	}
+	fprintf(fp, "Files checked: [%llu]\n", (unsigned long long)t->files);
+	fprintf(fp, "Clean: [%llu]\n", (unsigned long long)t->clean);
+	fprintf(fp, "Damaged: [%llu]\n", (unsigned long long)t->damaged);
+	fprintf(fp, "Unreadable directories: [%llu]\n", dir_errors);
+	for (i = 0; i < FSCK_NUM_PROBLEMS; i++)
+		if (t->problems[i])
+			fprintf(fp, "Files with [%s]: [%llu]\n",
+				fsck_problem_names[i],
+				(unsigned long long)t->problems[i]);
+}
+
+int main(int argc, char **argv)
+{
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char fnek_sig[ECRYPTFS_SIG_SIZE];
+	struct fsck_totals sum;
+	struct ecryptfs_walk walk;
+	struct fsck fsck;
+	char *wrapped_file = NULL;
+	int use_key = 0;
+	int names = 0;
+	size_t key_size = 16;
+	int num_threads = 0;
+	int c;
+	int i, j;
+	int rc = 0;
+
+	memset(&fsck, 0, sizeof(fsck));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	memset(passphrase, 0, sizeof(passphrase));
+	memset(fnek, 0, sizeof(fnek));
+	pthread_mutex_init(&fsck.kek_lock, NULL);
+	fsck.format = FSCK_FORMAT_JSON;
+	fsck.samples = FSCK_DEFAULT_SAMPLES;
+	while ((c = getopt(argc, argv, "o:t:as:pw:fk:h")) != -1) {
+		switch (c) {
+		case 'o':
+			if (!strcmp(optarg, "json"))
+				fsck.format = FSCK_FORMAT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				fsck.format = FSCK_FORMAT_CSV;
+			else {
+				usage(argv[0]);
+				rc = -EINVAL;
+				goto out;
+			}
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'a':
+			fsck.all = 1;
+			break;
+		case 's':
+			fsck.samples = atoi(optarg);
+			break;
+		case 'p':
+			use_key = 1;
+			break;
+		case 'w':
+			use_key = 1;
+			wrapped_file = optarg;
+			break;
+		case 'f':
+			names = 1;
+			break;
+		case 'k':
+			key_size = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (optind >= argc || fsck.samples < 0 || (names && !use_key)
+	    || (key_size != 16 && key_size != 24 && key_size != 32)) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	if (use_key) {
+		rc = ecryptfs_utils_get_passphrase(passphrase, wrapped_file,
+						   NULL);
+		if (rc)
+			goto out;
+		fsck.passphrase = passphrase;
+	}
+	if (names) {
+		rc = ecryptfs_derive_fnek(fnek, fnek_sig, passphrase);
+		if (rc) {
+			fprintf(stderr, "Error deriving the filename key; "
+				"rc = [%d]\n", rc);
+			goto out;
+		}
+	}
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	fsck.workers = calloc(num_threads, sizeof(*fsck.workers));
+	if (!fsck.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		fsck.workers[i].seed = (getpid() ^ (i * 2654435761U));
+		if (!names)
+			continue;
+		rc = ecryptfs_fn_ctx_create(
+			&fsck.workers[i].fn_ctx,
+			ecryptfs_code_for_cipher_string("aes", key_size),
+			fnek, key_size, fnek_sig);
+		if (rc) {
+			fprintf(stderr, "Error setting up filename decryption; "
+				"rc = [%d]\n", rc);
+			goto out;
+		}
+	}
+	if (fsck.format == FSCK_FORMAT_CSV)
+		printf("path,lower_size,size,metadata,expected_lower_size,"
+		       "problems\n");
+	walk.num_threads = num_threads;
+	walk.flags = ECRYPTFS_WALK_XDEV;
+	walk.fn = fsck_visit;
+	walk.priv = &fsck;
+	rc = ecryptfs_walk_tree(&walk, argv[optind]);
+	if (rc)
+		fprintf(stderr, "Error checking [%s]; rc = [%d]\n",
+			argv[optind], rc);
+	for (i = 0; i < num_threads; i++) {
+		struct fsck_totals *t = &fsck.workers[i].totals;
+
+		sum.files += t->files;
+		sum.clean += t->clean;
+		sum.damaged += t->damaged;
+		for (j = 0; j < FSCK_NUM_PROBLEMS; j++)
+			sum.problems[j] += t->problems[j];
+	}
+	fsck_print_totals(&sum, fsck.format, walk.num_errors);
+	if (!rc && walk.num_errors)
+		rc = -EIO;
+out:
+	if (fsck.workers) {
+		for (i = 0; i < num_threads; i++) {
+			free(fsck.workers[i].out.data);
+			ecryptfs_fn_ctx_destroy(fsck.workers[i].fn_ctx);
+		}
+		free(fsck.workers);
+	}
+	memset(&fsck.keks, 0, sizeof(fsck.keks));
+	memset(fnek, 0, sizeof(fnek));
+	memset(passphrase, 0, sizeof(passphrase));
+	if (rc)
+		return FSCK_EXIT_ERROR;
+	return sum.damaged ? FSCK_EXIT_PROBLEMS : FSCK_EXIT_CLEAN;
+}
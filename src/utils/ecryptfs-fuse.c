@@ -0,0 +1,1258 @@
+/**
+ * ecryptfs-fuse: Read-only FUSE file system serving the plaintext of an
+ * eCryptfs lower directory without the kernel module
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <getopt.h>
+#include <limits.h>
+#include <nss.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+
+/* Default size of the decrypted extent cache, in MiB */
+#define EFUSE_DEFAULT_CACHE_MB 64
+/* Default and starting sequential readahead windows, in extents */
+#define EFUSE_DEFAULT_READAHEAD 256
+#define EFUSE_MIN_READAHEAD 8
+/* Most extents read from the lower file by one pread() */
+#define EFUSE_MAX_RUN 256
+/* Idle extent contexts kept per open file */
+#define EFUSE_MAX_FILE_CTX 8
+/* Number of distinct salts whose session key encryption key is
+ * remembered; every file written by one mount shares a single salt */
+#define EFUSE_MAX_KEKS 16
+/* Slots in the direct-mapped cache of decrypted directory listings */
+#define EFUSE_DIR_SLOTS 1024
+/* Names handed to ecryptfs_decrypt_filenames() at once */
+#define EFUSE_DIR_BATCH 128
+
+/**
+ * Identifies one version of a lower file; a write to the lower file
+ * changes its mtime and so retires every cached extent of it
+ */
+struct efuse_id {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+};
+
+/**
+ * One decrypted extent
+ * @hash_next: Next extent in the same hash bucket
+ * @lru_prev, @lru_next: Position in the LRU list; the head is the most
+ *                       recently used
+ */
+struct efuse_extent {
+	struct efuse_extent *hash_next;
+	struct efuse_extent *lru_prev;
+	struct efuse_extent *lru_next;
+	struct efuse_id id;
+	uint64_t index;
+	char data[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+};
+
+/**
+ * struct efuse_cache - Decrypted extents shared by every open file
+ * @lru: Sentinel of the LRU list
+ * @count: Extents allocated, never more than @max
+ */
+struct efuse_cache {
+	pthread_mutex_t lock;
+	struct efuse_extent **buckets;
+	size_t mask;
+	struct efuse_extent lru;
+	size_t count;
+	size_t max;
+};
+
+/**
+ * @name: Upper name
+ * @ino, @type: As read from the lower directory
+ */
+struct efuse_dirent {
+	char *name;
+	ino_t ino;
+	unsigned char type;
+};
+
+/**
+ * A decrypted lower directory listing
+ * @refs: One for the cache slot holding it and one per reader
+ */
+struct efuse_dir {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	int refs;
+	size_t count;
+	struct efuse_dirent *ents;
+};
+
+/**
+ * @salt: Salt found in a tag 3 packet
+ * @sig: Binary signature of @fekek
+ * @fekek: Passphrase run through the KDF with @salt
+ */
+struct efuse_kek {
+	char salt[ECRYPTFS_SALT_SIZE];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+};
+
+/**
+ * An open lower file
+ * @ctx, @num_ctx: Idle extent contexts; a context serves one thread at
+ *                 a time and reads of one file may run concurrently
+ * @next_extent: Extent following the last read, to spot sequential reads
+ * @readahead: Current readahead window, in extents; zero after a seek
+ * @readahead_end: Extent following the last one read ahead
+ */
+struct efuse_file {
+	int fd;
+	struct efuse_id id;
+	uint64_t upper_size;
+	uint64_t header_size;
+	uint64_t num_extents;
+	uint8_t cipher_code;
+	size_t key_size;
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	pthread_mutex_t lock;
+	struct ecryptfs_extent_ctx *ctx[EFUSE_MAX_FILE_CTX];
+	int num_ctx;
+	uint64_t next_extent;
+	uint64_t readahead;
+	uint64_t readahead_end;
+};
+
+/**
+ * struct efuse - State of the mount
+ * @root_fd: The lower directory, opened before the mount so that it may
+ *           be mounted over
+ * @fn_key: Each thread's filename context
+ * @max_readahead: Largest readahead window, in extents; zero disables
+ *                 readahead
+ */
+struct efuse {
+	int root_fd;
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char fnek_sig[ECRYPTFS_SIG_SIZE];
+	uint8_t fn_cipher_code;
+	size_t fn_key_bytes;
+	pthread_key_t fn_key;
+	pthread_mutex_t kek_lock;
+	struct efuse_kek keks[EFUSE_MAX_KEKS];
+	int num_keks;
+	struct efuse_cache cache;
+	pthread_mutex_t dir_lock;
+	struct efuse_dir *dirs[EFUSE_DIR_SLOTS];
+	uint64_t max_readahead;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-w <wrapped-passphrase-file>] [-k <fnek-bytes>] "
+		"[-c <cache-MiB>]\n"
+		"\t[-r <readahead-extents>] <lower-dir> <mountpoint> "
+		"[<FUSE options>]\n\n"
+		"Mounts the plaintext of the eCryptfs lower directory "
+		"<lower-dir> read-only on\n"
+		"<mountpoint>, decrypting with the mount passphrase read from "
+		"stdin.\n\n"
+		"  -w  Unwrap the mount passphrase from this file\n"
+		"  -k  Filename encryption key size in bytes (default: 16)\n"
+		"  -c  Size of the decrypted extent cache (default: %d)\n"
+		"  -r  Largest sequential readahead, in extents (default: "
+		"%d)\n\n"
+		"Options after <mountpoint>, such as -f or -o allow_other, go "
+		"to FUSE.\n",
+		name, EFUSE_DEFAULT_CACHE_MB, EFUSE_DEFAULT_READAHEAD);
+}
+
+static struct efuse *efuse_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static size_t efuse_hash(const struct efuse_id *id, uint64_t index)
+{
+	uint64_t h = ((uint64_t)id->ino * 0x9e3779b97f4a7c15ULL);
+
+	h ^= ((uint64_t)id->dev + index) * 0xc2b2ae3d27d4eb4fULL;
+	return (size_t)(h ^ (h >> 29));
+}
+
+static int efuse_id_equal(const struct efuse_id *a, const struct efuse_id *b)
+{
+	return (a->ino == b->ino && a->dev == b->dev
+		&& a->mtime.tv_sec == b->mtime.tv_sec
+		&& a->mtime.tv_nsec == b->mtime.tv_nsec);
+}
+
+static int efuse_cache_init(struct efuse_cache *cache, size_t max)
+{
+	size_t num_buckets = 1;
+
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->lru.lru_next = &cache->lru;
+	cache->lru.lru_prev = &cache->lru;
+	cache->max = max;
+	while (num_buckets < max)
+		num_buckets <<= 1;
+	cache->buckets = calloc(num_buckets, sizeof(*cache->buckets));
+	if (!cache->buckets)
+		return -ENOMEM;
+	cache->mask = (num_buckets - 1);
+	return 0;
+}
+
+static void efuse_cache_destroy(struct efuse_cache *cache)
+{
+	struct efuse_extent *e = cache->lru.lru_next;
+
+	while (e != &cache->lru) {
+		struct efuse_extent *next = e->lru_next;
+
+		memset(e->data, 0, sizeof(e->data));
+		free(e);
+		e = next;
+	}
+	free(cache->buckets);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static void efuse_lru_unlink(struct efuse_extent *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void efuse_lru_push(struct efuse_cache *cache, struct efuse_extent *e)
+{
+	e->lru_next = cache->lru.lru_next;
+	e->lru_prev = &cache->lru;
+	cache->lru.lru_next->lru_prev = e;
+	cache->lru.lru_next = e;
+}
+
+/**
+ * efuse_cache_find
+ *
+ * Called with the cache lock held
+ */
+static struct efuse_extent *efuse_cache_find(struct efuse_cache *cache,
+					     const struct efuse_id *id,
+					     uint64_t index)
+{
+	struct efuse_extent *e;
+
+	e = cache->buckets[efuse_hash(id, index) & cache->mask];
+	while (e && (e->index != index || !efuse_id_equal(&e->id, id)))
+		e = e->hash_next;
+	return e;
+}
+
+/**
+ * efuse_cache_get
+ * @dst: Receives the extent, if it is cached; NULL to only check
+ *
+ * Returns 1 if the extent is cached, 0 if not
+ */
+static int efuse_cache_get(struct efuse_cache *cache,
+			   const struct efuse_id *id, uint64_t index, char *dst)
+{
+	struct efuse_extent *e;
+
+	if (!cache->max)
+		return 0;
+	pthread_mutex_lock(&cache->lock);
+	e = efuse_cache_find(cache, id, index);
+	if (e) {
+		efuse_lru_unlink(e);
+		efuse_lru_push(cache, e);
+		if (dst)
+			memcpy(dst, e->data, ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return e ? 1 : 0;
+}
+
+/**
+ * efuse_cache_put
+ *
+ * Once the cache is full, the least recently used extent is recycled.
+ */
+static void efuse_cache_put(struct efuse_cache *cache,
+			    const struct efuse_id *id, uint64_t index,
+			    const char *src)
+{
+	struct efuse_extent **pp;
+	struct efuse_extent *e;
+
+	if (!cache->max)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	if (efuse_cache_find(cache, id, index))
+		goto out;
+	if (cache->count < cache->max) {
+		e = malloc(sizeof(*e));
+		if (!e)
+			goto out;
+		cache->count++;
+	} else {
+		e = cache->lru.lru_prev;
+		efuse_lru_unlink(e);
+		pp = &cache->buckets[efuse_hash(&e->id, e->index)
+				     & cache->mask];
+		while ((*pp) != e)
+			pp = &(*pp)->hash_next;
+		(*pp) = e->hash_next;
+	}
+	e->id = (*id);
+	e->index = index;
+	memcpy(e->data, src, ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	pp = &cache->buckets[efuse_hash(id, index) & cache->mask];
+	e->hash_next = (*pp);
+	(*pp) = e;
+	efuse_lru_push(cache, e);
+out:
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static void efuse_fn_ctx_destroy(void *ctx)
+{
+	ecryptfs_fn_ctx_destroy(ctx);
+}
+
+/**
+ * efuse_fn_ctx
+ *
+ * Filename contexts keep cipher state, so each thread gets its own,
+ * created the first time it needs one.
+ */
+static struct ecryptfs_fn_ctx *efuse_fn_ctx(struct efuse *ef)
+{
+	struct ecryptfs_fn_ctx *ctx = pthread_getspecific(ef->fn_key);
+
+	if (ctx)
+		return ctx;
+	if (ecryptfs_fn_ctx_create(&ctx, ef->fn_cipher_code, ef->fnek,
+				   ef->fn_key_bytes, ef->fnek_sig))
+		return NULL;
+	if (pthread_setspecific(ef->fn_key, ctx)) {
+		ecryptfs_fn_ctx_destroy(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/**
+ * efuse_lower_path
+ * @lower: Receives the path relative to the lower directory
+ *
+ * FUSE hands over whole upper paths. Filename encryption is
+ * deterministic, so each component is encrypted and looked up; a
+ * component that is not there encrypted is taken as is, as the kernel
+ * does for files created before filename encryption was enabled.
+ */
+static int efuse_lower_path(struct efuse *ef, const char *path, char *lower,
+			    size_t size)
+{
+	struct ecryptfs_fn_ctx *ctx = efuse_fn_ctx(ef);
+	char enc[NAME_MAX + 1];
+	size_t len = 1;
+	struct stat st;
+
+	if (!ctx)
+		return -ENOMEM;
+	strcpy(lower, ".");
+	while (*path) {
+		const char *name;
+		size_t name_size;
+
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		name = path;
+		while (*path && *path != '/')
+			path++;
+		name_size = (path - name);
+		if (!ecryptfs_encrypt_filename(ctx, enc, sizeof(enc), name,
+					       name_size)) {
+			if (len + 1 + strlen(enc) + 1 > size)
+				return -ENAMETOOLONG;
+			snprintf(&lower[len], (size - len), "/%s", enc);
+			if (!fstatat(ef->root_fd, lower, &st,
+				     AT_SYMLINK_NOFOLLOW)) {
+				len += (1 + strlen(enc));
+				continue;
+			}
+		}
+		if (len + 1 + name_size + 1 > size)
+			return -ENAMETOOLONG;
+		lower[len++] = '/';
+		memcpy(&lower[len], name, name_size);
+		len += name_size;
+		lower[len] = '\0';
+	}
+	return 0;
+}
+
+/**
+ * efuse_decrypt_target
+ * @upper: NAME_MAX + 1 bytes
+ *
+ * Symlink targets are encrypted like filenames; targets written without
+ * filename encryption are plain and returned as they are.
+ */
+static int efuse_decrypt_target(struct efuse *ef, char *upper,
+				size_t upper_size, const char *target,
+				size_t target_size)
+{
+	struct ecryptfs_fn_ctx *ctx;
+
+	if (!ecryptfs_is_encrypted_filename(target, target_size)) {
+		if (target_size >= upper_size)
+			return -ENAMETOOLONG;
+		memcpy(upper, target, target_size);
+		upper[target_size] = '\0';
+		return 0;
+	}
+	ctx = efuse_fn_ctx(ef);
+	if (!ctx)
+		return -ENOMEM;
+	if (ecryptfs_decrypt_filename(ctx, upper, target, target_size))
+		return -EIO;
+	return 0;
+}
+
+static uint64_t efuse_get_be64(const unsigned char *buf)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		val = ((val << 8) | buf[i]);
+	return val;
+}
+
+/**
+ * efuse_upper_size
+ *
+ * The kernel keeps the size of the plaintext in the first eight bytes
+ * of the metadata, ahead of the marker. Files that carry no eCryptfs
+ * metadata keep their lower size.
+ */
+static void efuse_upper_size(struct efuse *ef, const char *lower,
+			     struct stat *st)
+{
+	unsigned char buf[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE];
+	ssize_t got;
+	int fd;
+
+	if (!st->st_size)
+		return;
+	fd = openat(ef->root_fd, lower, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return;
+	got = pread(fd, buf, 16, 0);
+	if (got != 16 || !ecryptfs_contains_ecryptfs_marker((char *)&buf[8]))
+		got = fgetxattr(fd, ECRYPTFS_XATTR_NAME, buf, sizeof(buf));
+	if (got >= 16 && ecryptfs_contains_ecryptfs_marker((char *)&buf[8]))
+		st->st_size = efuse_get_be64(buf);
+	close(fd);
+}
+
+static int efuse_getattr(const char *path, struct stat *st,
+			 struct fuse_file_info *fi)
+{
+	struct efuse *ef = efuse_get();
+	char lower[PATH_MAX];
+	int rc;
+
+	rc = efuse_lower_path(ef, path, lower, sizeof(lower));
+	if (rc)
+		return rc;
+	if (fstatat(ef->root_fd, lower, st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	if (S_ISREG(st->st_mode)) {
+		efuse_upper_size(ef, lower, st);
+	} else if (S_ISLNK(st->st_mode)) {
+		char target[PATH_MAX];
+		char upper[NAME_MAX + 1];
+		ssize_t len;
+
+		len = readlinkat(ef->root_fd, lower, target, sizeof(target));
+		if (len < 0)
+			return -errno;
+		if (!efuse_decrypt_target(ef, upper, sizeof(upper), target,
+					  len))
+			st->st_size = strlen(upper);
+	}
+	return 0;
+}
+
+static int efuse_readlink(const char *path, char *buf, size_t size)
+{
+	struct efuse *ef = efuse_get();
+	char lower[PATH_MAX];
+	char target[PATH_MAX];
+	char upper[NAME_MAX + 1];
+	ssize_t len;
+	int rc;
+
+	rc = efuse_lower_path(ef, path, lower, sizeof(lower));
+	if (rc)
+		return rc;
+	len = readlinkat(ef->root_fd, lower, target, sizeof(target));
+	if (len < 0)
+		return -errno;
+	rc = efuse_decrypt_target(ef, upper, sizeof(upper), target, len);
+	if (rc)
+		return rc;
+	if (size) {
+		strncpy(buf, upper, size - 1);
+		buf[size - 1] = '\0';
+	}
+	return 0;
+}
+
+/**
+ * efuse_get_kek
+ * @kek: Set to the session key encryption key for @salt
+ *
+ * The KDF runs outside the lock; two threads racing on a new salt both
+ * derive it, and only one copy is kept.
+ */
+static int efuse_get_kek(struct efuse *ef, struct efuse_kek *kek,
+			 const unsigned char *salt)
+{
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	int i;
+	int rc;
+
+	pthread_mutex_lock(&ef->kek_lock);
+	for (i = 0; i < ef->num_keks; i++)
+		if (!memcmp(ef->keks[i].salt, salt, ECRYPTFS_SALT_SIZE)) {
+			memcpy(kek, &ef->keks[i], sizeof(*kek));
+			pthread_mutex_unlock(&ef->kek_lock);
+			return 0;
+		}
+	pthread_mutex_unlock(&ef->kek_lock);
+	memcpy(kek->salt, salt, ECRYPTFS_SALT_SIZE);
+	rc = generate_passphrase_sig(sig_hex, kek->fekek, kek->salt,
+				     ef->passphrase);
+	if (rc)
+		return rc;
+	from_hex(kek->sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	pthread_mutex_lock(&ef->kek_lock);
+	for (i = 0; i < ef->num_keks; i++)
+		if (!memcmp(ef->keks[i].salt, salt, ECRYPTFS_SALT_SIZE))
+			break;
+	if (i == ef->num_keks && i < EFUSE_MAX_KEKS) {
+		memcpy(&ef->keks[i], kek, sizeof(*kek));
+		ef->num_keks++;
+	}
+	pthread_mutex_unlock(&ef->kek_lock);
+	return 0;
+}
+
+/**
+ * efuse_find_fek
+ *
+ * Unlike ecryptfs_find_fek_with_passphrase(), does not run the KDF for
+ * every file opened.
+ */
+static int efuse_find_fek(struct efuse *ef, struct efuse_file *f,
+			  struct ecryptfs_packet_set_user *packet_set)
+{
+	struct efuse_kek kek;
+	uint32_t i;
+	int rc = -ENOKEY;
+
+	for (i = 0; i < packet_set->num_keys; i++) {
+		struct ecryptfs_key_packet_user *key = &packet_set->keys[i];
+
+		if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE)
+			continue;
+		rc = efuse_get_kek(ef, &kek, key->salt);
+		if (rc)
+			break;
+		if (memcmp(key->sig, kek.sig, ECRYPTFS_SIG_SIZE)) {
+			rc = -ENOKEY;
+			continue;
+		}
+		rc = ecryptfs_decrypt_fek(f->fek, key, kek.fekek);
+		if (!rc)
+			f->key_size = key->key_size;
+		break;
+	}
+	memset(&kek, 0, sizeof(kek));
+	return rc;
+}
+
+static void efuse_release_file(struct efuse_file *f)
+{
+	int i;
+
+	for (i = 0; i < f->num_ctx; i++)
+		ecryptfs_extent_ctx_destroy(f->ctx[i]);
+	if (f->fd != -1)
+		close(f->fd);
+	pthread_mutex_destroy(&f->lock);
+	memset(f->fek, 0, sizeof(f->fek));
+	free(f);
+}
+
+/**
+ * efuse_open
+ *
+ * Files that are not encrypted eCryptfs files cannot be read, as
+ * through the kernel mount.
+ */
+static int efuse_open(const char *path, struct fuse_file_info *fi)
+{
+	struct efuse *ef = efuse_get();
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	struct efuse_file *f = NULL;
+	char lower[PATH_MAX];
+	char *meta = NULL;
+	struct stat st;
+	int rc;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	rc = efuse_lower_path(ef, path, lower, sizeof(lower));
+	if (rc)
+		return rc;
+	f = calloc(1, sizeof(*f));
+	meta = malloc(ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE * 2);
+	if (!f || !meta) {
+		free(f);
+		free(meta);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&f->lock, NULL);
+	f->fd = openat(ef->root_fd, lower, O_RDONLY | O_NOFOLLOW);
+	if (f->fd == -1 || fstat(f->fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	f->id.dev = st.st_dev;
+	f->id.ino = st.st_ino;
+	f->id.mtime = st.st_mtim;
+	rc = ecryptfs_read_lower_metadata(f->fd, meta,
+					  (ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE
+					   * 2), &crypt_stat, &packet_set,
+					  &f->header_size);
+	if (rc || !(crypt_stat.flags & ECRYPTFS_ENCRYPTED)) {
+		rc = -EIO;
+		goto out;
+	}
+	rc = efuse_find_fek(ef, f, &packet_set);
+	if (rc) {
+		rc = (rc == -ENOMEM) ? rc : -EIO;
+		goto out;
+	}
+	f->cipher_code = packet_set.cipher_code;
+	f->upper_size = crypt_stat.file_size;
+	f->num_extents = ((f->upper_size + ECRYPTFS_DEFAULT_EXTENT_SIZE - 1)
+			  / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	fi->fh = (uintptr_t)f;
+out:
+	free(meta);
+	if (rc)
+		efuse_release_file(f);
+	return rc;
+}
+
+static int efuse_release(const char *path, struct fuse_file_info *fi)
+{
+	efuse_release_file((struct efuse_file *)(uintptr_t)fi->fh);
+	return 0;
+}
+
+static struct ecryptfs_extent_ctx *efuse_get_ctx(struct efuse_file *f)
+{
+	struct ecryptfs_extent_ctx *ctx = NULL;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->num_ctx)
+		ctx = f->ctx[--f->num_ctx];
+	pthread_mutex_unlock(&f->lock);
+	if (!ctx && ecryptfs_extent_ctx_create(&ctx, f->cipher_code, f->fek,
+					       f->key_size,
+					       ECRYPTFS_DEFAULT_EXTENT_SIZE))
+		return NULL;
+	return ctx;
+}
+
+static void efuse_put_ctx(struct efuse_file *f,
+			  struct ecryptfs_extent_ctx *ctx)
+{
+	pthread_mutex_lock(&f->lock);
+	if (f->num_ctx < EFUSE_MAX_FILE_CTX) {
+		f->ctx[f->num_ctx++] = ctx;
+		ctx = NULL;
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (ctx)
+		ecryptfs_extent_ctx_destroy(ctx);
+}
+
+/**
+ * efuse_read_run
+ * @first, @count: Extents to read with one pread(), none of them cached
+ * @plain: Receives the plaintext of extents up to @last, counted from
+ *         @base; extents past @last are read ahead into the cache only
+ */
+static int efuse_read_run(struct efuse *ef, struct efuse_file *f,
+			  struct ecryptfs_extent_ctx *ctx, char *cipher,
+			  uint64_t first, uint64_t count, char *plain,
+			  uint64_t base, uint64_t last)
+{
+	char tmp[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	uint64_t got_extents;
+	ssize_t got;
+	uint64_t i;
+	int rc;
+
+	got = pread(f->fd, cipher, (count * ECRYPTFS_DEFAULT_EXTENT_SIZE),
+		    (f->header_size + (first * ECRYPTFS_DEFAULT_EXTENT_SIZE)));
+	if (got < 0)
+		return -errno;
+	got_extents = (got / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	if (first + got_extents <= last && got_extents < count)
+		return -EIO;
+	for (i = 0; i < got_extents; i++) {
+		uint64_t extent = (first + i);
+		char *dst = (extent <= last)
+			? &plain[(extent - base) * ECRYPTFS_DEFAULT_EXTENT_SIZE]
+			: tmp;
+
+		rc = ecryptfs_decrypt_extent(ctx, dst,
+					     &cipher[i * ECRYPTFS_DEFAULT_EXTENT_SIZE],
+					     extent);
+		if (rc)
+			return -EIO;
+		efuse_cache_put(&ef->cache, &f->id, extent, dst);
+	}
+	return 0;
+}
+
+/**
+ * efuse_readahead_end
+ *
+ * Works out how far past @last this read should decrypt. The window
+ * doubles with each sequential read, up to -r, and is only refilled
+ * once half of it has been consumed, so that the lower file is read in
+ * large runs.
+ */
+static uint64_t efuse_readahead_end(struct efuse *ef, struct efuse_file *f,
+				    uint64_t first, uint64_t last)
+{
+	uint64_t end = (last + 1);
+
+	pthread_mutex_lock(&f->lock);
+	if (first != f->next_extent || !ef->max_readahead) {
+		f->readahead = 0;
+		f->readahead_end = (last + 1);
+	} else {
+		if (!f->readahead)
+			f->readahead = EFUSE_MIN_READAHEAD;
+		else if (f->readahead < ef->max_readahead)
+			f->readahead *= 2;
+		if (f->readahead > ef->max_readahead)
+			f->readahead = ef->max_readahead;
+		if (f->readahead_end < (last + 1))
+			f->readahead_end = (last + 1);
+		if (f->readahead_end - (last + 1) <= (f->readahead / 2)) {
+			end = (last + 1 + f->readahead);
+			if (end > f->num_extents)
+				end = f->num_extents;
+			if (end < (last + 1))
+				end = (last + 1);
+			f->readahead_end = end;
+		}
+	}
+	f->next_extent = (last + 1);
+	pthread_mutex_unlock(&f->lock);
+	return end;
+}
+
+static int efuse_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	struct efuse *ef = efuse_get();
+	struct efuse_file *f = (struct efuse_file *)(uintptr_t)fi->fh;
+	struct ecryptfs_extent_ctx *ctx = NULL;
+	char *plain = NULL;
+	char *cipher = NULL;
+	uint64_t first, last, end, i;
+	int rc = 0;
+
+	if (offset < 0)
+		return -EINVAL;
+	if ((uint64_t)offset >= f->upper_size || !size)
+		return 0;
+	if (size > f->upper_size - offset)
+		size = (f->upper_size - offset);
+	first = (offset / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	last = ((offset + size - 1) / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	end = efuse_readahead_end(ef, f, first, last);
+	plain = malloc((last - first + 1) * ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	if (!plain) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = first; i < end; ) {
+		uint64_t j;
+
+		if (efuse_cache_get(&ef->cache, &f->id, i, (i <= last)
+				    ? &plain[(i - first)
+					     * ECRYPTFS_DEFAULT_EXTENT_SIZE]
+				    : NULL)) {
+			i++;
+			continue;
+		}
+		for (j = (i + 1); j < end && (j - i) < EFUSE_MAX_RUN; j++)
+			if (efuse_cache_get(&ef->cache, &f->id, j, NULL))
+				break;
+		if (!cipher) {
+			cipher = malloc(EFUSE_MAX_RUN
+					* ECRYPTFS_DEFAULT_EXTENT_SIZE);
+			ctx = efuse_get_ctx(f);
+			if (!cipher || !ctx) {
+				rc = -ENOMEM;
+				goto out;
+			}
+		}
+		rc = efuse_read_run(ef, f, ctx, cipher, i, (j - i), plain,
+				    first, last);
+		if (rc && i > last) {
+			/* Readahead is only a hint */
+			rc = 0;
+			break;
+		}
+		if (rc)
+			goto out;
+		i = j;
+	}
+	memcpy(buf, &plain[offset - (first * ECRYPTFS_DEFAULT_EXTENT_SIZE)],
+	       size);
+	rc = size;
+out:
+	if (ctx)
+		efuse_put_ctx(f, ctx);
+	free(cipher);
+	free(plain);
+	return rc;
+}
+
+static int efuse_statfs(const char *path, struct statvfs *st)
+{
+	struct efuse *ef = efuse_get();
+
+	if (fstatvfs(ef->root_fd, st))
+		return -errno;
+	return 0;
+}
+
+static int efuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct efuse *ef = efuse_get();
+	char lower[PATH_MAX];
+	int fd;
+	int rc;
+
+	rc = efuse_lower_path(ef, path, lower, sizeof(lower));
+	if (rc)
+		return rc;
+	fd = openat(ef->root_fd, lower, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	fi->fh = fd;
+	return 0;
+}
+
+static int efuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	close(fi->fh);
+	return 0;
+}
+
+static void efuse_dir_free(struct efuse_dir *dir)
+{
+	size_t i;
+
+	for (i = 0; i < dir->count; i++)
+		free(dir->ents[i].name);
+	free(dir->ents);
+	free(dir);
+}
+
+static void efuse_dir_put(struct efuse *ef, struct efuse_dir *dir)
+{
+	int refs;
+
+	pthread_mutex_lock(&ef->dir_lock);
+	refs = --dir->refs;
+	pthread_mutex_unlock(&ef->dir_lock);
+	if (!refs)
+		efuse_dir_free(dir);
+}
+
+/**
+ * efuse_dir_add_batch
+ *
+ * Names that do not decrypt are left out of the listing, as the kernel
+ * does.
+ */
+static int efuse_dir_add_batch(struct efuse *ef, struct efuse_dir *dir,
+			       struct ecryptfs_filename *batch,
+			       struct dirent *ents, size_t count)
+{
+	struct ecryptfs_fn_ctx *ctx = efuse_fn_ctx(ef);
+	size_t i;
+	int rc;
+
+	if (!ctx)
+		return -ENOMEM;
+	rc = ecryptfs_decrypt_filenames(ctx, batch, count);
+	if (rc)
+		return rc;
+	for (i = 0; i < count; i++) {
+		struct efuse_dirent *ent = &dir->ents[dir->count];
+
+		if (batch[i].rc)
+			continue;
+		ent->name = strdup(batch[i].upper);
+		if (!ent->name)
+			return -ENOMEM;
+		ent->ino = ents[i].d_ino;
+		ent->type = ents[i].d_type;
+		dir->count++;
+	}
+	return 0;
+}
+
+/**
+ * efuse_dir_read
+ * @fd: The lower directory; left open and unmoved
+ */
+static int efuse_dir_read(struct efuse *ef, int fd, struct efuse_dir *dir)
+{
+	struct ecryptfs_filename *batch = NULL;
+	struct dirent *ents = NULL;
+	struct dirent *de;
+	size_t alloc = 0;
+	size_t count = 0;
+	DIR *d;
+	int dup_fd;
+	int rc = 0;
+
+	dup_fd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+	if (dup_fd == -1)
+		return -errno;
+	d = fdopendir(dup_fd);
+	if (!d) {
+		rc = -errno;
+		close(dup_fd);
+		return rc;
+	}
+	batch = calloc(EFUSE_DIR_BATCH, sizeof(*batch));
+	ents = calloc(EFUSE_DIR_BATCH, sizeof(*ents));
+	if (!batch || !ents) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	while ((de = readdir(d))) {
+		if (dir->count + count == alloc) {
+			struct efuse_dirent *grown;
+
+			alloc = alloc ? (alloc * 2) : 64;
+			grown = realloc(dir->ents, alloc * sizeof(*grown));
+			if (!grown) {
+				rc = -ENOMEM;
+				goto out;
+			}
+			dir->ents = grown;
+		}
+		ents[count] = (*de);
+		batch[count].lower = ents[count].d_name;
+		batch[count].lower_size = strlen(ents[count].d_name);
+		if (++count == EFUSE_DIR_BATCH) {
+			rc = efuse_dir_add_batch(ef, dir, batch, ents, count);
+			if (rc)
+				goto out;
+			count = 0;
+		}
+	}
+	if (count)
+		rc = efuse_dir_add_batch(ef, dir, batch, ents, count);
+out:
+	closedir(d);
+	free(batch);
+	free(ents);
+	return rc;
+}
+
+/**
+ * efuse_dir_get
+ *
+ * Returns a reference to the decrypted listing of the lower directory
+ * @fd, cached until the directory's mtime or ctime moves on. The
+ * listing is built outside the lock.
+ */
+static int efuse_dir_get(struct efuse *ef, int fd, struct efuse_dir **dir)
+{
+	struct efuse_dir *new_dir;
+	struct efuse_dir *old = NULL;
+	struct efuse_dir **slot;
+	struct stat st;
+	int rc;
+
+	if (fstat(fd, &st))
+		return -errno;
+	slot = &ef->dirs[(((uint64_t)st.st_ino * 0x9e3779b97f4a7c15ULL)
+			  ^ st.st_dev) % EFUSE_DIR_SLOTS];
+	pthread_mutex_lock(&ef->dir_lock);
+	if ((*slot) && (*slot)->dev == st.st_dev && (*slot)->ino == st.st_ino
+	    && (*slot)->mtime.tv_sec == st.st_mtim.tv_sec
+	    && (*slot)->mtime.tv_nsec == st.st_mtim.tv_nsec
+	    && (*slot)->ctime.tv_sec == st.st_ctim.tv_sec
+	    && (*slot)->ctime.tv_nsec == st.st_ctim.tv_nsec) {
+		(*dir) = (*slot);
+		(*dir)->refs++;
+		pthread_mutex_unlock(&ef->dir_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&ef->dir_lock);
+	new_dir = calloc(1, sizeof(*new_dir));
+	if (!new_dir)
+		return -ENOMEM;
+	new_dir->dev = st.st_dev;
+	new_dir->ino = st.st_ino;
+	new_dir->mtime = st.st_mtim;
+	new_dir->ctime = st.st_ctim;
+	rc = efuse_dir_read(ef, fd, new_dir);
+	if (rc) {
+		efuse_dir_free(new_dir);
+		return rc;
+	}
+	new_dir->refs = 2;
+	pthread_mutex_lock(&ef->dir_lock);
+	old = (*slot);
+	(*slot) = new_dir;
+	if (old && --old->refs)
+		old = NULL;
+	pthread_mutex_unlock(&ef->dir_lock);
+	if (old)
+		efuse_dir_free(old);
+	(*dir) = new_dir;
+	return 0;
+}
+
+static int efuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	struct efuse *ef = efuse_get();
+	struct efuse_dir *dir = NULL;
+	struct stat st;
+	size_t i;
+	int rc;
+
+	rc = efuse_dir_get(ef, fi->fh, &dir);
+	if (rc)
+		return rc;
+	memset(&st, 0, sizeof(st));
+	for (i = 0; i < dir->count; i++) {
+		st.st_ino = dir->ents[i].ino;
+		st.st_mode = (dir->ents[i].type << 12);
+		if (filler(buf, dir->ents[i].name, &st, 0, 0))
+			break;
+	}
+	efuse_dir_put(ef, dir);
+	return 0;
+}
+
+static void *efuse_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	cfg->use_ino = 1;
+	cfg->auto_cache = 1;
+	return efuse_get();
+}
+
+static void efuse_destroy(void *private_data)
+{
+	struct efuse *ef = private_data;
+	int i;
+
+	for (i = 0; i < EFUSE_DIR_SLOTS; i++)
+		if (ef->dirs[i])
+			efuse_dir_free(ef->dirs[i]);
+	efuse_cache_destroy(&ef->cache);
+}
+
+static const struct fuse_operations efuse_ops = {
+	.getattr = efuse_getattr,
+	.readlink = efuse_readlink,
+	.open = efuse_open,
+	.read = efuse_read,
+	.statfs = efuse_statfs,
+	.release = efuse_release,
+	.opendir = efuse_opendir,
+	.readdir = efuse_readdir,
+	.releasedir = efuse_releasedir,
+	.init = efuse_init,
+	.destroy = efuse_destroy,
+};
+
+int main(int argc, char **argv)
+{
+	static struct efuse ef;
+	char **fuse_argv = NULL;
+	char *wrapped_file = NULL;
+	char *fuse_opts = NULL;
+	int cache_mb = EFUSE_DEFAULT_CACHE_MB;
+	int readahead = EFUSE_DEFAULT_READAHEAD;
+	int key_bytes = 16;
+	int fuse_argc = 0;
+	int key_init = 0;
+	char *lower_dir;
+	int c;
+	int i;
+	int rc = 0;
+
+	ef.root_fd = -1;
+	pthread_mutex_init(&ef.kek_lock, NULL);
+	pthread_mutex_init(&ef.dir_lock, NULL);
+	while ((c = getopt(argc, argv, "+w:k:c:r:h")) != -1) {
+		switch (c) {
+		case 'w':
+			wrapped_file = optarg;
+			break;
+		case 'k':
+			key_bytes = atoi(optarg);
+			break;
+		case 'c':
+			cache_mb = atoi(optarg);
+			break;
+		case 'r':
+			readahead = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	ef.fn_cipher_code = ecryptfs_code_for_cipher_string("aes", key_bytes);
+	if ((argc - optind) < 2 || !ef.fn_cipher_code || cache_mb < 0
+	    || readahead < 0) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	ef.fn_key_bytes = key_bytes;
+	lower_dir = argv[optind];
+	ef.root_fd = open(lower_dir, O_RDONLY | O_DIRECTORY);
+	if (ef.root_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", lower_dir);
+		goto out;
+	}
+	rc = efuse_cache_init(&ef.cache, (((size_t)cache_mb << 20)
+					  / ECRYPTFS_DEFAULT_EXTENT_SIZE));
+	if (rc)
+		goto out;
+	ef.max_readahead = ef.cache.max ? readahead : 0;
+	if (ef.max_readahead > ef.cache.max / 4)
+		ef.max_readahead = (ef.cache.max / 4);
+	rc = ecryptfs_utils_get_passphrase(ef.passphrase, wrapped_file, NULL);
+	if (rc)
+		goto out;
+	rc = ecryptfs_derive_fnek(ef.fnek, ef.fnek_sig, ef.passphrase);
+	if (rc) {
+		fprintf(stderr, "Error deriving the filename key; rc = [%d]\n",
+			rc);
+		goto out;
+	}
+	rc = pthread_key_create(&ef.fn_key, efuse_fn_ctx_destroy);
+	if (rc) {
+		rc = -rc;
+		goto out;
+	}
+	key_init = 1;
+	/* NSS does not survive the fork when FUSE goes into the
+	 * background; the library initializes it again on first use */
+	NSS_Shutdown();
+	if (asprintf(&fuse_opts, "ro,default_permissions,subtype=ecryptfs%s%s",
+		     strchr(lower_dir, ',') ? "" : ",fsname=",
+		     strchr(lower_dir, ',') ? "" : lower_dir) == -1) {
+		fuse_opts = NULL;
+		rc = -ENOMEM;
+		goto out;
+	}
+	fuse_argv = calloc(argc + 3, sizeof(*fuse_argv));
+	if (!fuse_argv) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = "-o";
+	fuse_argv[fuse_argc++] = fuse_opts;
+	for (i = (optind + 1); i < argc; i++)
+		fuse_argv[fuse_argc++] = argv[i];
+	rc = fuse_main(fuse_argc, fuse_argv, &efuse_ops, &ef);
+out:
+	if (key_init)
+		pthread_key_delete(ef.fn_key);
+	if (ef.root_fd != -1)
+		close(ef.root_fd);
+	memset(ef.passphrase, 0, sizeof(ef.passphrase));
+	memset(ef.fnek, 0, sizeof(ef.fnek));
+	memset(ef.keks, 0, sizeof(ef.keks));
+	free(fuse_argv);
+	free(fuse_opts);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,685 @@
+/**
+ * ecryptfs-hmac-tree: Build, verify and incrementally update HMAC trees
+ * over the ciphertext extents of the files in an eCryptfs lower
+ * directory
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+#include "walker.h"
+
+/* Extents read per system call while hashing a whole file */
+#define HTREE_BATCH_EXTENTS 256
+
+enum htree_cmd {
+	HTREE_BUILD,
+	HTREE_VERIFY,
+	HTREE_UPDATE,
+};
+
+struct htree_totals {
+	uint64_t files;
+	uint64_t ok;
+	uint64_t mismatched;
+	uint64_t missing;
+	uint64_t skipped;
+	uint64_t failed;
+	uint64_t extents;
+};
+
+struct htree_worker {
+	struct htree_totals totals;
+	char *buf;
+};
+
+/**
+ * struct htree - State shared by every worker
+ * @store_fd: Directory holding one sidecar per lower file, at the same
+ *            relative path
+ * @root_len: Length of the lower root; entry paths start with it
+ */
+struct htree {
+	enum htree_cmd cmd;
+	unsigned char key[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+	int store_fd;
+	size_t root_len;
+	struct htree_worker *workers;
+	pthread_mutex_t out_lock;
+};
+
+/**
+ * A lower file opened for hashing
+ * @meta: The header region, or the value of the metadata xattr
+ * @header_size: Bytes in front of the first extent
+ */
+struct htree_file {
+	int fd;
+	uint64_t lower_size;
+	uint64_t header_size;
+	uint64_t num_extents;
+	char meta[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE * 2];
+	size_t meta_size;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s build -s <store> [-w <wrapped-passphrase-file>] "
+		"[-t <threads>] <lower-dir>\n"
+		"%s verify -s <store> [-w <wrapped-passphrase-file>] "
+		"[-t <threads>] <lower-dir>\n"
+		"%s verify -s <store> [-w <wrapped-passphrase-file>] "
+		"-e <first>[-<last>] <lower-dir> <file>\n"
+		"%s update -s <store> [-w <wrapped-passphrase-file>] "
+		"-e <first>[-<last>] <lower-dir> <file>\n\n"
+		"Keeps, in <store>, an HMAC tree over the ciphertext extents of "
+		"each file in the\n"
+		"eCryptfs lower directory <lower-dir>, keyed from the mount "
+		"passphrase read\n"
+		"from stdin.\n\n"
+		"  build   Hash every file and write its tree\n"
+		"  verify  Hash every file and check it against its tree; with "
+		"-e, check only\n"
+		"          those extents of <file>, relative to <lower-dir>\n"
+		"  update  Record new contents for those extents of <file>\n\n"
+		"  -s  Directory holding the trees\n"
+		"  -w  Unwrap the mount passphrase from this file\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -e  Range of extents, counted from zero\n",
+		name, name, name, name);
+}
+
+/**
+ * htree_open_file
+ *
+ * Returns zero on success; -ENODATA if @path is not an eCryptfs file
+ */
+static int htree_open_file(struct htree_file *f, int dirfd, const char *name)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	struct stat st;
+	ssize_t got;
+	int rc;
+
+	f->fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if (f->fd == -1)
+		return -errno;
+	if (fstat(f->fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	f->lower_size = st.st_size;
+	rc = ecryptfs_read_lower_metadata(f->fd, f->meta, sizeof(f->meta),
+					  &crypt_stat, &packet_set,
+					  &f->header_size);
+	if (rc) {
+		rc = -ENODATA;
+		goto out;
+	}
+	if (f->header_size) {
+		if (f->header_size > sizeof(f->meta)
+		    || f->header_size > f->lower_size) {
+			rc = -EINVAL;
+			goto out;
+		}
+		got = pread(f->fd, f->meta, f->header_size, 0);
+		if (got != (ssize_t)f->header_size) {
+			rc = -EIO;
+			goto out;
+		}
+	} else {
+		got = fgetxattr(f->fd, ECRYPTFS_XATTR_NAME, f->meta,
+				sizeof(f->meta));
+		if (got < 0) {
+			rc = -errno;
+			goto out;
+		}
+	}
+	f->meta_size = got;
+	f->num_extents = ((f->lower_size - f->header_size
+			   + ECRYPTFS_DEFAULT_EXTENT_SIZE - 1)
+			  / ECRYPTFS_DEFAULT_EXTENT_SIZE);
+out:
+	if (rc) {
+		close(f->fd);
+		f->fd = -1;
+	}
+	return rc;
+}
+
+static ssize_t htree_read_extent(struct htree_file *f, char *buf,
+				 uint64_t index)
+{
+	return pread(f->fd, buf, ECRYPTFS_DEFAULT_EXTENT_SIZE,
+		     (f->header_size + (index * ECRYPTFS_DEFAULT_EXTENT_SIZE)));
+}
+
+/**
+ * htree_hash_file
+ * @tree: Set to a new tree over every extent of @f
+ */
+static int htree_hash_file(struct htree *ht, struct htree_worker *w,
+			   struct htree_file *f,
+			   struct ecryptfs_hmac_tree **tree)
+{
+	struct ecryptfs_hmac_tree *new_tree;
+	uint64_t extent = 0;
+	int rc;
+
+	rc = ecryptfs_hmac_tree_create(&new_tree, ht->key, f->num_extents,
+				       f->lower_size);
+	if (rc)
+		return rc;
+	posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (extent < f->num_extents) {
+		ssize_t got;
+		size_t i;
+
+		got = pread(f->fd, w->buf, (HTREE_BATCH_EXTENTS
+					    * ECRYPTFS_DEFAULT_EXTENT_SIZE),
+			    (f->header_size
+			     + (extent * ECRYPTFS_DEFAULT_EXTENT_SIZE)));
+		if (got <= 0) {
+			rc = (got < 0) ? -errno : -EAGAIN;
+			goto out;
+		}
+		for (i = 0; i < (size_t)got && extent < f->num_extents;
+		     i += ECRYPTFS_DEFAULT_EXTENT_SIZE, extent++) {
+			size_t len = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+
+			if (got - i < len)
+				len = (got - i);
+			rc = ecryptfs_hmac_tree_set_leaf(new_tree, extent,
+							 &w->buf[i], len);
+			if (rc)
+				goto out;
+		}
+	}
+	w->totals.extents += f->num_extents;
+	rc = ecryptfs_hmac_tree_set_binding(new_tree, f->meta, f->meta_size);
+	if (!rc)
+		rc = ecryptfs_hmac_tree_build(new_tree);
+out:
+	if (rc)
+		ecryptfs_hmac_tree_destroy(new_tree);
+	else
+		(*tree) = new_tree;
+	return rc;
+}
+
+static int htree_write_sidecar(struct htree *ht, const char *rel,
+			       struct ecryptfs_hmac_tree *tree)
+{
+	int fd;
+	int rc;
+
+	fd = openat(ht->store_fd, rel, O_WRONLY | O_CREAT | O_NOFOLLOW,
+		    S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return -errno;
+	rc = ecryptfs_hmac_tree_write(tree, fd);
+	if (close(fd) && !rc)
+		rc = -errno;
+	return rc;
+}
+
+static int htree_read_sidecar(struct htree *ht, const char *rel,
+			      struct ecryptfs_hmac_tree **tree, int flags,
+			      int *sidecar_fd)
+{
+	int fd;
+	int rc;
+
+	fd = openat(ht->store_fd, rel, flags | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	rc = ecryptfs_hmac_tree_read(tree, ht->key, fd);
+	if (rc || !sidecar_fd)
+		close(fd);
+	else
+		(*sidecar_fd) = fd;
+	return rc;
+}
+
+static void htree_error(const char *path, int rc)
+{
+	if (rc == -ENOKEY)
+		fprintf(stderr, "The tree of [%s] was built with another "
+			"passphrase\n", path);
+	else
+		fprintf(stderr, "Error processing [%s]; rc = [%d]\n", path,
+			rc);
+}
+
+static void htree_report(struct htree *ht, const char *path,
+			 const char *what)
+{
+	pthread_mutex_lock(&ht->out_lock);
+	printf("%s: %s\n", path, what);
+	pthread_mutex_unlock(&ht->out_lock);
+}
+
+/**
+ * htree_verify_file
+ *
+ * A fresh tree over the file has the root of the stored one only if
+ * every extent and the metadata are unchanged; the stored leaves only
+ * serve to point at the first extent that differs.
+ */
+static int htree_verify_file(struct htree *ht, struct htree_worker *w,
+			     const char *path, const char *rel,
+			     struct ecryptfs_hmac_tree *fresh)
+{
+	struct ecryptfs_hmac_tree *stored = NULL;
+	uint64_t first_bad;
+	char what[64];
+	int rc;
+
+	rc = htree_read_sidecar(ht, rel, &stored, O_RDONLY, NULL);
+	if (rc == -ENOENT) {
+		htree_report(ht, path, "no tree");
+		w->totals.missing++;
+		return 0;
+	}
+	if (rc)
+		return rc;
+	rc = ecryptfs_hmac_tree_compare(fresh, stored, &first_bad);
+	if (rc == -EBADMSG) {
+		if (ecryptfs_hmac_tree_num_leaves(fresh)
+		    != ecryptfs_hmac_tree_num_leaves(stored))
+			snprintf(what, sizeof(what), "size changed");
+		else if (first_bad < ecryptfs_hmac_tree_num_leaves(fresh))
+			snprintf(what, sizeof(what), "extent %llu differs",
+				 (unsigned long long)first_bad);
+		else
+			snprintf(what, sizeof(what),
+				 "metadata or tree differs");
+		htree_report(ht, path, what);
+		w->totals.mismatched++;
+		rc = 0;
+	} else if (!rc)
+		w->totals.ok++;
+	ecryptfs_hmac_tree_destroy(stored);
+	return rc;
+}
+
+static int htree_visit(struct ecryptfs_walk_entry *entry, void *priv,
+		       int worker)
+{
+	struct htree *ht = priv;
+	struct htree_worker *w = &ht->workers[worker];
+	const char *rel = (entry->path + ht->root_len + 1);
+	struct ecryptfs_hmac_tree *tree = NULL;
+	struct htree_file f;
+	struct stat st;
+	int rc;
+
+	if (fstatat(entry->dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW)) {
+		fprintf(stderr, "Error reading [%s]: %m\n", entry->path);
+		w->totals.failed++;
+		return 0;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (ht->cmd == HTREE_BUILD
+		    && mkdirat(ht->store_fd, rel, S_IRWXU) && errno != EEXIST)
+			fprintf(stderr, "Error creating [%s] in the store: "
+				"%m\n", rel);
+		return 0;
+	}
+	if (!S_ISREG(st.st_mode))
+		return 0;
+	w->totals.files++;
+	rc = htree_open_file(&f, entry->dirfd, entry->name);
+	if (rc == -ENODATA) {
+		w->totals.skipped++;
+		return 0;
+	}
+	if (!rc) {
+		rc = htree_hash_file(ht, w, &f, &tree);
+		close(f.fd);
+	}
+	if (!rc && ht->cmd == HTREE_BUILD) {
+		rc = htree_write_sidecar(ht, rel, tree);
+		if (!rc)
+			w->totals.ok++;
+	} else if (!rc)
+		rc = htree_verify_file(ht, w, entry->path, rel, tree);
+	ecryptfs_hmac_tree_destroy(tree);
+	if (rc) {
+		htree_error(entry->path, rc);
+		w->totals.failed++;
+	}
+	return 0;
+}
+
+/**
+ * htree_extents
+ *
+ * Checks or records extents @first to @last of one file, rehashing
+ * only the nodes on their paths to the root. A file whose number of
+ * extents changed has a differently shaped tree, and an update
+ * rebuilds it whole.
+ */
+static int htree_extents(struct htree *ht, struct htree_worker *w,
+			 const char *root, const char *rel, uint64_t first,
+			 uint64_t last)
+{
+	struct ecryptfs_hmac_tree *tree = NULL;
+	struct htree_file f;
+	char *path = NULL;
+	int sidecar_fd = -1;
+	uint64_t i;
+	int rc;
+
+	f.fd = -1;
+	w->totals.files++;
+	if (asprintf(&path, "%s/%s", root, rel) == -1) {
+		path = NULL;
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = htree_open_file(&f, AT_FDCWD, path);
+	if (rc)
+		goto out;
+	rc = htree_read_sidecar(ht, rel, &tree, (ht->cmd == HTREE_UPDATE)
+				? O_RDWR : O_RDONLY, &sidecar_fd);
+	if (rc)
+		goto out;
+	if (ecryptfs_hmac_tree_num_leaves(tree) != f.num_extents) {
+		if (ht->cmd == HTREE_VERIFY) {
+			htree_report(ht, path, "size changed");
+			w->totals.mismatched++;
+			goto out;
+		}
+		ecryptfs_hmac_tree_destroy(tree);
+		tree = NULL;
+		printf("%s: size changed; rebuilding the whole tree\n", path);
+		rc = htree_hash_file(ht, w, &f, &tree);
+		if (!rc)
+			rc = ecryptfs_hmac_tree_write(tree, sidecar_fd);
+		if (!rc)
+			w->totals.ok++;
+		goto out;
+	}
+	if (last >= f.num_extents) {
+		rc = -ERANGE;
+		goto out;
+	}
+	if (ht->cmd == HTREE_VERIFY
+	    && ecryptfs_hmac_tree_check_binding(tree, f.meta, f.meta_size)) {
+		htree_report(ht, path, "metadata differs");
+		w->totals.mismatched++;
+		goto out;
+	}
+	for (i = first; i <= last; i++) {
+		unsigned char leaf[ECRYPTFS_HMAC_TREE_NODE_SIZE];
+		ssize_t got = htree_read_extent(&f, w->buf, i);
+
+		if (got <= 0) {
+			rc = (got < 0) ? -errno : -EAGAIN;
+			goto out;
+		}
+		if (ht->cmd == HTREE_UPDATE) {
+			rc = ecryptfs_hmac_tree_replace_leaf(tree, i, w->buf,
+							     got);
+		} else {
+			rc = ecryptfs_hmac_tree_hash_leaf(tree, leaf, i,
+							  w->buf, got);
+			if (!rc)
+				rc = ecryptfs_hmac_tree_verify_leaf(tree, i,
+								    leaf);
+		}
+		if (rc == -EBADMSG) {
+			char what[64];
+
+			snprintf(what, sizeof(what), (ht->cmd == HTREE_UPDATE)
+				 ? "tree differs at extent %llu"
+				 : "extent %llu differs",
+				 (unsigned long long)i);
+			htree_report(ht, path, what);
+			w->totals.mismatched++;
+			rc = 0;
+			goto out;
+		}
+		if (rc)
+			goto out;
+		w->totals.extents++;
+	}
+	if (ht->cmd == HTREE_UPDATE) {
+		rc = ecryptfs_hmac_tree_rebind(tree, f.meta, f.meta_size);
+		for (i = first; !rc && i <= last; i++)
+			rc = ecryptfs_hmac_tree_write_path(tree, sidecar_fd, i);
+	}
+	if (!rc)
+		w->totals.ok++;
+out:
+	if (rc) {
+		htree_error(path ? path : rel, rc);
+		w->totals.failed++;
+	}
+	ecryptfs_hmac_tree_destroy(tree);
+	if (sidecar_fd != -1 && close(sidecar_fd) && !rc)
+		rc = -errno;
+	if (f.fd != -1)
+		close(f.fd);
+	free(path);
+	return rc;
+}
+
+/**
+ * htree_get_key
+ *
+ * Reads the mount passphrase, or unwraps it with -w, and derives the
+ * tree key from it
+ */
+static int htree_get_key(unsigned char *key, char *wrapped_file)
+{
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	int rc;
+
+	rc = ecryptfs_utils_get_passphrase(passphrase, wrapped_file, NULL);
+	if (!rc)
+		rc = ecryptfs_derive_hmac_tree_key(key, passphrase);
+	memset(passphrase, 0, sizeof(passphrase));
+	return rc;
+}
+
+static int htree_parse_range(const char *arg, uint64_t *first,
+			     uint64_t *last)
+{
+	char *end;
+
+	(*first) = strtoull(arg, &end, 10);
+	if (end == arg)
+		return -EINVAL;
+	if (*end == '-') {
+		arg = (end + 1);
+		(*last) = strtoull(arg, &end, 10);
+		if (end == arg)
+			return -EINVAL;
+	} else
+		(*last) = (*first);
+	if (*end || (*last) < (*first))
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct htree_totals sum;
+	struct ecryptfs_walk walk;
+	struct htree ht;
+	char *store = NULL;
+	char *wrapped_file = NULL;
+	char *range = NULL;
+	uint64_t first = 0, last = 0;
+	int num_threads = 0;
+	char *cmd;
+	char *root;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&ht, 0, sizeof(ht));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	ht.store_fd = -1;
+	pthread_mutex_init(&ht.out_lock, NULL);
+	while ((c = getopt(argc, argv, "s:w:t:e:h")) != -1) {
+		switch (c) {
+		case 's':
+			store = optarg;
+			break;
+		case 'w':
+			wrapped_file = optarg;
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'e':
+			range = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if ((argc - optind) < 2 || !store || num_threads < 0
+	    || (range && htree_parse_range(range, &first, &last))) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	cmd = argv[optind];
+	if (!strcmp(cmd, "build"))
+		ht.cmd = HTREE_BUILD;
+	else if (!strcmp(cmd, "verify"))
+		ht.cmd = HTREE_VERIFY;
+	else if (!strcmp(cmd, "update"))
+		ht.cmd = HTREE_UPDATE;
+	else
+		cmd = NULL;
+	if (!cmd || (ht.cmd == HTREE_UPDATE && !range)
+	    || (ht.cmd == HTREE_BUILD && range)
+	    || (argc - optind) != (range ? 3 : 2)) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	root = argv[optind + 1];
+	while (strlen(root) > 1 && root[strlen(root) - 1] == '/')
+		root[strlen(root) - 1] = '\0';
+	ht.root_len = strlen(root);
+	if (ht.cmd == HTREE_BUILD && mkdir(store, S_IRWXU) && errno != EEXIST) {
+		rc = -errno;
+		fprintf(stderr, "Error creating [%s]: %m\n", store);
+		goto out;
+	}
+	ht.store_fd = open(store, O_RDONLY | O_DIRECTORY);
+	if (ht.store_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", store);
+		goto out;
+	}
+	rc = htree_get_key(ht.key, wrapped_file);
+	if (rc) {
+		fprintf(stderr, "Error deriving the tree key; rc = [%d]\n",
+			rc);
+		goto out;
+	}
+	num_threads = range ? 1 : ecryptfs_walk_num_threads(num_threads);
+	ht.workers = calloc(num_threads, sizeof(*ht.workers));
+	if (!ht.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		ht.workers[i].buf = malloc(HTREE_BATCH_EXTENTS
+					   * ECRYPTFS_DEFAULT_EXTENT_SIZE);
+		if (!ht.workers[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	if (range) {
+		rc = htree_extents(&ht, &ht.workers[0], root,
+				   argv[optind + 2], first, last);
+	} else {
+		walk.num_threads = num_threads;
+		walk.flags = (ECRYPTFS_WALK_DIRS | ECRYPTFS_WALK_XDEV);
+		walk.fn = htree_visit;
+		walk.priv = &ht;
+		rc = ecryptfs_walk_tree(&walk, root);
+		if (rc)
+			fprintf(stderr, "Error walking [%s]; rc = [%d]\n",
+				root, rc);
+	}
+	for (i = 0; i < num_threads; i++) {
+		struct htree_totals *t = &ht.workers[i].totals;
+
+		sum.files += t->files;
+		sum.ok += t->ok;
+		sum.mismatched += t->mismatched;
+		sum.missing += t->missing;
+		sum.skipped += t->skipped;
+		sum.failed += t->failed;
+		sum.extents += t->extents;
+	}
+	printf("Files: [%llu]\n", (unsigned long long)sum.files);
+	printf("%s: [%llu]\n", (ht.cmd == HTREE_VERIFY) ? "Verified"
+	       : (ht.cmd == HTREE_BUILD) ? "Built" : "Updated",
+	       (unsigned long long)sum.ok);
+	if (ht.cmd == HTREE_VERIFY || ht.cmd == HTREE_UPDATE)
+		printf("Mismatched: [%llu]\n",
+		       (unsigned long long)sum.mismatched);
+	if (ht.cmd == HTREE_VERIFY && !range)
+		printf("Without a tree: [%llu]\n",
+		       (unsigned long long)sum.missing);
+	printf("Not eCryptfs files: [%llu]\n", (unsigned long long)sum.skipped);
+	printf("Failed: [%llu]\n", (unsigned long long)sum.failed);
+	printf("Extents hashed: [%llu]\n", (unsigned long long)sum.extents);
+	if (!rc && (sum.mismatched || sum.missing || sum.failed
+		    || walk.num_errors))
+		rc = -EIO;
+out:
+	if (ht.workers) {
+		for (i = 0; i < num_threads; i++)
+			free(ht.workers[i].buf);
+		free(ht.workers);
+	}
+	if (ht.store_fd != -1)
+		close(ht.store_fd);
+	memset(ht.key, 0, sizeof(ht.key));
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,625 @@
+/**
+ * ecryptfs-import: Populate an eCryptfs lower directory straight from a
+ * plaintext tree, without going through a mount
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+#include "walker.h"
+
+/* Extents read, encrypted and written per system call */
+#define IMPORT_BATCH_EXTENTS 64
+
+struct import_totals {
+	uint64_t files;
+	uint64_t dirs;
+	uint64_t symlinks;
+	uint64_t bytes;
+	uint64_t skipped;
+	uint64_t failed;
+};
+
+/**
+ * @buf: IMPORT_BATCH_EXTENTS extents of plaintext, encrypted in place
+ * @fn_ctx: Filename context; NULL unless filenames are encrypted
+ */
+struct import_worker {
+	char *buf;
+	struct ecryptfs_fn_ctx *fn_ctx;
+	struct import_totals totals;
+};
+
+/**
+ * Directory whose mode, owner and times are applied once the walk is
+ * over, so that creating its children does not disturb them
+ */
+struct import_dir {
+	char *lower_path;
+	struct stat st;
+	struct import_dir *next;
+};
+
+/**
+ * struct import - State shared by every worker
+ * @src_len: Length of the source root; entry paths start with it
+ * @dst_fd: The lower directory being populated
+ * @flags: ECRYPTFS_ENCRYPTED plus ECRYPTFS_METADATA_IN_XATTR and
+ *         ECRYPTFS_ENCRYPT_FILENAMES as requested
+ * @fekek, @sig, @salt: The mount passphrase key
+ */
+struct import {
+	size_t src_len;
+	int dst_fd;
+	uint32_t flags;
+	uint8_t cipher_code;
+	size_t key_size;
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char salt[ECRYPTFS_SALT_SIZE];
+	int set_owner;
+	struct import_worker *workers;
+	pthread_mutex_t dirs_lock;
+	struct import_dir *dirs;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-x] [-f] [-k <key-bytes>] [-t <threads>] "
+		"[-w <wrapped-passphrase-file>] <source> <lower-dir>\n\n"
+		"Encrypts the plaintext tree <source> into <lower-dir>, which "
+		"can then be\n"
+		"mounted with eCryptfs under the same passphrase.\n"
+		"The mount passphrase, or with -w the wrapping passphrase, "
+		"is read from stdin.\n\n"
+		"  -x  Keep the metadata in the user.ecryptfs xattr "
+		"(ecryptfs_xattr_metadata)\n"
+		"  -f  Encrypt filenames (ecryptfs_fnek_sig)\n"
+		"  -k  AES key size in bytes: 16, 24 or 32 (default 16)\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -w  Unwrap the mount passphrase from this file\n",
+		name);
+}
+
+/**
+ * import_lower_path
+ * @rel: Path relative to the source root
+ * @dst: Receives @rel with every component encrypted
+ *
+ * Names are encrypted again for every entry; the filename prefix is
+ * precomputed, so a component costs a single ECB call.
+ */
+static int import_lower_path(struct import_worker *worker, const char *rel,
+			     char *dst, size_t dst_size)
+{
+	size_t len = 0;
+	int rc;
+
+	if (!worker->fn_ctx) {
+		if (strlen(rel) >= dst_size)
+			return -ENAMETOOLONG;
+		strcpy(dst, rel);
+		return 0;
+	}
+	while (*rel) {
+		const char *end = strchrnul(rel, '/');
+
+		if ((dst_size - len) < (NAME_MAX + 2))
+			return -ENAMETOOLONG;
+		if (len)
+			dst[len++] = '/';
+		rc = ecryptfs_encrypt_filename(worker->fn_ctx, &dst[len],
+					       (dst_size - len), rel,
+					       (end - rel));
+		if (rc)
+			return rc;
+		len += strlen(&dst[len]);
+		rel = (*end) ? (end + 1) : end;
+	}
+	dst[len] = '\0';
+	return 0;
+}
+
+/**
+ * import_write_header
+ * @st: Source file; gives the size recorded in the header
+ *
+ * In header mode the metadata takes the first two 4096 byte extents;
+ * in xattr mode it goes to user.ecryptfs and the lower file holds
+ * nothing but extents.
+ */
+static int import_write_header(struct import *imp, int fd, struct stat *st,
+			       const unsigned char *fek)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	char header[ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE];
+	size_t written;
+	int rc;
+
+	memset(header, 0, sizeof(header));
+	memset(&crypt_stat, 0, sizeof(crypt_stat));
+	crypt_stat.flags = imp->flags;
+	crypt_stat.file_size = st->st_size;
+	crypt_stat.num_header_bytes_at_front =
+		ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE;
+	rc = ecryptfs_write_header_metadata(header, &crypt_stat);
+	if (rc)
+		return rc;
+	/* The kernel only looks for packets in the first extent */
+	rc = ecryptfs_write_passphrase_key_packets(
+		(unsigned char *)&header[ECRYPTFS_HEADER_METADATA_BYTES],
+		(ECRYPTFS_DEFAULT_EXTENT_SIZE - ECRYPTFS_HEADER_METADATA_BYTES
+		 - 1), &written, imp->cipher_code, fek, imp->key_size,
+		imp->fekek, imp->sig, imp->salt);
+	if (rc)
+		return rc;
+	if (imp->flags & ECRYPTFS_METADATA_IN_XATTR) {
+		if (fsetxattr(fd, ECRYPTFS_XATTR_NAME, header,
+			      (ECRYPTFS_HEADER_METADATA_BYTES + written + 1),
+			      XATTR_CREATE))
+			return -errno;
+		return 0;
+	}
+	if (pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+		return -EIO;
+	return 0;
+}
+
+static int import_file(struct import *imp, struct import_worker *worker,
+		       int src_fd, int fd, struct stat *st)
+{
+	struct ecryptfs_extent_ctx *ctx = NULL;
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	size_t extent_size = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	off_t header_size = (imp->flags & ECRYPTFS_METADATA_IN_XATTR) ? 0
+		: ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE;
+	uint64_t extent = 0;
+	off_t offset = 0;
+	int rc;
+
+	rc = ecryptfs_generate_fek(fek, imp->key_size);
+	if (rc)
+		goto out;
+	rc = ecryptfs_extent_ctx_create(&ctx, imp->cipher_code, fek,
+					imp->key_size, extent_size);
+	if (rc)
+		goto out;
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (offset < st->st_size) {
+		size_t want = (IMPORT_BATCH_EXTENTS * extent_size);
+		size_t num_extents;
+		ssize_t got;
+
+		if ((uint64_t)(st->st_size - offset) < want)
+			want = (st->st_size - offset);
+		got = pread(src_fd, worker->buf, want, offset);
+		if (got < 0) {
+			rc = -errno;
+			goto out;
+		}
+		/* The file shrank under us; the header size would lie */
+		if ((size_t)got != want) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		num_extents = ((want + extent_size - 1) / extent_size);
+		memset(&worker->buf[want], 0,
+		       ((num_extents * extent_size) - want));
+		rc = ecryptfs_encrypt_extents(ctx, worker->buf, worker->buf,
+					      extent, num_extents);
+		if (rc)
+			goto out;
+		if (pwrite(fd, worker->buf, (num_extents * extent_size),
+			   (header_size + (extent * extent_size)))
+		    != (ssize_t)(num_extents * extent_size)) {
+			rc = -EIO;
+			goto out;
+		}
+		offset += want;
+		extent += num_extents;
+	}
+	/* Written last, so that an interrupted import leaves files the
+	 * kernel refuses rather than files it misreads */
+	rc = import_write_header(imp, fd, st, fek);
+	if (rc)
+		goto out;
+	worker->totals.bytes += st->st_size;
+out:
+	ecryptfs_extent_ctx_destroy(ctx);
+	memset(fek, 0, sizeof(fek));
+	return rc;
+}
+
+static int import_regular(struct import *imp, struct import_worker *worker,
+			  struct ecryptfs_walk_entry *entry,
+			  const char *lower_path)
+{
+	struct timespec times[2];
+	struct stat st;
+	int src_fd;
+	int fd = -1;
+	int rc;
+
+	src_fd = openat(entry->dirfd, entry->name, O_RDONLY | O_NOFOLLOW);
+	if (src_fd == -1)
+		return -errno;
+	if (fstat(src_fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	fd = openat(imp->dst_fd, lower_path,
+		    O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		rc = -errno;
+		goto out;
+	}
+	rc = import_file(imp, worker, src_fd, fd, &st);
+	if (rc) {
+		unlinkat(imp->dst_fd, lower_path, 0);
+		goto out;
+	}
+	if (imp->set_owner && fchown(fd, st.st_uid, st.st_gid)) {
+		rc = -errno;
+		goto out;
+	}
+	if (fchmod(fd, (st.st_mode & 07777))) {
+		rc = -errno;
+		goto out;
+	}
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (futimens(fd, times)) {
+		rc = -errno;
+		goto out;
+	}
+	worker->totals.files++;
+out:
+	if (fd != -1)
+		close(fd);
+	close(src_fd);
+	return rc;
+}
+
+static int import_symlink(struct import *imp, struct import_worker *worker,
+			  struct ecryptfs_walk_entry *entry,
+			  const char *lower_path)
+{
+	char target[PATH_MAX];
+	char lower_target[NAME_MAX + 1];
+	struct timespec times[2];
+	struct stat st;
+	ssize_t len;
+	int rc;
+
+	if (fstatat(entry->dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	len = readlinkat(entry->dirfd, entry->name, target, sizeof(target));
+	if (len < 0)
+		return -errno;
+	if (len == sizeof(target))
+		return -ENAMETOOLONG;
+	target[len] = '\0';
+	/* Like the kernel, encrypt the whole target as a single name */
+	if (worker->fn_ctx) {
+		rc = ecryptfs_encrypt_filename(worker->fn_ctx, lower_target,
+					       sizeof(lower_target), target,
+					       len);
+		if (rc)
+			return rc;
+	}
+	if (symlinkat(worker->fn_ctx ? lower_target : target, imp->dst_fd,
+		      lower_path))
+		return -errno;
+	if (imp->set_owner && fchownat(imp->dst_fd, lower_path, st.st_uid,
+				       st.st_gid, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	utimensat(imp->dst_fd, lower_path, times, AT_SYMLINK_NOFOLLOW);
+	worker->totals.symlinks++;
+	return 0;
+}
+
+static int import_dir(struct import *imp, struct import_worker *worker,
+		      struct ecryptfs_walk_entry *entry,
+		      const char *lower_path)
+{
+	struct import_dir *dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return -ENOMEM;
+	if (fstatat(entry->dirfd, entry->name, &dir->st,
+		    AT_SYMLINK_NOFOLLOW)) {
+		free(dir);
+		return -errno;
+	}
+	dir->lower_path = strdup(lower_path);
+	if (!dir->lower_path) {
+		free(dir);
+		return -ENOMEM;
+	}
+	if (mkdirat(imp->dst_fd, lower_path, S_IRWXU) && errno != EEXIST) {
+		free(dir->lower_path);
+		free(dir);
+		return -errno;
+	}
+	pthread_mutex_lock(&imp->dirs_lock);
+	dir->next = imp->dirs;
+	imp->dirs = dir;
+	pthread_mutex_unlock(&imp->dirs_lock);
+	worker->totals.dirs++;
+	return 0;
+}
+
+static int import_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			int worker_id)
+{
+	struct import *imp = priv;
+	struct import_worker *worker = &imp->workers[worker_id];
+	char lower_path[PATH_MAX];
+	unsigned char d_type = entry->d_type;
+	int rc;
+
+	if (d_type == DT_UNKNOWN) {
+		struct stat st;
+
+		if (fstatat(entry->dirfd, entry->name, &st,
+			    AT_SYMLINK_NOFOLLOW) == 0)
+			d_type = IFTODT(st.st_mode);
+	}
+	if (d_type != DT_REG && d_type != DT_DIR && d_type != DT_LNK) {
+		fprintf(stderr, "Skipping [%s]: not a regular file, directory "
+			"or symlink\n", entry->path);
+		worker->totals.skipped++;
+		return 0;
+	}
+	rc = import_lower_path(worker, (entry->path + imp->src_len + 1),
+			       lower_path, sizeof(lower_path));
+	if (!rc) {
+		if (d_type == DT_REG)
+			rc = import_regular(imp, worker, entry, lower_path);
+		else if (d_type == DT_LNK)
+			rc = import_symlink(imp, worker, entry, lower_path);
+		else
+			rc = import_dir(imp, worker, entry, lower_path);
+	}
+	if (rc) {
+		fprintf(stderr, "Error importing [%s]; rc = [%d]\n",
+			entry->path, rc);
+		worker->totals.failed++;
+	}
+	return 0;
+}
+
+/**
+ * import_finish_dirs
+ *
+ * Children were added after their directory was created, so modes,
+ * owners and times are only applied now.
+ */
+static void import_finish_dirs(struct import *imp)
+{
+	struct import_dir *dir = imp->dirs;
+
+	while (dir) {
+		struct import_dir *next = dir->next;
+		struct timespec times[2];
+
+		if (imp->set_owner)
+			fchownat(imp->dst_fd, dir->lower_path, dir->st.st_uid,
+				 dir->st.st_gid, AT_SYMLINK_NOFOLLOW);
+		fchmodat(imp->dst_fd, dir->lower_path,
+			 (dir->st.st_mode & 07777), 0);
+		times[0] = dir->st.st_atim;
+		times[1] = dir->st.st_mtim;
+		utimensat(imp->dst_fd, dir->lower_path, times,
+			  AT_SYMLINK_NOFOLLOW);
+		free(dir->lower_path);
+		free(dir);
+		dir = next;
+	}
+	imp->dirs = NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct import imp;
+	struct import_totals sum;
+	struct ecryptfs_walk walk;
+	struct stat st;
+	char passphrase[ECRYPTFS_MAX_PASSWORD_LENGTH + 1];
+	char salt_hex[ECRYPTFS_SALT_SIZE_HEX];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char fnek_sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char fnek_sig[ECRYPTFS_SIG_SIZE];
+	char *wrapped_file = NULL;
+	char *src_root;
+	int num_threads = 0;
+	int key_bytes = 16;
+	int i, c;
+	int rc = 0;
+
+	memset(&imp, 0, sizeof(imp));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	memset(passphrase, 0, sizeof(passphrase));
+	memset(fnek, 0, sizeof(fnek));
+	imp.dst_fd = -1;
+	imp.flags = ECRYPTFS_ENCRYPTED;
+	pthread_mutex_init(&imp.dirs_lock, NULL);
+	while ((c = getopt(argc, argv, "xfk:t:w:h")) != -1) {
+		switch (c) {
+		case 'x':
+			imp.flags |= ECRYPTFS_METADATA_IN_XATTR;
+			break;
+		case 'f':
+			imp.flags |= ECRYPTFS_ENCRYPT_FILENAMES;
+			break;
+		case 'k':
+			key_bytes = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'w':
+			wrapped_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	imp.cipher_code = ecryptfs_code_for_cipher_string("aes", key_bytes);
+	if (optind != (argc - 2) || num_threads < 0 || !imp.cipher_code) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	imp.key_size = key_bytes;
+	src_root = argv[optind];
+	if (stat(src_root, &st) || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "[%s] is not a directory\n", src_root);
+		rc = -ENOTDIR;
+		goto out;
+	}
+	/* Entry paths are built from the root with trailing slashes
+	 * stripped */
+	imp.src_len = strlen(src_root);
+	while (imp.src_len > 1 && src_root[imp.src_len - 1] == '/')
+		imp.src_len--;
+	imp.dst_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY);
+	if (imp.dst_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", argv[optind + 1]);
+		goto out;
+	}
+	imp.set_owner = (geteuid() == 0);
+	if (ecryptfs_read_salt_hex_from_rc(salt_hex))
+		from_hex(imp.salt, ECRYPTFS_DEFAULT_SALT_HEX,
+			 ECRYPTFS_SALT_SIZE);
+	else
+		from_hex(imp.salt, salt_hex, ECRYPTFS_SALT_SIZE);
+	rc = ecryptfs_utils_get_passphrase(passphrase, wrapped_file, imp.salt);
+	if (rc)
+		goto out;
+	rc = generate_passphrase_sig(sig_hex, imp.fekek, imp.salt, passphrase);
+	if (rc) {
+		fprintf(stderr, "Error deriving the mount key; rc = [%d]\n",
+			rc);
+		goto out;
+	}
+	from_hex(imp.sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	if (imp.flags & ECRYPTFS_ENCRYPT_FILENAMES) {
+		rc = ecryptfs_derive_fnek(fnek, fnek_sig, passphrase);
+		if (rc) {
+			fprintf(stderr, "Error deriving the filename key; "
+				"rc = [%d]\n", rc);
+			goto out;
+		}
+		to_hex(fnek_sig_hex, fnek_sig, ECRYPTFS_SIG_SIZE);
+	}
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	imp.workers = calloc(num_threads, sizeof(*imp.workers));
+	if (!imp.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		imp.workers[i].buf = malloc(IMPORT_BATCH_EXTENTS
+					    * ECRYPTFS_DEFAULT_EXTENT_SIZE);
+		if (!imp.workers[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		if (!(imp.flags & ECRYPTFS_ENCRYPT_FILENAMES))
+			continue;
+		rc = ecryptfs_fn_ctx_create(&imp.workers[i].fn_ctx,
+					    imp.cipher_code, fnek,
+					    imp.key_size, fnek_sig);
+		if (rc) {
+			fprintf(stderr, "Error setting up filename encryption; "
+				"rc = [%d]\n", rc);
+			goto out;
+		}
+	}
+	walk.num_threads = num_threads;
+	walk.flags = (ECRYPTFS_WALK_DIRS | ECRYPTFS_WALK_XDEV);
+	walk.fn = import_visit;
+	walk.priv = &imp;
+	rc = ecryptfs_walk_tree(&walk, src_root);
+	import_finish_dirs(&imp);
+	if (rc)
+		fprintf(stderr, "Error walking [%s]; rc = [%d]\n", src_root,
+			rc);
+	for (i = 0; i < num_threads; i++) {
+		sum.files += imp.workers[i].totals.files;
+		sum.dirs += imp.workers[i].totals.dirs;
+		sum.symlinks += imp.workers[i].totals.symlinks;
+		sum.bytes += imp.workers[i].totals.bytes;
+		sum.skipped += imp.workers[i].totals.skipped;
+		sum.failed += imp.workers[i].totals.failed;
+	}
+	printf("Files: [%llu]; bytes: [%llu]\n",
+	       (unsigned long long)sum.files, (unsigned long long)sum.bytes);
+	printf("Directories: [%llu]\n", (unsigned long long)sum.dirs);
+	printf("Symlinks: [%llu]\n", (unsigned long long)sum.symlinks);
+	printf("Skipped: [%llu]\n", (unsigned long long)sum.skipped);
+	printf("Failed: [%llu]\n", (unsigned long long)sum.failed);
+	printf("Mount options: ecryptfs_sig=%s,ecryptfs_cipher=aes,"
+	       "ecryptfs_key_bytes=%zu", sig_hex, imp.key_size);
+	if (imp.flags & ECRYPTFS_ENCRYPT_FILENAMES)
+		printf(",ecryptfs_fnek_sig=%s", fnek_sig_hex);
+	if (imp.flags & ECRYPTFS_METADATA_IN_XATTR)
+		printf(",ecryptfs_xattr_metadata");
+	printf("\n");
+	if (!rc && (sum.failed || walk.num_errors))
+		rc = -EIO;
+out:
+	if (imp.workers) {
+		for (i = 0; i < num_threads; i++) {
+			free(imp.workers[i].buf);
+			ecryptfs_fn_ctx_destroy(imp.workers[i].fn_ctx);
+		}
+		free(imp.workers);
+	}
+	if (imp.dst_fd != -1)
+		close(imp.dst_fd);
+	memset(imp.fekek, 0, sizeof(imp.fekek));
+	memset(fnek, 0, sizeof(fnek));
+	memset(passphrase, 0, sizeof(passphrase));
+	return rc ? 1 : 0;
+}
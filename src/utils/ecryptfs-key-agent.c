@@ -0,0 +1,130 @@
+/**
+ * ecryptfs-key-agent: Hand keys to, query and flush the per-user agent
+ * that keeps the private directory keys between an auto-umount and the
+ * next login
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/ecryptfs.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s status\n"
+		"%s restore\n"
+		"%s flush\n"
+		"%s hold [-t <seconds>] <sig> [<fnek-sig>]\n\n"
+		"  status   Print how long the agent keeps the keys for\n"
+		"  restore  Put the keys back into the user keyring\n"
+		"  flush    Wipe the keys and stop the agent\n"
+		"  hold     Copy the keys with the given signatures out of the "
+		"user\n"
+		"           keyring into a new agent\n\n"
+		"  -t  Seconds to keep the keys for (default: the contents of\n"
+		"      ~/.ecryptfs/%s, or %d)\n",
+		name, name, name, name, ECRYPTFS_KEY_AGENT_FILE,
+		ECRYPTFS_KEY_AGENT_DEFAULT_GRACE);
+}
+
+static int hold(int argc, char **argv)
+{
+	unsigned int grace = ECRYPTFS_KEY_AGENT_DEFAULT_GRACE;
+	struct passwd *pwd;
+	char *end;
+	int c;
+
+	pwd = getpwuid(getuid());
+	if (pwd)
+		ecryptfs_key_agent_grace(pwd->pw_dir, &grace);
+	optind = 1;
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			grace = strtoul(optarg, &end, 10);
+			if (*end != '\0' || grace == 0
+			    || grace > ECRYPTFS_KEY_AGENT_MAX_GRACE) {
+				fprintf(stderr, "Grace period must be between "
+					"1 and %d seconds\n",
+					ECRYPTFS_KEY_AGENT_MAX_GRACE);
+				return -EINVAL;
+			}
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+	if (optind >= argc || argc - optind > 2)
+		return -EINVAL;
+	return ecryptfs_key_agent_hold(&argv[optind], argc - optind, grace);
+}
+
+int main(int argc, char **argv)
+{
+	char reply[32];
+	char *cmd;
+	int rc;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	cmd = argv[1];
+	if (strcmp(cmd, "hold") == 0) {
+		rc = hold(argc - 1, argv + 1);
+		if (rc == -EINVAL)
+			usage(argv[0]);
+		else if (rc)
+			fprintf(stderr, "Error handing the keys to the agent: "
+				"%s\n", strerror(-rc));
+		goto out;
+	}
+	if (argc != 2 || (strcmp(cmd, ECRYPTFS_KEY_AGENT_STATUS)
+			  && strcmp(cmd, ECRYPTFS_KEY_AGENT_RESTORE)
+			  && strcmp(cmd, ECRYPTFS_KEY_AGENT_FLUSH))) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	rc = ecryptfs_key_agent_request(cmd, reply, sizeof(reply));
+	if (rc == -ECONNREFUSED || rc == -ENOENT) {
+		/* Nothing to flush is not an error */
+		if (strcmp(cmd, ECRYPTFS_KEY_AGENT_FLUSH) == 0)
+			rc = 0;
+		else
+			fprintf(stderr, "No key agent is running\n");
+		goto out;
+	}
+	if (rc) {
+		fprintf(stderr, "The key agent refused the %s request: %s\n",
+			cmd, strerror(-rc));
+		goto out;
+	}
+	if (strcmp(cmd, ECRYPTFS_KEY_AGENT_STATUS) == 0)
+		printf("Holding the keys for another [%s] seconds\n", reply);
+out:
+	return rc ? 1 : 0;
+}
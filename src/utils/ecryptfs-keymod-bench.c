@@ -0,0 +1,529 @@
+/**
+ * ecryptfs-keymod-bench: Closed-loop benchmark of the per-operation
+ * paths (encrypt, decrypt, get_key_sig) of an eCryptfs key module
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/ecryptfs.h"
+#include "../include/decision_graph.h"
+#include "io.h"
+
+#define KEYMOD_BENCH_DEFAULT_SECONDS 5
+#define KEYMOD_BENCH_DEFAULT_THREADS "1,2,4,8"
+#define KEYMOD_BENCH_MAX_THREAD_COUNTS 32
+/* Size of a 256-bit file encryption key, which is what the kernel
+ * asks key modules to wrap */
+#define KEYMOD_BENCH_DEFAULT_DATA_SIZE 32
+#define KEYMOD_BENCH_INITIAL_SAMPLES 4096
+
+enum keymod_bench_op {
+	KEYMOD_BENCH_ENCRYPT,
+	KEYMOD_BENCH_DECRYPT,
+	KEYMOD_BENCH_GET_KEY_SIG,
+	KEYMOD_BENCH_NUM_OPS
+};
+
+static const char *keymod_bench_op_names[KEYMOD_BENCH_NUM_OPS] = {
+	"encrypt",
+	"decrypt",
+	"get_key_sig"
+};
+
+/**
+ * struct keymod_bench - State shared by every worker of one run
+ * @ops: Key module operations, as returned by get_key_mod_ops()
+ * @blob: Key module blob built from the module parameters
+ * @plaintext: Input for the encrypt operation
+ * @ciphertext: Input for the decrypt operation
+ * @op: The operation being driven in this run
+ * @stop: Set by the main thread once the run duration has elapsed
+ */
+struct keymod_bench {
+	struct ecryptfs_key_mod_ops *ops;
+	unsigned char *blob;
+	char *plaintext;
+	size_t plaintext_size;
+	char *ciphertext;
+	size_t ciphertext_size;
+	enum keymod_bench_op op;
+	volatile int stop;
+};
+
+/**
+ * struct keymod_bench_worker - Per-thread latency samples
+ * @samples: Latency of each completed operation, in nanoseconds
+ * @errors: Number of operations that returned an error
+ */
+struct keymod_bench_worker {
+	pthread_t thread;
+	struct keymod_bench *bench;
+	uint64_t *samples;
+	size_t num_samples;
+	size_t max_samples;
+	uint64_t errors;
+	int rc;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s -m <alias> [-o <options>] [-t <threads>] [-d <seconds>]\n"
+		"\t[-s <bytes>] [-O <ops>]\n\n"
+		"  -m  Key module alias (openssl, pkcs11-helper, tspi, ...)\n"
+		"  -o  Key module options, e.g. "
+		"\"keyfile=/tmp/key.pem:passwd=secret\"\n"
+		"  -t  Comma-separated list of thread counts (default %s)\n"
+		"  -d  Duration of each run in seconds (default %d)\n"
+		"  -s  Size of the data being wrapped (default %d)\n"
+		"  -O  Comma-separated list of operations out of "
+		"encrypt,decrypt,get_key_sig\n"
+		"      (default all)\n",
+		name, KEYMOD_BENCH_DEFAULT_THREADS,
+		KEYMOD_BENCH_DEFAULT_SECONDS, KEYMOD_BENCH_DEFAULT_DATA_SIZE);
+}
+
+static uint64_t keymod_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int keymod_bench_add_sample(struct keymod_bench_worker *worker,
+				   uint64_t sample)
+{
+	if (worker->num_samples == worker->max_samples) {
+		size_t max_samples = (worker->max_samples
+				      ? (worker->max_samples * 2)
+				      : KEYMOD_BENCH_INITIAL_SAMPLES);
+		uint64_t *samples;
+
+		samples = realloc(worker->samples,
+				  max_samples * sizeof(uint64_t));
+		if (!samples)
+			return -ENOMEM;
+		worker->samples = samples;
+		worker->max_samples = max_samples;
+	}
+	worker->samples[worker->num_samples++] = sample;
+	return 0;
+}
+
+static int keymod_bench_do_op(struct keymod_bench *bench, char *to,
+			      size_t to_size)
+{
+	unsigned char sig[ECRYPTFS_SIG_SIZE_HEX + 1];
+
+	switch (bench->op) {
+	case KEYMOD_BENCH_ENCRYPT:
+		return bench->ops->encrypt(to, &to_size, bench->plaintext,
+					   bench->plaintext_size, bench->blob,
+					   ECRYPTFS_BLOB_TYPE_BLOB);
+	case KEYMOD_BENCH_DECRYPT:
+		return bench->ops->decrypt(to, &to_size, bench->ciphertext,
+					   bench->ciphertext_size, bench->blob,
+					   ECRYPTFS_BLOB_TYPE_BLOB);
+	case KEYMOD_BENCH_GET_KEY_SIG:
+		return bench->ops->get_key_sig(sig, bench->blob);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void *keymod_bench_worker_fn(void *arg)
+{
+	struct keymod_bench_worker *worker = arg;
+	struct keymod_bench *bench = worker->bench;
+	size_t to_size = (bench->ciphertext_size > bench->plaintext_size
+			  ? bench->ciphertext_size : bench->plaintext_size);
+	char *to;
+
+	/* Some modules write more than they reported on decrypt, so
+	 * leave slack in the output buffer */
+	to_size *= 2;
+	to = malloc(to_size);
+	if (!to) {
+		worker->rc = -ENOMEM;
+		goto out;
+	}
+	while (!bench->stop) {
+		uint64_t start = keymod_bench_now();
+
+		if (keymod_bench_do_op(bench, to, to_size)) {
+			worker->errors++;
+			continue;
+		}
+		worker->rc = keymod_bench_add_sample(
+			worker, keymod_bench_now() - start);
+		if (worker->rc)
+			break;
+	}
+out:
+	free(to);
+	return NULL;
+}
+
+static int keymod_bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static double keymod_bench_percentile_us(uint64_t *samples, size_t n,
+					 unsigned int pct)
+{
+	size_t idx;
+
+	if (!n)
+		return 0;
+	idx = (n * pct) / 100;
+	if (idx >= n)
+		idx = (n - 1);
+	return (samples[idx] / 1000.0);
+}
+
+/**
+ * keymod_bench_run
+ * @bench: Benchmark state; bench->op selects the operation
+ * @num_threads: Number of closed-loop workers
+ * @seconds: Length of the run
+ *
+ * Every worker issues the next operation as soon as the previous one
+ * returns. Latency samples from all workers are merged once the run
+ * completes, so the only shared write during the run is the stop flag.
+ */
+static int keymod_bench_run(struct keymod_bench *bench, int num_threads,
+			    int seconds)
+{
+	struct keymod_bench_worker *workers;
+	uint64_t *all = NULL;
+	uint64_t start, elapsed, errors = 0;
+	size_t total = 0;
+	int started = 0;
+	int i;
+	int rc = 0;
+
+	workers = calloc(num_threads, sizeof(*workers));
+	if (!workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	bench->stop = 0;
+	start = keymod_bench_now();
+	for (i = 0; i < num_threads; i++) {
+		workers[i].bench = bench;
+		rc = pthread_create(&workers[i].thread, NULL,
+				    keymod_bench_worker_fn, &workers[i]);
+		if (rc) {
+			fprintf(stderr, "Error creating worker thread; "
+				"rc = [%d]\n", rc);
+			rc = -rc;
+			break;
+		}
+		started++;
+	}
+	if (!rc)
+		sleep(seconds);
+	bench->stop = 1;
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = keymod_bench_now() - start;
+	if (rc)
+		goto out_free;
+	for (i = 0; i < num_threads; i++) {
+		if (workers[i].rc) {
+			rc = workers[i].rc;
+			goto out_free;
+		}
+		total += workers[i].num_samples;
+		errors += workers[i].errors;
+	}
+	if (total) {
+		size_t off = 0;
+
+		all = malloc(total * sizeof(uint64_t));
+		if (!all) {
+			rc = -ENOMEM;
+			goto out_free;
+		}
+		for (i = 0; i < num_threads; i++) {
+			memcpy(&all[off], workers[i].samples,
+			       workers[i].num_samples * sizeof(uint64_t));
+			off += workers[i].num_samples;
+		}
+		qsort(all, total, sizeof(uint64_t), keymod_bench_cmp_u64);
+	}
+	printf("%-12s %7d %12.1f %10.1f %10.1f %10.1f %10.1f %8llu\n",
+	       keymod_bench_op_names[bench->op], num_threads,
+	       total / (elapsed / 1000000000.0),
+	       keymod_bench_percentile_us(all, total, 50),
+	       keymod_bench_percentile_us(all, total, 90),
+	       keymod_bench_percentile_us(all, total, 99),
+	       total ? (all[total - 1] / 1000.0) : 0.0,
+	       (unsigned long long)errors);
+	fflush(stdout);
+out_free:
+	free(all);
+	for (i = 0; i < num_threads; i++)
+		free(workers[i].samples);
+	free(workers);
+out:
+	return rc;
+}
+
+static int keymod_bench_parse_threads(int *counts, int *num_counts,
+				      char *list)
+{
+	char *tok, *saveptr = NULL;
+
+	(*num_counts) = 0;
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		int n = atoi(tok);
+
+		if (n <= 0 || (*num_counts) == KEYMOD_BENCH_MAX_THREAD_COUNTS)
+			return -EINVAL;
+		counts[(*num_counts)++] = n;
+	}
+	return (*num_counts) ? 0 : -EINVAL;
+}
+
+static int keymod_bench_parse_ops(int *ops, char *list)
+{
+	char *tok, *saveptr = NULL;
+	int i;
+
+	memset(ops, 0, KEYMOD_BENCH_NUM_OPS * sizeof(int));
+	for (tok = strtok_r(list, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < KEYMOD_BENCH_NUM_OPS; i++)
+			if (!strcmp(tok, keymod_bench_op_names[i]))
+				break;
+		if (i == KEYMOD_BENCH_NUM_OPS)
+			return -EINVAL;
+		ops[i] = 1;
+	}
+	return 0;
+}
+
+/**
+ * keymod_bench_prepare
+ * @bench: Filled in with a plaintext and the matching ciphertext
+ *
+ * Does one encrypt/decrypt round trip through the module and checks
+ * that it returns the original data, so that a broken module fails
+ * loudly instead of benchmarking its error path.
+ */
+static int keymod_bench_prepare(struct keymod_bench *bench)
+{
+	char *decrypted = NULL;
+	size_t decrypted_size;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < bench->plaintext_size; i++)
+		bench->plaintext[i] = (char)random();
+	rc = bench->ops->encrypt(NULL, &bench->ciphertext_size,
+				 bench->plaintext, bench->plaintext_size,
+				 bench->blob, ECRYPTFS_BLOB_TYPE_BLOB);
+	if (rc) {
+		fprintf(stderr, "Key module encrypt failed to report the "
+			"output size; rc = [%d]\n", rc);
+		goto out;
+	}
+	bench->ciphertext = malloc(bench->ciphertext_size);
+	if (!bench->ciphertext) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = bench->ops->encrypt(bench->ciphertext, &bench->ciphertext_size,
+				 bench->plaintext, bench->plaintext_size,
+				 bench->blob, ECRYPTFS_BLOB_TYPE_BLOB);
+	if (rc) {
+		fprintf(stderr, "Key module encrypt failed; rc = [%d]\n", rc);
+		goto out;
+	}
+	decrypted_size = (bench->ciphertext_size * 2);
+	decrypted = malloc(decrypted_size);
+	if (!decrypted) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	rc = bench->ops->decrypt(decrypted, &decrypted_size,
+				 bench->ciphertext, bench->ciphertext_size,
+				 bench->blob, ECRYPTFS_BLOB_TYPE_BLOB);
+	if (rc) {
+		fprintf(stderr, "Key module decrypt failed; rc = [%d]\n", rc);
+		goto out;
+	}
+	if (decrypted_size != bench->plaintext_size
+	    || memcmp(decrypted, bench->plaintext, decrypted_size)) {
+		fprintf(stderr, "Key module decrypt did not return the "
+			"encrypted data\n");
+		rc = -EIO;
+		goto out;
+	}
+out:
+	free(decrypted);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct ecryptfs_ctx ctx;
+	struct ecryptfs_key_mod *key_mod = NULL;
+	struct val_node *mnt_params = NULL;
+	struct keymod_bench bench;
+	char *alias = NULL;
+	char *opts = NULL;
+	char *opts_str = NULL;
+	char threads_list[] = KEYMOD_BENCH_DEFAULT_THREADS;
+	char *threads = threads_list;
+	int thread_counts[KEYMOD_BENCH_MAX_THREAD_COUNTS];
+	int num_thread_counts;
+	int run_ops[KEYMOD_BENCH_NUM_OPS] = { 1, 1, 1 };
+	int seconds = KEYMOD_BENCH_DEFAULT_SECONDS;
+	uint32_t version;
+	int ctx_registered = 0;
+	int i, j, c;
+	int rc = 0;
+
+	memset(&bench, 0, sizeof(bench));
+	bench.plaintext_size = KEYMOD_BENCH_DEFAULT_DATA_SIZE;
+	while ((c = getopt(argc, argv, "m:o:t:d:s:O:h")) != -1) {
+		switch (c) {
+		case 'm':
+			alias = optarg;
+			break;
+		case 'o':
+			opts = optarg;
+			break;
+		case 't':
+			threads = optarg;
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			bench.plaintext_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			if (keymod_bench_parse_ops(run_ops, optarg)) {
+				usage(argv[0]);
+				rc = -EINVAL;
+				goto out;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (!alias || seconds <= 0 || !bench.plaintext_size
+	    || bench.plaintext_size > ECRYPTFS_MAX_ENCRYPTED_KEY_BYTES
+	    || keymod_bench_parse_threads(thread_counts, &num_thread_counts,
+					  threads)) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	if (ecryptfs_get_version(&version))
+		version = ECRYPTFS_VERSIONING_PASSPHRASE;
+	/* The module subgraphs are only offered when pubkey support is
+	 * advertised; the benchmark does not need the kernel at all */
+	version |= ECRYPTFS_VERSIONING_PUBKEY;
+	if (asprintf(&opts_str, "key=%s%s%s", alias, opts ? ":" : "",
+		     opts ? opts : "") == -1) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.get_string = &get_string_stdin;
+	if ((mnt_params = malloc(sizeof(struct val_node))) == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memset(mnt_params, 0, sizeof(struct val_node));
+	ctx_registered = 1;
+	rc = ecryptfs_process_decision_graph(&ctx, &mnt_params, version,
+					     opts_str,
+					     ECRYPTFS_KEY_MODULE_ONLY);
+	if (rc) {
+		fprintf(stderr, "Error building the key module blob from the "
+			"given options; rc = [%d]\n", rc);
+		goto out;
+	}
+	rc = ecryptfs_find_key_mod(&key_mod, &ctx, alias);
+	if (rc || !key_mod->blob) {
+		fprintf(stderr, "Key module [%s] did not produce a blob; "
+			"rc = [%d]\n", alias, rc);
+		rc = rc ? rc : -EINVAL;
+		goto out;
+	}
+	bench.ops = key_mod->ops;
+	bench.blob = (unsigned char *)key_mod->blob;
+	bench.plaintext = malloc(bench.plaintext_size);
+	if (!bench.plaintext) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	srandom(time(NULL));
+	rc = keymod_bench_prepare(&bench);
+	if (rc)
+		goto out;
+	printf("Key module [%s]; blob size [%zu]; wrapping [%zu] bytes into "
+	       "[%zu] bytes; [%d]s per run\n\n", alias, key_mod->blob_size,
+	       bench.plaintext_size, bench.ciphertext_size, seconds);
+	printf("%-12s %7s %12s %10s %10s %10s %10s %8s\n", "op", "threads",
+	       "ops/s", "p50(us)", "p90(us)", "p99(us)", "max(us)", "errors");
+	for (i = 0; i < KEYMOD_BENCH_NUM_OPS; i++) {
+		if (!run_ops[i])
+			continue;
+		bench.op = i;
+		for (j = 0; j < num_thread_counts; j++) {
+			rc = keymod_bench_run(&bench, thread_counts[j],
+					      seconds);
+			if (rc)
+				goto out;
+		}
+	}
+out:
+	if (bench.plaintext) {
+		memset(bench.plaintext, 0, bench.plaintext_size);
+		free(bench.plaintext);
+	}
+	free(bench.ciphertext);
+	free(opts_str);
+	if (ctx_registered)
+		ecryptfs_free_key_mod_list(&ctx);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,903 @@
+/**
+ * ecryptfs-migrate: Copy a plaintext tree into a mounted eCryptfs
+ * directory with parallel workers, resumably, and verify the copy
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <nss.h>
+#include <pk11pub.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+#define MIGRATE_DIGEST_SIZE 32
+#define MIGRATE_DEFAULT_BUF_KIB 1024
+/* Files, and bytes, copied between checkpoints of the journal */
+#define MIGRATE_JOURNAL_BATCH 1024
+#define MIGRATE_JOURNAL_BATCH_BYTES (256ULL << 20)
+
+#ifndef ECRYPTFS_SUPER_MAGIC
+#define ECRYPTFS_SUPER_MAGIC 0xf15f
+#endif
+
+/**
+ * A regular file that has been copied, with the SHA-256 of the
+ * plaintext that was read from the source
+ */
+struct migrate_file {
+	char *path;
+	unsigned char digest[MIGRATE_DIGEST_SIZE];
+};
+
+/**
+ * Set of copied files, open addressed by path; loaded from the journal
+ * and added to as files are copied
+ */
+struct migrate_file_set {
+	struct migrate_file *files;
+	size_t mask;
+	size_t count;
+};
+
+struct migrate_totals {
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t dirs;
+	uint64_t symlinks;
+	uint64_t specials;
+	uint64_t already;
+	uint64_t failed;
+	uint64_t verified;
+	uint64_t mismatched;
+};
+
+struct migrate_worker {
+	struct migrate_totals totals;
+	char *buf;
+};
+
+/**
+ * Directory whose mode, owner and times are applied once the walk is
+ * over, so that creating its children does not disturb them
+ */
+struct migrate_dir {
+	char *path;
+	struct stat st;
+	struct migrate_dir *next;
+};
+
+/**
+ * struct migrate - State shared by every worker
+ * @src_len: Length of the source root; entry paths start with it
+ * @dst_fd: The mounted eCryptfs directory being populated
+ * @buf_size: Bytes per read and write; a multiple of the extent size,
+ *            so that only the last write of a file leaves a partial
+ *            extent for eCryptfs to fill in
+ * @set_lock: Protects @files and the journal
+ * @journal_pending, @journal_bytes: Copied since the last checkpoint
+ */
+struct migrate {
+	size_t src_len;
+	int dst_fd;
+	size_t buf_size;
+	int set_owner;
+	struct migrate_worker *workers;
+	pthread_mutex_t set_lock;
+	struct migrate_file_set files;
+	FILE *journal;
+	int journal_pending;
+	uint64_t journal_bytes;
+	pthread_mutex_t dirs_lock;
+	struct migrate_dir *dirs;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-t <threads>] [-b <KiB>] [-j <journal>] [-n] [-F] "
+		"<source> <destination>\n\n"
+		"Copies the tree <source> into <destination>, a mounted "
+		"eCryptfs directory,\n"
+		"then reads every copied file back and compares it with what "
+		"was read from\n"
+		"<source>.\n\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -b  Size of each read and write in KiB (default %d)\n"
+		"  -j  Checkpoint copied files here and skip files recorded "
+		"by an earlier run\n"
+		"  -n  Do not verify the copy\n"
+		"  -F  Copy even if <destination> is not an eCryptfs mount\n",
+		name, MIGRATE_DEFAULT_BUF_KIB);
+}
+
+static size_t migrate_hash_path(const char *path)
+{
+	size_t hash = 5381;
+
+	while (*path)
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+	return hash;
+}
+
+/**
+ * migrate_set_find
+ *
+ * Returns the file recorded for @path, or NULL
+ */
+static struct migrate_file *migrate_set_find(struct migrate_file_set *set,
+					     const char *path)
+{
+	size_t i;
+
+	if (!set->count)
+		return NULL;
+	for (i = migrate_hash_path(path) & set->mask; set->files[i].path;
+	     i = (i + 1) & set->mask)
+		if (!strcmp(set->files[i].path, path))
+			return &set->files[i];
+	return NULL;
+}
+
+/**
+ * migrate_set_add
+ * @path: Kept by the set; not copied
+ *
+ * A later record for the same path replaces the digest of an earlier
+ * one, since the file was copied again.
+ */
+static int migrate_set_add(struct migrate_file_set *set, char *path,
+			   const unsigned char *digest)
+{
+	size_t i;
+
+	if ((set->count + 1) * 2 > (set->mask + 1)) {
+		struct migrate_file_set bigger;
+		size_t j;
+
+		bigger.mask = set->files ? ((set->mask + 1) * 2 - 1) : 1023;
+		bigger.count = 0;
+		bigger.files = calloc(bigger.mask + 1, sizeof(*bigger.files));
+		if (!bigger.files)
+			return -ENOMEM;
+		for (j = 0; set->files && j <= set->mask; j++)
+			if (set->files[j].path)
+				migrate_set_add(&bigger, set->files[j].path,
+						set->files[j].digest);
+		free(set->files);
+		(*set) = bigger;
+	}
+	for (i = migrate_hash_path(path) & set->mask; set->files[i].path;
+	     i = (i + 1) & set->mask)
+		if (!strcmp(set->files[i].path, path))
+			break;
+	if (!set->files[i].path) {
+		set->files[i].path = path;
+		set->count++;
+	}
+	memcpy(set->files[i].digest, digest, MIGRATE_DIGEST_SIZE);
+	return 0;
+}
+
+/**
+ * migrate_load_journal
+ * @buf: Set to the journal contents, which the set points into
+ *
+ * Each record is a path relative to the source root and the hex digest
+ * of its contents, both NUL terminated. A record cut short by a crash
+ * is ignored, and that file copied again.
+ */
+static int migrate_load_journal(struct migrate *mig, const char *path,
+				char **buf)
+{
+	unsigned char digest[MIGRATE_DIGEST_SIZE];
+	struct stat st;
+	size_t size = 0;
+	size_t i;
+	int fd;
+	int rc = 0;
+
+	(*buf) = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+	if (fstat(fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	(*buf) = malloc(st.st_size + 1);
+	if (!(*buf)) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	while (size < (size_t)st.st_size) {
+		ssize_t n = read(fd, &(*buf)[size], (st.st_size - size));
+
+		if (n <= 0)
+			break;
+		size += n;
+	}
+	(*buf)[size] = '\0';
+	for (i = 0; i < size;) {
+		char *rel = &(*buf)[i];
+		size_t rel_len = strlen(rel);
+		char *hex;
+
+		if (i + rel_len + 1 + (MIGRATE_DIGEST_SIZE * 2) + 1 > size)
+			break;
+		hex = &rel[rel_len + 1];
+		if (strlen(hex) != (MIGRATE_DIGEST_SIZE * 2))
+			break;
+		from_hex((char *)digest, hex, MIGRATE_DIGEST_SIZE);
+		rc = migrate_set_add(&mig->files, rel, digest);
+		if (rc)
+			goto out;
+		i += (rel_len + 1 + (MIGRATE_DIGEST_SIZE * 2) + 1);
+	}
+out:
+	close(fd);
+	return rc;
+}
+
+/**
+ * migrate_checkpoint
+ *
+ * Called with set_lock held. eCryptfs has no sync_fs of its own, so
+ * syncing the mount only pushes the encrypted pages down to the lower
+ * file system; the lower file system is synced after that, and only
+ * then are the records that say those files are done.
+ */
+static void migrate_checkpoint(struct migrate *mig)
+{
+	if (!mig->journal || !mig->journal_pending)
+		return;
+	syncfs(mig->dst_fd);
+	sync();
+	fflush(mig->journal);
+	fdatasync(fileno(mig->journal));
+	mig->journal_pending = 0;
+	mig->journal_bytes = 0;
+}
+
+static int migrate_file_done(struct migrate *mig, const char *rel,
+			     const unsigned char *digest, uint64_t bytes)
+{
+	char hex[(MIGRATE_DIGEST_SIZE * 2) + 1];
+	char *path;
+	int rc;
+
+	path = strdup(rel);
+	if (!path)
+		return -ENOMEM;
+	to_hex(hex, (char *)digest, MIGRATE_DIGEST_SIZE);
+	pthread_mutex_lock(&mig->set_lock);
+	rc = migrate_set_add(&mig->files, path, digest);
+	if (rc) {
+		pthread_mutex_unlock(&mig->set_lock);
+		free(path);
+		return rc;
+	}
+	if (mig->journal) {
+		fwrite(rel, 1, strlen(rel) + 1, mig->journal);
+		fwrite(hex, 1, sizeof(hex), mig->journal);
+		mig->journal_bytes += bytes;
+		if (++mig->journal_pending >= MIGRATE_JOURNAL_BATCH
+		    || mig->journal_bytes >= MIGRATE_JOURNAL_BATCH_BYTES)
+			migrate_checkpoint(mig);
+	}
+	pthread_mutex_unlock(&mig->set_lock);
+	return 0;
+}
+
+/**
+ * migrate_copy
+ * @digest: Set to the SHA-256 of what was read from @src_fd
+ *
+ * The source pages are dropped behind the copy; a home directory is
+ * usually far larger than memory, and nothing reads them again.
+ */
+static int migrate_copy(struct migrate *mig, struct migrate_worker *worker,
+			int src_fd, int fd, struct stat *st,
+			unsigned char *digest)
+{
+	PK11Context *hash;
+	unsigned int digest_len = 0;
+	off_t offset = 0;
+	int rc = 0;
+
+	hash = PK11_CreateDigestContext(SEC_OID_SHA256);
+	if (!hash || PK11_DigestBegin(hash) != SECSuccess) {
+		rc = -EIO;
+		goto out;
+	}
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	while (offset < st->st_size) {
+		size_t want = mig->buf_size;
+		ssize_t got;
+		size_t done;
+
+		if ((uint64_t)(st->st_size - offset) < want)
+			want = (st->st_size - offset);
+		got = pread(src_fd, worker->buf, want, offset);
+		if (got < 0) {
+			rc = -errno;
+			goto out;
+		}
+		/* The file shrank under us */
+		if ((size_t)got != want) {
+			rc = -EAGAIN;
+			goto out;
+		}
+		for (done = 0; done < want;) {
+			ssize_t n = pwrite(fd, &worker->buf[done],
+					   (want - done), (offset + done));
+
+			if (n < 0) {
+				rc = -errno;
+				goto out;
+			}
+			done += n;
+		}
+		if (PK11_DigestOp(hash, (unsigned char *)worker->buf,
+				  want) != SECSuccess) {
+			rc = -EIO;
+			goto out;
+		}
+		posix_fadvise(src_fd, offset, want, POSIX_FADV_DONTNEED);
+		offset += want;
+	}
+	if (PK11_DigestFinal(hash, digest, &digest_len,
+			     MIGRATE_DIGEST_SIZE) != SECSuccess
+	    || digest_len != MIGRATE_DIGEST_SIZE)
+		rc = -EIO;
+out:
+	if (hash)
+		PK11_DestroyContext(hash, PR_TRUE);
+	return rc;
+}
+
+static int migrate_regular(struct migrate *mig, struct migrate_worker *worker,
+			   struct ecryptfs_walk_entry *entry, const char *rel)
+{
+	unsigned char digest[MIGRATE_DIGEST_SIZE];
+	struct timespec times[2];
+	struct stat st, after;
+	int src_fd;
+	int fd = -1;
+	int rc;
+
+	pthread_mutex_lock(&mig->set_lock);
+	rc = (migrate_set_find(&mig->files, rel) != NULL);
+	pthread_mutex_unlock(&mig->set_lock);
+	if (rc) {
+		worker->totals.already++;
+		return 0;
+	}
+	src_fd = openat(entry->dirfd, entry->name,
+			O_RDONLY | O_NOFOLLOW | O_NOATIME);
+	if (src_fd == -1 && errno == EPERM)
+		src_fd = openat(entry->dirfd, entry->name,
+				O_RDONLY | O_NOFOLLOW);
+	if (src_fd == -1)
+		return -errno;
+	if (fstat(src_fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	/* A file left half copied by an interrupted run starts over */
+	fd = openat(mig->dst_fd, rel,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		rc = -errno;
+		goto out;
+	}
+	rc = migrate_copy(mig, worker, src_fd, fd, &st, digest);
+	if (rc)
+		goto out;
+	if (fstat(src_fd, &after)) {
+		rc = -errno;
+		goto out;
+	}
+	if (after.st_size != st.st_size
+	    || after.st_mtim.tv_sec != st.st_mtim.tv_sec
+	    || after.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+		rc = -EAGAIN;
+		goto out;
+	}
+	if (mig->set_owner && fchown(fd, st.st_uid, st.st_gid)) {
+		rc = -errno;
+		goto out;
+	}
+	if (fchmod(fd, (st.st_mode & 07777))) {
+		rc = -errno;
+		goto out;
+	}
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (futimens(fd, times)) {
+		rc = -errno;
+		goto out;
+	}
+	rc = migrate_file_done(mig, rel, digest, st.st_size);
+	if (rc)
+		goto out;
+	worker->totals.files++;
+	worker->totals.bytes += st.st_size;
+out:
+	if (fd != -1)
+		close(fd);
+	close(src_fd);
+	return rc;
+}
+
+/**
+ * migrate_symlink
+ *
+ * Symlinks, like device nodes and fifos, are not journaled; an earlier
+ * run's copy is replaced.
+ */
+static int migrate_symlink(struct migrate *mig, struct migrate_worker *worker,
+			   struct ecryptfs_walk_entry *entry, const char *rel)
+{
+	char target[PATH_MAX];
+	struct timespec times[2];
+	struct stat st;
+	ssize_t len;
+
+	if (fstatat(entry->dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	len = readlinkat(entry->dirfd, entry->name, target, sizeof(target));
+	if (len < 0)
+		return -errno;
+	if (len == sizeof(target))
+		return -ENAMETOOLONG;
+	target[len] = '\0';
+	if (symlinkat(target, mig->dst_fd, rel)) {
+		if (errno != EEXIST || unlinkat(mig->dst_fd, rel, 0)
+		    || symlinkat(target, mig->dst_fd, rel))
+			return -errno;
+	}
+	if (mig->set_owner && fchownat(mig->dst_fd, rel, st.st_uid,
+				       st.st_gid, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	utimensat(mig->dst_fd, rel, times, AT_SYMLINK_NOFOLLOW);
+	worker->totals.symlinks++;
+	return 0;
+}
+
+static int migrate_special(struct migrate *mig, struct migrate_worker *worker,
+			   struct ecryptfs_walk_entry *entry, const char *rel)
+{
+	struct timespec times[2];
+	struct stat st;
+
+	if (fstatat(entry->dirfd, entry->name, &st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	if (mknodat(mig->dst_fd, rel, (st.st_mode & ~07777) | S_IRUSR
+		    | S_IWUSR, st.st_rdev)) {
+		if (errno != EEXIST || unlinkat(mig->dst_fd, rel, 0)
+		    || mknodat(mig->dst_fd, rel, (st.st_mode & ~07777)
+			       | S_IRUSR | S_IWUSR, st.st_rdev))
+			return -errno;
+	}
+	if (mig->set_owner && fchownat(mig->dst_fd, rel, st.st_uid,
+				       st.st_gid, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	if (fchmodat(mig->dst_fd, rel, (st.st_mode & 07777), 0))
+		return -errno;
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	utimensat(mig->dst_fd, rel, times, AT_SYMLINK_NOFOLLOW);
+	worker->totals.specials++;
+	return 0;
+}
+
+static int migrate_dir(struct migrate *mig, struct migrate_worker *worker,
+		       struct ecryptfs_walk_entry *entry, const char *rel)
+{
+	struct migrate_dir *dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return -ENOMEM;
+	if (fstatat(entry->dirfd, entry->name, &dir->st,
+		    AT_SYMLINK_NOFOLLOW)) {
+		free(dir);
+		return -errno;
+	}
+	dir->path = strdup(rel);
+	if (!dir->path) {
+		free(dir);
+		return -ENOMEM;
+	}
+	if (mkdirat(mig->dst_fd, rel, S_IRWXU) && errno != EEXIST) {
+		free(dir->path);
+		free(dir);
+		return -errno;
+	}
+	pthread_mutex_lock(&mig->dirs_lock);
+	dir->next = mig->dirs;
+	mig->dirs = dir;
+	pthread_mutex_unlock(&mig->dirs_lock);
+	worker->totals.dirs++;
+	return 0;
+}
+
+static int migrate_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			 int worker_id)
+{
+	struct migrate *mig = priv;
+	struct migrate_worker *worker = &mig->workers[worker_id];
+	const char *rel = (entry->path + mig->src_len + 1);
+	unsigned char d_type = entry->d_type;
+	int rc;
+
+	if (d_type == DT_UNKNOWN) {
+		struct stat st;
+
+		if (fstatat(entry->dirfd, entry->name, &st,
+			    AT_SYMLINK_NOFOLLOW) == 0)
+			d_type = IFTODT(st.st_mode);
+	}
+	if (d_type == DT_REG)
+		rc = migrate_regular(mig, worker, entry, rel);
+	else if (d_type == DT_DIR)
+		rc = migrate_dir(mig, worker, entry, rel);
+	else if (d_type == DT_LNK)
+		rc = migrate_symlink(mig, worker, entry, rel);
+	else
+		rc = migrate_special(mig, worker, entry, rel);
+	if (rc) {
+		fprintf(stderr, "Error copying [%s]; rc = [%d]\n",
+			entry->path, rc);
+		worker->totals.failed++;
+	}
+	return 0;
+}
+
+/**
+ * migrate_finish_dirs
+ *
+ * Children were added after their directory was created, so modes,
+ * owners and times are only applied now.
+ */
+static void migrate_finish_dirs(struct migrate *mig)
+{
+	struct migrate_dir *dir = mig->dirs;
+
+	while (dir) {
+		struct migrate_dir *next = dir->next;
+		struct timespec times[2];
+
+		if (mig->set_owner)
+			fchownat(mig->dst_fd, dir->path, dir->st.st_uid,
+				 dir->st.st_gid, AT_SYMLINK_NOFOLLOW);
+		fchmodat(mig->dst_fd, dir->path, (dir->st.st_mode & 07777), 0);
+		times[0] = dir->st.st_atim;
+		times[1] = dir->st.st_mtim;
+		utimensat(mig->dst_fd, dir->path, times, AT_SYMLINK_NOFOLLOW);
+		free(dir->path);
+		free(dir);
+		dir = next;
+	}
+	mig->dirs = NULL;
+}
+
+/**
+ * migrate_verify_file
+ *
+ * The copy's pages are dropped from the page cache first, so that
+ * what is hashed has been decrypted from the lower file rather than
+ * left over from the write.
+ */
+static int migrate_verify_file(struct migrate *mig,
+			       struct migrate_worker *worker,
+			       struct migrate_file *file)
+{
+	unsigned char digest[MIGRATE_DIGEST_SIZE];
+	unsigned int digest_len = 0;
+	PK11Context *hash;
+	off_t offset = 0;
+	int fd;
+	int rc = 0;
+
+	fd = openat(mig->dst_fd, file->path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
+	hash = PK11_CreateDigestContext(SEC_OID_SHA256);
+	if (!hash || PK11_DigestBegin(hash) != SECSuccess) {
+		rc = -EIO;
+		goto out;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		ssize_t got = pread(fd, worker->buf, mig->buf_size, offset);
+
+		if (got < 0) {
+			rc = -errno;
+			goto out;
+		}
+		if (!got)
+			break;
+		if (PK11_DigestOp(hash, (unsigned char *)worker->buf,
+				  got) != SECSuccess) {
+			rc = -EIO;
+			goto out;
+		}
+		offset += got;
+	}
+	if (PK11_DigestFinal(hash, digest, &digest_len,
+			     MIGRATE_DIGEST_SIZE) != SECSuccess
+	    || digest_len != MIGRATE_DIGEST_SIZE) {
+		rc = -EIO;
+		goto out;
+	}
+	if (memcmp(digest, file->digest, MIGRATE_DIGEST_SIZE))
+		rc = -EILSEQ;
+out:
+	if (hash)
+		PK11_DestroyContext(hash, PR_TRUE);
+	close(fd);
+	return rc;
+}
+
+struct migrate_verify_thread {
+	pthread_t thread;
+	struct migrate *mig;
+	int id;
+	int num_threads;
+};
+
+/* Thread n takes every num_threads'th slot of the file set */
+static void *migrate_verify_fn(void *arg)
+{
+	struct migrate_verify_thread *t = arg;
+	struct migrate *mig = t->mig;
+	struct migrate_worker *worker = &mig->workers[t->id];
+	size_t i;
+
+	for (i = t->id; i <= mig->files.mask; i += t->num_threads) {
+		struct migrate_file *file = &mig->files.files[i];
+		int rc;
+
+		if (!file->path)
+			continue;
+		rc = migrate_verify_file(mig, worker, file);
+		if (!rc) {
+			worker->totals.verified++;
+			continue;
+		}
+		worker->totals.mismatched++;
+		if (rc == -EILSEQ)
+			fprintf(stderr, "Copy of [%s] does not match the "
+				"original\n", file->path);
+		else
+			fprintf(stderr, "Error verifying [%s]; rc = [%d]\n",
+				file->path, rc);
+	}
+	return NULL;
+}
+
+static int migrate_verify(struct migrate *mig, int num_threads)
+{
+	struct migrate_verify_thread *threads;
+	int started = 0;
+	int i;
+	int rc = 0;
+
+	if (!mig->files.count)
+		return 0;
+	/* Dirty pages cannot be dropped; write them all out first */
+	syncfs(mig->dst_fd);
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	for (i = 0; i < num_threads; i++) {
+		threads[i].mig = mig;
+		threads[i].id = i;
+		threads[i].num_threads = num_threads;
+		rc = -pthread_create(&threads[i].thread, NULL,
+				     migrate_verify_fn, &threads[i]);
+		if (rc)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	free(threads);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct migrate_totals sum;
+	struct ecryptfs_walk walk;
+	struct migrate mig;
+	struct statfs sfs;
+	struct stat src_st;
+	char *journal_path = NULL;
+	char *journal_buf = NULL;
+	char *src_root;
+	size_t buf_kib = MIGRATE_DEFAULT_BUF_KIB;
+	int num_threads = 0;
+	int verify = 1;
+	int force = 0;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&mig, 0, sizeof(mig));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	mig.dst_fd = -1;
+	pthread_mutex_init(&mig.set_lock, NULL);
+	pthread_mutex_init(&mig.dirs_lock, NULL);
+	while ((c = getopt(argc, argv, "t:b:j:nFh")) != -1) {
+		switch (c) {
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'b':
+			buf_kib = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			journal_path = optarg;
+			break;
+		case 'n':
+			verify = 0;
+			break;
+		case 'F':
+			force = 1;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if ((argc - optind) != 2 || !buf_kib) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	mig.buf_size = (((buf_kib * 1024) + ECRYPTFS_DEFAULT_EXTENT_SIZE - 1)
+			/ ECRYPTFS_DEFAULT_EXTENT_SIZE)
+		* ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	src_root = argv[optind];
+	while (strlen(src_root) > 1 && src_root[strlen(src_root) - 1] == '/')
+		src_root[strlen(src_root) - 1] = '\0';
+	mig.src_len = strlen(src_root);
+	if (stat(src_root, &src_st) || !S_ISDIR(src_st.st_mode)) {
+		fprintf(stderr, "[%s] is not a directory\n", src_root);
+		rc = -ENOTDIR;
+		goto out;
+	}
+	mig.dst_fd = open(argv[optind + 1], O_RDONLY | O_DIRECTORY);
+	if (mig.dst_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", argv[optind + 1]);
+		goto out;
+	}
+	if (!force && (fstatfs(mig.dst_fd, &sfs)
+		       || sfs.f_type != ECRYPTFS_SUPER_MAGIC)) {
+		fprintf(stderr, "[%s] is not a mounted eCryptfs directory\n",
+			argv[optind + 1]);
+		rc = -EINVAL;
+		goto out;
+	}
+	mig.set_owner = (geteuid() == 0);
+	NSS_NoDB_Init(NULL);
+	if (journal_path) {
+		rc = migrate_load_journal(&mig, journal_path, &journal_buf);
+		if (rc) {
+			fprintf(stderr, "Error reading journal [%s]; "
+				"rc = [%d]\n", journal_path, rc);
+			goto out;
+		}
+		mig.journal = fopen(journal_path, "a");
+		if (!mig.journal) {
+			rc = -errno;
+			fprintf(stderr, "Error opening journal [%s]: %m\n",
+				journal_path);
+			goto out;
+		}
+	}
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	mig.workers = calloc(num_threads, sizeof(*mig.workers));
+	if (!mig.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < num_threads; i++) {
+		if (posix_memalign((void **)&mig.workers[i].buf,
+				   sysconf(_SC_PAGESIZE), mig.buf_size)) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	walk.num_threads = num_threads;
+	walk.flags = (ECRYPTFS_WALK_DIRS | ECRYPTFS_WALK_XDEV);
+	walk.fn = migrate_visit;
+	walk.priv = &mig;
+	rc = ecryptfs_walk_tree(&walk, src_root);
+	migrate_finish_dirs(&mig);
+	pthread_mutex_lock(&mig.set_lock);
+	migrate_checkpoint(&mig);
+	pthread_mutex_unlock(&mig.set_lock);
+	if (rc)
+		fprintf(stderr, "Error walking [%s]; rc = [%d]\n", src_root,
+			rc);
+	if (!rc && verify)
+		rc = migrate_verify(&mig, num_threads);
+	for (i = 0; i < num_threads; i++) {
+		struct migrate_totals *t = &mig.workers[i].totals;
+
+		sum.files += t->files;
+		sum.bytes += t->bytes;
+		sum.dirs += t->dirs;
+		sum.symlinks += t->symlinks;
+		sum.specials += t->specials;
+		sum.already += t->already;
+		sum.failed += t->failed;
+		sum.verified += t->verified;
+		sum.mismatched += t->mismatched;
+	}
+	printf("Files copied: [%llu]; bytes: [%llu]\n",
+	       (unsigned long long)sum.files, (unsigned long long)sum.bytes);
+	printf("Directories: [%llu]\n", (unsigned long long)sum.dirs);
+	printf("Symlinks: [%llu]\n", (unsigned long long)sum.symlinks);
+	printf("Other files: [%llu]\n", (unsigned long long)sum.specials);
+	printf("Skipped from journal: [%llu]\n",
+	       (unsigned long long)sum.already);
+	printf("Failed: [%llu]\n", (unsigned long long)sum.failed);
+	if (verify) {
+		printf("Verified: [%llu]\n", (unsigned long long)sum.verified);
+		printf("Mismatched: [%llu]\n",
+		       (unsigned long long)sum.mismatched);
+	}
+	if (!rc && (sum.failed || sum.mismatched || walk.num_errors))
+		rc = -EIO;
+out:
+	if (mig.workers) {
+		for (i = 0; i < num_threads; i++)
+			free(mig.workers[i].buf);
+		free(mig.workers);
+	}
+	if (mig.journal)
+		fclose(mig.journal);
+	if (mig.dst_fd != -1)
+		close(mig.dst_fd);
+	free(journal_buf);
+	return rc ? 1 : 0;
+}
@@ -0,0 +1,1047 @@
+/**
+ * ecryptfs-rekey: Rewrap the file encryption keys of a lower tree under
+ * a new mount passphrase by rewriting only the header packet sets, and
+ * encrypt the lower names again under the new filename key
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+/* Number of distinct salts whose old session key encryption key is
+ * remembered; every file written by one mount shares a single salt */
+#define REKEY_MAX_KEKS 16
+/* Completed files between flushes of the journal */
+#define REKEY_JOURNAL_BATCH 256
+
+/**
+ * @salt: Salt found in a tag 3 packet
+ * @sig: Binary signature of @fekek
+ * @fekek: Old passphrase run through the KDF with @salt
+ */
+struct rekey_kek {
+	char salt[ECRYPTFS_SALT_SIZE];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+};
+
+/**
+ * Set of paths read back from the journal, open addressed
+ */
+struct rekey_done_set {
+	char **paths;
+	size_t mask;
+	size_t count;
+};
+
+struct rekey_totals {
+	uint64_t renamed;
+	uint64_t rekeyed;
+	uint64_t already;
+	uint64_t skipped;
+	uint64_t not_ecryptfs;
+	uint64_t failed;
+};
+
+/**
+ * struct rekey - State shared by every worker
+ * @old_passphrase: Passphrase the keys are currently wrapped under
+ * @keks: Cache of old session key encryption keys, by salt; the KDF
+ *        costs 65536 SHA-512 rounds, far more than the header rewrite
+ * @new_fekek, @new_sig, @new_salt: The new wrapping key
+ * @add: Keep the old key packet and add one for the new key
+ * @old_fn_ctx, @new_fn_ctx: Filename keys of the old and the new
+ *                           passphrase; NULL with @add
+ * @done: Paths completed by an earlier run
+ * @journal: Completed paths are appended here, NUL terminated
+ * @sync_fd: Any descriptor on the lower file system, for syncfs()
+ */
+struct rekey {
+	char *old_passphrase;
+	pthread_mutex_t kek_lock;
+	struct rekey_kek keks[REKEY_MAX_KEKS];
+	int num_keks;
+	char new_fekek[ECRYPTFS_MAX_KEY_BYTES];
+	char new_sig[ECRYPTFS_SIG_SIZE];
+	char new_salt[ECRYPTFS_SALT_SIZE];
+	int add;
+	struct ecryptfs_fn_ctx *old_fn_ctx;
+	struct ecryptfs_fn_ctx *new_fn_ctx;
+	struct rekey_done_set done;
+	pthread_mutex_t journal_lock;
+	FILE *journal;
+	int journal_pending;
+	int sync_fd;
+	struct rekey_totals *totals;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-a] [-k <key-bytes>] [-t <threads>] [-j <journal>] "
+		"<lower-path>\n\n"
+		"Rewraps the file encryption key of every eCryptfs lower file "
+		"under <lower-path>\n"
+		"from the old mount passphrase to a new one, without touching "
+		"file contents,\n"
+		"and encrypts encrypted lower names and symlink targets again "
+		"under the new\n"
+		"filename key.\n"
+		"The old and then the new mount passphrase are read from "
+		"stdin.\n\n"
+		"  -a  Add a key packet for the new passphrase instead of "
+		"replacing the old one;\n"
+		"      names stay under the old filename key\n"
+		"  -k  Filename key size in bytes (default 16)\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -j  Record finished files here and skip files recorded by "
+		"an earlier run\n",
+		name);
+}
+
+static size_t rekey_hash_path(const char *path)
+{
+	size_t hash = 5381;
+
+	while (*path)
+		hash = ((hash << 5) + hash) + (unsigned char)*path++;
+	return hash;
+}
+
+static int rekey_done_contains(struct rekey_done_set *set, const char *path)
+{
+	size_t i;
+
+	if (!set->count)
+		return 0;
+	for (i = rekey_hash_path(path) & set->mask; set->paths[i];
+	     i = (i + 1) & set->mask)
+		if (!strcmp(set->paths[i], path))
+			return 1;
+	return 0;
+}
+
+static int rekey_done_add(struct rekey_done_set *set, char *path)
+{
+	size_t i;
+
+	if ((set->count + 1) * 2 > (set->mask + 1)) {
+		struct rekey_done_set bigger;
+		size_t j;
+
+		bigger.mask = set->paths ? ((set->mask + 1) * 2 - 1) : 1023;
+		bigger.count = 0;
+		bigger.paths = calloc(bigger.mask + 1, sizeof(char *));
+		if (!bigger.paths)
+			return -ENOMEM;
+		for (j = 0; set->paths && j <= set->mask; j++)
+			if (set->paths[j])
+				rekey_done_add(&bigger, set->paths[j]);
+		free(set->paths);
+		(*set) = bigger;
+	}
+	for (i = rekey_hash_path(path) & set->mask; set->paths[i];
+	     i = (i + 1) & set->mask)
+		if (!strcmp(set->paths[i], path))
+			return 0;
+	set->paths[i] = path;
+	set->count++;
+	return 0;
+}
+
+/**
+ * rekey_load_journal
+ * @rekey: Receives the set of paths already done
+ * @path: Journal file; created if it does not exist
+ * @buf: Set to the journal contents, which the set points into
+ *
+ * A crash can lose the last unflushed records; those files are simply
+ * looked at again, and found to be wrapped under the new key already.
+ */
+static int rekey_load_journal(struct rekey *rekey, const char *path,
+			      char **buf)
+{
+	struct stat st;
+	size_t size = 0;
+	size_t i, start;
+	int fd;
+	int rc = 0;
+
+	(*buf) = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT) ? 0 : -errno;
+	if (fstat(fd, &st)) {
+		rc = -errno;
+		goto out;
+	}
+	(*buf) = malloc(st.st_size + 1);
+	if (!(*buf)) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	while (size < (size_t)st.st_size) {
+		ssize_t n = read(fd, &(*buf)[size], (st.st_size - size));
+
+		if (n <= 0)
+			break;
+		size += n;
+	}
+	/* Drop a trailing record that was cut short */
+	while (size && (*buf)[size - 1] != '\0')
+		size--;
+	for (start = 0, i = 0; i < size; i++) {
+		if ((*buf)[i] != '\0')
+			continue;
+		if (i > start) {
+			rc = rekey_done_add(&rekey->done, &(*buf)[start]);
+			if (rc)
+				goto out;
+		}
+		start = (i + 1);
+	}
+out:
+	close(fd);
+	return rc;
+}
+
+/**
+ * rekey_flush_journal
+ *
+ * Called with journal_lock held. The rewritten headers are synced
+ * before the records that say they are done.
+ */
+static void rekey_flush_journal(struct rekey *rekey)
+{
+	if (!rekey->journal || !rekey->journal_pending)
+		return;
+	syncfs(rekey->sync_fd);
+	fflush(rekey->journal);
+	fdatasync(fileno(rekey->journal));
+	rekey->journal_pending = 0;
+}
+
+static void rekey_journal_done(struct rekey *rekey, const char *path)
+{
+	if (!rekey->journal)
+		return;
+	pthread_mutex_lock(&rekey->journal_lock);
+	fwrite(path, 1, strlen(path) + 1, rekey->journal);
+	if (++rekey->journal_pending >= REKEY_JOURNAL_BATCH)
+		rekey_flush_journal(rekey);
+	pthread_mutex_unlock(&rekey->journal_lock);
+}
+
+/**
+ * rekey_get_old_kek
+ * @kek: Set to the old session key encryption key for @salt
+ *
+ * The KDF runs outside the lock; two threads racing on a new salt both
+ * derive it, and only one copy is kept.
+ */
+static int rekey_get_old_kek(struct rekey *rekey, struct rekey_kek *kek,
+			     const unsigned char *salt)
+{
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	int i;
+	int rc;
+
+	pthread_mutex_lock(&rekey->kek_lock);
+	for (i = 0; i < rekey->num_keks; i++)
+		if (!memcmp(rekey->keks[i].salt, salt, ECRYPTFS_SALT_SIZE)) {
+			memcpy(kek, &rekey->keks[i], sizeof(*kek));
+			pthread_mutex_unlock(&rekey->kek_lock);
+			return 0;
+		}
+	pthread_mutex_unlock(&rekey->kek_lock);
+	memcpy(kek->salt, salt, ECRYPTFS_SALT_SIZE);
+	rc = generate_passphrase_sig(sig_hex, kek->fekek, kek->salt,
+				     rekey->old_passphrase);
+	if (rc)
+		return rc;
+	from_hex(kek->sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	pthread_mutex_lock(&rekey->kek_lock);
+	for (i = 0; i < rekey->num_keks; i++)
+		if (!memcmp(rekey->keks[i].salt, salt, ECRYPTFS_SALT_SIZE))
+			break;
+	if (i == rekey->num_keks && i < REKEY_MAX_KEKS) {
+		memcpy(&rekey->keks[i], kek, sizeof(*kek));
+		rekey->num_keks++;
+	}
+	pthread_mutex_unlock(&rekey->kek_lock);
+	return 0;
+}
+
+/**
+ * rekey_build_header
+ * @rekey: Rekey state
+ * @header: Metadata as read from the file; rewritten in place
+ * @packet_set: Parsed from @header
+ * @old_key: Packet wrapped under the old passphrase, or NULL
+ * @have_new: Whether the set already has a packet for the new key
+ * @size: Set to the number of metadata bytes now in @header
+ *
+ * Packets other than the old key are copied byte for byte, so keys from
+ * other passphrases and key modules survive the rotation.
+ */
+static int rekey_build_header(struct rekey *rekey, char *header,
+			      struct ecryptfs_packet_set_user *packet_set,
+			      struct ecryptfs_key_packet_user *old_key,
+			      int have_new, size_t *size)
+{
+	unsigned char set[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	struct rekey_kek kek;
+	size_t max = (ECRYPTFS_DEFAULT_EXTENT_SIZE
+		      - ECRYPTFS_HEADER_METADATA_BYTES - 1);
+	size_t len = 0;
+	uint32_t i;
+	int rc = 0;
+
+	for (i = 0; i < packet_set->num_keys; i++) {
+		struct ecryptfs_key_packet_user *key = &packet_set->keys[i];
+
+		if (key == old_key && !have_new) {
+			size_t written;
+
+			rc = rekey_get_old_kek(rekey, &kek, key->salt);
+			if (!rc)
+				rc = ecryptfs_decrypt_fek(fek, key, kek.fekek);
+			if (!rc)
+				rc = ecryptfs_write_passphrase_key_packets(
+					&set[len], (max - len), &written,
+					key->cipher_code, fek, key->key_size,
+					rekey->new_fekek, rekey->new_sig,
+					rekey->new_salt);
+			memset(fek, 0, sizeof(fek));
+			memset(&kek, 0, sizeof(kek));
+			if (rc)
+				goto out;
+			len += written;
+			if (!rekey->add)
+				continue;
+		} else if (key == old_key && !rekey->add)
+			continue;
+		if (key->packet_size > (max - len)) {
+			rc = -ENOSPC;
+			goto out;
+		}
+		memcpy(&set[len], key->packet, key->packet_size);
+		len += key->packet_size;
+	}
+	/* Clear out the rest of the old packet set as well */
+	memset(&header[ECRYPTFS_HEADER_METADATA_BYTES], 0,
+	       (ECRYPTFS_DEFAULT_EXTENT_SIZE - ECRYPTFS_HEADER_METADATA_BYTES));
+	memcpy(&header[ECRYPTFS_HEADER_METADATA_BYTES], set, len);
+	(*size) = (ECRYPTFS_HEADER_METADATA_BYTES + len + 1);
+out:
+	memset(set, 0, sizeof(set));
+	return rc;
+}
+
+/*
+ * The old header extent is kept in the second extent of the header
+ * while the new one is written. The kernel never puts anything there,
+ * since the header it writes is at least
+ * ECRYPTFS_MINIMUM_HEADER_EXTENT_SIZE bytes of one extent of metadata
+ * followed by zeros.
+ */
+#define REKEY_BACKUP_OFFSET ECRYPTFS_DEFAULT_EXTENT_SIZE
+
+static int rekey_pwrite_extent(int fd, const char *buf, off_t offset)
+{
+	ssize_t n = pwrite(fd, buf, ECRYPTFS_DEFAULT_EXTENT_SIZE, offset);
+
+	if (n != ECRYPTFS_DEFAULT_EXTENT_SIZE)
+		return (n == -1) ? -errno : -EIO;
+	return 0;
+}
+
+/**
+ * rekey_write_header
+ * @old_header: The header extent as it was before the rekey
+ *
+ * In xattr mode the attribute is replaced as a whole. In the file, the
+ * old header extent is first copied to REKEY_BACKUP_OFFSET and synced,
+ * so that a crash in the middle of the new write leaves a copy that
+ * rekey_recover_header() puts back on the next run. The copy is wiped
+ * once the new header is on disk. The lower timestamps are put back,
+ * since eCryptfs shows them as the upper ones.
+ */
+static int rekey_write_header(int fd, struct stat *st, char *header,
+			      const char *old_header, size_t size,
+			      uint64_t header_size)
+{
+	char zeros[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	struct timespec times[2];
+	int rc;
+
+	if (!header_size) {
+		if (fsetxattr(fd, ECRYPTFS_XATTR_NAME, header, size,
+			      XATTR_REPLACE))
+			return -errno;
+		goto out;
+	}
+	if (header_size < (REKEY_BACKUP_OFFSET + ECRYPTFS_DEFAULT_EXTENT_SIZE))
+		return -ENOSPC;
+	if ((rc = rekey_pwrite_extent(fd, old_header, REKEY_BACKUP_OFFSET)))
+		return rc;
+	if (fdatasync(fd))
+		return -errno;
+	if ((rc = rekey_pwrite_extent(fd, header, 0)))
+		return rc;
+	if (fdatasync(fd))
+		return -errno;
+	/* Synced by the journal, or at the end of the run */
+	memset(zeros, 0, sizeof(zeros));
+	if ((rc = rekey_pwrite_extent(fd, zeros, REKEY_BACKUP_OFFSET)))
+		return rc;
+out:
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	futimens(fd, times);
+	return 0;
+}
+
+/**
+ * rekey_recover_header
+ * @header: Set to the header extent, as ecryptfs_read_lower_metadata()
+ *          would read it
+ *
+ * Finishes what rekey_write_header() was doing when an earlier run
+ * stopped: a header that no longer parses is put back from the copy,
+ * and a leftover copy is wiped, since it holds the key wrapped under
+ * the old passphrase.
+ */
+static int rekey_recover_header(int fd, struct stat *st, char *header)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	char backup[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	char zeros[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	struct timespec times[2];
+	ssize_t n;
+	int rc = 0;
+
+	if (st->st_size < (REKEY_BACKUP_OFFSET + ECRYPTFS_DEFAULT_EXTENT_SIZE))
+		return 0;
+	n = pread(fd, backup, sizeof(backup), REKEY_BACKUP_OFFSET);
+	if (n != sizeof(backup))
+		return (n == -1) ? -errno : 0;
+	memset(zeros, 0, sizeof(zeros));
+	if (!memcmp(backup, zeros, sizeof(zeros)))
+		return 0;
+	/* Either a copy or file data; only a copy parses as a header
+	 * that is long enough to have held it */
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set, backup,
+					   sizeof(backup))
+	    || crypt_stat.num_header_bytes_at_front
+	       < (REKEY_BACKUP_OFFSET + ECRYPTFS_DEFAULT_EXTENT_SIZE))
+		goto out;
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set, header,
+					   ECRYPTFS_DEFAULT_EXTENT_SIZE)) {
+		/* Then again, the front of a file that keeps its metadata
+		 * in the xattr is data */
+		if (fgetxattr(fd, ECRYPTFS_XATTR_NAME, NULL, 0) != -1
+		    || errno != ENODATA)
+			goto out;
+		if ((rc = rekey_pwrite_extent(fd, backup, 0)))
+			goto out;
+		if (fdatasync(fd)) {
+			rc = -errno;
+			goto out;
+		}
+		memcpy(header, backup, sizeof(backup));
+	}
+	if ((rc = rekey_pwrite_extent(fd, zeros, REKEY_BACKUP_OFFSET)))
+		goto out;
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	futimens(fd, times);
+out:
+	memset(backup, 0, sizeof(backup));
+	return rc;
+}
+
+enum rekey_result {
+	REKEY_REKEYED,
+	REKEY_ALREADY,
+	REKEY_NOT_ECRYPTFS,
+	REKEY_FAILED
+};
+
+static enum rekey_result rekey_file(struct rekey *rekey, int fd,
+				    struct stat *st, const char *path)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	struct ecryptfs_key_packet_user *old_key = NULL;
+	char header[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	char old_header[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	uint64_t header_size;
+	int have_new = 0;
+	size_t size;
+	uint32_t i;
+	int rc;
+
+	memset(header, 0, sizeof(header));
+	if (pread(fd, header, sizeof(header), 0) == -1
+	    || rekey_recover_header(fd, st, header)) {
+		fprintf(stderr, "Error recovering the header of [%s] from an "
+			"interrupted run\n", path);
+		return REKEY_FAILED;
+	}
+	if (ecryptfs_read_lower_metadata(fd, header, sizeof(header),
+					 &crypt_stat, &packet_set,
+					 &header_size))
+		return REKEY_NOT_ECRYPTFS;
+	if (packet_set.total_keys > packet_set.num_keys) {
+		fprintf(stderr, "[%s] has more key packets than can be "
+			"preserved\n", path);
+		return REKEY_FAILED;
+	}
+	for (i = 0; i < packet_set.num_keys; i++) {
+		struct ecryptfs_key_packet_user *key = &packet_set.keys[i];
+		struct rekey_kek kek;
+
+		if (key->tag != ECRYPTFS_TAG_3_PACKET_TYPE || !key->sig)
+			continue;
+		if (!memcmp(key->sig, rekey->new_sig, ECRYPTFS_SIG_SIZE)) {
+			have_new = 1;
+			continue;
+		}
+		if (old_key)
+			continue;
+		rc = rekey_get_old_kek(rekey, &kek, key->salt);
+		memset(kek.fekek, 0, sizeof(kek.fekek));
+		if (rc) {
+			fprintf(stderr, "Error deriving the old key for [%s]; "
+				"rc = [%d]\n", path, rc);
+			return REKEY_FAILED;
+		}
+		if (!memcmp(key->sig, kek.sig, ECRYPTFS_SIG_SIZE))
+			old_key = key;
+	}
+	if (!old_key) {
+		if (have_new)
+			return REKEY_ALREADY;
+		fprintf(stderr, "[%s] is not encrypted under the old "
+			"passphrase\n", path);
+		return REKEY_FAILED;
+	}
+	if (have_new && rekey->add)
+		return REKEY_ALREADY;
+	memcpy(old_header, header, sizeof(header));
+	rc = rekey_build_header(rekey, header, &packet_set, old_key, have_new,
+				&size);
+	if (!rc)
+		rc = rekey_write_header(fd, st, header, old_header, size,
+					header_size);
+	memset(header, 0, sizeof(header));
+	memset(old_header, 0, sizeof(old_header));
+	if (rc) {
+		fprintf(stderr, "Error rewriting the header of [%s]; "
+			"rc = [%d]\n", path, rc);
+		return REKEY_FAILED;
+	}
+	return REKEY_REKEYED;
+}
+
+static int rekey_visit(struct ecryptfs_walk_entry *entry, void *priv,
+		       int worker)
+{
+	struct rekey *rekey = priv;
+	struct rekey_totals *totals = &rekey->totals[worker];
+	struct stat st;
+	int fd;
+
+	if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+		return 0;
+	if (rekey_done_contains(&rekey->done, entry->path)) {
+		totals->skipped++;
+		return 0;
+	}
+	fd = openat(entry->dirfd, entry->name,
+		    O_RDWR | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1) {
+		if (errno != ELOOP) {
+			fprintf(stderr, "Error opening [%s]: %m\n",
+				entry->path);
+			totals->failed++;
+		}
+		return 0;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return 0;
+	}
+	switch (rekey_file(rekey, fd, &st, entry->path)) {
+	case REKEY_REKEYED:
+		totals->rekeyed++;
+		rekey_journal_done(rekey, entry->path);
+		break;
+	case REKEY_ALREADY:
+		totals->already++;
+		rekey_journal_done(rekey, entry->path);
+		break;
+	case REKEY_NOT_ECRYPTFS:
+		totals->not_ecryptfs++;
+		break;
+	default:
+		totals->failed++;
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+ * rekey_name
+ * @name: Lower name, or symlink target
+ * @new_name: Set to @name encrypted under the new filename key;
+ *            NAME_MAX + 1 bytes
+ *
+ * Returns zero when @new_name was set, one if @name stays as it is
+ * because it is not encrypted or is under the new filename key already
+ */
+static int rekey_name(struct rekey *rekey, const char *name, char *new_name)
+{
+	char upper[NAME_MAX + 1];
+	size_t len = strlen(name);
+	int rc;
+
+	if (!ecryptfs_is_encrypted_filename(name, len))
+		return 1;
+	rc = ecryptfs_decrypt_filename(rekey->old_fn_ctx, upper, name, len);
+	if (rc == -ENOKEY && !ecryptfs_decrypt_filename(rekey->new_fn_ctx,
+							upper, name, len))
+		rc = 1;
+	else if (!rc)
+		rc = ecryptfs_encrypt_filename(rekey->new_fn_ctx, new_name,
+					       (NAME_MAX + 1), upper,
+					       strlen(upper));
+	memset(upper, 0, sizeof(upper));
+	return rc;
+}
+
+/**
+ * rekey_replace_symlink
+ *
+ * A symlink target cannot be changed in place; a new link is made
+ * under a temporary name and renamed over @new_name, and @name is
+ * removed if it differs. A run stopped in between leaves @name and
+ * @new_name both, and the next one finishes the job.
+ */
+static int rekey_replace_symlink(int dirfd, struct stat *st,
+				 const char *name, const char *new_name,
+				 const char *target)
+{
+	static unsigned int serial;
+	char tmp[NAME_MAX + 1];
+	int rc = 0;
+
+	do {
+		snprintf(tmp, sizeof(tmp), ".ecryptfs-rekey.%d.%u", getpid(),
+			 serial++);
+		if (!symlinkat(target, dirfd, tmp))
+			break;
+		if (errno != EEXIST)
+			return -errno;
+	} while (1);
+	if (fchownat(dirfd, tmp, st->st_uid, st->st_gid,
+		     AT_SYMLINK_NOFOLLOW)
+	    && (st->st_uid != geteuid() || st->st_gid != getegid())) {
+		rc = -errno;
+		unlinkat(dirfd, tmp, 0);
+		goto out;
+	}
+	if (renameat(dirfd, tmp, dirfd, new_name)) {
+		rc = -errno;
+		unlinkat(dirfd, tmp, 0);
+		goto out;
+	}
+	if (strcmp(name, new_name) && unlinkat(dirfd, name, 0))
+		rc = -errno;
+out:
+	return rc;
+}
+
+/**
+ * rekey_rename_entry
+ *
+ * Returns zero if the entry was renamed, one if it stays as it is
+ */
+static int rekey_rename_entry(struct rekey *rekey, int dirfd,
+			      const char *name, struct stat *st)
+{
+	char new_name[NAME_MAX + 1];
+	char new_target[NAME_MAX + 1];
+	char target[PATH_MAX];
+	struct stat tmp_st;
+	int target_rc = 1;
+	int name_rc;
+	ssize_t len;
+
+	name_rc = rekey_name(rekey, name, new_name);
+	if (name_rc < 0)
+		return name_rc;
+	if (S_ISLNK(st->st_mode)) {
+		len = readlinkat(dirfd, name, target, (sizeof(target) - 1));
+		if (len == -1)
+			return -errno;
+		target[len] = '\0';
+		target_rc = rekey_name(rekey, target, new_target);
+		if (target_rc < 0)
+			return target_rc;
+	}
+	if (name_rc && target_rc)
+		return 1;
+	if (!target_rc)
+		return rekey_replace_symlink(dirfd, st, name,
+					     name_rc ? name : new_name,
+					     new_target);
+	/* Two lower names only decrypt to the same upper name if the
+	 * tree was tampered with; do not lose either */
+	if (!fstatat(dirfd, new_name, &tmp_st, AT_SYMLINK_NOFOLLOW))
+		return -EEXIST;
+	if (renameat(dirfd, name, dirfd, new_name))
+		return -errno;
+	return 0;
+}
+
+/**
+ * rekey_names_dir
+ * @dirfd: Directory to work on
+ * @path: Its path, for reporting
+ * @dev: Device of the tree; other file systems are left alone
+ *
+ * The entries are read in full before any is renamed, so that readdir()
+ * does not return renamed entries a second time, and subdirectories are
+ * done before their own name changes. This is a single thread, unlike
+ * the header pass; renames are cheap next to the KDF and the syncs.
+ */
+static void rekey_names_dir(struct rekey *rekey, int dirfd, const char *path,
+			    dev_t dev)
+{
+	struct rekey_totals *totals = &rekey->totals[0];
+	struct timespec times[2];
+	struct dirent *de;
+	struct stat dir_st;
+	struct stat st;
+	char **names = NULL;
+	size_t num_names = 0;
+	size_t max_names = 0;
+	int renamed = 0;
+	DIR *dir;
+	size_t i;
+	int fd;
+	int rc;
+
+	if (fstat(dirfd, &dir_st) || (fd = dup(dirfd)) == -1
+	    || !(dir = fdopendir(fd))) {
+		fprintf(stderr, "Error reading [%s]: %m\n", path);
+		totals->failed++;
+		return;
+	}
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (num_names == max_names) {
+			char **tmp;
+
+			max_names = max_names ? (max_names * 2) : 64;
+			tmp = realloc(names, (max_names * sizeof(char *)));
+			if (!tmp)
+				break;
+			names = tmp;
+		}
+		if (!(names[num_names] = strdup(de->d_name)))
+			break;
+		num_names++;
+	}
+	if (de) {
+		fprintf(stderr, "Out of memory reading [%s]\n", path);
+		totals->failed++;
+	}
+	closedir(dir);
+	for (i = 0; i < num_names; i++) {
+		char *sub_path;
+
+		if (asprintf(&sub_path, "%s/%s", path, names[i]) == -1) {
+			totals->failed++;
+			continue;
+		}
+		if (fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW)) {
+			fprintf(stderr, "Error looking at [%s]: %m\n",
+				sub_path);
+			totals->failed++;
+			goto next;
+		}
+		if (S_ISDIR(st.st_mode) && st.st_dev == dev) {
+			fd = openat(dirfd, names[i],
+				    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd == -1) {
+				fprintf(stderr, "Error opening [%s]: %m\n",
+					sub_path);
+				totals->failed++;
+				goto next;
+			}
+			rekey_names_dir(rekey, fd, sub_path, dev);
+			close(fd);
+		}
+		rc = rekey_rename_entry(rekey, dirfd, names[i], &st);
+		if (rc < 0) {
+			fprintf(stderr, "Error encrypting the name of [%s] "
+				"under the new filename key; rc = [%d]\n",
+				sub_path, rc);
+			totals->failed++;
+		} else if (!rc) {
+			totals->renamed++;
+			renamed = 1;
+		}
+next:
+		free(sub_path);
+		free(names[i]);
+	}
+	free(names);
+	/* As for the files, the lower times are the upper ones */
+	if (renamed) {
+		times[0] = dir_st.st_atim;
+		times[1] = dir_st.st_mtim;
+		futimens(dirfd, times);
+	}
+}
+
+/**
+ * rekey_read_passphrase
+ *
+ * Prompts go to stderr, and only when stdin is a terminal, so both
+ * passphrases can be piped in.
+ */
+static char *rekey_read_passphrase(const char *prompt)
+{
+	int interactive = isatty(STDIN_FILENO);
+	char *passphrase;
+
+	if (interactive)
+		fprintf(stderr, "%s: ", prompt);
+	passphrase = ecryptfs_get_passphrase(NULL);
+	if (interactive)
+		fprintf(stderr, "\n");
+	return passphrase;
+}
+
+int main(int argc, char **argv)
+{
+	struct rekey rekey;
+	struct rekey_totals sum;
+	struct ecryptfs_walk walk;
+	char salt_hex[ECRYPTFS_SALT_SIZE_HEX];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char *new_passphrase = NULL;
+	char *journal_path = NULL;
+	char *journal_buf = NULL;
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char fnek_sig[ECRYPTFS_SIG_SIZE];
+	uint8_t cipher_code;
+	int key_bytes = 16;
+	int root_fd = -1;
+	struct stat root_st;
+	int num_threads = 0;
+	int i, c;
+	int rc = 0;
+
+	memset(&rekey, 0, sizeof(rekey));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	memset(fnek, 0, sizeof(fnek));
+	rekey.sync_fd = -1;
+	pthread_mutex_init(&rekey.kek_lock, NULL);
+	pthread_mutex_init(&rekey.journal_lock, NULL);
+	while ((c = getopt(argc, argv, "ak:t:j:h")) != -1) {
+		switch (c) {
+		case 'a':
+			rekey.add = 1;
+			break;
+		case 'k':
+			key_bytes = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'j':
+			journal_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	cipher_code = ecryptfs_code_for_cipher_string("aes", key_bytes);
+	if (optind != (argc - 1) || num_threads < 0 || !cipher_code) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	rekey.old_passphrase = rekey_read_passphrase("Old mount passphrase");
+	if (rekey.old_passphrase)
+		new_passphrase = rekey_read_passphrase("New mount passphrase");
+	if (!rekey.old_passphrase || !new_passphrase) {
+		rc = -EINVAL;
+		goto out;
+	}
+	if (ecryptfs_read_salt_hex_from_rc(salt_hex))
+		from_hex(rekey.new_salt, ECRYPTFS_DEFAULT_SALT_HEX,
+			 ECRYPTFS_SALT_SIZE);
+	else
+		from_hex(rekey.new_salt, salt_hex, ECRYPTFS_SALT_SIZE);
+	rc = generate_passphrase_sig(sig_hex, rekey.new_fekek, rekey.new_salt,
+				     new_passphrase);
+	if (rc) {
+		fprintf(stderr, "Error deriving the new key; rc = [%d]\n", rc);
+		goto out;
+	}
+	from_hex(rekey.new_sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	printf("New key signature [%s]\n", sig_hex);
+	if (!rekey.add) {
+		rc = ecryptfs_derive_fnek(fnek, fnek_sig,
+					  rekey.old_passphrase);
+		if (!rc)
+			rc = ecryptfs_fn_ctx_create(&rekey.old_fn_ctx,
+						    cipher_code, fnek,
+						    key_bytes, fnek_sig);
+		if (!rc)
+			rc = ecryptfs_derive_fnek(fnek, fnek_sig,
+						  new_passphrase);
+		if (!rc)
+			rc = ecryptfs_fn_ctx_create(&rekey.new_fn_ctx,
+						    cipher_code, fnek,
+						    key_bytes, fnek_sig);
+		memset(fnek, 0, sizeof(fnek));
+		if (rc) {
+			fprintf(stderr, "Error setting up the filename keys; "
+				"rc = [%d]\n", rc);
+			goto out;
+		}
+		to_hex(sig_hex, fnek_sig, ECRYPTFS_SIG_SIZE);
+		printf("New filename key signature [%s]\n", sig_hex);
+	}
+	rekey.sync_fd = open(argv[optind], O_RDONLY);
+	if (rekey.sync_fd == -1) {
+		rc = -errno;
+		fprintf(stderr, "Error opening [%s]: %m\n", argv[optind]);
+		goto out;
+	}
+	if (journal_path) {
+		rc = rekey_load_journal(&rekey, journal_path, &journal_buf);
+		if (rc) {
+			fprintf(stderr, "Error reading journal [%s]; "
+				"rc = [%d]\n", journal_path, rc);
+			goto out;
+		}
+		rekey.journal = fopen(journal_path, "a");
+		if (!rekey.journal) {
+			rc = -errno;
+			fprintf(stderr, "Error opening journal [%s]: %m\n",
+				journal_path);
+			goto out;
+		}
+	}
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	rekey.totals = calloc(num_threads, sizeof(*rekey.totals));
+	if (!rekey.totals) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	/* Names first, so that the paths in the journal stay valid */
+	root_fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+	if (rekey.new_fn_ctx && root_fd != -1 && !fstat(root_fd, &root_st))
+		rekey_names_dir(&rekey, root_fd, argv[optind], root_st.st_dev);
+	walk.num_threads = num_threads;
+	walk.flags = ECRYPTFS_WALK_XDEV;
+	walk.fn = rekey_visit;
+	walk.priv = &rekey;
+	rc = ecryptfs_walk_tree(&walk, argv[optind]);
+	pthread_mutex_lock(&rekey.journal_lock);
+	rekey_flush_journal(&rekey);
+	pthread_mutex_unlock(&rekey.journal_lock);
+	/* Also gets the wiped header copies to disk */
+	syncfs(rekey.sync_fd);
+	if (rc)
+		fprintf(stderr, "Error walking [%s]; rc = [%d]\n",
+			argv[optind], rc);
+	for (i = 0; i < num_threads; i++) {
+		sum.renamed += rekey.totals[i].renamed;
+		sum.rekeyed += rekey.totals[i].rekeyed;
+		sum.already += rekey.totals[i].already;
+		sum.skipped += rekey.totals[i].skipped;
+		sum.not_ecryptfs += rekey.totals[i].not_ecryptfs;
+		sum.failed += rekey.totals[i].failed;
+	}
+	printf("Renamed: [%llu]\n", (unsigned long long)sum.renamed);
+	printf("Rewrapped: [%llu]\n", (unsigned long long)sum.rekeyed);
+	printf("Already under the new key: [%llu]\n",
+	       (unsigned long long)sum.already);
+	printf("Skipped from journal: [%llu]\n",
+	       (unsigned long long)sum.skipped);
+	printf("Not eCryptfs files: [%llu]\n",
+	       (unsigned long long)sum.not_ecryptfs);
+	printf("Failed: [%llu]\n", (unsigned long long)sum.failed);
+	if (!rc && (sum.failed || walk.num_errors))
+		rc = -EIO;
+out:
+	if (rekey.journal)
+		fclose(rekey.journal);
+	if (rekey.sync_fd != -1)
+		close(rekey.sync_fd);
+	if (root_fd != -1)
+		close(root_fd);
+	if (rekey.old_fn_ctx)
+		ecryptfs_fn_ctx_destroy(rekey.old_fn_ctx);
+	if (rekey.new_fn_ctx)
+		ecryptfs_fn_ctx_destroy(rekey.new_fn_ctx);
+	free(rekey.done.paths);
+	free(journal_buf);
+	free(rekey.totals);
+	memset(&rekey.keks, 0, sizeof(rekey.keks));
+	memset(rekey.new_fekek, 0, sizeof(rekey.new_fekek));
+	if (rekey.old_passphrase) {
+		memset(rekey.old_passphrase, 0, strlen(rekey.old_passphrase));
+		free(rekey.old_passphrase);
+	}
+	if (new_passphrase) {
+		memset(new_passphrase, 0, strlen(new_passphrase));
+		free(new_passphrase);
+	}
+	return rc ? 1 : 0;
+}
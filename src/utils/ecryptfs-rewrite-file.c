@@ -0,0 +1,806 @@
+/**
+ * ecryptfs-rewrite-file: Force files to be rewritten, and so
+ * reencrypted, in the lower file system, by copying each one to a
+ * temporary file next to it and renaming that over the original
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include "../include/ecryptfs.h"
+#include "walker.h"
+
+#define REWRITE_DEFAULT_BUF_KIB 1024
+#define REWRITE_TEMP_TRIES 100
+/* Prefix of temporary names when ".<name>." would be too long once
+ * encrypted */
+#define REWRITE_SHORT_PREFIX ".rewrite"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+struct rewrite_item {
+	char *path;
+	unsigned char d_type;
+	int depth;
+};
+
+struct rewrite_list {
+	struct rewrite_item *items;
+	size_t count;
+	size_t size;
+};
+
+struct rewrite_failure {
+	char *path;
+	int rc;
+	struct rewrite_failure *next;
+};
+
+/**
+ * struct rewrite - State shared by every worker
+ * @files: Everything but directories, from every worker's walk
+ * @dirs: Directories; renamed once every file has been rewritten, the
+ *        deepest first, so that no rename moves a path another worker
+ *        is using
+ * @next: Index of the next item to hand out in the current pass
+ * @done: Items finished, for the progress report
+ * @missing: Paths given that do not exist; counted as failed rewrites
+ * @last_report: Second of the last progress report
+ * @reported: @done as of the last progress report
+ */
+struct rewrite {
+	struct rewrite_list *lists;
+	struct rewrite_list files;
+	struct rewrite_list dirs;
+	int num_threads;
+	size_t buf_size;
+	int quiet;
+	int is_root;
+	struct rewrite_item *pass;
+	size_t pass_count;
+	size_t next;
+	uint64_t done;
+	uint64_t succeeded;
+	uint64_t total;
+	uint64_t missing;
+	uint64_t bytes;
+	time_t last_report;
+	uint64_t reported;
+	pthread_mutex_t failures_lock;
+	struct rewrite_failure *failures;
+	uint64_t num_failures;
+};
+
+struct rewrite_thread {
+	pthread_t thread;
+	struct rewrite *rw;
+	char *buf;
+	unsigned int seed;
+};
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage:\n\n"
+		"%s [-r] [-t <threads>] [-b <KiB>] [-q] <path> [<path> ...]\n\n"
+		"Rewrites each file, directory and symlink given, so that "
+		"eCryptfs reencrypts\n"
+		"it in the lower file system.\n\n"
+		"  -r  Also rewrite everything under the directories given\n"
+		"  -t  Number of worker threads (default: online CPUs)\n"
+		"  -b  Size of each read and write in KiB (default %d)\n"
+		"  -q  Do not report progress\n", name, REWRITE_DEFAULT_BUF_KIB);
+}
+
+static int rewrite_list_add(struct rewrite_list *list, const char *path,
+			    unsigned char d_type)
+{
+	const char *p;
+
+	if (list->count == list->size) {
+		size_t size = list->size ? (list->size * 2) : 256;
+		struct rewrite_item *items;
+
+		items = realloc(list->items, size * sizeof(*items));
+		if (!items)
+			return -ENOMEM;
+		list->items = items;
+		list->size = size;
+	}
+	list->items[list->count].path = strdup(path);
+	if (!list->items[list->count].path)
+		return -ENOMEM;
+	list->items[list->count].d_type = d_type;
+	list->items[list->count].depth = 0;
+	for (p = path; *p; p++)
+		if (*p == '/')
+			list->items[list->count].depth++;
+	list->count++;
+	return 0;
+}
+
+static int rewrite_list_splice(struct rewrite_list *dst,
+			       struct rewrite_list *src)
+{
+	if (dst->count + src->count > dst->size) {
+		size_t size = dst->count + src->count;
+		struct rewrite_item *items;
+
+		items = realloc(dst->items, size * sizeof(*items));
+		if (!items)
+			return -ENOMEM;
+		dst->items = items;
+		dst->size = size;
+	}
+	memcpy(&dst->items[dst->count], src->items,
+	       src->count * sizeof(*src->items));
+	dst->count += src->count;
+	free(src->items);
+	memset(src, 0, sizeof(*src));
+	return 0;
+}
+
+static void rewrite_failed(struct rewrite *rw, const char *path, int rc)
+{
+	struct rewrite_failure *failure;
+
+	__atomic_add_fetch(&rw->num_failures, 1, __ATOMIC_RELAXED);
+	failure = calloc(1, sizeof(*failure));
+	if (!failure)
+		return;
+	failure->path = strdup(path);
+	failure->rc = rc;
+	pthread_mutex_lock(&rw->failures_lock);
+	failure->next = rw->failures;
+	rw->failures = failure;
+	pthread_mutex_unlock(&rw->failures_lock);
+}
+
+/**
+ * rewrite_progress
+ *
+ * At most one line a second, from whichever worker gets there first
+ */
+static void rewrite_progress(struct rewrite *rw, int force)
+{
+	uint64_t done = __atomic_load_n(&rw->done, __ATOMIC_RELAXED);
+	time_t last = __atomic_load_n(&rw->last_report, __ATOMIC_RELAXED);
+	time_t now = time(NULL);
+
+	if (rw->quiet || (!force && now == last)
+	    || (force && done == rw->reported))
+		return;
+	if (!force && !__atomic_compare_exchange_n(&rw->last_report, &last,
+						   now, 0, __ATOMIC_RELAXED,
+						   __ATOMIC_RELAXED))
+		return;
+	rw->reported = done;
+	fprintf(stderr, "INFO: Rewritten [%llu/%llu]; [%llu] bytes; "
+		"[%llu] failed\n", (unsigned long long)done,
+		(unsigned long long)rw->total,
+		(unsigned long long)__atomic_load_n(&rw->bytes,
+						    __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&rw->num_failures,
+						    __ATOMIC_RELAXED));
+}
+
+/**
+ * rewrite_temp_name
+ * @tmp: Receives ".<name>.XXXXXX", or a shorter name when @short_name
+ *
+ * The same form as mkstemp() callers use, which ecryptfs-fsck knows to
+ * report if a crash leaves one behind
+ */
+static int rewrite_temp_name(char *tmp, size_t size, const char *name,
+			     int short_name, unsigned int *seed)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	size_t len;
+	int i;
+
+	if (short_name)
+		len = snprintf(tmp, size, "%s.", REWRITE_SHORT_PREFIX);
+	else
+		len = snprintf(tmp, size, ".%s.", name);
+	if (len + 7 > size)
+		return -ENAMETOOLONG;
+	for (i = 0; i < 6; i++)
+		tmp[len + i] = chars[rand_r(seed) % (sizeof(chars) - 1)];
+	tmp[len + 6] = '\0';
+	return 0;
+}
+
+/**
+ * rewrite_rename
+ *
+ * eCryptfs refuses every renameat2() flag, so @flags is only a
+ * safeguard on file systems that take it
+ */
+static int rewrite_rename(int dirfd, const char *from, const char *to,
+			  unsigned int flags)
+{
+#ifdef HAVE_RENAMEAT2
+	if (flags) {
+		if (!renameat2(dirfd, from, dirfd, to, flags))
+			return 0;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -errno;
+	}
+#endif
+	if (renameat(dirfd, from, dirfd, to))
+		return -errno;
+	return 0;
+}
+
+/**
+ * rewrite_copy_xattrs
+ *
+ * As cp -a does; attributes the caller may not set, and file systems
+ * without them, are passed over. An attribute that cannot be read
+ * fails the file rather than being dropped from the copy.
+ */
+static int rewrite_copy_xattrs(int src_fd, int fd)
+{
+	char *names = NULL;
+	char *value = NULL;
+	ssize_t len;
+	ssize_t i;
+	int rc = 0;
+
+	len = flistxattr(src_fd, NULL, 0);
+	if (len <= 0) {
+		if (len < 0 && errno != ENOTSUP)
+			rc = -errno;
+		goto out;
+	}
+	names = malloc(len);
+	if (!names) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	len = flistxattr(src_fd, names, len);
+	if (len < 0) {
+		rc = -errno;
+		goto out;
+	}
+	for (i = 0; i < len; i += (strlen(&names[i]) + 1)) {
+		ssize_t size;
+
+		size = fgetxattr(src_fd, &names[i], NULL, 0);
+		if (size < 0) {
+			/* Removed since it was listed */
+			if (errno == ENODATA)
+				continue;
+			rc = -errno;
+			goto out;
+		}
+		free(value);
+		value = malloc(size ? size : 1);
+		if (!value) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		size = fgetxattr(src_fd, &names[i], value, size);
+		if (size < 0) {
+			if (errno == ENODATA)
+				continue;
+			rc = -errno;
+			goto out;
+		}
+		if (fsetxattr(fd, &names[i], value, size, 0)
+		    && errno != EPERM && errno != ENOTSUP) {
+			rc = -errno;
+			goto out;
+		}
+	}
+out:
+	free(value);
+	free(names);
+	return rc;
+}
+
+static int rewrite_owner(struct rewrite *rw, int rc)
+{
+	/* Only root may give a file away; cp -a does not complain either */
+	if (rc && !rw->is_root && errno == EPERM)
+		return 0;
+	return rc ? -errno : 0;
+}
+
+static int rewrite_regular(struct rewrite_thread *t, int dirfd,
+			   const char *name, char *tmp, struct stat *st)
+{
+	struct rewrite *rw = t->rw;
+	struct timespec times[2];
+	struct stat after;
+	off_t offset = 0;
+	int src_fd;
+	int fd = -1;
+	int i;
+	int rc = 0;
+
+	src_fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+	if (src_fd == -1)
+		return -errno;
+	for (i = 0; i < REWRITE_TEMP_TRIES; i++) {
+		rc = rewrite_temp_name(tmp, NAME_MAX + 1, name,
+				       (i >= REWRITE_TEMP_TRIES / 2), &t->seed);
+		if (rc)
+			continue;
+		fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL
+			    | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+		if (fd != -1)
+			break;
+		rc = -errno;
+		if (errno != EEXIST && errno != ENAMETOOLONG)
+			goto out;
+	}
+	if (rc)
+		goto out;
+	posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		ssize_t got = read(src_fd, t->buf, rw->buf_size);
+		ssize_t done;
+
+		if (got < 0) {
+			rc = -errno;
+			goto out_unlink;
+		}
+		if (!got)
+			break;
+		for (done = 0; done < got;) {
+			ssize_t n = write(fd, &t->buf[done], (got - done));
+
+			if (n < 0) {
+				rc = -errno;
+				goto out_unlink;
+			}
+			done += n;
+		}
+		offset += got;
+	}
+	if (fstat(src_fd, &after)) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	if (after.st_size != offset
+	    || after.st_mtim.tv_sec != st->st_mtim.tv_sec
+	    || after.st_mtim.tv_nsec != st->st_mtim.tv_nsec) {
+		rc = -EAGAIN;
+		goto out_unlink;
+	}
+	rc = rewrite_owner(rw, fchown(fd, st->st_uid, st->st_gid));
+	if (rc)
+		goto out_unlink;
+	rc = rewrite_copy_xattrs(src_fd, fd);
+	if (rc)
+		goto out_unlink;
+	if (fchmod(fd, (st->st_mode & 07777))) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	if (futimens(fd, times)) {
+		rc = -errno;
+		goto out_unlink;
+	}
+	rc = rewrite_rename(dirfd, tmp, name, 0);
+	if (rc)
+		goto out_unlink;
+	__atomic_add_fetch(&rw->bytes, offset, __ATOMIC_RELAXED);
+	goto out_close;
+out_unlink:
+	unlinkat(dirfd, tmp, 0);
+out_close:
+	close(fd);
+out:
+	close(src_fd);
+	return rc;
+}
+
+/**
+ * rewrite_other
+ *
+ * Symlinks, device nodes, fifos and sockets are created afresh under
+ * a temporary name and renamed over the original.
+ */
+static int rewrite_other(struct rewrite_thread *t, int dirfd,
+			 const char *name, char *tmp, struct stat *st)
+{
+	char target[PATH_MAX];
+	struct timespec times[2];
+	ssize_t len = 0;
+	int i;
+	int rc = 0;
+
+	if (S_ISLNK(st->st_mode)) {
+		len = readlinkat(dirfd, name, target, sizeof(target));
+		if (len < 0)
+			return -errno;
+		if (len == sizeof(target))
+			return -ENAMETOOLONG;
+		target[len] = '\0';
+	}
+	for (i = 0; i < REWRITE_TEMP_TRIES; i++) {
+		int err;
+
+		rc = rewrite_temp_name(tmp, NAME_MAX + 1, name,
+				       (i >= REWRITE_TEMP_TRIES / 2), &t->seed);
+		if (rc)
+			continue;
+		if (S_ISLNK(st->st_mode))
+			err = symlinkat(target, dirfd, tmp);
+		else
+			err = mknodat(dirfd, tmp, (st->st_mode & ~07777)
+				      | S_IRUSR | S_IWUSR, st->st_rdev);
+		if (!err)
+			break;
+		rc = -errno;
+		if (errno != EEXIST && errno != ENAMETOOLONG)
+			return rc;
+	}
+	if (rc)
+		return rc;
+	rc = rewrite_owner(t->rw, fchownat(dirfd, tmp, st->st_uid, st->st_gid,
+					   AT_SYMLINK_NOFOLLOW));
+	if (rc)
+		goto out;
+	if (!S_ISLNK(st->st_mode) && fchmodat(dirfd, tmp,
+					      (st->st_mode & 07777), 0)) {
+		rc = -errno;
+		goto out;
+	}
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	utimensat(dirfd, tmp, times, AT_SYMLINK_NOFOLLOW);
+	rc = rewrite_rename(dirfd, tmp, name, 0);
+out:
+	if (rc)
+		unlinkat(dirfd, tmp, 0);
+	return rc;
+}
+
+/**
+ * rewrite_dir
+ *
+ * Moving a directory away and back gives it a freshly encrypted name.
+ * An empty directory holds the temporary name, as mktemp -d would, so
+ * that the first rename can only ever replace that.
+ */
+static int rewrite_dir(struct rewrite_thread *t, int dirfd, const char *name,
+		       char *tmp)
+{
+	int i;
+	int rc = 0;
+
+	for (i = 0; i < REWRITE_TEMP_TRIES; i++) {
+		rc = rewrite_temp_name(tmp, NAME_MAX + 1, name,
+				       (i >= REWRITE_TEMP_TRIES / 2), &t->seed);
+		if (rc)
+			continue;
+		if (!mkdirat(dirfd, tmp, S_IRWXU))
+			break;
+		rc = -errno;
+		if (errno != EEXIST && errno != ENAMETOOLONG)
+			return rc;
+	}
+	if (rc)
+		return rc;
+	rc = rewrite_rename(dirfd, name, tmp, 0);
+	if (rc) {
+		unlinkat(dirfd, tmp, AT_REMOVEDIR);
+		return rc;
+	}
+	rc = rewrite_rename(dirfd, tmp, name, RENAME_NOREPLACE);
+	if (rc)
+		fprintf(stderr, "ERROR: [%s] was left at [%s]\n", name, tmp);
+	return rc;
+}
+
+static int rewrite_item(struct rewrite_thread *t, struct rewrite_item *item)
+{
+	char tmp[NAME_MAX + 1];
+	char *dir = NULL;
+	const char *name;
+	struct stat st;
+	char *slash;
+	int dirfd;
+	int rc;
+
+	slash = strrchr(item->path, '/');
+	if (slash) {
+		dir = strndup(item->path, (slash == item->path) ? 1
+			      : (size_t)(slash - item->path));
+		if (!dir)
+			return -ENOMEM;
+		name = (slash + 1);
+	} else
+		name = item->path;
+	dirfd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (dirfd == -1)
+		return -errno;
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+		rc = -errno;
+		goto out;
+	}
+	if (S_ISDIR(st.st_mode))
+		rc = rewrite_dir(t, dirfd, name, tmp);
+	else if (S_ISREG(st.st_mode))
+		rc = rewrite_regular(t, dirfd, name, tmp, &st);
+	else
+		rc = rewrite_other(t, dirfd, name, tmp, &st);
+out:
+	close(dirfd);
+	return rc;
+}
+
+static void *rewrite_thread_fn(void *arg)
+{
+	struct rewrite_thread *t = arg;
+	struct rewrite *rw = t->rw;
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&rw->next, 1, __ATOMIC_RELAXED);
+		int rc;
+
+		if (i >= rw->pass_count)
+			break;
+		rc = rewrite_item(t, &rw->pass[i]);
+		if (rc)
+			rewrite_failed(rw, rw->pass[i].path, rc);
+		else
+			__atomic_add_fetch(&rw->succeeded, 1,
+					   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&rw->done, 1, __ATOMIC_RELAXED);
+		rewrite_progress(rw, 0);
+	}
+	return NULL;
+}
+
+/**
+ * rewrite_pass
+ *
+ * Hands @count items out to the workers, one at a time, and waits for
+ * all of them to be done
+ */
+static int rewrite_pass(struct rewrite *rw, struct rewrite_thread *threads,
+			struct rewrite_item *items, size_t count)
+{
+	int started = 0;
+	int i;
+	int rc = 0;
+
+	rw->pass = items;
+	rw->pass_count = count;
+	rw->next = 0;
+	for (i = 0; i < rw->num_threads && (size_t)i < count; i++) {
+		rc = -pthread_create(&threads[i].thread, NULL,
+				     rewrite_thread_fn, &threads[i]);
+		if (rc)
+			break;
+		started++;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i].thread, NULL);
+	return rc;
+}
+
+static int rewrite_visit(struct ecryptfs_walk_entry *entry, void *priv,
+			 int worker)
+{
+	struct rewrite *rw = priv;
+
+	return rewrite_list_add(&rw->lists[worker], entry->path,
+				entry->d_type);
+}
+
+static int rewrite_deepest_first(const void *a, const void *b)
+{
+	const struct rewrite_item *ia = a;
+	const struct rewrite_item *ib = b;
+
+	return (ib->depth - ia->depth);
+}
+
+/**
+ * rewrite_collect
+ *
+ * Lists the paths given, and with @recurse everything under them, into
+ * rw->files and rw->dirs. The directories "." and ".." cannot be moved
+ * and are only descended into.
+ */
+static int rewrite_collect(struct rewrite *rw, char **paths, int num_paths,
+			   int recurse)
+{
+	struct ecryptfs_walk walk;
+	int i;
+	int j;
+	int rc = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.num_threads = rw->num_threads;
+	walk.flags = (ECRYPTFS_WALK_DIRS | ECRYPTFS_WALK_XDEV);
+	walk.fn = rewrite_visit;
+	walk.priv = rw;
+	for (i = 0; i < num_paths; i++) {
+		const char *base = strrchr(paths[i], '/');
+		struct stat st;
+
+		base = base ? (base + 1) : paths[i];
+		if (lstat(paths[i], &st)) {
+			rewrite_failed(rw, paths[i], -errno);
+			rw->missing++;
+			continue;
+		}
+		if (S_ISDIR(st.st_mode) && recurse) {
+			rc = ecryptfs_walk_tree(&walk, paths[i]);
+			if (rc)
+				goto out;
+			if (walk.num_errors)
+				rewrite_failed(rw, paths[i], -EIO);
+		}
+		if (!strcmp(base, ".") || !strcmp(base, "..")
+		    || !strcmp(base, ""))
+			continue;
+		rc = rewrite_list_add(S_ISDIR(st.st_mode) ? &rw->dirs
+				      : &rw->files, paths[i],
+				      S_ISDIR(st.st_mode) ? DT_DIR : DT_REG);
+		if (rc)
+			goto out;
+	}
+	for (i = 0; i < rw->num_threads; i++) {
+		struct rewrite_list *list = &rw->lists[i];
+		struct rewrite_list dirs;
+
+		memset(&dirs, 0, sizeof(dirs));
+		for (j = 0; j < (int)list->count; j++) {
+			if (list->items[j].d_type != DT_DIR)
+				continue;
+			rc = rewrite_list_add(&dirs, list->items[j].path,
+					      DT_DIR);
+			if (rc)
+				goto out;
+			free(list->items[j].path);
+			list->items[j] = list->items[--list->count];
+			j--;
+		}
+		rc = rewrite_list_splice(&rw->files, list);
+		if (!rc)
+			rc = rewrite_list_splice(&rw->dirs, &dirs);
+		if (rc)
+			goto out;
+	}
+	qsort(rw->dirs.items, rw->dirs.count, sizeof(*rw->dirs.items),
+	      rewrite_deepest_first);
+out:
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	struct rewrite_thread *threads = NULL;
+	struct rewrite_failure *failure;
+	struct rewrite rw;
+	size_t buf_kib = REWRITE_DEFAULT_BUF_KIB;
+	size_t start;
+	size_t end;
+	int recurse = 0;
+	int c;
+	int i;
+	int rc = 0;
+
+	memset(&rw, 0, sizeof(rw));
+	pthread_mutex_init(&rw.failures_lock, NULL);
+	while ((c = getopt(argc, argv, "rt:b:qh")) != -1) {
+		switch (c) {
+		case 'r':
+			recurse = 1;
+			break;
+		case 't':
+			rw.num_threads = atoi(optarg);
+			break;
+		case 'b':
+			buf_kib = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			rw.quiet = 1;
+			break;
+		default:
+			usage(argv[0]);
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+	if (optind >= argc || !buf_kib) {
+		usage(argv[0]);
+		rc = -EINVAL;
+		goto out;
+	}
+	rw.buf_size = (((buf_kib * 1024) + ECRYPTFS_DEFAULT_EXTENT_SIZE - 1)
+		       / ECRYPTFS_DEFAULT_EXTENT_SIZE)
+		* ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	rw.is_root = (geteuid() == 0);
+	rw.num_threads = ecryptfs_walk_num_threads(rw.num_threads);
+	rw.lists = calloc(rw.num_threads, sizeof(*rw.lists));
+	threads = calloc(rw.num_threads, sizeof(*threads));
+	if (!rw.lists || !threads) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < rw.num_threads; i++) {
+		threads[i].rw = &rw;
+		threads[i].seed = (unsigned int)(time(NULL) ^ getpid()) + i;
+		threads[i].buf = malloc(rw.buf_size);
+		if (!threads[i].buf) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+	rc = rewrite_collect(&rw, &argv[optind], (argc - optind), recurse);
+	if (rc) {
+		fprintf(stderr, "ERROR: Could not list the files to rewrite; "
+			"rc = [%d]\n", rc);
+		goto out;
+	}
+	rw.total = (rw.files.count + rw.dirs.count);
+	rc = rewrite_pass(&rw, threads, rw.files.items, rw.files.count);
+	/* Directories at one depth cannot contain one another */
+	for (start = 0; !rc && start < rw.dirs.count; start = end) {
+		for (end = start; end < rw.dirs.count
+			     && rw.dirs.items[end].depth
+			     == rw.dirs.items[start].depth; end++)
+			;
+		rc = rewrite_pass(&rw, threads, &rw.dirs.items[start],
+				  (end - start));
+	}
+	rewrite_progress(&rw, 1);
+	for (failure = rw.failures; failure; failure = failure->next)
+		fprintf(stderr, "ERROR: Could not rewrite [%s]: %s\n",
+			failure->path, strerror(-failure->rc));
+	printf("%llu/%llu rewrites succeeded\n",
+	       (unsigned long long)rw.succeeded,
+	       (unsigned long long)(rw.total + rw.missing));
+	if (!rc && rw.num_failures)
+		rc = -EIO;
+out:
+	if (threads) {
+		for (i = 0; i < rw.num_threads; i++)
+			free(threads[i].buf);
+		free(threads);
+	}
+	free(rw.lists);
+	return rc ? 1 : 0;
+}
@@ -2,34 +2,51 @@
  * Present statistics on encrypted eCryptfs file attributes
  */
 
+#include "config.h"
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dirent.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include "../include/ecryptfs.h"
+#include "walker.h"
+
+#define ECRYPTFS_STAT_FORMAT_JSON 0
+#define ECRYPTFS_STAT_FORMAT_CSV  1
+#define ECRYPTFS_STAT_MAX_SIGS 64
 
 static void usage(const char *filename)
 {
 	printf("Usage:\n\n"
-	       "%s <filename>\n", filename);
+	       "%s <filename>\n"
+	       "%s -r [-o json|csv] [-t <threads>] [-s] [-k] "
+	       "<lower directory>\n\n"
+	       "  -r  Recursively scan a lower (encrypted) directory\n"
+	       "  -o  Record format for the recursive scan (default json)\n"
+	       "  -t  Number of scanning threads (default: online CPUs)\n"
+	       "  -s  Only print the totals\n"
+	       "  -k  Also parse the key packets; report the key signatures,\n"
+	       "      cipher and key size of each file\n", filename, filename);
 }
 
-int main(int argc, const char *argv[])
+static int stat_one_file(const char *filename)
 {
-	const char *filename;
 	int fd = -1;
 	ssize_t quant_read;
 	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
 	char buf[4096];
+	int i;
 	int rc = 0;
 
-	if (argc == 1) {
-		usage(argv[0]);
-		goto out;
-	}
-	filename = argv[1];
 	fd = open(filename, O_RDONLY);
 	if (fd == -1) {
 		printf("Error opening file [%s] for RD_ONLY access; errno msg "
@@ -68,8 +85,577 @@ int main(int argc, const char *argv[])
 		printf("HMAC enabled\n");
 	else
 		printf("HMAC disabled\n");
+	if (ecryptfs_parse_packet_set(
+		    &packet_set,
+		    (unsigned char *)&buf[ECRYPTFS_HEADER_METADATA_BYTES],
+		    (quant_read - ECRYPTFS_HEADER_METADATA_BYTES))) {
+		printf("Unable to parse the key packets\n");
+		goto out;
+	}
+	for (i = 0; i < packet_set.num_keys; i++) {
+		struct ecryptfs_key_packet_user *key = &packet_set.keys[i];
+		char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1] = "";
+		const char *cipher;
+
+		if (key->sig)
+			to_hex(sig_hex, (char *)key->sig, ECRYPTFS_SIG_SIZE);
+		if (key->tag == ECRYPTFS_TAG_1_PACKET_TYPE) {
+			printf("Key [%d]: public key; signature [%s]; "
+			       "encrypted key size [%zu]\n", i, sig_hex,
+			       key->encrypted_key_size);
+			continue;
+		}
+		cipher = ecryptfs_cipher_code_to_string(key->cipher_code);
+		printf("Key [%d]: passphrase; signature [%s]; cipher [%s]; "
+		       "key size [%zu]\n", i, sig_hex,
+		       cipher ? cipher : "unknown", key->key_size);
+	}
+	if (packet_set.total_keys > packet_set.num_keys)
+		printf("[%u] more keys not shown\n",
+		       (packet_set.total_keys - packet_set.num_keys));
 out:
 	if (fd != -1)
 		close(fd);
 	return rc;
 }
+
+/**
+ * Totals are kept per scanning thread and summed once the walk is
+ * over, so that the scan itself shares nothing but stdout.
+ */
+struct ecryptfs_stat_totals {
+	unsigned long long files;
+	unsigned long long valid;
+	unsigned long long invalid;
+	unsigned long long unreadable;
+	unsigned long long plaintext_bytes;
+	unsigned long long lower_bytes;
+	unsigned long long hmac;
+	unsigned long long xattr;
+	unsigned long long versions[256];
+	int num_sigs;
+	struct {
+		unsigned char sig[ECRYPTFS_SIG_SIZE];
+		unsigned long long files;
+	} sigs[ECRYPTFS_STAT_MAX_SIGS];
+	unsigned long long other_sigs;
+};
+
+struct ecryptfs_stat_out {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct ecryptfs_stat_scan {
+	int format;
+	int summary_only;
+	int keys;
+	struct ecryptfs_stat_totals *totals;
+	struct ecryptfs_stat_out *out;
+};
+
+static int stat_out_append(struct ecryptfs_stat_out *out, const char *str,
+			   size_t len)
+{
+	if (out->len + len + 1 > out->size) {
+		size_t size = (out->size ? out->size : 512);
+		char *data;
+
+		while (out->len + len + 1 > size)
+			size *= 2;
+		data = realloc(out->data, size);
+		if (!data)
+			return -ENOMEM;
+		out->data = data;
+		out->size = size;
+	}
+	memcpy(&out->data[out->len], str, len);
+	out->len += len;
+	out->data[out->len] = '\0';
+	return 0;
+}
+
+static int stat_out_printf(struct ecryptfs_stat_out *out, const char *fmt,
+			   ...) __attribute__((format(printf, 2, 3)));
+
+static int stat_out_printf(struct ecryptfs_stat_out *out, const char *fmt,
+			   ...)
+{
+	char tmp[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (len < 0 || (size_t)len >= sizeof(tmp))
+		return -EINVAL;
+	return stat_out_append(out, tmp, len);
+}
+
+static int stat_out_path(struct ecryptfs_stat_out *out, const char *path,
+			 int format)
+{
+	const char *p;
+	int rc;
+
+	if ((rc = stat_out_append(out, "\"", 1)))
+		return rc;
+	for (p = path; *p && !rc; p++) {
+		unsigned char c = (unsigned char)*p;
+
+		if (format == ECRYPTFS_STAT_FORMAT_CSV) {
+			rc = (c == '"') ? stat_out_append(out, "\"\"", 2)
+				: stat_out_append(out, p, 1);
+		} else if (c == '"' || c == '\\') {
+			char esc[2] = { '\\', c };
+
+			rc = stat_out_append(out, esc, 2);
+		} else if (c < 0x20) {
+			rc = stat_out_printf(out, "\\u%04x", c);
+		} else
+			rc = stat_out_append(out, p, 1);
+	}
+	if (!rc)
+		rc = stat_out_append(out, "\"", 1);
+	return rc;
+}
+
+/**
+ * stat_read_metadata
+ * @fd: Lower file
+ * @st: Result of fstat() on @fd
+ * @buf: Scratch space for the metadata
+ * @buf_size: Size of @buf; must be at least ECRYPTFS_HEADER_METADATA_BYTES
+ * @crypt_stat: Parsed metadata
+ * @packet_set: If not NULL, parse the key packets as well
+ * @map: Set to a mapping of the header extent that @packet_set points
+ *       into; the caller unmaps it
+ *
+ * Without @packet_set, only reads the leading bytes that
+ * ecryptfs_parse_stat() looks at. With it, the header extent is mapped
+ * rather than copied. When the lower file does not start with a valid
+ * header, the metadata may live in the user.ecryptfs xattr instead.
+ */
+static int stat_read_metadata(int fd, struct stat *st, char *buf,
+			      size_t buf_size,
+			      struct ecryptfs_crypt_stat_user *crypt_stat,
+			      struct ecryptfs_packet_set_user *packet_set,
+			      void **map)
+{
+	size_t map_size = ECRYPTFS_DEFAULT_EXTENT_SIZE;
+	ssize_t size;
+
+	(*map) = NULL;
+	if (!packet_set) {
+		size = pread(fd, buf, ECRYPTFS_HEADER_METADATA_BYTES, 0);
+		if (size == -1)
+			return -errno;
+		if (!ecryptfs_parse_stat(crypt_stat, buf, size))
+			return 0;
+	} else if (st->st_size >= ECRYPTFS_HEADER_METADATA_BYTES) {
+		if (st->st_size < map_size)
+			map_size = st->st_size;
+		(*map) = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		if ((*map) == MAP_FAILED) {
+			(*map) = NULL;
+			return -errno;
+		}
+		if (!ecryptfs_parse_stat_packet_set(crypt_stat, packet_set,
+						    (*map), map_size))
+			return 0;
+		munmap((*map), map_size);
+		(*map) = NULL;
+	}
+	size = fgetxattr(fd, ECRYPTFS_XATTR_NAME, buf, buf_size);
+	if (size == -1)
+		return -EINVAL;
+	if (packet_set)
+		return ecryptfs_parse_stat_packet_set(crypt_stat, packet_set,
+						      buf, size);
+	return ecryptfs_parse_stat(crypt_stat, buf, size);
+}
+
+static void stat_count_sigs(struct ecryptfs_stat_totals *totals,
+			    struct ecryptfs_packet_set_user *packet_set)
+{
+	uint32_t i, k;
+	int j;
+
+	for (i = 0; i < packet_set->num_keys; i++) {
+		const unsigned char *sig = packet_set->keys[i].sig;
+
+		if (!sig)
+			continue;
+		/* A file wrapped twice under the same key counts once */
+		for (k = 0; k < i; k++)
+			if (packet_set->keys[k].sig
+			    && !memcmp(packet_set->keys[k].sig, sig,
+				       ECRYPTFS_SIG_SIZE))
+				break;
+		if (k < i)
+			continue;
+		for (j = 0; j < totals->num_sigs; j++)
+			if (!memcmp(totals->sigs[j].sig, sig,
+				    ECRYPTFS_SIG_SIZE))
+				break;
+		if (j == totals->num_sigs) {
+			if (j == ECRYPTFS_STAT_MAX_SIGS) {
+				totals->other_sigs++;
+				continue;
+			}
+			memcpy(totals->sigs[j].sig, sig, ECRYPTFS_SIG_SIZE);
+			totals->sigs[j].files = 0;
+			totals->num_sigs++;
+		}
+		totals->sigs[j].files++;
+	}
+}
+
+static int stat_out_keys(struct ecryptfs_stat_out *out, int format,
+			 struct ecryptfs_packet_set_user *packet_set)
+{
+	const char *cipher = ecryptfs_cipher_code_to_string(
+		packet_set->cipher_code);
+	uint32_t i;
+	int rc;
+
+	if (format == ECRYPTFS_STAT_FORMAT_JSON)
+		rc = stat_out_printf(out, ",\"cipher\":\"%s\","
+				     "\"key_size\":%zu,\"keys\":[",
+				     cipher ? cipher : "",
+				     packet_set->key_size);
+	else
+		rc = stat_out_printf(out, ",%s,%zu,", cipher ? cipher : "",
+				     packet_set->key_size);
+	for (i = 0; !rc && i < packet_set->num_keys; i++) {
+		char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1] = "";
+
+		if (packet_set->keys[i].sig)
+			to_hex(sig_hex, (char *)packet_set->keys[i].sig,
+			       ECRYPTFS_SIG_SIZE);
+		if (format == ECRYPTFS_STAT_FORMAT_JSON)
+			rc = stat_out_printf(out, "%s\"%s\"", i ? "," : "",
+					     sig_hex);
+		else
+			rc = stat_out_printf(out, "%s%s", i ? " " : "",
+					     sig_hex);
+	}
+	if (!rc && format == ECRYPTFS_STAT_FORMAT_JSON)
+		rc = stat_out_append(out, "]", 1);
+	return rc;
+}
+
+static int stat_visit(struct ecryptfs_walk_entry *entry, void *priv,
+		      int worker)
+{
+	struct ecryptfs_stat_scan *scan = priv;
+	struct ecryptfs_stat_totals *totals = &scan->totals[worker];
+	struct ecryptfs_stat_out *out = &scan->out[worker];
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	char buf[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	void *map = NULL;
+	struct stat st;
+	int in_xattr = 0;
+	int valid = 0;
+	int fd;
+	int rc = 0;
+
+	if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+		goto out;
+	fd = openat(entry->dirfd, entry->name,
+		    O_RDONLY | O_NOFOLLOW | O_NOATIME | O_NONBLOCK);
+	if (fd == -1 && errno == EPERM)
+		fd = openat(entry->dirfd, entry->name,
+			    O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+	if (fd == -1) {
+		totals->unreadable++;
+		fprintf(stderr, "Error opening file [%s] for RD_ONLY access; "
+			"errno msg = [%m]\n", entry->path);
+		goto out;
+	}
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		goto out;
+	}
+	totals->files++;
+	if (!stat_read_metadata(fd, &st, buf, sizeof(buf), &crypt_stat,
+				scan->keys ? &packet_set : NULL, &map)) {
+		valid = 1;
+		in_xattr = (crypt_stat.flags & ECRYPTFS_METADATA_IN_XATTR);
+		totals->valid++;
+		totals->plaintext_bytes += crypt_stat.file_size;
+		totals->lower_bytes += st.st_size;
+		if (crypt_stat.flags & ECRYPTFS_ENABLE_HMAC)
+			totals->hmac++;
+		if (in_xattr)
+			totals->xattr++;
+		totals->versions[crypt_stat.file_version & 0xFF]++;
+		if (scan->keys)
+			stat_count_sigs(totals, &packet_set);
+	} else
+		totals->invalid++;
+	close(fd);
+	if (scan->summary_only)
+		goto out;
+	out->len = 0;
+	if (scan->format == ECRYPTFS_STAT_FORMAT_JSON) {
+		rc = stat_out_append(out, "{\"path\":", 8);
+		if (!rc)
+			rc = stat_out_path(out, entry->path, scan->format);
+		if (!rc && !valid)
+			rc = stat_out_printf(out, ",\"lower_size\":%lld,"
+					     "\"valid\":false}\n",
+					     (long long)st.st_size);
+		else if (!rc)
+			rc = stat_out_printf(
+				out, ",\"lower_size\":%lld,\"valid\":true,"
+				"\"version\":%u,\"size\":%llu,"
+				"\"header_bytes\":%zu,\"metadata\":\"%s\","
+				"\"encrypted\":%s,\"hmac\":%s",
+				(long long)st.st_size, crypt_stat.file_version,
+				(unsigned long long)crypt_stat.file_size,
+				in_xattr ? 0 : crypt_stat.num_header_bytes_at_front,
+				in_xattr ? "xattr" : "header",
+				(crypt_stat.flags & ECRYPTFS_ENCRYPTED)
+				? "true" : "false",
+				(crypt_stat.flags & ECRYPTFS_ENABLE_HMAC)
+				? "true" : "false");
+		if (!rc && valid && scan->keys)
+			rc = stat_out_keys(out, scan->format, &packet_set);
+		if (!rc && valid)
+			rc = stat_out_append(out, "}\n", 2);
+	} else {
+		rc = stat_out_path(out, entry->path, scan->format);
+		if (!rc && !valid)
+			rc = stat_out_printf(out, ",%lld,0,,,,,,%s\n",
+					     (long long)st.st_size,
+					     scan->keys ? ",,," : "");
+		else if (!rc)
+			rc = stat_out_printf(
+				out, ",%lld,1,%u,%llu,%zu,%s,%d,%d",
+				(long long)st.st_size, crypt_stat.file_version,
+				(unsigned long long)crypt_stat.file_size,
+				in_xattr ? 0 : crypt_stat.num_header_bytes_at_front,
+				in_xattr ? "xattr" : "header",
+				!!(crypt_stat.flags & ECRYPTFS_ENCRYPTED),
+				!!(crypt_stat.flags & ECRYPTFS_ENABLE_HMAC));
+		if (!rc && valid && scan->keys)
+			rc = stat_out_keys(out, scan->format, &packet_set);
+		if (!rc && valid)
+			rc = stat_out_append(out, "\n", 1);
+	}
+	/* One stdio call per record keeps records from interleaving */
+	if (!rc)
+		fwrite(out->data, 1, out->len, stdout);
+out:
+	if (map)
+		munmap(map, (st.st_size < ECRYPTFS_DEFAULT_EXTENT_SIZE)
+		       ? st.st_size : ECRYPTFS_DEFAULT_EXTENT_SIZE);
+	return rc;
+}
+
+static void print_totals(struct ecryptfs_stat_totals *t, int format,
+			 int keys, unsigned long long dir_errors)
+{
+	FILE *fp = (format == ECRYPTFS_STAT_FORMAT_JSON) ? stdout : stderr;
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	int i;
+	int first = 1;
+
+	if (format == ECRYPTFS_STAT_FORMAT_JSON) {
+		fprintf(fp, "{\"totals\":{\"files\":%llu,\"valid\":%llu,"
+			"\"invalid\":%llu,\"unreadable\":%llu,"
+			"\"directory_errors\":%llu,\"plaintext_bytes\":%llu,"
+			"\"lower_bytes\":%llu,\"hmac\":%llu,\"xattr\":%llu,"
+			"\"versions\":{", t->files, t->valid, t->invalid,
+			t->unreadable, dir_errors, t->plaintext_bytes,
+			t->lower_bytes, t->hmac, t->xattr);
+		for (i = 0; i < 256; i++) {
+			if (!t->versions[i])
+				continue;
+			fprintf(fp, "%s\"%d\":%llu", first ? "" : ",", i,
+				t->versions[i]);
+			first = 0;
+		}
+		fprintf(fp, "}");
+		if (keys) {
+			fprintf(fp, ",\"signatures\":{");
+			for (i = 0; i < t->num_sigs; i++) {
+				to_hex(sig_hex, (char *)t->sigs[i].sig,
+				       ECRYPTFS_SIG_SIZE);
+				fprintf(fp, "%s\"%s\":%llu", i ? "," : "",
+					sig_hex, t->sigs[i].files);
+			}
+			fprintf(fp, "},\"other_signatures\":%llu",
+				t->other_sigs);
+		}
+		fprintf(fp, "}}\n");
+		return;
+	}
+	fprintf(fp, "Files scanned: [%llu]\n", t->files);
+	fprintf(fp, "Valid eCryptfs headers: [%llu]\n", t->valid);
+	fprintf(fp, "Invalid headers: [%llu]\n", t->invalid);
+	fprintf(fp, "Unreadable files: [%llu]\n", t->unreadable);
+	fprintf(fp, "Unreadable directories: [%llu]\n", dir_errors);
+	fprintf(fp, "Plaintext bytes: [%llu]\n", t->plaintext_bytes);
+	fprintf(fp, "Lower bytes: [%llu]\n", t->lower_bytes);
+	fprintf(fp, "HMAC enabled: [%llu]\n", t->hmac);
+	fprintf(fp, "Metadata in xattr: [%llu]\n", t->xattr);
+	for (i = 0; i < 256; i++)
+		if (t->versions[i])
+			fprintf(fp, "File version [%d]: [%llu]\n", i,
+				t->versions[i]);
+	if (!keys)
+		return;
+	for (i = 0; i < t->num_sigs; i++) {
+		to_hex(sig_hex, (char *)t->sigs[i].sig, ECRYPTFS_SIG_SIZE);
+		fprintf(fp, "Files under key [%s]: [%llu]\n", sig_hex,
+			t->sigs[i].files);
+	}
+	if (t->other_sigs)
+		fprintf(fp, "Files under other keys: [%llu]\n",
+			t->other_sigs);
+}
+
+static void stat_merge_sigs(struct ecryptfs_stat_totals *sum,
+			    struct ecryptfs_stat_totals *t)
+{
+	int i, j;
+
+	sum->other_sigs += t->other_sigs;
+	for (i = 0; i < t->num_sigs; i++) {
+		for (j = 0; j < sum->num_sigs; j++)
+			if (!memcmp(sum->sigs[j].sig, t->sigs[i].sig,
+				    ECRYPTFS_SIG_SIZE))
+				break;
+		if (j == sum->num_sigs) {
+			if (j == ECRYPTFS_STAT_MAX_SIGS) {
+				sum->other_sigs += t->sigs[i].files;
+				continue;
+			}
+			memcpy(sum->sigs[j].sig, t->sigs[i].sig,
+			       ECRYPTFS_SIG_SIZE);
+			sum->sigs[j].files = 0;
+			sum->num_sigs++;
+		}
+		sum->sigs[j].files += t->sigs[i].files;
+	}
+}
+
+static int stat_tree(const char *root, int format, int num_threads,
+		     int summary_only, int keys)
+{
+	struct ecryptfs_stat_scan scan;
+	struct ecryptfs_stat_totals sum;
+	struct ecryptfs_walk walk;
+	int i, j;
+	int rc = 0;
+
+	memset(&scan, 0, sizeof(scan));
+	memset(&walk, 0, sizeof(walk));
+	memset(&sum, 0, sizeof(sum));
+	num_threads = ecryptfs_walk_num_threads(num_threads);
+	scan.format = format;
+	scan.summary_only = summary_only;
+	scan.keys = keys;
+	scan.totals = calloc(num_threads, sizeof(*scan.totals));
+	scan.out = calloc(num_threads, sizeof(*scan.out));
+	if (!scan.totals || !scan.out) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (!summary_only && format == ECRYPTFS_STAT_FORMAT_CSV)
+		printf("path,lower_size,valid,version,size,header_bytes,"
+		       "metadata,encrypted,hmac%s\n",
+		       keys ? ",cipher,key_size,keys" : "");
+	walk.num_threads = num_threads;
+	walk.fn = stat_visit;
+	walk.priv = &scan;
+	rc = ecryptfs_walk_tree(&walk, root);
+	if (rc)
+		fprintf(stderr, "Error scanning [%s]; rc = [%d]\n", root, rc);
+	for (i = 0; i < num_threads; i++) {
+		struct ecryptfs_stat_totals *t = &scan.totals[i];
+
+		sum.files += t->files;
+		sum.valid += t->valid;
+		sum.invalid += t->invalid;
+		sum.unreadable += t->unreadable;
+		sum.plaintext_bytes += t->plaintext_bytes;
+		sum.lower_bytes += t->lower_bytes;
+		sum.hmac += t->hmac;
+		sum.xattr += t->xattr;
+		for (j = 0; j < 256; j++)
+			sum.versions[j] += t->versions[j];
+		stat_merge_sigs(&sum, t);
+	}
+	print_totals(&sum, format, keys, walk.num_errors);
+	if (!rc && (walk.num_errors || sum.unreadable))
+		rc = -EIO;
+out:
+	if (scan.out)
+		for (i = 0; i < num_threads; i++)
+			free(scan.out[i].data);
+	free(scan.out);
+	free(scan.totals);
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int recursive = 0;
+	int summary_only = 0;
+	int format = ECRYPTFS_STAT_FORMAT_JSON;
+	int num_threads = 0;
+	int keys = 0;
+	int c;
+	int rc = 0;
+
+	while ((c = getopt(argc, argv, "ro:t:skh")) != -1) {
+		switch (c) {
+		case 'r':
+			recursive = 1;
+			break;
+		case 'o':
+			if (!strcmp(optarg, "json"))
+				format = ECRYPTFS_STAT_FORMAT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				format = ECRYPTFS_STAT_FORMAT_CSV;
+			else {
+				usage(argv[0]);
+				rc = -EINVAL;
+				goto out;
+			}
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 's':
+			summary_only = 1;
+			break;
+		case 'k':
+			keys = 1;
+			break;
+		default:
+			usage(argv[0]);
+			goto out;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		goto out;
+	}
+	if (recursive)
+		rc = stat_tree(argv[optind], format, num_threads,
+			       summary_only, keys);
+	else {
+		/* Let the library explain why a single file is invalid */
+		ecryptfs_verbosity = 1;
+		rc = stat_one_file(argv[optind]);
+	}
+out:
+	return rc;
+}
@@ -28,11 +28,16 @@
 #define _GNU_SOURCE
 
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
 #include <keyutils.h>
 #include <mntent.h>
 #include <pwd.h>
@@ -41,7 +46,6 @@
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
-#include <values.h>
 #include "../include/ecryptfs.h"
 
 /* Perhaps a future version of this program will allow these to be configurable
@@ -51,7 +55,7 @@
 #define KEY_BYTES 16
 #define KEY_CIPHER "aes"
 #define FSTYPE "ecryptfs"
-#define TMP "/dev/shm"
+#define ALIAS_MAX 64
 
 int read_config(char *pw_dir, int uid, char *alias, char **s, char **d, char **o) {
 /* Read an fstab(5) style config file */
@@ -97,6 +101,33 @@ out:
 	return 0;
 }
 
+int check_alias(char *a) {
+/* The alias names the configuration in ~/.ecryptfs and the root-owned
+ * counter in COUNTER_DIR, so keep it to a short name of letters, digits,
+ * underscores, periods and dashes, that does not start with a period or
+ * a dash
+ */
+	int i;
+	char c;
+	int len;
+	len = strlen(a);
+	if (len == 0 || len > ALIAS_MAX || a[0] == '.' || a[0] == '-') {
+		fputs("Invalid alias\n", stderr);
+		return 1;
+	}
+	for (i=0; i<len; i++) {
+		c = a[i];
+		if (	!(c>='a' && c<='z') && !(c>='A' && c<='Z') &&
+			!(c>='0' && c<='9') &&
+			!(c=='_') && !(c=='.') && !(c=='-')
+		) {
+			fputs("Invalid alias\n", stderr);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int check_username(char *u) {
 /* We follow the username guidelines used by the adduser program.  Quoting its
  * error message:
@@ -369,103 +400,348 @@ fail_early:
 	return 1;
 }
 
-FILE *lock_counter(char *u, int uid, char *alias) {
+/* Mount counters live in a root-owned directory, so that no user can
+ * put a file in the place of another's, and on tmpfs, so that they are
+ * cleared on boot */
+#define COUNTER_DIR "/run/ecryptfs"
+#define COUNTER_SLOTS 255
+/* Users cannot remove their counters, so cap how many they can make */
+#define COUNTER_MAX_PER_USER 16
+/* Where counters were kept before, one text file per user and alias */
+#define OLD_COUNTER_DIR "/dev/shm"
+
+/**
+ * struct session_counter - Mount counter shared through a mapping of its
+ *                          file, so that it is updated atomically
+ *                          rather than under a lock
+ * @count: Sessions using the mount
+ * @unmounting: Set by the holder of the lock before it checks @count
+ *              one last time and unmounts; a session that sees it
+ *              takes the lock before trusting the mount
+ * @slots: Session ID and start time of the session leader of as many
+ *         of the counted sessions as fit, so that sessions that ended
+ *         without unmounting can be taken out of @count
+ */
+struct session_counter {
+	uint32_t count;
+	uint32_t unmounting;
+	struct session_slot {
+		int32_t sid;
+		uint32_t pad;
+		uint64_t start;
+	} slots[COUNTER_SLOTS];
+};
+
+/* Start time of process @pid in clock ticks after boot, 0 if unknown */
+static uint64_t process_start(pid_t pid)
+{
+	char buf[1024];
+	char *p;
+	int fd, i;
+	ssize_t len;
+
+	snprintf(buf, sizeof(buf), "/proc/%d/stat", pid);
+	if ((fd = open(buf, O_RDONLY)) < 0)
+		return 0;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	/* The command name may hold spaces; count fields after it */
+	if ((p = strrchr(buf, ')')) == NULL)
+		return 0;
+	/* starttime is the 20th field after the command name */
+	for (i = 0; i < 20 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (p == NULL)
+		return 0;
+	return strtoull(p + 1, NULL, 10);
+}
+
+static int session_alive(struct session_slot *slot, int32_t sid)
+{
+	uint64_t start = __atomic_load_n(&slot->start, __ATOMIC_ACQUIRE);
+
+	if (kill(sid, 0) < 0 && errno == ESRCH)
+		return 0;
+	/* A start time of 0 is a slot still being filled in */
+	return (start == 0 || process_start(sid) == start);
+}
+
+static int count_user_counters(int uid) {
+/* Number of counters this user has in COUNTER_DIR */
+	char prefix[32];
+	struct dirent *d;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(prefix, sizeof(prefix), "%d-", uid);
+	if ((dir = opendir(COUNTER_DIR)) == NULL)
+		return 0;
+	while ((d = readdir(dir)) != NULL)
+		if (strncmp(d->d_name, prefix, strlen(prefix)) == 0)
+			n++;
+	closedir(dir);
+	return n;
+}
+
+static void migrate_counter(char *u, int uid, char *alias,
+			    struct session_counter *counter) {
+/* Count the sessions that an older version of this program counted in
+ * its own file, so that they keep the mount up after an upgrade.  Those
+ * sessions have no slots, so they only go away by unmounting.
+ */
 	char *f;
 	int fd;
+	int count;
 	FILE *fh;
 	struct stat s;
-	int i = 1;
-	/* We expect TMP to exist, be writeable by the user,
-	 * and to be cleared on boot */
-	if (asprintf(&f, "%s/%s-%s-%s", TMP, FSTYPE, u, alias) < 0) {
+
+	if (asprintf(&f, "%s/%s-%s-%s", OLD_COUNTER_DIR, FSTYPE, u, alias) < 0)
+		return;
+	if ((fd = open(f, O_RDONLY | O_NOFOLLOW)) < 0)
+		goto out;
+	/* Anyone could have put a file there; only trust the user's own */
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_uid != uid ||
+	    (fh = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		goto out;
+	}
+	if (fscanf(fh, "%d\n", &count) == 1 && count > 0)
+		__atomic_add_fetch(&counter->count, count, __ATOMIC_SEQ_CST);
+	fclose(fh);
+	unlink(f);
+out:
+	free(f);
+}
+
+FILE *open_counter(int uid, char *u, char *alias,
+		   struct session_counter **counter) {
+/* Map the mount counter of this user and alias.  The file is created as
+ * root and mapped shared; the descriptor is returned locked by no one, to
+ * be flock()ed only around a mount or an unmount.
+ */
+	char *f;
+	int fd = -1;
+	int created = 0;
+	FILE *fh = NULL;
+	struct stat s;
+
+	if (asprintf(&f, "%s/%d-%s", COUNTER_DIR, uid, alias) < 0) {
 		perror("asprintf");
 		return NULL;
 	}
-	/* If the counter path exists, and it's either not a regular
-	 * file, or it's not owned by the current user, append iterator
-	 * until we find a filename we can use.
-	 */
-	while (i < 50) {
-		if (((fd = open(f, O_RDWR | O_CREAT | O_NOFOLLOW, 0600)) >= 0) &&
-		    (fstat(fd, &s)==0 && (S_ISREG(s.st_mode) && s.st_uid==uid))) {
-			break;
-		} else {
-			if (fd >= 0)
-				close(fd);
-			free(f);
-			if (asprintf(&f, "%s/%s-%s-%s-%d", TMP, FSTYPE, u,
-			    alias, i++) < 0) {
-				perror("asprintf");
-				return NULL;
-			}
+	if (seteuid(0) < 0) {
+		perror("seteuid");
+		goto out;
+	}
+	if (mkdir(COUNTER_DIR, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir");
+		goto out_uid;
+	}
+	if (lstat(COUNTER_DIR, &s) < 0 || !S_ISDIR(s.st_mode) || s.st_uid != 0 ||
+	    (s.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "%s is not a directory that only root can write to\n",
+			COUNTER_DIR);
+		goto out_uid;
+	}
+	if ((fd = open(f, O_RDWR | O_NOFOLLOW)) < 0 && errno == ENOENT) {
+		if (count_user_counters(uid) >= COUNTER_MAX_PER_USER) {
+			fprintf(stderr, "Too many mount counters in %s\n",
+				COUNTER_DIR);
+			goto out_uid;
 		}
+		fd = open(f, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+		if (fd >= 0)
+			created = 1;
+		else if (errno == EEXIST)
+			fd = open(f, O_RDWR | O_NOFOLLOW);
 	}
-
 	if (fd < 0) {
 		perror("open");
-		return NULL;
+		goto out_uid;
 	}
-
-	flock(fd, LOCK_EX);
-	fh = fdopen(fd, "r+");
-	if (fh == NULL) {
-		perror("fopen");
-		close(fd);
-		return NULL;
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode)) {
+		fprintf(stderr, "%s is not a regular file\n", f);
+		goto out_close;
+	}
+	/* Every process extends the file to the same size, so a race
+	 * between two of them does no harm */
+	if (s.st_size < (off_t)sizeof(**counter) &&
+	    ftruncate(fd, sizeof(**counter)) < 0) {
+		perror("ftruncate");
+		goto out_close;
+	}
+	*counter = mmap(NULL, sizeof(**counter), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (*counter == MAP_FAILED) {
+		perror("mmap");
+		goto out_close;
 	}
+	if ((fh = fdopen(fd, "r+")) == NULL) {
+		perror("fdopen");
+		munmap(*counter, sizeof(**counter));
+		goto out_close;
+	}
+	if (created)
+		migrate_counter(u, uid, alias, *counter);
+	goto out_uid;
+out_close:
+	close(fd);
+out_uid:
+	if (seteuid(uid) < 0 || geteuid() != uid) {
+		perror("seteuid");
+		exit(1);
+	}
+out:
+	free(f);
 	return fh;
 }
 
-void unlock_counter(FILE *fh) {
+void close_counter(FILE *fh, struct session_counter *counter) {
+	if (counter != NULL)
+		munmap(counter, sizeof(*counter));
 	if (fh != NULL) {
-		/* This should remove the lock too */
+		/* This removes the lock too, if we hold it */
 		fclose(fh);
 	}
 }
 
-int bump_counter(FILE *fh, int delta) {
-/* Maintain a mount counter
- *   increment on delta = 1
- *   decrement on delta = -1
- *   remove the counter file on delta = 0
- *   return the updated count, negative on error
- */
-	int count;
-	/* Read the count from file, default to 0 */
-	rewind(fh);
-	if (fscanf(fh, "%d\n", &count) != 1) {
-		count = 0;
-	}
-	/* Increment/decrement the counter */
-	count += delta;
-	if (count < 0) {
-		/* Never set a count less than 0 */
-		count = 0;
-	}
-	/* Write the count to file */
-	rewind(fh);
-	fprintf(fh, "%d\n", count);
-	fflush(fh);
-	return count;
+void lock_counter(FILE *fh) {
+/* Taken only to mount or unmount; an exec'ed umount keeps the lock
+ * until it is done, since the descriptor is inherited */
+	flock(fileno(fh), LOCK_EX);
 }
 
+static uint32_t counter_sub(struct session_counter *counter) {
+/* Count one session less, never going below 0; return the new count */
+	uint32_t count = __atomic_load_n(&counter->count, __ATOMIC_SEQ_CST);
 
-int increment(FILE *fh) {
-/* Bump counter up */
-	return bump_counter(fh, 1);
+	do {
+		if (count == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&counter->count, &count,
+					      count - 1, 0, __ATOMIC_SEQ_CST,
+					      __ATOMIC_SEQ_CST));
+	return count - 1;
 }
 
+int increment(struct session_counter *counter) {
+/* Count this session in, and record it in a free slot, if any */
+	int32_t sid = getsid(0);
+	int32_t free_sid;
+	int i;
 
-int decrement(FILE *fh) {
-/* Bump counter down */
-	return bump_counter(fh, -1);
+	for (i = 0; sid > 0 && i < COUNTER_SLOTS; i++) {
+		free_sid = 0;
+		if (__atomic_compare_exchange_n(&counter->slots[i].sid,
+						&free_sid, sid, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			__atomic_store_n(&counter->slots[i].start,
+					 process_start(sid), __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	return __atomic_add_fetch(&counter->count, 1, __ATOMIC_SEQ_CST);
 }
 
-int zero(FILE *fh) {
-/* Zero the counter file */
-	return bump_counter(fh, -MAXINT+1);
+int reconcile(struct session_counter *counter) {
+/* Take the sessions that ended without unmounting out of the count;
+ * return the updated count */
+	int32_t sid;
+	int i;
+
+	for (i = 0; i < COUNTER_SLOTS; i++) {
+		sid = __atomic_load_n(&counter->slots[i].sid, __ATOMIC_ACQUIRE);
+		if (sid == 0 || session_alive(&counter->slots[i], sid))
+			continue;
+		/* Only the process that frees the slot counts it out */
+		if (__atomic_compare_exchange_n(&counter->slots[i].sid, &sid, 0,
+						0, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			__atomic_store_n(&counter->slots[i].start, 0,
+					 __ATOMIC_RELEASE);
+			counter_sub(counter);
+		}
+	}
+	return __atomic_load_n(&counter->count, __ATOMIC_SEQ_CST);
 }
 
+int decrement(struct session_counter *counter) {
+/* Count this session out; when others seem to remain, make sure they
+ * are alive.  Return the updated count */
+	int32_t sid = getsid(0);
+	uint64_t start = process_start(sid);
+	int32_t slot_sid;
+	int i;
+
+	for (i = 0; sid > 0 && i < COUNTER_SLOTS; i++) {
+		slot_sid = sid;
+		if (__atomic_load_n(&counter->slots[i].start,
+				    __ATOMIC_ACQUIRE) != start)
+			continue;
+		if (__atomic_compare_exchange_n(&counter->slots[i].sid,
+						&slot_sid, 0, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			__atomic_store_n(&counter->slots[i].start, 0,
+					 __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	if (counter_sub(counter) == 0)
+		return 0;
+	return reconcile(counter);
+}
+
+int zero(struct session_counter *counter) {
+/* Zero the counter and forget every session */
+	int i;
+
+	for (i = 0; i < COUNTER_SLOTS; i++) {
+		__atomic_store_n(&counter->slots[i].sid, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&counter->slots[i].start, 0, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&counter->count, 0, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+
+/* pam_ecryptfs passes a pipe in ECRYPTFS_TIMING_FD for a record of the
+ * phases of this mount; returns NULL unless it did */
+static struct ecryptfs_timing *timing_open(struct ecryptfs_timing *timing,
+					   int *fd)
+{
+	char *env = getenv(ECRYPTFS_TIMING_FD_ENV);
+	char *end;
+
+	*fd = -1;
+	if (env == NULL)
+		return NULL;
+	*fd = strtol(env, &end, 10);
+	if (*end != '\0' || *fd <= STDERR_FILENO || fcntl(*fd, F_GETFD) < 0) {
+		*fd = -1;
+		return NULL;
+	}
+	/* Not to be handed on to /bin/umount */
+	fcntl(*fd, F_SETFD, FD_CLOEXEC);
+	ecryptfs_timing_init(timing);
+	return timing;
+}
+
+static void timing_close(struct ecryptfs_timing *timing, int fd)
+{
+	char record[ECRYPTFS_TIMING_MAX_RECORD];
+
+	if (timing == NULL)
+		return;
+	if (ecryptfs_timing_format(timing, "mount_", record,
+				   sizeof(record)) == 0)
+		dprintf(fd, "%s\n", record);
+	close(fd);
+}
 
 /* This program is a setuid-executable allowing a non-privileged user to mount
  * and unmount an ecryptfs private directory.  This program is necessary to
@@ -508,7 +784,12 @@ int main(int argc, char *argv[]) {
 	char *sig_fekek = NULL, *sig_fnek = NULL;
 	char **sigs;
 	FILE *fh_counter = NULL;
+	struct session_counter *counter = NULL;
+	struct ecryptfs_timing timing_buf;
+	struct ecryptfs_timing *timing;
+	int timing_fd;
 
+	timing = timing_open(&timing_buf, &timing_fd);
 	uid = getuid();
 	gid = getgid();
 	/* Non-privileged effective uid is sufficient for all but the code
@@ -519,10 +800,12 @@ int main(int argc, char *argv[]) {
 		perror("setuid");
 		goto fail;
 	}
+	ecryptfs_timing_begin(timing, "passwd");
 	if ((pwd = getpwuid(uid)) == NULL) {
 		perror("getpwuid");
 		goto fail;
 	}
+	ecryptfs_timing_begin(timing, "dotecryptfs");
 
 	/* If no arguments, default to private dir; but accept at most one
 	   argument, an alias for the configuration to read and use.
@@ -541,6 +824,8 @@ int main(int argc, char *argv[]) {
 		}
 	} else if (argc == 2) {
 		alias = argv[1];
+		if (check_alias(alias) != 0)
+			exit(1);
 		/* Read the source and destination dirs from .conf file */
 		if (read_config(pwd->pw_dir, uid, alias, &src, &dest, &opts2) < 0) {
 			fputs("Error reading configuration file\n", stderr);
@@ -555,17 +840,15 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
-	if (strstr(alias, "..")) {
-		fputs("Invalid alias", stderr);
-		exit(1);
-	}
-
-	/* Lock the counter through the rest of the program */
-	fh_counter = lock_counter(pwd->pw_name, uid, alias);
+	/* Sessions update the counter without waiting on each other; only
+	 * mounting and unmounting take its lock */
+	ecryptfs_timing_begin(timing, "counter");
+	fh_counter = open_counter(uid, pwd->pw_name, alias, &counter);
 	if (fh_counter == NULL) {
-		fputs("Error locking counter\n", stderr);
+		fputs("Error opening counter\n", stderr);
 		goto fail;
 	}
+	ecryptfs_timing_begin(timing, "dotecryptfs");
 
 	if (check_username(pwd->pw_name) != 0) {
 		/* Must protect against a crafted user=john,suid from entering
@@ -622,14 +905,26 @@ int main(int argc, char *argv[]) {
  	}
 
 	if (mounting == 1) {
-		/* Increment mount counter, errors non-fatal */
-		if (increment(fh_counter) < 0) {
-			fputs("Error incrementing mount counter\n", stderr);
+		/* Increment mount counter */
+		ecryptfs_timing_begin(timing, "counter");
+		increment(counter);
+		/* Mounting, so exit if already mounted, unless an unmount
+		 * may be under way: either it saw our count and backs off, or
+		 * we see its flag and wait for it before mounting again */
+		ecryptfs_timing_begin(timing, "mounted");
+		if (__atomic_load_n(&counter->unmounting, __ATOMIC_SEQ_CST) == 0 &&
+		    ecryptfs_private_is_mounted(src, dest, sig_fekek, mounting) == 1) {
+			goto success;
 		}
-		/* Mounting, so exit if already mounted */
+		ecryptfs_timing_begin(timing, "counter");
+		lock_counter(fh_counter);
+		/* Whoever unmounted is done with it now */
+		__atomic_store_n(&counter->unmounting, 0, __ATOMIC_SEQ_CST);
+		ecryptfs_timing_begin(timing, "mounted");
 		if (ecryptfs_private_is_mounted(src, dest, sig_fekek, mounting) == 1) {
 			goto success;
 		}
+		ecryptfs_timing_end(timing);
 		/* We must maintain our real uid as the user who called this
  		 * program in order to have access to their kernel keyring.
 		 * Even though root has the power to mount, only a user with
@@ -648,7 +943,9 @@ int main(int argc, char *argv[]) {
 			goto fail;
 		}
  		/* Perform mount */
+		ecryptfs_timing_begin(timing, "mount");
 		if (mount(src, ".", FSTYPE, MS_NOSUID | MS_NODEV, opt) == 0) {
+			ecryptfs_timing_begin(timing, "mtab");
 			if (update_mtab(src, dest, opt) != 0) {
 				goto fail;
 			}
@@ -664,14 +961,34 @@ int main(int argc, char *argv[]) {
 			goto fail;
 		}
 	} else {
+		unsigned int grace;
 		int rc = 0;
 		/* Decrement counter, exiting if >0, and non-forced unmount */
 		if (force == 1) {
-			zero(fh_counter);
-		} else if (decrement(fh_counter) > 0) {
+			zero(counter);
+		} else if (decrement(counter) > 0) {
+			fputs("Sessions still open, not unmounting\n", stderr);
+			goto fail;
+		}
+		/* Check the count one last time under the lock, after
+		 * raising the flag that makes new sessions wait for us */
+		lock_counter(fh_counter);
+		__atomic_store_n(&counter->unmounting, 1, __ATOMIC_SEQ_CST);
+		if (force == 0 &&
+		    __atomic_load_n(&counter->count, __ATOMIC_SEQ_CST) > 0) {
+			__atomic_store_n(&counter->unmounting, 0, __ATOMIC_SEQ_CST);
 			fputs("Sessions still open, not unmounting\n", stderr);
 			goto fail;
 		}
+		/* With ~/.ecryptfs/key-agent, an agent keeps a copy of
+		   the keys for a while, so that logging straight back in
+		   does not unwrap the passphrase again.  An explicit -f
+		   means the user wants the keys gone. */
+		if (force == 0 && sig_fekek != NULL &&
+		    ecryptfs_key_agent_grace(pwd->pw_dir, &grace) == 0) {
+			if (ecryptfs_key_agent_hold(sigs, 2, grace) != 0)
+				fputs("Could not start the key agent\n", stderr);
+		}
 		/* Attempt to clear the user's keys from the keyring,
                    to prevent root from mounting without the user's key.
                    This is a best-effort basis, so we'll just print messages
@@ -708,9 +1025,11 @@ int main(int argc, char *argv[]) {
 		goto fail;
 	}
 success:
-	unlock_counter(fh_counter);
+	close_counter(fh_counter, counter);
+	timing_close(timing, timing_fd);
 	return 0;
 fail:
-	unlock_counter(fh_counter);
+	close_counter(fh_counter, counter);
+	timing_close(timing, timing_fd);
 	return 1;
 }
@@ -0,0 +1,78 @@
+/**
+ * Passphrase input for the offline utilities
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/ecryptfs.h"
+#include "passphrase.h"
+
+/**
+ * ecryptfs_utils_get_passphrase
+ * @passphrase: ECRYPTFS_MAX_PASSWORD_LENGTH + 1 bytes
+ * @wrapped_file: Wrapped passphrase file, or NULL
+ * @salt: ECRYPTFS_SALT_SIZE bytes of wrapping salt, or NULL for the one
+ *        in the rc file, or the default
+ *
+ * Reads the mount passphrase from stdin, or the wrapping passphrase
+ * when @wrapped_file is given, and unwraps that file with it. Prompts
+ * go to stderr, since stdout may carry the output of the tool.
+ *
+ * Returns 0 on success, negative errno otherwise
+ */
+int ecryptfs_utils_get_passphrase(char *passphrase, const char *wrapped_file,
+				  const char *salt)
+{
+	char salt_buf[ECRYPTFS_SALT_SIZE];
+	char salt_hex[ECRYPTFS_SALT_SIZE_HEX];
+	int interactive = isatty(STDIN_FILENO);
+	char *input;
+	int rc = 0;
+
+	if (interactive)
+		fprintf(stderr, "%s: ", wrapped_file ? "Wrapping passphrase"
+			: "Mount passphrase");
+	input = ecryptfs_get_passphrase(NULL);
+	if (interactive)
+		fprintf(stderr, "\n");
+	if (!input)
+		return -EINVAL;
+	if (!wrapped_file) {
+		strcpy(passphrase, input);
+		goto out;
+	}
+	if (salt)
+		memcpy(salt_buf, salt, ECRYPTFS_SALT_SIZE);
+	else if (ecryptfs_read_salt_hex_from_rc(salt_hex))
+		from_hex(salt_buf, ECRYPTFS_DEFAULT_SALT_HEX,
+			 ECRYPTFS_SALT_SIZE);
+	else
+		from_hex(salt_buf, salt_hex, ECRYPTFS_SALT_SIZE);
+	rc = ecryptfs_unwrap_passphrase(passphrase, (char *)wrapped_file,
+					input, salt_buf);
+	if (rc)
+		fprintf(stderr, "%s [%d]\n", ECRYPTFS_ERROR_UNWRAP, rc);
+out:
+	memset(input, 0, strlen(input));
+	free(input);
+	return rc;
+}
@@ -19,7 +19,6 @@
  */
 
 #include <errno.h>
-#include <mntent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -78,33 +77,23 @@ out:
 
 static int unlink_keys_from_keyring(const char *mnt_point)
 {
-	struct mntent *mntent;
-	FILE *file;
+	struct ecryptfs_mount *mnt = NULL;
 	char *fekek_sig = NULL, *fnek_sig = NULL;
 	int fekek_fail = 0, fnek_fail = 0;
 	int rc;
 
-	file = setmntent("/etc/mtab", "r");
-	if (!file) {
+	/* The kernel shows ecryptfs_unlink_sigs and the signatures in its
+	 * mount options, so the mount is looked up there rather than by
+	 * scanning /etc/mtab */
+	if (ecryptfs_mount_find(mnt_point, "ecryptfs", &mnt)) {
 		rc = EINVAL;
 		goto out;
 	}
-	while ((mntent = getmntent(file))) {
-		if (strcmp("ecryptfs", mntent->mnt_type))
-			continue;
-		if (strcmp(mnt_point, mntent->mnt_dir))
-			continue;
-		break;
-	}
-	if (!mntent) {
-		rc = EINVAL;
-		goto end_out;
-	}
-	if (!hasmntopt(mntent, "ecryptfs_unlink_sigs")) {
+	if (!ecryptfs_mount_has_opt(mnt, "ecryptfs_unlink_sigs")) {
 		rc = 0;
 		goto end_out;
 	}
-	rc = get_mount_opt_value(mntent->mnt_opts, "ecryptfs_sig=", &fekek_sig);
+	rc = get_mount_opt_value(mnt->options, "ecryptfs_sig=", &fekek_sig);
 	if (!rc) {
 		fekek_fail = ecryptfs_remove_auth_tok_from_keyring(fekek_sig);
 		if (fekek_fail == ENOKEY)
@@ -116,7 +105,7 @@ static int unlink_keys_from_keyring(const char *mnt_point)
 	} else {
 		fekek_fail = rc;
 	}
-	if (!get_mount_opt_value(mntent->mnt_opts,
+	if (!get_mount_opt_value(mnt->options,
 				 "ecryptfs_fnek_sig=", &fnek_sig)
 	    && strcmp(fekek_sig, fnek_sig)) {
 		fnek_fail = ecryptfs_remove_auth_tok_from_keyring(fnek_sig);
@@ -131,7 +120,7 @@ static int unlink_keys_from_keyring(const char *mnt_point)
 	free(fekek_sig);
 	free(fnek_sig);
 end_out:
-	endmntent(file);
+	ecryptfs_mount_free(mnt);
 out:
 	return (fekek_fail ? fekek_fail : (fnek_fail ? fnek_fail : rc));
 }
@@ -0,0 +1,370 @@
+/**
+ * Parallel directory tree walker for the bulk utilities
+ *
+ * Each worker owns a deque of directories still to be read. A worker
+ * pushes the subdirectories it finds onto the tail of its own deque
+ * and pops from the tail, so it keeps descending depth-first through
+ * warm dentries; idle workers steal from the head of a victim's deque,
+ * which holds the shallowest and therefore largest pending subtrees.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "walker.h"
+
+struct ecryptfs_walk_dir {
+	char *path;
+	dev_t dev;
+};
+
+struct ecryptfs_walk_deque {
+	pthread_mutex_t lock;
+	struct ecryptfs_walk_dir *dirs;
+	size_t head;
+	size_t tail;
+	size_t size;
+};
+
+struct ecryptfs_walk_ctx;
+
+struct ecryptfs_walk_worker {
+	pthread_t thread;
+	struct ecryptfs_walk_ctx *ctx;
+	struct ecryptfs_walk_deque deque;
+	unsigned int seed;
+	int id;
+};
+
+struct ecryptfs_walk_ctx {
+	struct ecryptfs_walk *walk;
+	struct ecryptfs_walk_worker *workers;
+	int num_workers;
+	dev_t root_dev;
+	/* Directories queued or being read; the walk is over when this
+	 * drops to zero */
+	long pending;
+	int rc;
+};
+
+int ecryptfs_walk_num_threads(int num_threads)
+{
+	long cpus;
+
+	if (num_threads > 0)
+		return num_threads;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (int)cpus : 1;
+}
+
+static int ecryptfs_walk_push(struct ecryptfs_walk_deque *deque,
+			      char *path, dev_t dev)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head == deque->tail) {
+		deque->head = 0;
+		deque->tail = 0;
+	} else if (deque->tail == deque->size && deque->head) {
+		memmove(deque->dirs, &deque->dirs[deque->head],
+			(deque->tail - deque->head) * sizeof(*deque->dirs));
+		deque->tail -= deque->head;
+		deque->head = 0;
+	}
+	if (deque->tail == deque->size) {
+		size_t size = deque->size ? (deque->size * 2) : 64;
+		struct ecryptfs_walk_dir *dirs;
+
+		dirs = realloc(deque->dirs, size * sizeof(*dirs));
+		if (!dirs) {
+			rc = -ENOMEM;
+			goto out;
+		}
+		deque->dirs = dirs;
+		deque->size = size;
+	}
+	deque->dirs[deque->tail].path = path;
+	deque->dirs[deque->tail].dev = dev;
+	deque->tail++;
+out:
+	pthread_mutex_unlock(&deque->lock);
+	return rc;
+}
+
+static int ecryptfs_walk_pop(struct ecryptfs_walk_deque *deque,
+			     struct ecryptfs_walk_dir *dir, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->head != deque->tail) {
+		if (steal)
+			(*dir) = deque->dirs[deque->head++];
+		else
+			(*dir) = deque->dirs[--deque->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+static int ecryptfs_walk_steal(struct ecryptfs_walk_worker *worker,
+			       struct ecryptfs_walk_dir *dir)
+{
+	struct ecryptfs_walk_ctx *ctx = worker->ctx;
+	int start = rand_r(&worker->seed) % ctx->num_workers;
+	int i;
+
+	for (i = 0; i < ctx->num_workers; i++) {
+		int victim = (start + i) % ctx->num_workers;
+
+		if (victim == worker->id)
+			continue;
+		if (ecryptfs_walk_pop(&ctx->workers[victim].deque, dir, 1))
+			return 1;
+	}
+	return 0;
+}
+
+static void ecryptfs_walk_set_rc(struct ecryptfs_walk_ctx *ctx, int rc)
+{
+	int expected = 0;
+
+	__atomic_compare_exchange_n(&ctx->rc, &expected, rc, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static int ecryptfs_walk_aborted(struct ecryptfs_walk_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->rc, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * ecryptfs_walk_read_dir
+ *
+ * Reads one directory, handing every entry to the visitor and queuing
+ * subdirectories on the worker's own deque.
+ */
+static void ecryptfs_walk_read_dir(struct ecryptfs_walk_worker *worker,
+				   struct ecryptfs_walk_dir *wdir)
+{
+	struct ecryptfs_walk_ctx *ctx = worker->ctx;
+	struct ecryptfs_walk *walk = ctx->walk;
+	struct dirent *ep;
+	DIR *dp;
+	int fd;
+	int rc;
+
+	fd = open(wdir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1 || !(dp = fdopendir(fd))) {
+		fprintf(stderr, "Error opening directory [%s]; errno msg = "
+			"[%m]\n", wdir->path);
+		if (fd != -1)
+			close(fd);
+		__atomic_add_fetch(&walk->num_errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	while (!ecryptfs_walk_aborted(ctx) && (ep = readdir(dp))) {
+		struct ecryptfs_walk_entry entry;
+		unsigned char d_type = ep->d_type;
+		char *path;
+		struct stat st;
+		dev_t dev = wdir->dev;
+
+		if (!strcmp(ep->d_name, ".") || !strcmp(ep->d_name, ".."))
+			continue;
+		if (d_type == DT_UNKNOWN || (walk->flags & ECRYPTFS_WALK_XDEV
+					     && d_type == DT_DIR)) {
+			if (fstatat(fd, ep->d_name, &st,
+				    AT_SYMLINK_NOFOLLOW) == 0) {
+				if (S_ISDIR(st.st_mode))
+					d_type = DT_DIR;
+				else if (S_ISREG(st.st_mode))
+					d_type = DT_REG;
+				else if (S_ISLNK(st.st_mode))
+					d_type = DT_LNK;
+				dev = st.st_dev;
+			}
+		}
+		if (asprintf(&path, "%s/%s", wdir->path, ep->d_name) == -1) {
+			ecryptfs_walk_set_rc(ctx, -ENOMEM);
+			break;
+		}
+		if (d_type != DT_DIR || (walk->flags & ECRYPTFS_WALK_DIRS)) {
+			entry.dirfd = fd;
+			entry.name = ep->d_name;
+			entry.path = path;
+			entry.d_type = d_type;
+			rc = walk->fn(&entry, walk->priv, worker->id);
+			if (rc) {
+				ecryptfs_walk_set_rc(ctx, rc);
+				free(path);
+				break;
+			}
+		}
+		if (d_type != DT_DIR || ((walk->flags & ECRYPTFS_WALK_XDEV)
+					 && dev != ctx->root_dev)) {
+			free(path);
+			continue;
+		}
+		__atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+		rc = ecryptfs_walk_push(&worker->deque, path, dev);
+		if (rc) {
+			__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+			ecryptfs_walk_set_rc(ctx, rc);
+			free(path);
+			break;
+		}
+	}
+	closedir(dp);
+}
+
+static void *ecryptfs_walk_worker_fn(void *arg)
+{
+	struct ecryptfs_walk_worker *worker = arg;
+	struct ecryptfs_walk_ctx *ctx = worker->ctx;
+	struct timespec backoff = { 0, 100000 };
+	struct ecryptfs_walk_dir dir;
+	int idle = 0;
+
+	for (;;) {
+		if (ecryptfs_walk_pop(&worker->deque, &dir, 0)
+		    || ecryptfs_walk_steal(worker, &dir)) {
+			idle = 0;
+			if (!ecryptfs_walk_aborted(ctx))
+				ecryptfs_walk_read_dir(worker, &dir);
+			free(dir.path);
+			__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if (__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0)
+			break;
+		/* Someone is still reading a directory that may yet
+		 * yield work; spin briefly, then back off */
+		if (++idle < 64)
+			sched_yield();
+		else
+			nanosleep(&backoff, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * ecryptfs_walk_tree
+ * @walk: Walk parameters; walk->num_errors is updated
+ * @root: Directory to walk. If it is not a directory, the visitor is
+ *        called once for it.
+ *
+ * Returns zero on success, the first non-zero value returned by the
+ * visitor, or a negative errno value
+ */
+int ecryptfs_walk_tree(struct ecryptfs_walk *walk, const char *root)
+{
+	struct ecryptfs_walk_ctx ctx;
+	struct ecryptfs_walk_entry entry;
+	struct stat st;
+	char *root_path = NULL;
+	size_t len;
+	int started = 0;
+	int i;
+	int rc = 0;
+
+	walk->num_errors = 0;
+	if (lstat(root, &st)) {
+		rc = -errno;
+		fprintf(stderr, "Error attempting to stat [%s]; errno msg = "
+			"[%m]\n", root);
+		goto out;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		entry.dirfd = AT_FDCWD;
+		entry.name = root;
+		entry.path = root;
+		entry.d_type = S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		rc = walk->fn(&entry, walk->priv, 0);
+		goto out;
+	}
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.walk = walk;
+	ctx.root_dev = st.st_dev;
+	ctx.num_workers = ecryptfs_walk_num_threads(walk->num_threads);
+	ctx.workers = calloc(ctx.num_workers, sizeof(*ctx.workers));
+	if (!ctx.workers) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < ctx.num_workers; i++) {
+		ctx.workers[i].ctx = &ctx;
+		ctx.workers[i].id = i;
+		ctx.workers[i].seed = (unsigned int)(time(NULL) + i);
+		pthread_mutex_init(&ctx.workers[i].deque.lock, NULL);
+	}
+	root_path = strdup(root);
+	if (!root_path) {
+		rc = -ENOMEM;
+		goto out_free;
+	}
+	len = strlen(root_path);
+	while (len > 1 && root_path[len - 1] == '/')
+		root_path[--len] = '\0';
+	ctx.pending = 1;
+	if ((rc = ecryptfs_walk_push(&ctx.workers[0].deque, root_path,
+				     st.st_dev))) {
+		free(root_path);
+		goto out_free;
+	}
+	for (i = 0; i < ctx.num_workers; i++) {
+		rc = pthread_create(&ctx.workers[i].thread, NULL,
+				    ecryptfs_walk_worker_fn, &ctx.workers[i]);
+		if (rc) {
+			fprintf(stderr, "Error creating walker thread; "
+				"rc = [%d]\n", rc);
+			ecryptfs_walk_set_rc(&ctx, -rc);
+			break;
+		}
+		started++;
+	}
+	/* Worker 0 holds the root, so even a partial pool drains the
+	 * queues */
+	for (i = 0; i < started; i++)
+		pthread_join(ctx.workers[i].thread, NULL);
+	rc = ctx.rc;
+out_free:
+	for (i = 0; i < ctx.num_workers; i++) {
+		struct ecryptfs_walk_deque *deque = &ctx.workers[i].deque;
+
+		while (deque->head != deque->tail)
+			free(deque->dirs[deque->head++].path);
+		free(deque->dirs);
+		pthread_mutex_destroy(&deque->lock);
+	}
+	free(ctx.workers);
+out:
+	return rc;
+}
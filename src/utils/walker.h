@@ -0,0 +1,70 @@
+/**
+ * Parallel directory tree walker for the bulk utilities header file
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef ECRYPTFS_WALKER_H
+#define ECRYPTFS_WALKER_H
+
+#include <stdint.h>
+
+/**
+ * @dirfd: Open descriptor of the parent directory; use with openat()
+ *         and friends. AT_FDCWD when the walk root is not a directory.
+ * @name: Entry name, relative to @dirfd
+ * @path: Full path of the entry, for reporting
+ * @d_type: Type from readdir(); may be DT_UNKNOWN
+ */
+struct ecryptfs_walk_entry {
+	int dirfd;
+	const char *name;
+	const char *path;
+	unsigned char d_type;
+};
+
+/**
+ * Called for every entry found under the walk root, from whichever
+ * worker thread found it. @worker is in [0, num_threads) so that
+ * callers can keep per-thread state without locking. A non-zero
+ * return value stops the walk and is returned by ecryptfs_walk_tree().
+ */
+typedef int (*ecryptfs_walk_fn)(struct ecryptfs_walk_entry *entry,
+				void *priv, int worker);
+
+#define ECRYPTFS_WALK_DIRS     0x00000001 /* Also visit directories */
+#define ECRYPTFS_WALK_XDEV     0x00000002 /* Stay on the root's fs */
+
+/**
+ * @num_threads: Number of worker threads; 0 picks the number of
+ *               online CPUs
+ * @flags: ECRYPTFS_WALK_*
+ * @fn: Visitor
+ * @priv: Passed through to @fn
+ * @num_errors: Set to the number of directories that could not be read
+ */
+struct ecryptfs_walk {
+	int num_threads;
+	uint32_t flags;
+	ecryptfs_walk_fn fn;
+	void *priv;
+	uint64_t num_errors;
+};
+
+int ecryptfs_walk_num_threads(int num_threads);
+int ecryptfs_walk_tree(struct ecryptfs_walk *walk, const char *root);
+
+#endif
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# ecryptfs-backup.sh: Back up a lower directory, change one extent of
+#		      one file through the mount, and check that the
+#		      incremental delta only carries that extent and that
+#		      both deltas restore the same lower files
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+backup_dir=""
+ecryptfs_backup=${test_script_dir}/../../src/utils/ecryptfs-backup
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	[ -n "$backup_dir" ] && rm -rf $backup_dir
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+backup_dir=$(mktemp -d /tmp/ecryptfs-backup.XXXXXX) || exit
+
+mkdir ${test_dir}/sub || exit
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${test_dir}/${size} || exit
+	head -c $size /dev/urandom > ${test_dir}/sub/${size} || exit
+done
+sync
+
+$ecryptfs_backup -m ${backup_dir}/manifest -o ${backup_dir}/full \
+	$lower_dir 2> /dev/null || exit
+
+# Rewrite one extent in the middle of the largest file
+head -c 4096 /dev/urandom | \
+	dd of=${test_dir}/1048577 bs=4096 seek=100 conv=notrunc 2> /dev/null \
+	|| exit
+rm ${test_dir}/sub/1 || exit
+sync
+$ecryptfs_backup -m ${backup_dir}/manifest -o ${backup_dir}/incr \
+	$lower_dir > ${backup_dir}/out 2>&1 || exit
+grep -q "Extents sent: \[1/" ${backup_dir}/out || exit
+grep -q "Deleted: \[1\]" ${backup_dir}/out || exit
+
+mkdir ${backup_dir}/restore || exit
+$ecryptfs_backup -a ${backup_dir}/restore ${backup_dir}/full \
+	2> /dev/null || exit
+$ecryptfs_backup -a ${backup_dir}/restore ${backup_dir}/incr \
+	2> /dev/null || exit
+diff -r $lower_dir ${backup_dir}/restore > /dev/null || exit
+
+rc=0
+exit
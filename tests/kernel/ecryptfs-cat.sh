@@ -0,0 +1,70 @@
+#!/bin/bash
+#
+# ecryptfs-cat.sh: Check that ecryptfs-cat decrypts lower files written
+#		   by the kernel to the same contents that the mount shows
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+plain_dir=0
+ecryptfs_cat=${test_script_dir}/../../src/utils/ecryptfs-cat
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	rm -rf $plain_dir
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+plain_dir=$(mktemp -qd /tmp/etl-ecryptfs-cat-XXXXXXXXXX) || exit
+
+# Empty, sub-extent, exactly one extent, and enough extents to spread
+# over several batches and threads
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${plain_dir}/${size} || exit
+	cp ${plain_dir}/${size} ${test_dir}/${size} || exit
+done
+sync
+
+for size in 0 1 4096 4097 1048577; do
+	lower=$(etl_find_lower_path ${test_dir}/${size}) || exit
+	printf "%s\n" "$default_fekek_pass" \
+		| $ecryptfs_cat -t 4 -b 8 $lower > ${plain_dir}/${size}.out \
+		|| exit
+	cmp -s ${plain_dir}/${size} ${plain_dir}/${size}.out || exit
+done
+
+# A wrong passphrase must not produce any output
+lower=$(etl_find_lower_path ${test_dir}/4097) || exit
+out=$(printf "wrong\n" | $ecryptfs_cat $lower 2>/dev/null)
+if [ $? -eq 0 ] || [ -n "$out" ]; then
+	exit
+fi
+
+rc=0
+exit
@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# ecryptfs-convert.sh: Move the metadata of files written by the kernel
+#		       into the xattr and back, and check that the mount
+#		       reads the same contents each time
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+ecryptfs_convert=${test_script_dir}/../../src/utils/ecryptfs-convert
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+sums()
+{
+	(cd $test_dir && find . -type f -exec md5sum {} + | sort)
+}
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+header_opts=$(eval "echo $default_fne_mount_opts")
+export ETL_MOUNT_OPTS=$header_opts
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+
+mkdir ${test_dir}/sub || exit
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${test_dir}/${size} || exit
+	head -c $size /dev/urandom > ${test_dir}/sub/${size} || exit
+done
+before=$(sums) || exit
+lower=$(etl_find_lower_path ${test_dir}/4097) || exit
+etl_umount_i || exit
+
+$ecryptfs_convert -m xattr -t 4 $lower_dir > /dev/null || exit
+# The header and its 8192 bytes are gone from the lower file
+[ "$(stat -c %s $lower)" = "8192" ] || exit
+export ETL_MOUNT_OPTS="${header_opts},ecryptfs_xattr_metadata"
+etl_mount_i || exit
+[ "$(sums)" = "$before" ] || exit
+etl_umount_i || exit
+
+$ecryptfs_convert -m header -t 4 $lower_dir > /dev/null || exit
+[ "$(stat -c %s $lower)" = "16384" ] || exit
+export ETL_MOUNT_OPTS=$header_opts
+etl_mount_i || exit
+[ "$(sums)" = "$before" ] || exit
+
+rc=0
+exit
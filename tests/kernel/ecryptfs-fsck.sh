@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# ecryptfs-fsck.sh: Check that ecryptfs-fsck passes files written by the
+#		    kernel and finds lower files damaged behind its back
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+ecryptfs_fsck=${test_script_dir}/../../src/utils/ecryptfs-fsck
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+fsck_lower()
+{
+	printf "%s\n" "$default_fekek_pass" \
+		| $ecryptfs_fsck -p -t 4 -s 8 $lower_dir
+}
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${test_dir}/${size} || exit
+done
+lower=$(etl_find_lower_path ${test_dir}/4097) || exit
+etl_umount_i || exit
+
+# Everything the kernel wrote must check out clean
+fsck_lower > /dev/null || exit
+
+# Cut the last extent off one file and leave the crash remnants of
+# another behind
+truncate -s -4096 $lower || exit
+: > ${lower_dir}/empty || exit
+
+out=$(fsck_lower)
+if [ $? -ne 1 ]; then
+	exit
+fi
+echo "$out" | grep -q "\"path\":\"${lower}\".*\"truncated\"" || exit
+echo "$out" | grep -q "\"path\":\"${lower_dir}/empty\".*\"empty\"" || exit
+echo "$out" | grep -q "\"damaged\":2," || exit
+etl_mount_i || exit
+
+rc=0
+exit
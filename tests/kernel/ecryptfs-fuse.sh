@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# ecryptfs-fuse.sh: Write files, a directory and a symlink through the
+#		    mount, then check that the FUSE driver serves the same
+#		    tree from the lower directory
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+fuse_dir=""
+ecryptfs_fuse=${test_script_dir}/../../src/utils/ecryptfs-fuse
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	if [ -n "$fuse_dir" ]; then
+		fusermount3 -u $fuse_dir 2> /dev/null
+		rmdir $fuse_dir
+	fi
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# The driver is only built when fuse3 is found; until this test
+# framework has the notion of skipped tests, let it slide
+if [ ! -x $ecryptfs_fuse ] || ! which fusermount3 > /dev/null 2>&1; then
+	rc=0
+	exit
+fi
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+fuse_dir=$(mktemp -qd /tmp/etl-ecryptfs-fuse-XXXXXXXXXX) || exit
+
+mkdir ${test_dir}/dir || exit
+for size in 0 1 4096 4097 1048577 4194305; do
+	head -c $size /dev/urandom > ${test_dir}/${size} || exit
+	head -c $size /dev/urandom > ${test_dir}/dir/${size} || exit
+done
+ln -s 4097 ${test_dir}/link || exit
+sync
+
+printf "%s\n" "$default_fekek_pass" | $ecryptfs_fuse -c 1 -r 64 \
+	$lower_dir $fuse_dir || exit
+diff -r ${test_dir} ${fuse_dir} > /dev/null || exit
+[ "$(readlink ${fuse_dir}/link)" = "4097" ] || exit
+
+# Reads from the middle of a file, past the cache and the readahead
+cmp -s <(tail -c 1000000 ${test_dir}/4194305) \
+       <(tail -c 1000000 ${fuse_dir}/4194305) || exit
+touch ${fuse_dir}/new 2> /dev/null && exit
+
+rc=0
+exit
@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# ecryptfs-hmac-tree.sh: Build HMAC trees over the lower files, rewrite
+#			 one extent through the mount, and check that
+#			 verification points at it until the tree is
+#			 updated for that extent alone
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+store_dir=""
+ecryptfs_hmac_tree=${test_script_dir}/../../src/utils/ecryptfs-hmac-tree
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	[ -n "$store_dir" ] && rm -rf $store_dir
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+htree()
+{
+	printf "%s\n" "$default_fekek_pass" | $ecryptfs_hmac_tree "$@"
+}
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+store_dir=$(mktemp -qd /tmp/etl-ecryptfs-hmac-tree-XXXXXXXXXX) || exit
+
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${test_dir}/${size} || exit
+done
+sync
+lower=$(etl_find_lower_path ${test_dir}/1048577) || exit
+lower=${lower#${lower_dir}/}
+
+htree build -s $store_dir -t 4 $lower_dir > /dev/null || exit
+htree verify -s $store_dir -t 4 $lower_dir > /dev/null || exit
+
+head -c 4096 /dev/urandom | \
+	dd of=${test_dir}/1048577 bs=4096 seek=100 conv=notrunc 2> /dev/null \
+	|| exit
+sync
+out=$(htree verify -s $store_dir -t 4 $lower_dir) && exit
+echo "$out" | grep -q "extent 100 differs" || exit
+htree verify -s $store_dir -e 99 $lower_dir $lower > /dev/null || exit
+
+htree update -s $store_dir -e 100 $lower_dir $lower > /dev/null || exit
+htree verify -s $store_dir -t 4 $lower_dir > /dev/null || exit
+
+# Trees built with another passphrase do not verify
+printf "wrong\n" | $ecryptfs_hmac_tree verify -s $store_dir $lower_dir \
+	> /dev/null 2>&1 && exit
+
+rc=0
+exit
@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# ecryptfs-import.sh: Check that a tree written by ecryptfs-import,
+#		      with encrypted filenames, reads back through a
+#		      kernel mount
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+plain_dir=0
+ecryptfs_import=${test_script_dir}/../../src/utils/ecryptfs-import
+
+# mount.ecryptfs hands the FNEK salt to the KDF as ASCII rather than as
+# hex, and ecryptfs-import does the same. The test library converts the
+# salt from hex, so give it the hex of those ASCII bytes.
+fnek_salt_hex="3939383837373636"
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	rm -rf $plain_dir
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_fekek_passphrase || exit
+etl_add_fnek_passphrase "$default_fnek_pass" $fnek_salt_hex || exit
+export ETL_MOUNT_OPTS=$(eval "echo $default_fne_mount_opts")
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+lower_dir=$(etl_find_lower_path $test_dir) || exit
+etl_umount_i || exit
+plain_dir=$(mktemp -qd /tmp/etl-ecryptfs-import-XXXXXXXXXX) || exit
+
+mkdir -p ${plain_dir}/sub/deeper || exit
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${plain_dir}/${size} || exit
+done
+head -c 300000 /dev/urandom > ${plain_dir}/sub/deeper/file || exit
+ln -s sub/deeper/file ${plain_dir}/link || exit
+
+printf "%s\n" "$default_fekek_pass" \
+	| $ecryptfs_import -f -t 4 $plain_dir $lower_dir > /dev/null || exit
+etl_mount_i || exit
+
+diff -r $plain_dir $test_dir > /dev/null || exit
+if [ "$(readlink ${test_dir}/link)" != "sub/deeper/file" ]; then
+	exit
+fi
+
+rc=0
+exit
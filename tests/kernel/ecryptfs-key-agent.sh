@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# ecryptfs-key-agent.sh: Hand the mount keys to the key agent, unlink
+#			 them, then check that a restore puts back keys
+#			 that the kernel can mount with
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+key_agent=${test_script_dir}/../../src/utils/ecryptfs-key-agent
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	$key_agent flush
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_keys || exit
+if $ETL_TEST_FNE ; then
+	$key_agent hold -t 60 $ETL_FEKEK_SIG $ETL_FNEK_SIG || exit
+else
+	$key_agent hold -t 60 $ETL_FEKEK_SIG || exit
+fi
+$key_agent status > /dev/null || exit
+# The agent keeps the keys in memory that it has locked itself
+agent_pid=$(pgrep -n -f "ecryptfs-key-agent hold") || exit
+vmlck=$(awk '/^VmLck:/ { print $2 }' /proc/${agent_pid}/status)
+[ "${vmlck:-0}" -gt 0 ] || exit
+etl_unlink_keys || exit
+keyctl search @u user $ETL_FEKEK_SIG > /dev/null 2>&1 && exit
+
+$key_agent restore || exit
+# The agent is gone once it has restored the keys
+$key_agent status > /dev/null 2>&1 && exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+echo "key agent" > ${test_dir}/file || exit
+[ "$(cat ${test_dir}/file)" = "key agent" ] || exit
+
+# A flushed agent does not restore anything
+$key_agent hold -t 60 $ETL_FEKEK_SIG || exit
+$key_agent flush || exit
+$key_agent restore > /dev/null 2>&1 && exit
+
+rc=0
+exit
@@ -0,0 +1,74 @@
+#!/bin/bash
+#
+# ecryptfs-migrate.sh: Copy a plaintext tree into a mount with
+#		       ecryptfs-migrate, then resume the copy from its
+#		       journal
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+src_dir=""
+ecryptfs_migrate=${test_script_dir}/../../src/utils/ecryptfs-migrate
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	rm -rf "$src_dir" "${src_dir}.journal"
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+src_dir=$(mktemp -d) || exit
+
+mkdir -p ${src_dir}/a/b ${src_dir}/c || exit
+for size in 0 1 4096 4097 1048577 3000000; do
+	head -c $size /dev/urandom > ${src_dir}/a/${size} || exit
+	head -c $size /dev/urandom > ${src_dir}/a/b/${size} || exit
+done
+ln -s ../a/4097 ${src_dir}/c/link || exit
+chmod 640 ${src_dir}/a/4097 || exit
+
+$ecryptfs_migrate -t 4 -b 64 -j ${src_dir}.journal $src_dir $test_dir \
+	> /dev/null || exit
+diff -r $src_dir $test_dir > /dev/null || exit
+[ "$(stat -c %a ${test_dir}/a/4097)" = "640" ] || exit
+
+# Drop the last record from the journal and the file it records, as
+# if the copy had been interrupted before reaching that file; a second
+# run must copy only that one and verify everything
+last=$(tr '\0' '\n' < ${src_dir}.journal | tail -n 2 | head -n 1)
+[ -n "$last" ] || exit
+rm ${test_dir}/${last} || exit
+truncate -s -$((${#last} + 1 + 65)) ${src_dir}.journal || exit
+out=$($ecryptfs_migrate -j ${src_dir}.journal $src_dir $test_dir) || exit
+rm -f ${src_dir}.journal
+echo "$out" | grep -q "Files copied: \[1\]" || exit
+echo "$out" | grep -q "Mismatched: \[0\]" || exit
+diff -r $src_dir $test_dir > /dev/null || exit
+
+rc=0
+exit
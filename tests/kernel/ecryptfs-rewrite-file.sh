@@ -0,0 +1,66 @@
+#!/bin/bash
+#
+# ecryptfs-rewrite-file.sh: Rewrite a tree in a mount and check that
+#			    every lower file was replaced while the
+#			    contents seen through the mount stayed the same
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation version 2
+# of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA
+
+test_script_dir=$(dirname $0)
+rc=1
+test_dir=0
+ecryptfs_rewrite_file=${test_script_dir}/../../src/utils/ecryptfs-rewrite-file
+
+. ${test_script_dir}/../lib/etl_funcs.sh
+
+test_cleanup()
+{
+	etl_remove_test_dir $test_dir
+	etl_umount
+	etl_lumount
+	etl_unlink_keys
+	exit $rc
+}
+trap test_cleanup 0 1 2 3 15
+
+# TEST
+etl_add_keys || exit
+etl_lmount || exit
+etl_mount_i || exit
+test_dir=$(etl_create_test_dir) || exit
+
+mkdir -p ${test_dir}/a/b || exit
+for size in 0 1 4096 4097 1048577; do
+	head -c $size /dev/urandom > ${test_dir}/a/${size} || exit
+	head -c $size /dev/urandom > ${test_dir}/a/b/${size} || exit
+done
+ln -s 4097 ${test_dir}/a/link || exit
+chmod 640 ${test_dir}/a/4097 || exit
+before=$(cd $test_dir && find . -type f -exec md5sum {} + | sort) || exit
+lower=$(etl_find_lower_path ${test_dir}/a/b/4097) || exit
+inode=$(stat -c %i $lower) || exit
+
+$ecryptfs_rewrite_file -q -r -t 4 -b 64 $test_dir > /dev/null || exit
+
+after=$(cd $test_dir && find . -type f -exec md5sum {} + | sort) || exit
+[ "$before" = "$after" ] || exit
+[ "$(stat -c %a ${test_dir}/a/4097)" = "640" ] || exit
+[ "$(readlink ${test_dir}/a/link)" = "4097" ] || exit
+lower=$(etl_find_lower_path ${test_dir}/a/b/4097) || exit
+[ "$(stat -c %i $lower)" != "$inode" ] || exit
+[ -z "$(find $test_dir -name '.*')" ] || exit
+
+rc=0
+exit
@@ -0,0 +1,105 @@
+/**
+ * test.c: Check libecryptfs' filename encryption against names produced
+ *         the way the kernel does it, and that names decrypt again
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../../src/include/ecryptfs.h"
+
+#define FAIL(msg) do { fprintf(stderr, "%s\n", msg); return EINVAL; } while (0)
+
+/* Passphrase "foo", AES-128 filename key */
+#define FNEK_SIG_HEX "6967d0c28476ffa1"
+#define HELLO_ENCRYPTED "ECRYPTFS_FNEK_ENCRYPTED.FWZdNx10V5PzcET11n11tYOc" \
+			"hqBr4Vjw0axKmCaP_9kzFnwKCp_FGXGl9---"
+
+int main(void)
+{
+	struct ecryptfs_fn_ctx *ctx;
+	struct ecryptfs_filename names[3];
+	char fnek[ECRYPTFS_MAX_KEY_BYTES];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char name[NAME_MAX + 1];
+	char lower[NAME_MAX + 1];
+	char upper[NAME_MAX + 1];
+	size_t len;
+
+	if (ecryptfs_derive_fnek(fnek, sig, "foo"))
+		FAIL("ecryptfs_derive_fnek failed");
+	to_hex(sig_hex, sig, ECRYPTFS_SIG_SIZE);
+	if (strcmp(sig_hex, FNEK_SIG_HEX))
+		FAIL("Filename key signature does not match mount.ecryptfs");
+	if (ecryptfs_fn_ctx_create(&ctx, RFC2440_CIPHER_AES_128, fnek, 16,
+				   sig))
+		FAIL("ecryptfs_fn_ctx_create failed");
+	if (ecryptfs_encrypt_filename(ctx, lower, sizeof(lower), "hello", 5))
+		FAIL("Encrypting failed");
+	if (strcmp(lower, HELLO_ENCRYPTED))
+		FAIL("Encrypted name does not match the kernel's");
+	/* Every length up to the largest that fits in NAME_MAX */
+	for (len = 1; len <= 143; len++) {
+		memset(name, 'a' + (len % 26), len);
+		if (ecryptfs_encrypt_filename(ctx, lower, sizeof(lower), name,
+					      len))
+			FAIL("Encrypting failed");
+		if (strlen(lower) > NAME_MAX)
+			FAIL("Encrypted name too long");
+		if (strlen(lower) != ecryptfs_encrypted_filename_size(len))
+			FAIL("Encrypted name size not predicted");
+		if (ecryptfs_decrypt_filename(ctx, upper, lower,
+					      strlen(lower)))
+			FAIL("Decrypting failed");
+		if (strlen(upper) != len || memcmp(upper, name, len))
+			FAIL("Decrypted name does not match");
+	}
+	if (ecryptfs_encrypt_filename(ctx, lower, sizeof(lower), name, 144)
+	    != -ENAMETOOLONG
+	    || ecryptfs_encrypted_filename_size(144) <= NAME_MAX)
+		FAIL("Overlong name not rejected");
+	/* A batch mixing a good, a plaintext and a corrupt lower name */
+	names[0].lower = HELLO_ENCRYPTED;
+	names[0].lower_size = strlen(HELLO_ENCRYPTED);
+	names[1].lower = "plain";
+	names[1].lower_size = 5;
+	names[2].lower = "ECRYPTFS_FNEK_ENCRYPTED.F*Zd";
+	names[2].lower_size = strlen(names[2].lower);
+	if (ecryptfs_decrypt_filenames(ctx, names, 3))
+		FAIL("Batch decryption failed");
+	if (names[0].rc || strcmp(names[0].upper, "hello"))
+		FAIL("Batched name does not decrypt");
+	if (names[1].rc || strcmp(names[1].upper, "plain"))
+		FAIL("Plaintext name not passed through");
+	if (names[2].rc != -EINVAL)
+		FAIL("Corrupt name not rejected");
+	ecryptfs_fn_ctx_destroy(ctx);
+	/* The same name under another passphrase's filename key */
+	if (ecryptfs_derive_fnek(fnek, sig, "bar")
+	    || ecryptfs_fn_ctx_create(&ctx, RFC2440_CIPHER_AES_128, fnek, 16,
+				      sig))
+		FAIL("Setting up the second key failed");
+	if (ecryptfs_decrypt_filename(ctx, upper, HELLO_ENCRYPTED,
+				      strlen(HELLO_ENCRYPTED)) != -ENOKEY)
+		FAIL("Name under another key not rejected");
+	ecryptfs_fn_ctx_destroy(ctx);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * test.c: Check that file keys wrapped by
+ *         ecryptfs_write_passphrase_key_packets() parse and unwrap
+ *         again, and only under the right passphrase
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../../src/include/ecryptfs.h"
+
+#define FAIL(msg) do { fprintf(stderr, "%s\n", msg); return EINVAL; } while (0)
+
+static int check_key_size(uint8_t cipher_code, size_t key_size)
+{
+	struct ecryptfs_packet_set_user packet_set;
+	unsigned char buf[512];
+	unsigned char fek[ECRYPTFS_MAX_KEY_BYTES];
+	unsigned char out[ECRYPTFS_MAX_KEY_BYTES];
+	char fekek[ECRYPTFS_MAX_KEY_BYTES];
+	char sig_hex[ECRYPTFS_SIG_SIZE_HEX + 1];
+	char sig[ECRYPTFS_SIG_SIZE];
+	char salt[ECRYPTFS_SALT_SIZE];
+	size_t written, out_size;
+	size_t i;
+
+	for (i = 0; i < sizeof(fek); i++)
+		fek[i] = (i * 7) + key_size;
+	from_hex(salt, ECRYPTFS_DEFAULT_SALT_HEX, ECRYPTFS_SALT_SIZE);
+	if (generate_passphrase_sig(sig_hex, fekek, salt, "right"))
+		FAIL("generate_passphrase_sig failed");
+	from_hex(sig, sig_hex, ECRYPTFS_SIG_SIZE);
+	if (ecryptfs_write_passphrase_key_packets(buf, 10, &written,
+						  cipher_code, fek, key_size,
+						  fekek, sig, salt) != -ENOSPC)
+		FAIL("Short buffer not rejected");
+	if (ecryptfs_write_passphrase_key_packets(buf, sizeof(buf), &written,
+						  cipher_code, fek, key_size,
+						  fekek, sig, salt))
+		FAIL("Wrapping failed");
+	buf[written] = 0x00;
+	if (ecryptfs_parse_packet_set(&packet_set, buf, written + 1))
+		FAIL("Written packets do not parse");
+	if (packet_set.num_keys != 1 || packet_set.cipher_code != cipher_code
+	    || packet_set.keys[0].key_size != key_size
+	    || packet_set.keys[0].packet_size != written
+	    || memcmp(packet_set.keys[0].sig, sig, ECRYPTFS_SIG_SIZE))
+		FAIL("Parsed packet does not match what was written");
+	if (ecryptfs_find_fek_with_passphrase(out, &out_size, &packet_set,
+					      "wrong") != -ENOKEY)
+		FAIL("Wrong passphrase not rejected");
+	if (ecryptfs_find_fek_with_passphrase(out, &out_size, &packet_set,
+					      "right"))
+		FAIL("Unwrapping failed");
+	if (out_size != key_size || memcmp(out, fek, key_size))
+		FAIL("Unwrapped key does not match");
+	return 0;
+}
+
+int main(void)
+{
+	int rc;
+
+	rc = check_key_size(RFC2440_CIPHER_AES_128, 16);
+	if (!rc)
+		rc = check_key_size(RFC2440_CIPHER_AES_192, 24);
+	if (!rc)
+		rc = check_key_size(RFC2440_CIPHER_AES_256, 32);
+	if (!rc && ecryptfs_write_passphrase_key_packets(
+			NULL, 0, NULL, RFC2440_CIPHER_BLOWFISH, NULL, 16,
+			NULL, NULL, NULL) != -EOPNOTSUPP)
+		FAIL("Non-AES cipher not rejected");
+	return rc;
+}
@@ -0,0 +1,179 @@
+/**
+ * test.c: Check ecryptfs_parse_stat_packet_set() against hand-built
+ *         header packet sets
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../../src/include/ecryptfs.h"
+
+static const unsigned char old_sig[ECRYPTFS_SIG_SIZE] = {
+	0x25, 0x3c, 0xa7, 0xe8, 0x88, 0x11, 0xd1, 0x84 };
+static const unsigned char new_sig[ECRYPTFS_SIG_SIZE] = {
+	0xc4, 0x2e, 0xc7, 0x53, 0x01, 0xdc, 0x16, 0x74 };
+
+static size_t put_header(unsigned char *buf, uint64_t size)
+{
+	uint32_t m_1 = 0x12345678;
+	uint32_t m_2 = m_1 ^ MAGIC_ECRYPTFS_MARKER;
+	uint32_t flags = (0x03 << 24) | 0x00000002;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		buf[i] = (size >> (56 - (i * 8))) & 0xFF;
+	for (i = 0; i < 4; i++) {
+		buf[8 + i] = (m_1 >> (24 - (i * 8))) & 0xFF;
+		buf[12 + i] = (m_2 >> (24 - (i * 8))) & 0xFF;
+		buf[16 + i] = (flags >> (24 - (i * 8))) & 0xFF;
+	}
+	buf[20] = 0x00; buf[21] = 0x00; buf[22] = 0x10; buf[23] = 0x00;
+	buf[24] = 0x00; buf[25] = 0x02;
+	return ECRYPTFS_HEADER_METADATA_BYTES;
+}
+
+static size_t put_tag_3_and_11(unsigned char *buf, uint8_t cipher_code,
+			       size_t encrypted_key_size,
+			       const unsigned char *sig)
+{
+	size_t i = 0;
+
+	buf[i++] = ECRYPTFS_TAG_3_PACKET_TYPE;
+	buf[i++] = (ECRYPTFS_SALT_SIZE + 5 + encrypted_key_size);
+	buf[i++] = 0x04;
+	buf[i++] = cipher_code;
+	buf[i++] = 0x03;
+	buf[i++] = 0x0A;
+	memset(&buf[i], 0xAA, ECRYPTFS_SALT_SIZE);
+	i += ECRYPTFS_SALT_SIZE;
+	buf[i++] = 0x60;
+	memset(&buf[i], 0xBB, encrypted_key_size);
+	i += encrypted_key_size;
+	buf[i++] = ECRYPTFS_TAG_11_PACKET_TYPE;
+	buf[i++] = (14 + ECRYPTFS_SIG_SIZE);
+	buf[i++] = 0x62;
+	buf[i++] = 0x08;
+	memcpy(&buf[i], "_CONSOLE", 8);
+	i += 8;
+	memset(&buf[i], 0, 4);
+	i += 4;
+	memcpy(&buf[i], sig, ECRYPTFS_SIG_SIZE);
+	i += ECRYPTFS_SIG_SIZE;
+	return i;
+}
+
+static size_t put_tag_1(unsigned char *buf, size_t encrypted_key_size,
+			const unsigned char *sig)
+{
+	size_t body_size = (ECRYPTFS_SIG_SIZE + 2 + encrypted_key_size);
+	size_t i = 0;
+
+	buf[i++] = ECRYPTFS_TAG_1_PACKET_TYPE;
+	buf[i++] = (((body_size - 192) / 256) + 192);
+	buf[i++] = ((body_size - 192) % 256);
+	buf[i++] = 0x03;
+	memcpy(&buf[i], sig, ECRYPTFS_SIG_SIZE);
+	i += ECRYPTFS_SIG_SIZE;
+	buf[i++] = 0x01;
+	memset(&buf[i], 0xCC, encrypted_key_size);
+	i += encrypted_key_size;
+	return i;
+}
+
+#define FAIL(msg) do { fprintf(stderr, "%s\n", msg); return EINVAL; } while (0)
+
+int main(void)
+{
+	struct ecryptfs_crypt_stat_user crypt_stat;
+	struct ecryptfs_packet_set_user packet_set;
+	unsigned char buf[ECRYPTFS_DEFAULT_EXTENT_SIZE];
+	size_t len;
+
+	/* Two passphrase keys; the first one sets the cipher */
+	memset(buf, 0, sizeof(buf));
+	len = put_header(buf, 4242);
+	len += put_tag_3_and_11(&buf[len], RFC2440_CIPHER_AES_128, 16,
+				old_sig);
+	len += put_tag_3_and_11(&buf[len], RFC2440_CIPHER_AES_128, 16,
+				new_sig);
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set,
+					   (char *)buf, sizeof(buf)))
+		FAIL("Valid two-key packet set rejected");
+	if (crypt_stat.file_size != 4242 || crypt_stat.key_size != 16
+	    || packet_set.num_keys != 2 || packet_set.total_keys != 2
+	    || packet_set.cipher_code != RFC2440_CIPHER_AES_128
+	    || memcmp(packet_set.keys[0].sig, old_sig, ECRYPTFS_SIG_SIZE)
+	    || memcmp(packet_set.keys[1].sig, new_sig, ECRYPTFS_SIG_SIZE)
+	    || packet_set.keys[1].encrypted_key_size != 16
+	    || packet_set.keys[1].hash_iterations != 65536
+	    || packet_set.keys[0].literal_data_size != ECRYPTFS_SIG_SIZE
+	    || packet_set.size != (len + 1 - ECRYPTFS_HEADER_METADATA_BYTES))
+		FAIL("Two-key packet set parsed incorrectly");
+	/* Pointers must reference the caller's buffer */
+	if (packet_set.keys[0].encrypted_key < buf
+	    || packet_set.keys[0].encrypted_key >= (buf + sizeof(buf)))
+		FAIL("Packet set was copied");
+
+	/* AES-192 keys are padded to 32 bytes on disk */
+	memset(buf, 0, sizeof(buf));
+	len = put_header(buf, 1);
+	len += put_tag_3_and_11(&buf[len], RFC2440_CIPHER_AES_192, 32,
+				new_sig);
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set,
+					   (char *)buf, sizeof(buf))
+	    || packet_set.key_size != 24
+	    || strcmp(ecryptfs_cipher_code_to_string(packet_set.cipher_code),
+		      "aes"))
+		FAIL("AES-192 key size not derived from the cipher code");
+
+	/* Public key packet with a two-byte length */
+	memset(buf, 0, sizeof(buf));
+	len = put_header(buf, 1);
+	len += put_tag_1(&buf[len], 256, new_sig);
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set,
+					   (char *)buf, sizeof(buf))
+	    || packet_set.num_keys != 1
+	    || packet_set.keys[0].tag != ECRYPTFS_TAG_1_PACKET_TYPE
+	    || packet_set.keys[0].encrypted_key_size != 256
+	    || memcmp(packet_set.keys[0].sig, new_sig, ECRYPTFS_SIG_SIZE))
+		FAIL("Tag 1 packet parsed incorrectly");
+
+	/* Tag 11 is not allowed by itself */
+	memset(buf, 0, sizeof(buf));
+	len = put_header(buf, 1);
+	len += put_tag_3_and_11(&buf[len], RFC2440_CIPHER_AES_128, 16,
+				old_sig);
+	if (ecryptfs_parse_packet_set(
+		    &packet_set, &buf[ECRYPTFS_HEADER_METADATA_BYTES + 31],
+		    (sizeof(buf) - ECRYPTFS_HEADER_METADATA_BYTES - 31))
+	    != -EINVAL)
+		FAIL("Lone tag 11 packet accepted");
+
+	/* Packets running past the end of the buffer */
+	if (ecryptfs_parse_stat_packet_set(&crypt_stat, &packet_set,
+					   (char *)buf, (len - 4)) != -EINVAL)
+		FAIL("Truncated packet set accepted");
+
+	/* The header-only parser still only needs the fixed fields */
+	if (ecryptfs_parse_stat(&crypt_stat, (char *)buf,
+				ECRYPTFS_HEADER_METADATA_BYTES))
+		FAIL("Header fields rejected without a packet set");
+
+	return 0;
+}